@@ -0,0 +1,249 @@
+/*
+Program name: jcblock
+
+File name: cache.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+A cache of call decisions keyed on the number and name of the caller ID, for
+the callers that call again and again. It holds CACHE_SIZE decisions; when
+it is full the CLOCK algorithm picks the one to replace: a hand sweeps the
+entries, clearing the referenced flag of those used since it last passed
+and taking the first one whose flag is already clear. Each entry remembers
+the generation of the list snapshot it was decided with, so a new snapshot
+(a list edited or reloaded) makes every entry stale at once. Only the thread
+that handles the calls uses the cache, so it needs no locks. The decisions
+are saved when jcblock terminates and taken back when it starts (warm.c).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define CACHE_SIZE     1024
+#define CACHE_BUCKETS  2048    // hash chains
+
+struct cache_entry
+{
+  unsigned long generation;    // list snapshot of the decision, 0: unused
+  unsigned hash;
+  int   next;                  // next entry of the hash chain, -1: none
+  bool  referenced;            // used since the hand last passed
+  int   decision;
+  int   rule;
+  long  checkUsec;             // time the list checks took
+  char  number[CID_FIELD_MAX];
+  char  name[CID_FIELD_MAX];
+};
+
+struct saved_decision          // a decision in WARM_FILE
+{
+  int   decision;
+  int   rule;
+  long  checkUsec;
+  char  number[CID_FIELD_MAX];
+  char  name[CID_FIELD_MAX];
+};
+
+static struct cache_entry entries[CACHE_SIZE];
+static int buckets[CACHE_BUCKETS];
+static int hand;
+static bool initialized;
+
+static struct cache_entry *find_entry( const char *number, const char *name, unsigned hash );
+static struct cache_entry *replace_entry( unsigned long generation );
+static void unlink_entry( struct cache_entry *e );
+static unsigned caller_hash( const char *number, const char *name );
+
+//
+// Look up the decision of a caller for the lists of generation. Returns
+// TRUE, with the decision, the matching record and the time the list
+// checks took when it was made, or FALSE.
+//
+bool cache_lookup( unsigned long generation, const char *number, const char *name,
+                   int *decision, int *rule, long *checkUsec )
+{  /* Begin cache_lookup */
+  struct cache_entry *e;
+
+  if( !initialized ||
+      ( e = find_entry( number, name, caller_hash( number, name ) ) ) == NULL ||
+      e->generation != generation )
+    return( FALSE );
+  e->referenced = TRUE;
+  *decision  = e->decision;
+  *rule      = e->rule;
+  *checkUsec = e->checkUsec;
+  return( TRUE );
+}  /* end cache_lookup */
+
+//
+// Remember the decision of a caller (numbers or names too long for an
+// entry are not cached).
+//
+void cache_store( unsigned long generation, const char *number, const char *name,
+                  int decision, int rule, long checkUsec )
+{  /* Begin cache_store */
+  unsigned hash = caller_hash( number, name );
+  struct cache_entry *e;
+  int i;
+
+  if( strlen( number ) >= CID_FIELD_MAX || strlen( name ) >= CID_FIELD_MAX )
+    return;
+  if( !initialized )
+  {
+    for( i = 0; i < CACHE_BUCKETS; i++ )
+      buckets[i] = -1;
+    initialized = TRUE;
+  }
+
+  // A stale entry of the same caller is updated in place
+  if( ( e = find_entry( number, name, hash ) ) == NULL )
+  {
+    e = replace_entry( generation );
+    if( e->generation != 0 )
+      unlink_entry( e );
+    e->hash = hash;
+    strcpy( e->number, number );
+    strcpy( e->name, name );
+    e->next = buckets[hash % CACHE_BUCKETS];
+    buckets[hash % CACHE_BUCKETS] = e - entries;
+  }
+  e->generation = generation;
+  e->referenced = FALSE;
+  e->decision   = decision;
+  e->rule       = rule;
+  e->checkUsec  = checkUsec;
+}  /* end cache_store */
+
+//
+// Write the decisions made for generation to fp. Returns their number, or
+// -1 if a write failed.
+//
+int cache_save( FILE *fp, unsigned long generation )
+{  /* Begin cache_save */
+  struct saved_decision d;
+  uint32_t size = sizeof( d ), n = 0;
+  int i;
+
+  for( i = 0; i < CACHE_SIZE && generation != 0; i++ )
+  {
+    if( entries[i].generation == generation )
+      n++;
+  }
+  if( fwrite( &size, sizeof( size ), 1, fp ) != 1 || fwrite( &n, sizeof( n ), 1, fp ) != 1 )
+    return( -1 );
+  for( i = 0; i < CACHE_SIZE && n > 0; i++ )
+  {
+    if( entries[i].generation != generation )
+      continue;
+    memset( &d, 0, sizeof( d ) );
+    d.decision  = entries[i].decision;
+    d.rule      = entries[i].rule;
+    d.checkUsec = entries[i].checkUsec;
+    strcpy( d.number, entries[i].number );
+    strcpy( d.name, entries[i].name );
+    if( fwrite( &d, sizeof( d ), 1, fp ) != 1 )
+      return( -1 );
+  }
+  return( n );
+}  /* end cache_save */
+
+//
+// Take back the decisions written by cache_save() for lists with the same
+// entries as lists, for generation. Returns their number, or -1 if fp
+// does not hold them.
+//
+int cache_load( FILE *fp, unsigned long generation, const struct list_snapshot *lists )
+{  /* Begin cache_load */
+  struct saved_decision d;
+  const struct match_list *ml;
+  uint32_t size, n, i;
+  int loaded = 0;
+
+  if( fread( &size, sizeof( size ), 1, fp ) != 1 || size != sizeof( d ) ||
+      fread( &n, sizeof( n ), 1, fp ) != 1 )
+    return( -1 );
+  for( i = 0; i < n; i++ )
+  {
+    if( fread( &d, sizeof( d ), 1, fp ) != 1 )
+      return( -1 );
+    ml = d.decision == CALL_WHITELISTED ? lists->white :
+         d.decision == CALL_BLOCKED ? lists->black : NULL;
+    if( memchr( d.number, 0, sizeof( d.number ) ) == NULL ||
+        memchr( d.name, 0, sizeof( d.name ) ) == NULL ||
+        ( d.decision != CALL_ACCEPTED && ml == NULL ) ||
+        ( d.rule != NO_MATCH && ( ml == NULL || d.rule < 0 || d.rule >= ml->nrules ) ) )
+      continue;
+    cache_store( generation, d.number, d.name, d.decision, d.rule, d.checkUsec );
+    loaded++;
+  }
+  return( loaded );
+}  /* end cache_load */
+
+static struct cache_entry *find_entry( const char *number, const char *name, unsigned hash )
+{  /* Begin find_entry */
+  struct cache_entry *e;
+  int i;
+
+  for( i = buckets[hash % CACHE_BUCKETS]; i >= 0; i = e->next )
+  {
+    e = &entries[i];
+    if( e->hash == hash && strcmp( e->number, number ) == 0 && strcmp( e->name, name ) == 0 )
+      return( e );
+  }
+  return( NULL );
+}  /* end find_entry */
+
+//
+// The entry to reuse: an unused or stale one, or the first one the hand
+// finds that was not used since it last passed.
+//
+static struct cache_entry *replace_entry( unsigned long generation )
+{  /* Begin replace_entry */
+  struct cache_entry *e;
+
+  for( ;; )
+  {
+    e = &entries[hand];
+    hand = ( hand + 1 ) % CACHE_SIZE;
+    if( e->generation != generation || !e->referenced )
+      return( e );
+    e->referenced = FALSE;
+  }
+}  /* end replace_entry */
+
+static void unlink_entry( struct cache_entry *e )
+{  /* Begin unlink_entry */
+  int *link = &buckets[e->hash % CACHE_BUCKETS];
+
+  while( *link != e - entries )
+    link = &entries[*link].next;
+  *link = e->next;
+}  /* end unlink_entry */
+
+// FNV-1a over the number, a separator and the name
+static unsigned caller_hash( const char *number, const char *name )
+{  /* Begin caller_hash */
+  unsigned h = 2166136261U;
+
+  for( ; *number; number++ )
+    h = ( h ^ (unsigned char)*number ) * 16777619U;
+  h = ( h ^ '|' ) * 16777619U;
+  for( ; *name; name++ )
+    h = ( h ^ (unsigned char)*name ) * 16777619U;
+  return( h );
+}  /* end caller_hash */
@@ -0,0 +1,204 @@
+/*
+Program name: jcblock
+
+File name: cidparse.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Parses the caller ID a modem sends after AT+VCID=1, one byte at a time as it
+is read from the serial port, so a frame may arrive in any number of reads.
+The modem sends one field per line:
+  DATE = 1217
+  TIME = 1650
+  NMBR = 12345678901          (DDN_NMBR on some modems)
+  NAME = WIRELESS CALLER
+in any order, with blank lines around the frame. SDMF (single data message
+format) frames have no NAME. The fields go into a fixed struct caller_id;
+nothing is allocated. A frame is complete as soon as it has a number and a
+name, at a blank line or RING after the number, or (SDMF, no blank line) when
+the caller of cid_parse_end() decides no more characters are coming. The end
+of the number line is reported too (CID_NUMBER), so that the number can be
+checked while the rest of the frame is still arriving.
+Echoed commands, OK and anything else that is not a field are skipped.
+*/
+
+#include <string.h>
+
+#include "common.h"
+
+static int end_of_line( struct cid_parser *p );
+static void set_field( char *field, int size, const char *value, int len );
+static int finish_frame( struct cid_parser *p );
+
+//
+// Prepare a parser (also after a hang-up, to forget a partial frame).
+//
+void cid_init( struct cid_parser *p )
+{  /* Begin cid_init */
+  memset( p, 0, sizeof( *p ) );
+}  /* end cid_init */
+
+//
+// Take the next character from the modem. Returns CID_FRAME when p->frame
+// holds a complete caller ID, CID_NUMBER when the frame being received
+// (p->cid) has just got its number but is not complete, CID_RING for a
+// RING line, otherwise CID_NONE.
+//
+int cid_parse_byte( struct cid_parser *p, unsigned char c )
+{  /* Begin cid_parse_byte */
+  p->pending++;
+  if( c == '\n' && p->last == '\r' )
+  {
+    p->last = c;                 // "\r\n" ends one line, not two
+    return( CID_NONE );
+  }
+  p->last = c;
+  if( c == '\r' || c == '\n' )
+    return( end_of_line( p ) );
+
+  // Characters past the end of a long line are dropped
+  if( p->lineLen < sizeof( p->line ) - 1 )
+    p->line[p->lineLen++] = c;
+  return( CID_NONE );
+}  /* end cid_parse_byte */
+
+//
+// No more characters are coming for now. Returns CID_FRAME if the frame
+// received so far has a number (an SDMF frame without a blank line after
+// it), CID_PARTIAL if it has fields but no number, otherwise CID_NONE.
+// The parser is ready for the next frame either way.
+//
+int cid_parse_end( struct cid_parser *p )
+{  /* Begin cid_parse_end */
+  int result = CID_NONE;
+
+  if( p->lineLen > 0 && ( result = end_of_line( p ) ) == CID_FRAME )
+    return( result );
+  if( p->cid.fields & CID_NMBR )
+    return( finish_frame( p ) );
+  if( p->cid.fields != 0 )
+    result = CID_PARTIAL;
+  memset( &p->cid, 0, sizeof( p->cid ) );
+  p->pending = 0;
+  return( result );
+}  /* end cid_parse_end */
+
+//
+// A line is complete: store the field it holds.
+//
+static int end_of_line( struct cid_parser *p )
+{  /* Begin end_of_line */
+  struct caller_id *cid = &p->cid;
+  char *line = p->line;
+  char *value;
+  int keyLen, len;
+  int field;
+
+  len = p->lineLen;
+  p->lineLen = 0;
+  while( len > 0 && line[len - 1] == ' ' )
+    len--;
+  line[len] = 0;
+
+  // A blank line ends a frame that has a number
+  if( len == 0 )
+    return( ( cid->fields & CID_NMBR ) ? finish_frame( p ) : CID_NONE );
+
+  if( strcmp( line, "RING" ) == 0 )
+  {
+    if( cid->fields & CID_NMBR )
+      return( finish_frame( p ) );
+    memset( cid, 0, sizeof( *cid ) );
+    p->pending = 0;
+    return( CID_RING );
+  }
+
+  // "KEY = value" (the blanks around '=' are optional)
+  keyLen = strcspn( line, " =" );
+  value = line + keyLen;
+  while( *value == ' ' )
+    value++;
+  if( *value != '=' || keyLen == 0 )
+    return( CID_NONE );
+  value++;
+  while( *value == ' ' )
+    value++;
+
+  if( keyLen == 4 && strncmp( line, "DATE", 4 ) == 0 )
+    field = CID_DATE;
+  else if( keyLen == 4 && strncmp( line, "TIME", 4 ) == 0 )
+    field = CID_TIME;
+  else if( keyLen == 4 && strncmp( line, "NMBR", 4 ) == 0 )
+    field = CID_NMBR;
+  else if( keyLen == 8 && strncmp( line, "DDN_NMBR", 8 ) == 0 )
+    field = CID_NMBR;
+  else if( keyLen == 4 && strncmp( line, "NAME", 4 ) == 0 )
+    field = CID_NAME;
+  else
+    return( CID_NONE );          // MESG and other fields are not used
+
+  // A field seen twice starts a new frame (the last one was incomplete)
+  if( cid->fields & field )
+    memset( cid, 0, sizeof( *cid ) );
+
+  switch( field )
+  {
+    case CID_DATE:
+      set_field( cid->date, sizeof( cid->date ), value, strlen( value ) );
+      break;
+    case CID_TIME:
+      set_field( cid->time, sizeof( cid->time ), value, strlen( value ) );
+      break;
+    case CID_NMBR:
+      set_field( cid->number, sizeof( cid->number ), value, strlen( value ) );
+      break;
+    case CID_NAME:
+      set_field( cid->name, sizeof( cid->name ), value, strlen( value ) );
+      break;
+  }
+  cid->fields |= field;
+
+  // With a number and a name the frame is complete (MDMF)
+  if( ( cid->fields & ( CID_NMBR | CID_NAME ) ) == ( CID_NMBR | CID_NAME ) )
+    return( finish_frame( p ) );
+  return( field == CID_NMBR ? CID_NUMBER : CID_NONE );
+}  /* end end_of_line */
+
+//
+// Copy a value, truncated to the field size. '|' would break the record
+// format of callerID.dat, so it is replaced.
+//
+static void set_field( char *field, int size, const char *value, int len )
+{  /* Begin set_field */
+  int i;
+
+  if( len > size - 1 )
+    len = size - 1;
+  for( i = 0; i < len; i++ )
+    field[i] = ( value[i] == '|' ) ? '/' : value[i];
+  field[len] = 0;
+}  /* end set_field */
+
+//
+// Hand the frame to the caller: p->frame keeps it until the next frame is
+// complete; the parser starts over.
+//
+static int finish_frame( struct cid_parser *p )
+{  /* Begin finish_frame */
+  p->frame = p->cid;
+  memset( &p->cid, 0, sizeof( p->cid ) );
+  p->pending = 0;
+  return( CID_FRAME );
+}  /* end finish_frame */
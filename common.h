@@ -0,0 +1,562 @@
+/*
+Program name: jcblock
+
+File name: common.h
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Declarations shared by the jcblock source files.
+*/
+
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stdint.h>
+
+typedef int bool;
+
+#ifndef TRUE
+  #define TRUE 1
+  #define FALSE 0
+#endif
+
+// If jcblock called from cron BE SURE TO USE ABSOLUTE PATHS FOR <ANY> FILES THAT ARE OPENED
+// All files are kept in one directory; -d selects another one (jcblock.c).
+#define DEFAULT_DIR    "/home/pi/jcblock"
+#define FILE_PATH_MAX  256
+
+extern char listDir[FILE_PATH_MAX];
+extern char callerIDFile[FILE_PATH_MAX];
+extern char whitelistFile[FILE_PATH_MAX];
+extern char blacklistFile[FILE_PATH_MAX];
+extern char logFile[FILE_PATH_MAX];
+extern char statsFile[FILE_PATH_MAX];
+extern char historyDir[FILE_PATH_MAX];
+extern char hitLogFile[FILE_PATH_MAX];
+extern char hitsFile[FILE_PATH_MAX];
+extern char controlSocket[FILE_PATH_MAX];
+extern char warmFile[FILE_PATH_MAX];
+
+#define CALLERID_FILE  callerIDFile
+#define WHITELIST_FILE whitelistFile
+#define BLACKLIST_FILE blacklistFile
+#define LOG_FILE       logFile
+#define STATS_FILE     statsFile
+#define HISTORY_DIR    historyDir
+#define HITS_LOG       hitLogFile
+#define HITS_FILE      hitsFile
+#define CONTROL_SOCKET controlSocket
+#define WARM_FILE      warmFile
+#define LIST_DIR       listDir
+
+// Column layout of whitelist.dat and blacklist.dat records:
+// Test field?        |YYYY-MM-DDThh:mm|Comment string                               |
+#define LIST_TERM_MAX   18     // '?' must be at or before this column
+#define LIST_DATE_COL   20     // start of the timestamp field
+#define LIST_DATE_LEN   16     // YYYY-MM-DDThh:mm
+#define LIST_MIN_RECORD 26     // shorter records have no room for the date
+#define LIST_LINE_MAX   100
+
+//
+// log.c: messages go to an in-memory ring written out by a flusher thread.
+// Set 'start=end;' before a step; the next message shows its msec (the
+// timing is per thread).
+//
+#define LOG_INFO  0
+#define LOG_DEBUG 1
+
+extern __thread struct timeval start, end;
+
+int  log_start( int level, int syncInterval );
+void log_stop( void );
+int  log_info( char *command );
+int  log_debug_info( char *command );
+
+//
+// lists.c: whitelist.dat/blacklist.dat records parsed into an in-memory
+// Aho-Corasick automaton over all "Test field?" tokens (number rules go to
+// a number index, see numidx.c below).
+//
+struct list_rule
+{
+  long  file_pos;        // offset of the record in the .dat file
+  int   text_off;        // record text (no '\n') in the string pool
+  int   text_len;
+  int   token_len;       // the token is the first token_len chars of the text
+};
+
+struct ac_node
+{
+  int child;             // first child (children are sorted by byte)
+  int sibling;           // next sibling
+  int fail;              // Aho-Corasick failure link
+  int best;              // lowest rule index ending here or on the fail chain
+  unsigned char c;       // byte on the edge into this node
+};
+
+//
+// numidx.c: the number rules of a list (exact numbers, prefixes such as
+// 1-855-* and ranges such as 2025550100..199), matched against the
+// normalized number of the call only.
+//
+#define NUMBER_DIGITS_MAX 15   // longest normalized number (E.164)
+#define NUMBER_EXACT_MIN  10   // shorter digit-only test fields are text rules
+
+#define NUMBER_RULE       0    // numidx_add() results
+#define NOT_NUMBER_RULE   1
+#define BAD_NUMBER_RULE   2
+
+struct digit_node
+{
+  int child[10];         // node of the next digit (0: none)
+  int best;              // lowest rule whose prefix ends here
+};
+
+struct number_range
+{
+  uint64_t lo, hi;       // keys, both ends included
+  int      rule;
+};
+
+struct number_index
+{
+  int       nrules;
+  int       nexact;      // exact numbers: hash table of keys
+  unsigned  hashMask;    // table size - 1 (0: no table)
+  uint64_t *keys;        // 0: free slot
+  int      *exactRule;
+  int       nnodes;      // prefixes: node 0 is the root
+  int       nodeCap;
+  struct digit_node *nodes;
+  int       nranges;     // ranges: sorted segments after numidx_finish()
+  int       rangeCap;
+  struct number_range *ranges;
+};
+
+int  numidx_add( struct number_index *ni, const char *token, int len, int rule );
+int  numidx_finish( struct number_index *ni );
+int  numidx_lookup( const struct number_index *ni, const char *number, int len );
+uint64_t number_key( const char *number, int len );
+int  number_digits( uint64_t key, char *digits );
+long numidx_memory( const struct number_index *ni );
+void numidx_free( struct number_index *ni );
+
+//
+// pattern.c: glob and regular expression rules (N=, N~, P=, P~) on the whole
+// name or number of a call, run as one lazily built DFA per list.
+//
+#define PATTERN_RULE      0    // pattern_add() results
+#define NOT_PATTERN_RULE  1
+#define BAD_PATTERN_RULE  2
+
+struct pattern_set;
+
+int  pattern_add( struct pattern_set **psp, const char *token, int len, int rule );
+int  pattern_finish( struct pattern_set *ps );
+int  pattern_match( struct pattern_set *ps, const char *number, int numberLen,
+                    const char *name, int nameLen );
+long pattern_memory( const struct pattern_set *ps );
+void pattern_free( struct pattern_set *ps );
+
+struct match_list
+{
+  char  *path;
+  char  *name;           // "whitelist" or "blacklist" (for messages)
+  int    nrules;
+  struct list_rule *rules;
+  char  *pool;           // record texts
+  int    poolLen;
+  int    nnodes;
+  struct ac_node *nodes; // node 0 is the root
+  int    rootNext[256];  // dense transition table for the root
+  struct number_index numbers;  // number rules (not in the automaton)
+  int    npatterns;      // pattern rules (not in the automaton either)
+  int   *patternRules;
+  struct pattern_set *patterns; // (NULL: none)
+  time_t mtime;          // identity of the file the lists were built from
+  off_t  size;
+  ino_t  ino;
+  bool   partial;        // the last line had no '\n' (file still being written)
+  void  *image;          // mapped compiled image holding the arrays (or NULL)
+  size_t imageLen;
+};
+
+#define NO_MATCH (-1)
+
+// decide_call() results
+#define CALL_ACCEPTED    0
+#define CALL_WHITELISTED 1
+#define CALL_BLOCKED     2
+
+// A caller ID string shorter than this is blocked (one character number and
+// one character name): 2013-10-01T19:12|1|O| = 21 characters in length
+#define CALLSTR_MIN     23
+
+struct match_list *load_list( const char *path, const char *name );
+struct match_list *load_list_records( const char *records, const char *path, const char *name );
+struct match_list *new_list( const char *path, const char *name );
+int  list_add_record( struct match_list *ml, const char *record );
+struct match_list *list_without( const struct match_list *ml,
+                                 bool (*drop)( const char *token, void *arg ), void *arg );
+char *list_format_record( char *record, int size, const char *token, const char *date,
+                          const char *comment );
+void free_list( struct match_list *ml );
+bool list_changed( const struct match_list *ml );
+int  match_list( const struct match_list *ml, const char *callstr );
+const char *list_rule_token( const struct match_list *ml, int rule, char *buf, int bufLen );
+bool list_matches_dates( const struct match_list *ml );
+bool list_numbers_only( const struct match_list *ml );
+uint64_t list_fingerprint( const struct match_list *ml );
+long list_memory( const struct match_list *ml );
+int  decide_call( const struct match_list *white, const struct match_list *black,
+                  const char *callstr, int *rule, long *checkUsec );
+
+//
+// listimage.c: compiled list images (blacklist.jcb, whitelist.jcb) written by
+// jcblock-compile and mapped read-only by jcblock instead of parsing the text.
+//
+void list_image_path( const char *path, char *image, int size );
+int  write_list_image( const struct match_list *ml, const char *image );
+struct match_list *map_list_image( const char *path, const char *name, const char **why );
+struct match_list *open_list( const char *path, const char *name );
+
+//
+// fold.c: caller ID names folded to upper case (SIMD where the processor
+// has it) so that list tokens match them in any case.
+//
+#define FOLD_CHUNK      128    // bytes match_list() folds at a time
+
+void fold_upper( char *dst, const char *src, int len );
+const char *fold_kernel_name( void );
+int  fold_self_check( const char **failed );
+
+//
+// watch.c: list snapshots, rebuilt in the background when a list file
+// changes and published with an atomic pointer swap.
+//
+struct list_snapshot
+{
+  struct match_list *white;       // NULL if there is no whitelist.dat
+  struct match_list *black;
+  unsigned long generation;       // changes when the entries change (not
+                                  // for edits of dates or comments)
+  bool cacheable;                 // no entry can match the date of a call
+  unsigned long listSeq;          // list writes (persist.c) the files had
+  uint64_t fingerprint;           // of the tokens of both lists
+};
+
+int  start_list_watcher( void );
+int  lists_wait( void );
+int  lists_wait_fd( void );
+struct list_snapshot *lists_acquire( void );
+void lists_release( void );
+
+//
+// persist.c: call history appends and list entry hits, queued by the call
+// path and written by a background thread.
+//
+int  persist_start( void );
+void persist_history( const char *callerIDentry, int decision, int line );
+void persist_list_hit( const struct match_list *ml, int rule, const char *callstr );
+unsigned long persist_list_add( const char *path, const char *record );
+unsigned long persist_list_remove( const char *path, const char *token );
+unsigned long persist_lists_written( void );
+unsigned long persist_unchanged_count( void );
+bool persist_list_unchanged( unsigned long seq );
+void persist_drain( void );
+
+//
+// control.c: the control socket (jcblock.sock), served by the event loop,
+// and the list edits made through it, used until the list files have them.
+//
+#define CONTROL_TAG     2UL    // bit set in the event loop pointers of the socket
+
+int  control_start( int loopFd );
+void control_stop( void );
+void control_event( void *ptr );
+unsigned long control_generation( const struct list_snapshot *lists );
+int  control_decide( const struct list_snapshot *lists, const char *callstr,
+                     const struct match_list **matched, int *rule, long *checkUsec );
+bool control_decide_number( const struct list_snapshot *lists, const char *number,
+                            const struct match_list **matched, int *rule );
+void control_note_call( const char *callerIDentry, int decision,
+                        const struct match_list *matched, int rule );
+int  control_command( int argc, char **argv );
+
+//
+// history.c: the call history, one segment file per month (see history.c).
+//
+#define HISTORY_UNKNOWN 255    // decision of imported records
+
+struct history_record          // 32 bytes
+{
+  int64_t  time;               // local time of the call, as if UTC
+  uint64_t numberKey;          // normalized number (number_key()), 0: none
+  uint32_t number;             // offsets in strings.dat
+  uint32_t name;
+  uint8_t  decision;           // CALL_... or HISTORY_UNKNOWN
+  uint8_t  line;               // modem
+  uint8_t  reserved[6];
+};
+
+struct history_index_entry     // YYYY-MM.nix: sorted by key, then record
+{
+  uint64_t key;
+  uint32_t record;
+  uint32_t reserved;
+};
+
+struct history_segment         // a mapped month
+{
+  int    year, month;
+  void  *map;
+  size_t mapLen;
+  const uint32_t *dayFirst;    // first record of each day or 0xFFFFFFFF
+  const struct history_record *records;
+  long   count;
+  void  *indexMap;             // NULL: no index that covers every record
+  size_t indexMapLen;
+  const struct history_index_entry *index;
+  long   indexCount;
+};
+
+struct history_store           // the whole store mapped for reading
+{
+  const char *strings;
+  size_t stringsLen;
+  int    nsegs;                // in time order
+  struct history_segment *segs;
+};
+
+int  history_open( void );
+int  history_append( const char *callerIDentry, int decision, int line );
+void history_sync( void );
+void history_close( void );
+int  history_open_read( struct history_store *hs );
+void history_close_read( struct history_store *hs );
+const char *history_string( const struct history_store *hs, uint32_t offset );
+long history_seek( const struct history_segment *seg, int64_t from );
+int  history_parse_time( const char *date, int64_t *t, struct tm *tm );
+int  history_command( int argc, char **argv );
+
+//
+// hitlog.c: the hits of list entries, in a journal compacted into a
+// checkpoint (hits.log, hits.dat) instead of the date fields of the lists.
+//
+int  hitlog_open( void );
+int  hitlog_append( char list, const char *token, const char *date );
+void hitlog_sync( void );
+void hitlog_close( void );
+int  hits_command( int argc, char **argv );
+
+//
+// report.c: "jcblock report", the call reports, counted on all cores.
+//
+int  report_command( int argc, char **argv );
+
+//
+// import.c: "jcblock import", large blocklists added to blacklist.dat on
+// all cores.
+//
+int  import_command( int argc, char **argv );
+
+//
+// cache.c: the decisions of recent callers, valid for one list generation.
+//
+bool cache_lookup( unsigned long generation, const char *number, const char *name,
+                   int *decision, int *rule, long *checkUsec );
+void cache_store( unsigned long generation, const char *number, const char *name,
+                  int decision, int rule, long checkUsec );
+int  cache_save( FILE *fp, unsigned long generation );
+int  cache_load( FILE *fp, unsigned long generation, const struct list_snapshot *lists );
+
+//
+// velocity.c: callers on neither list that call too often, counted in
+// fixed-size sketches.
+//
+#define VELOCITY_OK      0     // velocity_check() results
+#define VELOCITY_NUMBER  1     // one number, too many calls
+#define VELOCITY_SPRAY   2     // one name, too many neighbouring numbers
+
+int  velocity_limits( const char *numberLimit, const char *sprayLimit );
+int  velocity_check( const char *number, const char *name, time_t now,
+                     char *token, int tokenLen, char *why, int whyLen );
+void velocity_added( const char *token );
+int  velocity_save( FILE *fp );
+int  velocity_load( FILE *fp );
+
+//
+// warm.c: the decision cache and the velocity sketches, saved to jcblock.warm
+// at termination and taken back at the start.
+//
+int  warm_save( void );
+int  warm_load( char *summary, int size );
+
+//
+// cidparse.c: the caller ID frame sent by the modem, parsed a byte at a time.
+//
+#define CID_FIELD_MAX   32     // longest number or name kept (names are 15)
+#define CID_LINE_MAX    96
+
+#define CID_DATE        0x01   // caller_id.fields
+#define CID_TIME        0x02
+#define CID_NMBR        0x04
+#define CID_NAME        0x08
+
+#define CID_NONE        0      // cid_parse_byte()/cid_parse_end() results
+#define CID_FRAME       1      // parser.frame holds a complete caller ID
+#define CID_RING        2
+#define CID_PARTIAL     3      // fields without a number (not usable)
+#define CID_NUMBER      4      // parser.cid has its number, the rest is coming
+
+struct caller_id
+{
+  char date[5];                // MMDD
+  char time[5];                // hhmm
+  char number[CID_FIELD_MAX];  // "O" (out of area) or "P" (private) too
+  char name[CID_FIELD_MAX];    // empty for SDMF
+  int  fields;                 // CID_DATE | CID_TIME | ... received
+};
+
+struct cid_parser
+{
+  char line[CID_LINE_MAX];     // line being received
+  int  lineLen;
+  unsigned char last;          // previous character
+  int  pending;                // characters received since the last frame
+  struct caller_id cid;        // frame being received
+  struct caller_id frame;      // last complete frame
+};
+
+void cid_init( struct cid_parser *p );
+int  cid_parse_byte( struct cid_parser *p, unsigned char c );
+int  cid_parse_end( struct cid_parser *p );
+
+//
+// fsk.c: the Bell 202 FSK caller ID signal itself, decoded from 8 kHz PCM
+// (a voice-mode modem or a WAV file) instead of by the modem.
+//
+#define FSK_RATE        8000   // samples per second
+#define FSK_CHUNK       256    // samples demodulated at a time
+#define FSK_WINDOW      7      // samples of one tone correlation (about a bit)
+#define FSK_MSG_MAX     258    // type, length, 255 bytes of data, checksum
+
+#define FSK_SDMF        0x04   // message types
+#define FSK_MDMF        0x80
+
+struct fsk_demod
+{
+  float x[FSK_WINDOW - 1 + FSK_CHUNK];  // the last samples, then the chunk
+  int   phase;                 // of the tone tables (sample count mod period)
+  int   bit;                   // bit of the byte being received, -1: none
+  float since;                 // samples since its start bit began
+  int   lead;                  // mark samples before that start bit
+  int   markRun;               // mark samples in a row (with a carrier)
+  float v[2];                  // the last two decisions (above 0: mark)
+  float sinceFall;             // samples since the last mark to space edge
+  float spaceWidth;            // how long a space bit looks, in samples
+  int   quiet;                 // samples in a row without a carrier
+  int   byte;
+  unsigned char msg[FSK_MSG_MAX];   // message being received
+  int   msgLen;
+  long  frames;                // messages decoded
+  long  errors;                // messages with bad checksums, cut short, ...
+};
+
+void fsk_init( struct fsk_demod *d );
+int  fsk_feed( struct fsk_demod *d, const int16_t *samples, int n,
+               struct caller_id *cid, int *used );
+int  fsk_message( const struct caller_id *cid, int type, unsigned char *msg );
+int  fsk_modulate( const unsigned char *msg, int len, double markLevel, double spaceLevel,
+                   double freqScale, int16_t *out, int max );
+int  fsk_read_wav( const char *path, int16_t **samples, int *count );
+int  fsk_write_wav( const char *path, const int16_t *samples, int count, int bits );
+const char *fsk_kernel_name( void );
+int  fsk_kernels( const char **names, int max );
+int  fsk_use_kernel( const char *name );
+int  fsk_self_check( const char **failed );
+int  decode_command( int argc, char **argv );
+
+//
+// dtmf.c: touch tone keys in the line audio (8 kHz PCM, as for fsk.c), so
+// that the star key can add the caller to the blacklist.
+//
+#define DTMF_RATE       8000   // samples per second
+#define DTMF_BLOCK      102    // samples per decision (12.75 msec)
+#define DTMF_TONES      8
+
+struct dtmf_detector
+{
+  float s[2][DTMF_TONES];      // the Goertzel filters: last output, the one before
+  float energy;                // of the samples of the block so far
+  int   count;                 // samples of the block so far
+  int   last;                  // key of the last block, 0: none
+  int   down;                  // key reported and still held, 0: none
+  long  blocks;                // blocks looked at
+  long  keys;                  // keys reported
+};
+
+void dtmf_init( struct dtmf_detector *d );
+int  dtmf_feed( struct dtmf_detector *d, const int16_t *samples, int n, char *keys, int max );
+int  dtmf_tone( int key, int msec, double level, int16_t *out, int max );
+const char *dtmf_kernel_name( void );
+int  dtmf_kernels( const char **names, int max );
+int  dtmf_use_kernel( const char *name );
+int  dtmf_self_check( const char **failed );
+int  tones_command( int argc, char **argv );
+
+//
+// stats.c: per-stage latency histograms and counters, written to
+// jcblock.prom (Prometheus text format) every few seconds.
+//
+#define STAGE_SERIAL_READ   0   // first character to complete caller ID frame
+#define STAGE_PARSE         1   // parsing the frame and building the string
+#define STAGE_HISTORY       2   // history append and sync (writer thread)
+#define STAGE_WHITELIST     3
+#define STAGE_BLACKLIST     4
+#define STAGE_DECISION      5   // complete caller ID frame to decision
+#define STAGE_HANGUP        6   // blacklist match to ATH0 answered
+#define STAGE_MODEM_INIT    7   // (re)initialization until the modem is ready
+#define STAGE_EARLY_GAIN    8   // hang-up started on the number to frame complete
+#define STAGE_STARTUP       9   // start until the lists and the modems are ready
+#define NUM_STAGES          10
+
+#define COUNT_CALLS         0
+#define COUNT_BLOCKED       1
+#define COUNT_ACCEPTED      2
+#define COUNT_WHITELISTED   3
+#define COUNT_PARSE_FAILED  4
+#define COUNT_MODEM_FAILED  5
+#define COUNT_CACHE_HITS    6
+#define COUNT_CACHE_MISSES  7
+#define COUNT_CACHE_SAVED   8   // usec of list checks saved by cache hits
+#define COUNT_FAST_CALLERS  9   // callers found by velocity.c
+#define COUNT_EARLY_HANGUPS 10  // calls terminated on their number alone
+#define COUNT_STAR_KEYS     11  // callers blacklisted with the star key
+#define NUM_COUNTERS        12
+
+int  stats_start( int intervalSec );
+void stats_stop( void );
+void stats_record( int stage, long usec );
+void stats_count( int counter );
+void stats_add( int counter, long n );
+int  stats_write( void );
+
+#endif
@@ -0,0 +1,1016 @@
+/*
+Program name: jcblock
+
+File name: control.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+The control socket (jcblock.sock in the list directory), through which other
+programs add and remove list entries, check what jcblock would do with a
+caller, see the recent calls and block the last caller, without editing the
+list files. One command per line; each answer ends with a line starting with
+OK or ERR (see "help" below and the README).
+
+The socket is served by the event loop of jcblock.c, on the thread that
+handles the calls, so the edits need no locks. An edit takes effect at once:
+it is kept in memory over the current list snapshot (watch.c) until a
+snapshot that includes it is published. Added entries are put in a small list
+of their own (the automaton of a long list is not rebuilt): a new entry is
+inserted into it as it is (list_add_record()), and it is only built again
+from its records when entries leave it. It is checked after the list it was
+added to, as if it were at the end of the file. A removed test field hides
+the entries of the list with that test field: a call whose first match is
+one of them is matched again against a copy of the list without them, made
+the first time it is needed (list_without()). The edits are written to the list files in the
+usual format by the writer thread (persist.c), each with a sequence number;
+a snapshot read after a number was written includes every edit up to it, and
+those edits are then dropped from memory. A removal that changed nothing (no
+entry had the test field) is dropped once the writer reports it done.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "common.h"
+
+#define CONTROL_CONNS     8    // programs connected at once
+#define CONTROL_LINE_MAX  512  // longest command
+#define EDITS_MAX         1024 // edits not yet in a snapshot
+#define RECENT_CALLS      32   // calls kept for "recent" and "block-last"
+#define REPLY_MAX         8192
+
+#define WHITE 0                // index of added[], listPath[] ...
+#define BLACK 1
+
+struct list_edit
+{
+  unsigned long seq;           // list write (persist.c)
+  int   list;                  // WHITE or BLACK
+  bool  add;                   // FALSE: removal of the test field
+  bool  failed;                // add: it could not be written (kept until
+                               // jcblock ends)
+  char  token[LIST_TERM_MAX + 1];
+  char  record[LIST_LINE_MAX]; // add: the record, with its '\n'
+};
+
+struct control_conn
+{
+  int   fd;                    // -1: free
+  int   len;
+  char  line[CONTROL_LINE_MAX];
+};
+
+struct recent_call
+{
+  char  entry[CID_FIELD_MAX * 2 + 24];  // date|number|name|
+  int   decision;
+  char  why[LIST_LINE_MAX];    // the entry that matched, or empty
+};
+
+static int epollFd = -1;
+static int listenFd = -1;
+static ino_t socketIno;                // of CONTROL_SOCKET once it is bound
+static struct control_conn conns[CONTROL_CONNS];
+static struct list_edit edits[EDITS_MAX];
+static int nedits;
+static struct match_list *added[2];    // the entries added to each list (or NULL)
+static struct match_list *kept[2];     // each list without its removed entries
+                                       // (made when needed, or NULL)
+static unsigned long keptGeneration;   // of the snapshot kept[] is made from
+static unsigned long absorbedSeq;      // list writes of the snapshot last seen
+static unsigned long absorbedUnchanged; // persist_unchanged_count() last seen
+static unsigned long editGeneration;   // changes with every edit
+static struct recent_call recent[RECENT_CALLS];
+static int recentCount, recentNext;
+
+static const char *listPath[2] = { WHITELIST_FILE, BLACKLIST_FILE };
+static const char *listName[2] = { "whitelist", "blacklist" };
+
+static void *tag( void *p );
+static void accept_conn( void );
+static void read_conn( struct control_conn *c );
+static void close_conn( struct control_conn *c );
+static void run_command( char *line, char *reply, int size );
+static void add_entry( int list, const char *token, const char *comment, char *reply, int size );
+static void remove_entry( int list, const char *token, char *reply, int size );
+static void query_caller( const char *number, const char *name, char *reply, int size );
+static void show_recent( int n, char *reply, int size );
+static void block_last( const char *comment, char *reply, int size );
+static int parse_list( const char *word );
+static const char *parse_token( char *args, char *token, char **rest );
+static void absorb_edits( const struct list_snapshot *lists );
+static int rebuild_added( int list );
+static int match_edited( const struct match_list *base, int list, const char *callstr,
+                         const struct match_list **matched );
+static bool token_removed( int list, const char *token );
+static const struct match_list *kept_list( const struct match_list *base, int list );
+static void drop_kept( int list );
+static bool drop_removed( const char *token, void *arg );
+static void record_text( const struct match_list *ml, int rule, char *buf, int bufLen );
+static long usec_now( void );
+
+//
+// Create the control socket and add it to the event loop. Returns 0 or -1
+// (jcblock runs without it).
+//
+int control_start( int loopFd )
+{  /* Begin control_start */
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  struct stat st;
+  mode_t mask;
+  int i, fd;
+
+  for( i = 0; i < CONTROL_CONNS; i++ )
+    conns[i].fd = -1;
+  epollFd = loopFd;
+
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  if( strlen( CONTROL_SOCKET ) >= sizeof( addr.sun_path ) )
+  {
+    log_debug_info("control socket path is too long; no control socket");
+    return( -1 );
+  }
+  strcpy( addr.sun_path, CONTROL_SOCKET );
+
+  // A socket left behind by a jcblock that was killed is removed; one that
+  // another jcblock still answers on is left alone
+  if( lstat( CONTROL_SOCKET, &st ) == 0 && S_ISSOCK( st.st_mode ) )
+  {
+    if( ( fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) >= 0 &&
+        connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) == 0 )
+    {
+      close( fd );
+      log_debug_info("another jcblock has the control socket; no control socket");
+      return( -1 );
+    }
+    if( fd >= 0 )
+      close( fd );
+    unlink( CONTROL_SOCKET );
+  }
+
+  // Only the owner may edit the lists
+  mask = umask( 0177 );
+  if( ( listenFd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0 ||
+      bind( listenFd, (struct sockaddr *)&addr, sizeof( addr ) ) != 0 ||
+      listen( listenFd, CONTROL_CONNS ) != 0 )
+  {
+    umask( mask );
+    log_debug_info("control socket could not be created");
+    if( listenFd >= 0 )
+      close( listenFd );
+    listenFd = -1;
+    return( -1 );
+  }
+  umask( mask );
+  if( stat( CONTROL_SOCKET, &st ) == 0 )
+    socketIno = st.st_ino;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = tag( &listenFd );
+  if( epoll_ctl( epollFd, EPOLL_CTL_ADD, listenFd, &ev ) != 0 )
+  {
+    log_debug_info("control socket could not be added to the event loop");
+    control_stop();
+    return( -1 );
+  }
+  return( 0 );
+}  /* end control_start */
+
+//
+// Close the control socket and remove it (called by cleanup()).
+//
+void control_stop( void )
+{  /* Begin control_stop */
+  struct stat st;
+  int i;
+
+  if( listenFd < 0 )
+    return;
+  for( i = 0; i < CONTROL_CONNS; i++ )
+    close_conn( &conns[i] );
+  close( listenFd );
+  listenFd = -1;
+
+  // (Unless a jcblock started since has replaced it)
+  if( stat( CONTROL_SOCKET, &st ) == 0 && st.st_ino == socketIno )
+    unlink( CONTROL_SOCKET );
+}  /* end control_stop */
+
+//
+// An event of the event loop for the control socket: ptr is the event's
+// pointer with the CONTROL_TAG bit cleared.
+//
+void control_event( void *ptr )
+{  /* Begin control_event */
+  if( ptr == &listenFd )
+    accept_conn();
+  else
+    read_conn( (struct control_conn *)ptr );
+}  /* end control_event */
+
+//
+// The generation to cache decisions under: it changes with the lists and
+// with every edit. 0 if decisions can not be cached now (an entry could
+// match the date, or edits are waiting to be written).
+//
+unsigned long control_generation( const struct list_snapshot *lists )
+{  /* Begin control_generation */
+  absorb_edits( lists );
+  if( !lists->cacheable || nedits > 0 )
+    return( 0 );
+
+  // Both only grow, so their sum changes whenever either does
+  return( lists->generation + editGeneration );
+}  /* end control_generation */
+
+//
+// decide_call() for the lists with the edits of the control socket. The
+// list the rule is in (the entries added, or the list itself) is returned
+// in *matched.
+//
+int control_decide( const struct list_snapshot *lists, const char *callstr,
+                    const struct match_list **matched, int *rule, long *checkUsec )
+{  /* Begin control_decide */
+  long t0;
+
+  absorb_edits( lists );
+  if( nedits == 0 )
+  {
+    // The usual case: the lists are as they were read
+    *matched = NULL;
+    switch( decide_call( lists->white, lists->black, callstr, rule, checkUsec ) )
+    {
+      case CALL_WHITELISTED:
+        *matched = lists->white;
+        return( CALL_WHITELISTED );
+      case CALL_BLOCKED:
+        *matched = lists->black;
+        return( CALL_BLOCKED );
+    }
+    return( CALL_ACCEPTED );
+  }
+
+  t0 = usec_now();
+  *rule = match_edited( lists->white, WHITE, callstr, matched );
+  if( checkUsec != NULL )
+    checkUsec[0] = usec_now() - t0;
+  if( *rule != NO_MATCH )
+  {
+    if( checkUsec != NULL )
+      checkUsec[1] = -1;
+    return( CALL_WHITELISTED );
+  }
+
+  t0 = usec_now();
+  *rule = match_edited( lists->black, BLACK, callstr, matched );
+  if( checkUsec != NULL )
+    checkUsec[1] = usec_now() - t0;
+  if( *rule != NO_MATCH )
+    return( CALL_BLOCKED );
+  *matched = lists->black;
+  return( strlen( callstr ) < CALLSTR_MIN ? CALL_BLOCKED : CALL_ACCEPTED );
+}  /* end control_decide */
+
+//
+// Whether a call from number is blocked whatever the rest of its caller ID
+// turns out to be (see early_decision() in jcblock.c): a number rule of the
+// blacklist, or of the entries added to it, matches the number, and no
+// whitelist entry can match because the whitelist has only number rules
+// and none of them matches. *matched and *rule are set to the number rule.
+//
+bool control_decide_number( const struct list_snapshot *lists, const char *number,
+                            const struct match_list **matched, int *rule )
+{  /* Begin control_decide_number */
+  const struct match_list *white[2], *black[2];
+  char token[LIST_TERM_MAX + 1];
+  int len = strlen( number );
+  int i;
+
+  absorb_edits( lists );
+  white[0] = lists->white;
+  white[1] = added[WHITE];
+  for( i = 0; i < 2; i++ )
+  {
+    if( white[i] != NULL && ( !list_numbers_only( white[i] ) ||
+        ( white[i]->numbers.nrules > 0 &&
+          numidx_lookup( &white[i]->numbers, number, len ) != NO_MATCH ) ) )
+      return( FALSE );
+  }
+
+  // (A rule whose test field was removed does not count, but another
+  // number rule of the list may)
+  black[0] = lists->black;
+  black[1] = added[BLACK];
+  for( i = 0; i < 2; i++ )
+  {
+    if( i == 0 && black[0] != NULL && black[0]->numbers.nrules > 0 &&
+        ( *rule = numidx_lookup( &black[0]->numbers, number, len ) ) != NO_MATCH &&
+        token_removed( BLACK, list_rule_token( black[0], *rule, token, sizeof( token ) ) ) )
+      black[0] = kept_list( black[0], BLACK );
+    if( black[i] != NULL && black[i]->numbers.nrules > 0 &&
+        ( *rule = numidx_lookup( &black[i]->numbers, number, len ) ) != NO_MATCH )
+    {
+      *matched = black[i];
+      return( TRUE );
+    }
+  }
+  return( FALSE );
+}  /* end control_decide_number */
+
+//
+// Remember a call for "recent" and "block-last". matched and rule are the
+// entry that decided it (rule NO_MATCH: none).
+//
+void control_note_call( const char *callerIDentry, int decision,
+                        const struct match_list *matched, int rule )
+{  /* Begin control_note_call */
+  struct recent_call *r = &recent[recentNext];
+
+  snprintf( r->entry, sizeof( r->entry ), "%.*s", (int)strcspn( callerIDentry, "\n" ),
+            callerIDentry );
+  r->decision = decision;
+  r->why[0] = 0;
+  if( matched != NULL && rule != NO_MATCH )
+    record_text( matched, rule, r->why, sizeof( r->why ) );
+  recentNext = ( recentNext + 1 ) % RECENT_CALLS;
+  if( recentCount < RECENT_CALLS )
+    recentCount++;
+}  /* end control_note_call */
+
+//
+// "jcblock control command...": send one command to the control socket of
+// a running jcblock and print the answer. Returns 0 if the answer was OK.
+//
+int control_command( int argc, char **argv )
+{  /* Begin control_command */
+  struct sockaddr_un addr;
+  char line[CONTROL_LINE_MAX];
+  char reply[REPLY_MAX];
+  int fd, i, len = 0, n, got = 0;
+  char *last, *nl;
+
+  if( argc < 2 )
+  {
+    fprintf( stderr, "Usage: jcblock control add|remove|query|recent|block-last|help ...\n" );
+    return( -1 );
+  }
+  for( i = 1; i < argc; i++ )
+  {
+    n = snprintf( line + len, sizeof( line ) - len, "%s%s", i > 1 ? " " : "", argv[i] );
+    if( n >= (int)sizeof( line ) - len - 1 )
+    {
+      fprintf( stderr, "jcblock control: command is too long\n" );
+      return( -1 );
+    }
+    len += n;
+  }
+  line[len++] = '\n';
+
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  if( strlen( CONTROL_SOCKET ) >= sizeof( addr.sun_path ) )
+  {
+    fprintf( stderr, "jcblock control: socket path %s is too long\n", CONTROL_SOCKET );
+    return( -1 );
+  }
+  strcpy( addr.sun_path, CONTROL_SOCKET );
+  if( ( fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) < 0 ||
+      connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) != 0 )
+  {
+    perror( CONTROL_SOCKET );
+    if( fd >= 0 )
+      close( fd );
+    return( -1 );
+  }
+  if( write( fd, line, len ) != len )
+  {
+    perror( "write" );
+    close( fd );
+    return( -1 );
+  }
+
+  // The answer ends with its OK or ERR line
+  last = reply;
+  while( got < (int)sizeof( reply ) - 1 &&
+         ( n = read( fd, reply + got, sizeof( reply ) - 1 - got ) ) > 0 )
+  {
+    got += n;
+    reply[got] = 0;
+    while( ( nl = strchr( last, '\n' ) ) != NULL && nl < reply + got - 1 )
+      last = nl + 1;
+    if( reply[got - 1] == '\n' &&
+        ( strncmp( last, "OK", 2 ) == 0 || strncmp( last, "ERR", 3 ) == 0 ) )
+      break;
+  }
+  close( fd );
+  reply[got] = 0;
+  fputs( reply, stdout );
+  return( strncmp( last, "OK", 2 ) == 0 ? 0 : -1 );
+}  /* end control_command */
+
+//
+// The event loop pointer of a control socket file descriptor (see
+// wait_for_response() in jcblock.c).
+//
+static void *tag( void *p )
+{  /* Begin tag */
+  return( (void *)( (unsigned long)p | CONTROL_TAG ) );
+}  /* end tag */
+
+static void accept_conn( void )
+{  /* Begin accept_conn */
+  struct epoll_event ev;
+  int fd, i;
+
+  while( ( fd = accept( listenFd, NULL, NULL ) ) >= 0 )
+  {
+    fcntl( fd, F_SETFL, O_NONBLOCK );
+    fcntl( fd, F_SETFD, FD_CLOEXEC );
+    for( i = 0; i < CONTROL_CONNS && conns[i].fd >= 0; i++ )
+      ;
+    if( i == CONTROL_CONNS )
+    {
+      if( send( fd, "ERR too many connections\n", 25, MSG_NOSIGNAL ) < 0 )
+        log_debug_info("control socket: too many connections");
+      close( fd );
+      continue;
+    }
+    conns[i].fd = fd;
+    conns[i].len = 0;
+    ev.events = EPOLLIN;
+    ev.data.ptr = tag( &conns[i] );
+    if( epoll_ctl( epollFd, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+      close_conn( &conns[i] );
+  }
+}  /* end accept_conn */
+
+//
+// Read what a program sent and run each complete command line.
+//
+static void read_conn( struct control_conn *c )
+{  /* Begin read_conn */
+  static char reply[REPLY_MAX];
+  char *nl;
+  int n, used;
+
+  if( c->fd < 0 )
+    return;
+  n = read( c->fd, c->line + c->len, sizeof( c->line ) - 1 - c->len );
+  if( n == 0 || ( n < 0 && errno != EAGAIN && errno != EINTR ) )
+  {
+    close_conn( c );
+    return;
+  }
+  if( n < 0 )
+    return;
+  c->len += n;
+  c->line[c->len] = 0;
+
+  for( used = 0; ( nl = strchr( c->line + used, '\n' ) ) != NULL; used = nl + 1 - c->line )
+  {
+    *nl = 0;
+    if( nl > c->line + used && nl[-1] == '\r' )
+      nl[-1] = 0;
+    run_command( c->line + used, reply, sizeof( reply ) );
+
+    // The program must read its answers; one that does not is dropped
+    n = strlen( reply );
+    if( send( c->fd, reply, n, MSG_NOSIGNAL | MSG_DONTWAIT ) != n )
+    {
+      close_conn( c );
+      return;
+    }
+  }
+  memmove( c->line, c->line + used, c->len - used );
+  c->len -= used;
+  if( c->len == (int)sizeof( c->line ) - 1 )
+  {
+    if( send( c->fd, "ERR line too long\n", 18, MSG_NOSIGNAL | MSG_DONTWAIT ) != 18 )
+    {
+      close_conn( c );
+      return;
+    }
+    c->len = 0;
+  }
+}  /* end read_conn */
+
+static void close_conn( struct control_conn *c )
+{  /* Begin close_conn */
+  if( c->fd < 0 )
+    return;
+  close( c->fd );        // (this also removes it from the event loop)
+  c->fd = -1;
+  c->len = 0;
+}  /* end close_conn */
+
+//
+// Run one command and put its answer in reply.
+//
+static void run_command( char *line, char *reply, int size )
+{  /* Begin run_command */
+  char token[LIST_TERM_MAX + 1];
+  char *command, *args, *rest;
+  const char *why;
+  int list, n;
+
+  args = line + strspn( line, " " );
+  command = args;
+  args += strcspn( args, " " );
+  if( *args != 0 )
+    *args++ = 0;
+  args += strspn( args, " " );
+
+  if( strcmp( command, "add" ) == 0 || strcmp( command, "remove" ) == 0 )
+  {
+    list = parse_list( args );
+    args += strcspn( args, " " );
+    args += strspn( args, " " );
+    if( list < 0 )
+      snprintf( reply, size, "ERR list must be white or black\n" );
+    else if( ( why = parse_token( args, token, &rest ) ) != NULL )
+      snprintf( reply, size, "ERR %s\n", why );
+    else if( command[0] == 'a' )
+      add_entry( list, token, *rest ? rest : "added by control socket", reply, size );
+    else
+      remove_entry( list, token, reply, size );
+  }
+  else if( strcmp( command, "query" ) == 0 )
+  {
+    rest = args + strcspn( args, " " );
+    if( *rest != 0 )
+      *rest++ = 0;
+    if( *args == 0 || strlen( args ) >= CID_FIELD_MAX || strlen( rest ) >= CID_FIELD_MAX )
+      snprintf( reply, size, "ERR query NUMBER [NAME]\n" );
+    else
+      query_caller( args, rest, reply, size );
+  }
+  else if( strcmp( command, "recent" ) == 0 )
+  {
+    n = *args ? atoi( args ) : 10;
+    show_recent( n, reply, size );
+  }
+  else if( strcmp( command, "block-last" ) == 0 )
+    block_last( *args ? args : "blocked last caller", reply, size );
+  else if( strcmp( command, "help" ) == 0 || *command == 0 )
+    snprintf( reply, size,
+              "add white|black TOKEN[?] [comment]   add an entry (TOKEN? may contain spaces)\n"
+              "remove white|black TOKEN[?]          remove the entries with this test field\n"
+              "query NUMBER [NAME]                  what a call would get\n"
+              "recent [N]                           the last N calls (newest first)\n"
+              "block-last [comment]                 add the number of the last call to the blacklist\n"
+              "OK\n" );
+  else
+    snprintf( reply, size, "ERR unknown command (try help)\n" );
+}  /* end run_command */
+
+//
+// Add an entry to a list: it is checked from now on and queued for the
+// end of the list file.
+//
+static void add_entry( int list, const char *token, const char *comment, char *reply, int size )
+{  /* Begin add_entry */
+  struct list_edit *e;
+  char date[LIST_DATE_LEN + 1];
+  char message[LIST_LINE_MAX + 40];
+  time_t now = time( NULL );
+  struct tm now_tm;
+  int rc;
+
+  if( nedits == EDITS_MAX )
+  {
+    snprintf( reply, size, "ERR too many edits waiting to be written\n" );
+    return;
+  }
+  e = &edits[nedits];
+  localtime_r( &now, &now_tm );
+  strftime( date, sizeof( date ), "%FT%R", &now_tm );
+  list_format_record( e->record, sizeof( e->record ), token, date, comment );
+
+  // The record must be one the list file would accept; it goes straight
+  // into the entries added to the list
+  if( added[list] == NULL && ( added[list] = new_list( listPath[list], listName[list] ) ) == NULL )
+  {
+    snprintf( reply, size, "ERR out of memory\n" );
+    return;
+  }
+  if( ( rc = list_add_record( added[list], e->record ) ) != 0 )
+  {
+    // A record that is not valid leaves the list as it was
+    if( rc < 0 || added[list]->nrules == 0 )
+      rebuild_added( list );
+    snprintf( reply, size, rc > 0 ? "ERR entry is not valid (see README)\n" : "ERR out of memory\n" );
+    return;
+  }
+
+  if( ( e->seq = persist_list_add( listPath[list], e->record ) ) == 0 )
+  {
+    rebuild_added( list );
+    snprintf( reply, size, "ERR write queue is full\n" );
+    return;
+  }
+  e->list = list;
+  e->add = TRUE;
+  e->failed = FALSE;
+  strcpy( e->token, token );
+  nedits++;
+  editGeneration++;
+
+  snprintf( message, sizeof( message ), "control socket: added to %s: %s", listName[list],
+            e->record );
+  log_info( message );
+  snprintf( reply, size, "OK added %s?\n", token );
+}  /* end add_entry */
+
+//
+// Remove the entries of a test field from a list: they no longer match from
+// now on, and the records are queued for removal from the list file.
+//
+static void remove_entry( int list, const char *token, char *reply, int size )
+{  /* Begin remove_entry */
+  struct list_edit *e;
+  char message[LIST_TERM_MAX + 80];
+  unsigned long seq;
+  bool pending = FALSE;
+  int i, j;
+
+  if( nedits == EDITS_MAX )
+  {
+    snprintf( reply, size, "ERR too many edits waiting to be written\n" );
+    return;
+  }
+  if( ( seq = persist_list_remove( listPath[list], token ) ) == 0 )
+  {
+    snprintf( reply, size, "ERR write queue is full\n" );
+    return;
+  }
+
+  // Entries added but not yet read from the file are dropped here
+  for( i = j = 0; i < nedits; i++ )
+  {
+    if( edits[i].add && edits[i].list == list && strcasecmp( edits[i].token, token ) == 0 )
+    {
+      pending = TRUE;
+      continue;
+    }
+    edits[j++] = edits[i];
+  }
+  nedits = j;
+  e = &edits[nedits++];
+  e->seq = seq;
+  e->list = list;
+  e->add = FALSE;
+  e->failed = FALSE;
+  strcpy( e->token, token );
+  e->record[0] = 0;
+  editGeneration++;
+  drop_kept( list );
+  if( pending && rebuild_added( list ) != 0 )
+  {
+    snprintf( reply, size, "ERR out of memory (the entry is removed once the file is read again)\n" );
+    return;
+  }
+
+  snprintf( message, sizeof( message ), "control socket: removed from %s: %s?\n",
+            listName[list], token );
+  log_info( message );
+  snprintf( reply, size, "OK removed %s?\n", token );
+}  /* end remove_entry */
+
+//
+// What a call of number and name would get now.
+//
+static void query_caller( const char *number, const char *name, char *reply, int size )
+{  /* Begin query_caller */
+  struct list_snapshot *lists;
+  const struct match_list *matched;
+  char callstr[CID_FIELD_MAX * 2 + 32];
+  char text[LIST_LINE_MAX];
+  char iso_8601[] = "YYYY-MM-DDTHH:MM:SS";
+  time_t now = time( NULL );
+  struct tm now_tm;
+  int decision, rule;
+
+  localtime_r( &now, &now_tm );
+  strftime( iso_8601, sizeof( iso_8601 ), "%FT%R", &now_tm );
+  sprintf( callstr, "%s|%s|%s|\n", iso_8601, number, name );
+
+  lists = lists_acquire();
+  decision = control_decide( lists, callstr, &matched, &rule, NULL );
+  if( rule != NO_MATCH )
+    record_text( matched, rule, text, sizeof( text ) );
+  lists_release();
+
+  if( decision == CALL_WHITELISTED )
+    snprintf( reply, size, "OK whitelisted by: %s\n", text );
+  else if( decision == CALL_BLOCKED && rule != NO_MATCH )
+    snprintf( reply, size, "OK blocked by: %s\n", text );
+  else if( decision == CALL_BLOCKED )
+    snprintf( reply, size, "OK blocked (short caller ID)\n" );
+  else
+    snprintf( reply, size, "OK accepted\n" );
+}  /* end query_caller */
+
+//
+// The last n calls, newest first.
+//
+static void show_recent( int n, char *reply, int size )
+{  /* Begin show_recent */
+  static const char *decisions[] = { "accepted", "whitelisted", "blocked" };
+  struct recent_call *r;
+  int i, len = 0;
+
+  if( n > recentCount )
+    n = recentCount;
+  for( i = 0; i < n; i++ )
+  {
+    r = &recent[( recentNext - 1 - i + RECENT_CALLS ) % RECENT_CALLS];
+    len += snprintf( reply + len, size - len, "%s %s%s%s\n", r->entry, decisions[r->decision],
+                     r->why[0] ? " by: " : "", r->why );
+    if( len >= size - 8 )
+    {
+      len = size - 8;
+      break;
+    }
+  }
+  snprintf( reply + len, size - len, "OK %d\n", i );
+}  /* end show_recent */
+
+//
+// Add the number of the last call to the blacklist.
+//
+static void block_last( const char *comment, char *reply, int size )
+{  /* Begin block_last */
+  struct recent_call *r = &recent[( recentNext - 1 + RECENT_CALLS ) % RECENT_CALLS];
+  char number[CID_FIELD_MAX];
+  const char *p;
+  int len;
+
+  if( recentCount == 0 )
+  {
+    snprintf( reply, size, "ERR no call since jcblock was started\n" );
+    return;
+  }
+  if( r->decision == CALL_BLOCKED )
+  {
+    snprintf( reply, size, "ERR the last call was blocked already\n" );
+    return;
+  }
+
+  // date|number|name|: "P" (private) and "O" (out of area) are many callers
+  p = strchr( r->entry, '|' ) + 1;
+  len = strcspn( p, "|" );
+  if( len > LIST_TERM_MAX - 1 )
+  {
+    snprintf( reply, size, "ERR the number of the last call is too long for a test field\n" );
+    return;
+  }
+  memcpy( number, p, len );
+  number[len] = 0;
+  if( number_key( number, len ) == 0 )
+  {
+    snprintf( reply, size, "ERR the last call has no number to block (%s)\n", number );
+    return;
+  }
+  add_entry( BLACK, number, comment, reply, size );
+}  /* end block_last */
+
+// "white" or "black" (or "whitelist", "blacklist"); -1 if neither
+static int parse_list( const char *word )
+{  /* Begin parse_list */
+  int len = strcspn( word, " " );
+
+  if( ( len == 5 || len == 9 ) && strncmp( word, "white", 5 ) == 0 &&
+      strncmp( word, "whitelist", len ) == 0 )
+    return( WHITE );
+  if( ( len == 5 || len == 9 ) && strncmp( word, "black", 5 ) == 0 &&
+      strncmp( word, "blacklist", len ) == 0 )
+    return( BLACK );
+  return( -1 );
+}  /* end parse_list */
+
+//
+// The test field at the start of args: up to a '?' (it may then contain
+// spaces) or the first word. *rest is set to what follows. Returns NULL, or
+// why the test field is not valid.
+//
+static const char *parse_token( char *args, char *token, char **rest )
+{  /* Begin parse_token */
+  char *mark = strchr( args, '?' );
+  int len;
+
+  if( mark != NULL && mark - args <= LIST_TERM_MAX )
+    len = mark - args;
+  else
+  {
+    len = strcspn( args, " " );
+    mark = args + len;
+    if( *mark == '?' )
+      mark++;
+  }
+  if( len == 0 )
+    return( "test field is empty" );
+  if( len > LIST_TERM_MAX )
+    return( "test field is longer than 18 characters" );
+  if( args[0] == '#' || memchr( args, '|', len ) != NULL || memchr( args, '\t', len ) != NULL )
+    return( "test field may not start with '#' or contain '|' or tabs" );
+  memcpy( token, args, len );
+  token[len] = 0;
+
+  if( *mark == '?' )
+    mark++;
+  *rest = mark + strspn( mark, " " );
+  return( NULL );
+}  /* end parse_token */
+
+//
+// Drop the edits the list files have when the snapshot includes them, and
+// the removals that left their file as it was (no snapshot follows them).
+// An entry added that could not be written is kept.
+//
+static void absorb_edits( const struct list_snapshot *lists )
+{  /* Begin absorb_edits */
+  bool rebuild[2] = { FALSE, FALSE };
+  char message[LIST_LINE_MAX + 80];
+  unsigned long unchangedCount = persist_unchanged_count();
+  bool unchanged = unchangedCount != absorbedUnchanged;
+  int i, j;
+
+  // The copies without the removed entries are of the lists they were
+  // made from
+  if( lists->generation != keptGeneration )
+  {
+    drop_kept( WHITE );
+    drop_kept( BLACK );
+    keptGeneration = lists->generation;
+  }
+
+  if( lists->listSeq == absorbedSeq && !unchanged )
+    return;
+  absorbedSeq = lists->listSeq;
+  absorbedUnchanged = unchangedCount;
+  for( i = j = 0; i < nedits; i++ )
+  {
+    // An entry that did not get into the file is only in memory
+    if( unchanged && edits[i].add && !edits[i].failed && persist_list_unchanged( edits[i].seq ) )
+    {
+      edits[i].failed = TRUE;
+      snprintf( message, sizeof( message ), "control socket: %s.dat could not be written; "
+                "the entry is used until jcblock ends: %s", listName[edits[i].list],
+                edits[i].record );
+      log_info( message );
+    }
+    if( ( edits[i].seq <= absorbedSeq && !edits[i].failed ) ||
+        ( unchanged && !edits[i].add && persist_list_unchanged( edits[i].seq ) ) )
+    {
+      rebuild[edits[i].list] |= edits[i].add;
+      if( !edits[i].add )
+        drop_kept( edits[i].list );
+      continue;
+    }
+    edits[j++] = edits[i];
+  }
+  if( j == nedits )
+    return;
+  nedits = j;
+  editGeneration++;
+  for( i = 0; i < 2; i++ )
+  {
+    if( rebuild[i] )
+      rebuild_added( i );
+  }
+}  /* end absorb_edits */
+
+//
+// Build the list of the entries added to a list again from their records,
+// in the order they were added (an entry is added to it without this, see
+// add_entry(); it is built again when entries leave it: removed, read
+// from the file, or not taken). There are at most EDITS_MAX records.
+// Returns 0 or -1.
+//
+static int rebuild_added( int list )
+{  /* Begin rebuild_added */
+  static char records[EDITS_MAX * LIST_LINE_MAX];
+  int i, len = 0;
+
+  free_list( added[list] );
+  added[list] = NULL;
+  for( i = 0; i < nedits; i++ )
+  {
+    if( edits[i].add && edits[i].list == list )
+    {
+      strcpy( records + len, edits[i].record );
+      len += strlen( edits[i].record );
+    }
+  }
+  if( len == 0 )
+    return( 0 );
+  if( ( added[list] = load_list_records( records, listPath[list], listName[list] ) ) == NULL )
+  {
+    log_debug_info("out of memory building the entries added through the control socket");
+    return( -1 );
+  }
+  return( 0 );
+}  /* end rebuild_added */
+
+//
+// match_list() of a list with its edits: an entry of the list itself
+// whose test field was not removed, else an entry added to it.
+//
+static int match_edited( const struct match_list *base, int list, const char *callstr,
+                         const struct match_list **matched )
+{  /* Begin match_edited */
+  char token[LIST_TERM_MAX + 1];
+  int rule;
+
+  rule = base != NULL ? match_list( base, callstr ) : NO_MATCH;
+
+  // The first entry that matches was removed: others may still match
+  if( rule != NO_MATCH &&
+      token_removed( list, list_rule_token( base, rule, token, sizeof( token ) ) ) )
+    rule = ( base = kept_list( base, list ) ) != NULL ? match_list( base, callstr ) : NO_MATCH;
+  if( rule != NO_MATCH )
+  {
+    *matched = base;
+    return( rule );
+  }
+  if( added[list] != NULL && ( rule = match_list( added[list], callstr ) ) != NO_MATCH )
+  {
+    *matched = added[list];
+    return( rule );
+  }
+  *matched = NULL;
+  return( NO_MATCH );
+}  /* end match_edited */
+
+static bool token_removed( int list, const char *token )
+{  /* Begin token_removed */
+  int i;
+
+  for( i = 0; i < nedits; i++ )
+  {
+    if( !edits[i].add && edits[i].list == list && strcasecmp( edits[i].token, token ) == 0 )
+      return( TRUE );
+  }
+  return( FALSE );
+}  /* end token_removed */
+
+//
+// base without the entries whose test field was removed (see
+// list_without()). It is kept until the removals or the lists change (see
+// drop_kept()). NULL if memory runs out.
+//
+static const struct match_list *kept_list( const struct match_list *base, int list )
+{  /* Begin kept_list */
+  static const int lists[2] = { WHITE, BLACK };
+
+  if( kept[list] == NULL )
+    kept[list] = list_without( base, drop_removed, (void *)&lists[list] );
+  return( kept[list] );
+}  /* end kept_list */
+
+static void drop_kept( int list )
+{  /* Begin drop_kept */
+  free_list( kept[list] );
+  kept[list] = NULL;
+}  /* end drop_kept */
+
+static bool drop_removed( const char *token, void *arg )
+{  /* Begin drop_removed */
+  return( token_removed( *(const int *)arg, token ) );
+}  /* end drop_removed */
+
+// The text of a record (without its '\n')
+static void record_text( const struct match_list *ml, int rule, char *buf, int bufLen )
+{  /* Begin record_text */
+  snprintf( buf, bufLen, "%.*s", ml->rules[rule].text_len, ml->pool + ml->rules[rule].text_off );
+}  /* end record_text */
+
+static long usec_now( void )
+{  /* Begin usec_now */
+  struct timespec t;
+
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return( t.tv_sec * 1000000L + t.tv_nsec / 1000 );
+}  /* end usec_now */
@@ -0,0 +1,551 @@
+/*
+Program name: jcblock
+
+File name: dtmf.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Finds touch tone (DTMF) keys in the line audio, so that the star key pressed
+during a call can add the caller to blacklist.dat, as tones.c once did with
+ALSA alone. The audio is 8 kHz PCM as for fsk.c: from a voice-mode modem
+(jcblock -v), from a command such as arecord (jcblock -t) or from a WAV file
+("jcblock tones").
+
+A key is the sum of one tone of each group:
+          1209  1336  1477  1633 Hz
+   697     1     2     3     A
+   770     4     5     6     B
+   852     7     8     9     C
+   941     *     0     #     D
+The power of all 8 tones is measured over blocks of DTMF_BLOCK samples (12.75
+msec: the tones of a group are about one filter bandwidth apart, and two
+blocks fit in the shortest key, 40 msec) with a bank of Goertzel filters,
+one filter per tone. Each sample updates all 8
+filters at once: one AVX vector, two SSE2 or NEON vectors, or one at a time
+where none of them is available. The kernel is picked like the one of fold.c
+and dtmf_self_check() compares each with the one at a time kernel. A block
+has a key if the strongest tone of each group stands out from the others of
+its group, the two are within the twist a line allows, and they carry most
+of the block's energy (speech and music do not). A key is reported once, when
+two blocks in a row have it; it is released after two blocks without it.
+
+On a PC this takes about 0.2 msec of processor time a second of audio (0.9
+msec one filter at a time), so it can run all the time next to the call loop,
+on a Raspberry Pi too.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define DTMF_X86
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#include <arm_neon.h>
+#define DTMF_NEON
+#endif
+
+#include "common.h"
+
+#define MIN_ENERGY    1e-6f  // mean square of a block with a key (about -60 dBFS)
+#define MIN_SHARE     0.6f   // part of the block's energy in the two tones
+#define MAX_TWIST     6.3f   // the high tone at most 8 dB above the low one
+#define MAX_REVERSE   2.5f   // and at most 4 dB below it
+#define MIN_PEAK      4.0f   // strongest tone over the others of its group (6 dB)
+
+typedef void (*goertzel_fn)( const int16_t *x, int n, const float *coef, float *s, float *energy );
+
+struct dtmf_kernel
+{
+  const char *name;
+  goertzel_fn goertzel;
+  bool      (*usable)( void );
+};
+
+static void goertzel_scalar( const int16_t *x, int n, const float *coef, float *s, float *energy );
+static bool always( void );
+#ifdef DTMF_X86
+static void goertzel_sse2( const int16_t *x, int n, const float *coef, float *s, float *energy );
+static void goertzel_avx( const int16_t *x, int n, const float *coef, float *s, float *energy );
+static bool have_sse2( void );
+static bool have_avx( void );
+#endif
+#ifdef DTMF_NEON
+static void goertzel_neon( const int16_t *x, int n, const float *coef, float *s, float *energy );
+#endif
+static const struct dtmf_kernel *pick_kernel( void );
+static void make_coefs( void );
+static int block_key( const struct dtmf_detector *d );
+static int strongest( const float *power, float *peak );
+
+// Best first; the last one is always usable
+static const struct dtmf_kernel kernels[] =
+{
+#ifdef DTMF_X86
+  { "avx",    goertzel_avx,    have_avx },
+  { "sse2",   goertzel_sse2,   have_sse2 },
+#endif
+#ifdef DTMF_NEON
+  { "neon",   goertzel_neon,   always },
+#endif
+  { "scalar", goertzel_scalar, always },
+};
+#define NUM_KERNELS ( (int)( sizeof( kernels ) / sizeof( kernels[0] ) ) )
+
+static const struct dtmf_kernel *kernel;
+
+// The tones, the 4 low (row) ones first, and their filter coefficients
+static const float tones[DTMF_TONES] = { 697, 770, 852, 941, 1209, 1336, 1477, 1633 };
+static const char keyMap[4][5] = { "123A", "456B", "789C", "*0#D" };
+static float coef[DTMF_TONES];
+static int coefsMade;
+
+//
+// Prepare a detector.
+//
+void dtmf_init( struct dtmf_detector *d )
+{  /* Begin dtmf_init */
+  memset( d, 0, sizeof( *d ) );
+  make_coefs();
+}  /* end dtmf_init */
+
+//
+// Look for keys in n samples (16 bit, 8000 a second). The keys pressed are
+// put in keys (up to max of them, as '0'-'9', '*', '#' or 'A'-'D').
+// Returns their number.
+//
+int dtmf_feed( struct dtmf_detector *d, const int16_t *samples, int n, char *keys, int max )
+{  /* Begin dtmf_feed */
+  const struct dtmf_kernel *k = pick_kernel();
+  int found = 0;
+  int chunk, key;
+
+  while( n > 0 )
+  {
+    chunk = ( n < DTMF_BLOCK - d->count ) ? n : DTMF_BLOCK - d->count;
+    k->goertzel( samples, chunk, coef, d->s[0], &d->energy );
+    samples += chunk;
+    n -= chunk;
+    if( ( d->count += chunk ) < DTMF_BLOCK )
+      break;
+
+    // A block is complete: report a key the second block in a row that
+    // has it, release it the second block in a row that does not
+    key = block_key( d );
+    if( key != 0 && key == d->last && key != d->down )
+    {
+      d->down = key;
+      d->keys++;
+      if( found < max )
+        keys[found++] = key;
+    }
+    if( key != d->down && d->last != d->down )
+      d->down = 0;
+    d->last = key;
+    d->blocks++;
+    memset( d->s, 0, sizeof( d->s ) );
+    d->energy = 0;
+    d->count = 0;
+  }
+  return( found );
+}  /* end dtmf_feed */
+
+//
+// Synthesize a key pressed for msec milliseconds: both of its tones with the
+// peak level level (1.0 is full scale). Returns the number of samples written
+// to out, or -1 for an unknown key or if more than max would be needed.
+//
+int dtmf_tone( int key, int msec, double level, int16_t *out, int max )
+{  /* Begin dtmf_tone */
+  int count = msec * DTMF_RATE / 1000;
+  const char *p = NULL;
+  int row, col, s;
+
+  for( row = 0; row < 4; row++ )
+  {
+    if( key != 0 && ( p = strchr( keyMap[row], key ) ) != NULL )
+      break;
+  }
+  if( row == 4 || count > max )
+    return( -1 );
+  col = p - keyMap[row];
+  for( s = 0; s < count; s++ )
+    out[s] = (int16_t)lrint( level * 32767 *
+                             ( sin( 2 * M_PI * tones[row] * s / DTMF_RATE ) +
+                               sin( 2 * M_PI * tones[4 + col] * s / DTMF_RATE ) ) / 2 );
+  return( count );
+}  /* end dtmf_tone */
+
+//
+// The name of the kernel dtmf_feed() uses.
+//
+const char *dtmf_kernel_name( void )
+{  /* Begin dtmf_kernel_name */
+  return( pick_kernel()->name );
+}  /* end dtmf_kernel_name */
+
+//
+// The names of the kernels this processor can use, best first. Returns
+// their number.
+//
+int dtmf_kernels( const char **names, int max )
+{  /* Begin dtmf_kernels */
+  int k, n = 0;
+
+  for( k = 0; k < NUM_KERNELS && n < max; k++ )
+  {
+    if( kernels[k].usable() )
+      names[n++] = kernels[k].name;
+  }
+  return( n );
+}  /* end dtmf_kernels */
+
+//
+// Use the kernel of that name from now on ("jcblock tones -k"). Returns 0,
+// or -1 if there is none or the processor can not use it.
+//
+int dtmf_use_kernel( const char *name )
+{  /* Begin dtmf_use_kernel */
+  int k;
+
+  for( k = 0; k < NUM_KERNELS; k++ )
+  {
+    if( strcmp( kernels[k].name, name ) == 0 && kernels[k].usable() )
+    {
+      __atomic_store_n( &kernel, &kernels[k], __ATOMIC_RELEASE );
+      return( 0 );
+    }
+  }
+  return( -1 );
+}  /* end dtmf_use_kernel */
+
+//
+// Run pseudo-random samples of every length up to DTMF_BLOCK through each
+// usable kernel and compare the filters with the one at a time kernel. The
+// operations are the same, but a compiler may fuse a multiply and an add in
+// one of them, so they only have to agree to a millionth of the energy.
+// Returns 0, or -1 with the name of the kernel that differs in *failed.
+//
+int dtmf_self_check( const char **failed )
+{  /* Begin dtmf_self_check */
+  int16_t x[DTMF_BLOCK];
+  float want[2][DTMF_TONES], got[2][DTMF_TONES];
+  float wantEnergy, gotEnergy;
+  unsigned long seed = 12345;
+  int k, len, i;
+
+  make_coefs();
+  for( i = 0; i < DTMF_BLOCK; i++ )
+  {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    x[i] = (int16_t)( (long)( seed >> 33 ) % 65536 - 32768 );
+  }
+  for( k = 0; k < NUM_KERNELS; k++ )
+  {
+    if( !kernels[k].usable() )
+      continue;
+    for( len = 0; len <= DTMF_BLOCK; len += ( len < 20 ) ? 1 : 11 )
+    {
+      memset( want, 0, sizeof( want ) );
+      memset( got, 0, sizeof( got ) );
+      wantEnergy = gotEnergy = 0;
+      goertzel_scalar( x, len, coef, want[0], &wantEnergy );
+      kernels[k].goertzel( x, len, coef, got[0], &gotEnergy );
+      for( i = 0; i < DTMF_TONES; i++ )
+      {
+        if( fabsf( got[0][i] - want[0][i] ) > 1e-6f * ( len * wantEnergy + 1e-3f ) ||
+            fabsf( got[1][i] - want[1][i] ) > 1e-6f * ( len * wantEnergy + 1e-3f ) ||
+            fabsf( gotEnergy - wantEnergy ) > 1e-6f * ( wantEnergy + 1e-3f ) )
+        {
+          *failed = kernels[k].name;
+          return( -1 );
+        }
+      }
+    }
+  }
+  return( 0 );
+}  /* end dtmf_self_check */
+
+//
+// "jcblock tones [-k kernel] file.wav...": print the keys found in each
+// file with the time they were pressed, and how long it took. Returns 0, or
+// 1 if a file could not be read.
+//
+int tones_command( int argc, char **argv )
+{  /* Begin tones_command */
+  struct dtmf_detector d;
+  struct timespec t0, t1;
+  const char *failed;
+  int16_t *samples;
+  char keys[16];
+  int count, pos, chunk, found, optChar, i;
+  int status = 0;
+  double msec;
+
+  optind = 0;
+  while( ( optChar = getopt( argc, argv, "k:" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 'k':
+        if( dtmf_use_kernel( optarg ) != 0 )
+        {
+          fprintf( stderr, "%s: no such kernel on this processor\n", optarg );
+          return( 1 );
+        }
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if( optind >= argc )
+  {
+    fprintf( stderr, "Usage: jcblock tones [-k kernel] file.wav...\n" );
+    return( 1 );
+  }
+  if( dtmf_self_check( &failed ) != 0 )
+  {
+    fprintf( stderr, "the %s kernel gives wrong results\n", failed );
+    return( 1 );
+  }
+
+  for( ; optind < argc; optind++ )
+  {
+    if( fsk_read_wav( argv[optind], &samples, &count ) != 0 )
+    {
+      status = 1;
+      continue;
+    }
+    dtmf_init( &d );
+    msec = 0;
+
+    // In blocks, as the audio comes from a modem
+    for( pos = 0; pos < count; pos += chunk )
+    {
+      chunk = ( count - pos < DTMF_BLOCK ) ? count - pos : DTMF_BLOCK;
+      clock_gettime( CLOCK_MONOTONIC, &t0 );
+      found = dtmf_feed( &d, samples + pos, chunk, keys, sizeof( keys ) );
+      clock_gettime( CLOCK_MONOTONIC, &t1 );
+      msec += ( t1.tv_sec - t0.tv_sec ) * 1000.0 + ( t1.tv_nsec - t0.tv_nsec ) / 1e6;
+      for( i = 0; i < found; i++ )
+        printf( "%s at %.2f sec: %c\n", argv[optind], (double)( pos + chunk ) / DTMF_RATE, keys[i] );
+    }
+    printf( "%s: %ld key(s); %.1f sec of audio in %.3f msec (%s)\n",
+            argv[optind], d.keys, (double)count / DTMF_RATE, msec, dtmf_kernel_name() );
+    free( samples );
+  }
+  return( status );
+}  /* end tones_command */
+
+static const struct dtmf_kernel *pick_kernel( void )
+{  /* Begin pick_kernel */
+  const struct dtmf_kernel *k = __atomic_load_n( &kernel, __ATOMIC_ACQUIRE );
+  int i;
+
+  if( k != NULL )
+    return( k );
+  for( i = 0; !kernels[i].usable(); i++ )
+    ;
+  k = &kernels[i];
+  __atomic_store_n( &kernel, k, __ATOMIC_RELEASE );
+  return( k );
+}  /* end pick_kernel */
+
+//
+// The Goertzel coefficients, 2 cos( 2 pi f / rate ) (the same values every
+// time, so two threads may).
+//
+static void make_coefs( void )
+{  /* Begin make_coefs */
+  int i;
+
+  if( __atomic_load_n( &coefsMade, __ATOMIC_ACQUIRE ) )
+    return;
+  for( i = 0; i < DTMF_TONES; i++ )
+    coef[i] = 2 * cos( 2 * M_PI * tones[i] / DTMF_RATE );
+  __atomic_store_n( &coefsMade, 1, __ATOMIC_RELEASE );
+}  /* end make_coefs */
+
+//
+// The key of a complete block, or 0 if it has none.
+//
+static int block_key( const struct dtmf_detector *d )
+{  /* Begin block_key */
+  float power[DTMF_TONES];
+  float low, high;
+  int row, col, i;
+
+  if( d->energy < MIN_ENERGY * DTMF_BLOCK )
+    return( 0 );
+
+  // The power of each tone; a tone of peak level A has ( A * N / 2 )^2
+  // and adds N * A^2 / 2 to the energy
+  for( i = 0; i < DTMF_TONES; i++ )
+    power[i] = d->s[0][i] * d->s[0][i] + d->s[1][i] * d->s[1][i] -
+               coef[i] * d->s[0][i] * d->s[1][i];
+  if( ( row = strongest( power, &low ) ) < 0 ||
+      ( col = strongest( power + 4, &high ) ) < 0 )
+    return( 0 );
+  if( high > low * MAX_TWIST || low > high * MAX_REVERSE )
+    return( 0 );
+  if( ( low + high ) * 2 < MIN_SHARE * DTMF_BLOCK * d->energy )
+    return( 0 );
+  return( keyMap[row][col] );
+}  /* end block_key */
+
+//
+// The strongest of the 4 tones of a group, with its power in *peak, or -1
+// if it does not stand out from the other three.
+//
+static int strongest( const float *power, float *peak )
+{  /* Begin strongest */
+  int best = 0, i;
+
+  for( i = 1; i < 4; i++ )
+  {
+    if( power[i] > power[best] )
+      best = i;
+  }
+  for( i = 0; i < 4; i++ )
+  {
+    if( i != best && power[i] * MIN_PEAK > power[best] )
+      return( -1 );
+  }
+  *peak = power[best];
+  return( best );
+}  /* end strongest */
+
+//
+// Run the n samples through the filters: s holds the last two outputs of
+// each (s[0..7] the last, s[8..15] the one before); energy sums the squares
+// of the samples.
+//
+static void goertzel_scalar( const int16_t *x, int n, const float *coef, float *s, float *energy )
+{  /* Begin goertzel_scalar */
+  float v, out;
+  int i, j;
+
+  for( i = 0; i < n; i++ )
+  {
+    v = x[i] * ( 1.0f / 32768 );
+    *energy += v * v;
+    for( j = 0; j < DTMF_TONES; j++ )
+    {
+      out = v + coef[j] * s[j] - s[DTMF_TONES + j];
+      s[DTMF_TONES + j] = s[j];
+      s[j] = out;
+    }
+  }
+}  /* end goertzel_scalar */
+
+static bool always( void )
+{  /* Begin always */
+  return( TRUE );
+}  /* end always */
+
+#ifdef DTMF_X86
+__attribute__(( target( "sse2" ) ))
+static void goertzel_sse2( const int16_t *x, int n, const float *coef, float *s, float *energy )
+{  /* Begin goertzel_sse2 */
+  __m128 c0 = _mm_loadu_ps( coef ), c1 = _mm_loadu_ps( coef + 4 );
+  __m128 a0 = _mm_loadu_ps( s ), a1 = _mm_loadu_ps( s + 4 );
+  __m128 b0 = _mm_loadu_ps( s + 8 ), b1 = _mm_loadu_ps( s + 12 );
+  __m128 xv, o0, o1;
+  float v;
+  int i;
+
+  for( i = 0; i < n; i++ )
+  {
+    v = x[i] * ( 1.0f / 32768 );
+    *energy += v * v;
+    xv = _mm_set1_ps( v );
+    o0 = _mm_sub_ps( _mm_add_ps( xv, _mm_mul_ps( c0, a0 ) ), b0 );
+    o1 = _mm_sub_ps( _mm_add_ps( xv, _mm_mul_ps( c1, a1 ) ), b1 );
+    b0 = a0;
+    b1 = a1;
+    a0 = o0;
+    a1 = o1;
+  }
+  _mm_storeu_ps( s, a0 );
+  _mm_storeu_ps( s + 4, a1 );
+  _mm_storeu_ps( s + 8, b0 );
+  _mm_storeu_ps( s + 12, b1 );
+}  /* end goertzel_sse2 */
+
+__attribute__(( target( "avx" ) ))
+static void goertzel_avx( const int16_t *x, int n, const float *coef, float *s, float *energy )
+{  /* Begin goertzel_avx */
+  __m256 c = _mm256_loadu_ps( coef );
+  __m256 a = _mm256_loadu_ps( s ), b = _mm256_loadu_ps( s + 8 );
+  __m256 o;
+  float v;
+  int i;
+
+  for( i = 0; i < n; i++ )
+  {
+    v = x[i] * ( 1.0f / 32768 );
+    *energy += v * v;
+    o = _mm256_sub_ps( _mm256_add_ps( _mm256_set1_ps( v ), _mm256_mul_ps( c, a ) ), b );
+    b = a;
+    a = o;
+  }
+  _mm256_storeu_ps( s, a );
+  _mm256_storeu_ps( s + 8, b );
+}  /* end goertzel_avx */
+
+static bool have_sse2( void )
+{  /* Begin have_sse2 */
+  return( __builtin_cpu_supports( "sse2" ) );
+}  /* end have_sse2 */
+
+static bool have_avx( void )
+{  /* Begin have_avx */
+  return( __builtin_cpu_supports( "avx" ) );
+}  /* end have_avx */
+#endif
+
+#ifdef DTMF_NEON
+static void goertzel_neon( const int16_t *x, int n, const float *coef, float *s, float *energy )
+{  /* Begin goertzel_neon */
+  float32x4_t c0 = vld1q_f32( coef ), c1 = vld1q_f32( coef + 4 );
+  float32x4_t a0 = vld1q_f32( s ), a1 = vld1q_f32( s + 4 );
+  float32x4_t b0 = vld1q_f32( s + 8 ), b1 = vld1q_f32( s + 12 );
+  float32x4_t xv, o0, o1;
+  float v;
+  int i;
+
+  for( i = 0; i < n; i++ )
+  {
+    v = x[i] * ( 1.0f / 32768 );
+    *energy += v * v;
+    xv = vdupq_n_f32( v );
+    o0 = vsubq_f32( vmlaq_f32( xv, c0, a0 ), b0 );
+    o1 = vsubq_f32( vmlaq_f32( xv, c1, a1 ), b1 );
+    b0 = a0;
+    b1 = a1;
+    a0 = o0;
+    a1 = o1;
+  }
+  vst1q_f32( s, a0 );
+  vst1q_f32( s + 4, a1 );
+  vst1q_f32( s + 8, b0 );
+  vst1q_f32( s + 12, b1 );
+}  /* end goertzel_neon */
+#endif
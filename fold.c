@@ -0,0 +1,241 @@
+/*
+Program name: jcblock
+
+File name: fold.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Folds caller ID names to upper case so that list tokens match whatever case
+a caller uses (see match_list() in lists.c). Only the ASCII letters a-z are
+changed; every other byte is copied as it is. The string is folded 16 or 32
+bytes at a time with SSE2 or AVX2 on x86 and NEON on ARM, one byte at a time
+where none of them is available. The kernel is picked the first time a string
+is folded, from what the processor supports; fold_self_check() compares each
+kernel this build has with the byte at a time one.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define FOLD_X86
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#include <arm_neon.h>
+#define FOLD_NEON
+#endif
+
+#include "common.h"
+
+typedef void (*fold_fn)( char *dst, const char *src, int len );
+
+struct fold_kernel
+{
+  const char *name;
+  fold_fn     fold;
+  bool      (*usable)( void );
+};
+
+static void fold_scalar( char *dst, const char *src, int len );
+static bool always( void );
+#ifdef FOLD_X86
+static void fold_sse2( char *dst, const char *src, int len );
+static void fold_avx2( char *dst, const char *src, int len );
+static bool have_sse2( void );
+static bool have_avx2( void );
+#endif
+#ifdef FOLD_NEON
+static void fold_neon( char *dst, const char *src, int len );
+#endif
+static const struct fold_kernel *pick_kernel( void );
+
+// Best first; the last one is always usable
+static const struct fold_kernel kernels[] =
+{
+#ifdef FOLD_X86
+  { "avx2",   fold_avx2,   have_avx2 },
+  { "sse2",   fold_sse2,   have_sse2 },
+#endif
+#ifdef FOLD_NEON
+  { "neon",   fold_neon,   always },
+#endif
+  { "scalar", fold_scalar, always },
+};
+#define NUM_KERNELS ( (int)( sizeof( kernels ) / sizeof( kernels[0] ) ) )
+
+static const struct fold_kernel *kernel;
+
+//
+// Copy len bytes of src to dst with a-z changed to A-Z. dst and src may
+// be the same buffer.
+//
+void fold_upper( char *dst, const char *src, int len )
+{  /* Begin fold_upper */
+  pick_kernel()->fold( dst, src, len );
+}  /* end fold_upper */
+
+//
+// The name of the kernel fold_upper() uses.
+//
+const char *fold_kernel_name( void )
+{  /* Begin fold_kernel_name */
+  return( pick_kernel()->name );
+}  /* end fold_kernel_name */
+
+//
+// Fold every byte value at every length up to 100 and every alignment of
+// the source and destination with each usable kernel and compare the
+// result with the byte at a time kernel. Returns 0, or -1 with the name
+// of the kernel that differs in *failed.
+//
+int fold_self_check( const char **failed )
+{  /* Begin fold_self_check */
+  unsigned char src[160], want[160], got[160];
+  int k, len, so, dof, i, round;
+
+  for( k = 0; k < NUM_KERNELS; k++ )
+  {
+    if( !kernels[k].usable() )
+      continue;
+    for( round = 0; round < 256; round += 64 )
+    {
+      for( i = 0; i < (int)sizeof( src ); i++ )
+        src[i] = (unsigned char)( round + i * 7 + i / 37 );
+      for( len = 0; len <= 100; len++ )
+      {
+        for( so = 0; so < 32; so += 3 )
+        {
+          for( dof = 0; dof < 32; dof += 5 )
+          {
+            memset( want, 0xAA, sizeof( want ) );
+            memset( got, 0xAA, sizeof( got ) );
+            fold_scalar( (char *)want + dof, (const char *)src + so, len );
+            kernels[k].fold( (char *)got + dof, (const char *)src + so, len );
+            if( memcmp( want, got, sizeof( want ) ) != 0 )
+            {
+              *failed = kernels[k].name;
+              return( -1 );
+            }
+          }
+        }
+      }
+    }
+  }
+  return( 0 );
+}  /* end fold_self_check */
+
+static const struct fold_kernel *pick_kernel( void )
+{  /* Begin pick_kernel */
+  const struct fold_kernel *k = __atomic_load_n( &kernel, __ATOMIC_ACQUIRE );
+  int i;
+
+  if( k != NULL )
+    return( k );
+  for( i = 0; !kernels[i].usable(); i++ )
+    ;
+  k = &kernels[i];
+  __atomic_store_n( &kernel, k, __ATOMIC_RELEASE );
+  return( k );
+}  /* end pick_kernel */
+
+static void fold_scalar( char *dst, const char *src, int len )
+{  /* Begin fold_scalar */
+  int i;
+
+  for( i = 0; i < len; i++ )
+    dst[i] = ( src[i] >= 'a' && src[i] <= 'z' ) ? src[i] - ( 'a' - 'A' ) : src[i];
+}  /* end fold_scalar */
+
+static bool always( void )
+{  /* Begin always */
+  return( TRUE );
+}  /* end always */
+
+#ifdef FOLD_X86
+//
+// The compares are signed, so bytes of 0x80 and up (negative) are below
+// 'a' and stay as they are.
+//
+__attribute__(( target( "sse2" ) ))
+static void fold_sse2( char *dst, const char *src, int len )
+{  /* Begin fold_sse2 */
+  const __m128i below = _mm_set1_epi8( 'a' - 1 );
+  const __m128i above = _mm_set1_epi8( 'z' + 1 );
+  const __m128i bit   = _mm_set1_epi8( 'a' - 'A' );
+  __m128i x, lower;
+  int i;
+
+  for( i = 0; i + 16 <= len; i += 16 )
+  {
+    x = _mm_loadu_si128( (const __m128i *)( src + i ) );
+    lower = _mm_and_si128( _mm_cmpgt_epi8( x, below ), _mm_cmplt_epi8( x, above ) );
+    _mm_storeu_si128( (__m128i *)( dst + i ), _mm_sub_epi8( x, _mm_and_si128( lower, bit ) ) );
+  }
+  fold_scalar( dst + i, src + i, len - i );
+}  /* end fold_sse2 */
+
+__attribute__(( target( "avx2" ) ))
+static void fold_avx2( char *dst, const char *src, int len )
+{  /* Begin fold_avx2 */
+  const __m256i below = _mm256_set1_epi8( 'a' - 1 );
+  const __m256i above = _mm256_set1_epi8( 'z' + 1 );
+  const __m256i bit   = _mm256_set1_epi8( 'a' - 'A' );
+  __m256i x, lower;
+  int i;
+
+  for( i = 0; i + 32 <= len; i += 32 )
+  {
+    x = _mm256_loadu_si256( (const __m256i *)( src + i ) );
+    lower = _mm256_and_si256( _mm256_cmpgt_epi8( x, below ), _mm256_cmpgt_epi8( above, x ) );
+    _mm256_storeu_si256( (__m256i *)( dst + i ),
+                         _mm256_sub_epi8( x, _mm256_and_si256( lower, bit ) ) );
+  }
+  // A caller ID string is seldom longer than 32 bytes; the rest is done
+  // 16 bytes at a time
+  fold_sse2( dst + i, src + i, len - i );
+}  /* end fold_avx2 */
+
+static bool have_sse2( void )
+{  /* Begin have_sse2 */
+  return( __builtin_cpu_supports( "sse2" ) );
+}  /* end have_sse2 */
+
+static bool have_avx2( void )
+{  /* Begin have_avx2 */
+  return( __builtin_cpu_supports( "avx2" ) );
+}  /* end have_avx2 */
+#endif
+
+#ifdef FOLD_NEON
+static void fold_neon( char *dst, const char *src, int len )
+{  /* Begin fold_neon */
+  const uint8x16_t first = vdupq_n_u8( 'a' );
+  const uint8x16_t count = vdupq_n_u8( 'z' - 'a' );
+  const uint8x16_t bit   = vdupq_n_u8( 'a' - 'A' );
+  uint8x16_t x, lower;
+  int i;
+
+  // Unsigned: x - 'a' is at most 'z' - 'a' only for the letters
+  for( i = 0; i + 16 <= len; i += 16 )
+  {
+    x = vld1q_u8( (const uint8_t *)( src + i ) );
+    lower = vcleq_u8( vsubq_u8( x, first ), count );
+    vst1q_u8( (uint8_t *)( dst + i ), vsubq_u8( x, vandq_u8( lower, bit ) ) );
+  }
+  fold_scalar( dst + i, src + i, len - i );
+}  /* end fold_neon */
+#endif
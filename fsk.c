@@ -0,0 +1,992 @@
+/*
+Program name: jcblock
+
+File name: fsk.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Decodes caller ID from the line audio, for modems whose own decoding (AT+VCID=1)
+misses calls: 8 kHz PCM from a voice-mode modem (jcblock -v) or a WAV file
+("jcblock decode").
+
+The caller ID is sent between the first and second ring as Bell 202 FSK at
+1200 baud: 1200 Hz for a 1 (mark), 2200 Hz for a 0 (space). A channel
+seizure of alternating bits and a mark period of at least 80 bits come first,
+then the message, each byte sent as a start bit, 8 data bits (the lowest
+first) and a stop bit:
+  type      0x04 SDMF: MMDDhhmm and the number, in ASCII
+            0x80 MDMF: parameters of type, length, data (1 date and time,
+                 2 number, 4 why there is no number, 7 name, 8 why there
+                 is no name)
+  length    of the data
+  data
+  checksum  makes the sum of all the bytes 0 (modulo 256)
+A message with a wrong checksum is not used.
+
+Each sample is correlated with both tones over the last FSK_WINDOW samples
+(about one bit); the sign of the difference of the two energies is the bit.
+The correlations are computed FSK_CHUNK samples at a time, 4 or 8 samples at
+once with SSE2 or AVX on x86 and NEON on ARM (one at a time where none of
+them is available); the kernel is picked like the one of fold.c, and
+fsk_self_check() compares each with the one sample at a time kernel. The
+bits are then framed into bytes and messages like a UART does: a start bit
+begins at a mark to space edge, timed to a fraction of a sample from where
+the difference crosses zero, and each bit is the vote of the three windows
+around its middle. A line that attenuates one tone more than the other
+("twist") moves the crossings; the measured width of the space bits
+corrects the bit timing for it.
+
+The same file synthesizes the signal (fsk_message(), fsk_modulate()) for
+modemsim and fskbench, and reads and writes WAV files.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define FSK_X86
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#include <arm_neon.h>
+#define FSK_NEON
+#endif
+
+#include "common.h"
+
+#define MARK_HZ       1200
+#define SPACE_HZ      2200
+#define FSK_PERIOD    40     // samples in which both tones make whole cycles
+#define LO_LEN        ( FSK_PERIOD + FSK_CHUNK + FSK_WINDOW )
+#define MIN_LEVEL     2e-5f  // correlation energy of a carrier (about -55 dBFS)
+#define MARK_MIN      60     // mark samples before a message type byte (9 bits)
+#define MARK_RESTART  134    // a longer mark within a message starts a new one (20 bits)
+#define QUIET_MAX     80     // samples without a carrier that end a message (12 bits)
+#define BIT_SAMPLES   ( (float)FSK_RATE / 1200 )
+
+#define SEIZURE_BITS  300
+#define MARK_BITS     180
+#define TAIL_BITS     10
+
+#define PARAM_DATE      0x01   // MDMF parameters
+#define PARAM_NUMBER    0x02
+#define PARAM_NO_NUMBER 0x04
+#define PARAM_NAME      0x07
+#define PARAM_NO_NAME   0x08
+
+typedef void (*disc_fn)( const float *x, const float *lo, int n, float *diff, float *level );
+
+struct fsk_kernel
+{
+  const char *name;
+  disc_fn     disc;
+  bool      (*usable)( void );
+};
+
+static void disc_scalar( const float *x, const float *lo, int n, float *diff, float *level );
+static bool always( void );
+#ifdef FSK_X86
+static void disc_sse2( const float *x, const float *lo, int n, float *diff, float *level );
+static void disc_avx( const float *x, const float *lo, int n, float *diff, float *level );
+static bool have_sse2( void );
+static bool have_avx( void );
+#endif
+#ifdef FSK_NEON
+static void disc_neon( const float *x, const float *lo, int n, float *diff, float *level );
+#endif
+static const struct fsk_kernel *pick_kernel( void );
+static void make_tables( void );
+static bool fsk_sample( struct fsk_demod *d, float diff, float level, struct caller_id *cid );
+static bool message_byte( struct fsk_demod *d, int c, struct caller_id *cid );
+static int decode_message( const unsigned char *msg, int len, struct caller_id *cid );
+static void copy_field( char *field, int size, const unsigned char *data, int len );
+static int put_param( unsigned char *p, int type, const char *value );
+static void print_frame( const struct caller_id *cid );
+static unsigned int get16( const unsigned char *p );
+static unsigned int get32( const unsigned char *p );
+static void put16( unsigned char *p, unsigned int v );
+static void put32( unsigned char *p, unsigned int v );
+static int16_t ulaw_sample( unsigned char u );
+static int16_t alaw_sample( unsigned char a );
+
+// Best first; the last one is always usable
+static const struct fsk_kernel kernels[] =
+{
+#ifdef FSK_X86
+  { "avx",    disc_avx,    have_avx },
+  { "sse2",   disc_sse2,   have_sse2 },
+#endif
+#ifdef FSK_NEON
+  { "neon",   disc_neon,   always },
+#endif
+  { "scalar", disc_scalar, always },
+};
+#define NUM_KERNELS ( (int)( sizeof( kernels ) / sizeof( kernels[0] ) ) )
+
+static const struct fsk_kernel *kernel;
+
+// The tones: cosine and sine of mark, then of space, LO_LEN samples each so
+// that a chunk starting at any phase has them in one piece
+static float lo[4 * LO_LEN];
+static int tablesMade;
+
+//
+// Prepare a demodulator (also to forget a partial message).
+//
+void fsk_init( struct fsk_demod *d )
+{  /* Begin fsk_init */
+  memset( d, 0, sizeof( *d ) );
+  d->bit = -1;
+  d->spaceWidth = BIT_SAMPLES;
+  make_tables();
+}  /* end fsk_init */
+
+//
+// Demodulate up to n samples (16 bit, 8000 a second). Returns CID_FRAME as
+// soon as a chunk completes a message with a good checksum and a number,
+// which is then in *cid, otherwise CID_NONE. *used is set to the number of
+// samples taken; the rest are to be fed again.
+//
+int fsk_feed( struct fsk_demod *d, const int16_t *samples, int n,
+              struct caller_id *cid, int *used )
+{  /* Begin fsk_feed */
+  float diff[FSK_CHUNK], level[FSK_CHUNK];
+  const struct fsk_kernel *k = pick_kernel();
+  int result = CID_NONE;
+  int done, chunk, start, i;
+
+  for( done = 0; done < n && result == CID_NONE; done += chunk )
+  {
+    chunk = ( n - done < FSK_CHUNK ) ? n - done : FSK_CHUNK;
+    for( i = 0; i < chunk; i++ )
+      d->x[FSK_WINDOW - 1 + i] = samples[done + i] * ( 1.0f / 32768 );
+
+    // The tables start at the phase of the oldest sample of the window
+    start = ( d->phase + FSK_PERIOD - ( FSK_WINDOW - 1 ) ) % FSK_PERIOD;
+    k->disc( d->x, lo + start, chunk, diff, level );
+    memmove( d->x, d->x + chunk, ( FSK_WINDOW - 1 ) * sizeof( float ) );
+    d->phase = ( d->phase + chunk ) % FSK_PERIOD;
+
+    for( i = 0; i < chunk; i++ )
+    {
+      if( fsk_sample( d, diff[i], level[i], cid ) )
+        result = CID_FRAME;
+    }
+  }
+  *used = done;
+  return( result );
+}  /* end fsk_feed */
+
+//
+// Build the message of a caller ID (type FSK_SDMF or FSK_MDMF) in msg
+// (FSK_MSG_MAX bytes), with its checksum. "O" and "P" as the number or name
+// are sent as the reason there is none. Returns the length.
+//
+int fsk_message( const struct caller_id *cid, int type, unsigned char *msg )
+{  /* Begin fsk_message */
+  const char *date = ( cid->fields & CID_DATE ) ? cid->date : "0101";
+  const char *time = ( cid->fields & CID_TIME ) ? cid->time : "0000";
+  int len, i, sum = 0;
+
+  msg[0] = type;
+  if( type == FSK_SDMF )
+  {
+    len = sprintf( (char *)msg + 2, "%.4s%.4s%.20s", date, time, cid->number );
+  }
+  else
+  {
+    msg[2] = PARAM_DATE;
+    msg[3] = 8;
+    memcpy( msg + 4, date, 4 );
+    memcpy( msg + 8, time, 4 );
+    len = 10;
+    if( strcmp( cid->number, "O" ) == 0 || strcmp( cid->number, "P" ) == 0 )
+      len += put_param( msg + 2 + len, PARAM_NO_NUMBER, cid->number );
+    else
+      len += put_param( msg + 2 + len, PARAM_NUMBER, cid->number );
+    if( strcmp( cid->name, "O" ) == 0 || strcmp( cid->name, "P" ) == 0 )
+      len += put_param( msg + 2 + len, PARAM_NO_NAME, cid->name );
+    else if( cid->fields & CID_NAME )
+      len += put_param( msg + 2 + len, PARAM_NAME, cid->name );
+  }
+  msg[1] = len;
+  for( i = 0; i < len + 2; i++ )
+    sum += msg[i];
+  msg[len + 2] = -sum & 0xFF;
+  return( len + 3 );
+}  /* end fsk_message */
+
+//
+// Synthesize the FSK signal of a message: the channel seizure, the mark
+// period, the bytes and a short mark at the end. The tones have the peak
+// levels markLevel and spaceLevel (1.0 is full scale) and are off by
+// freqScale (1.01 is 1% high). Returns the number of samples written to
+// out, or -1 if more than max would be needed.
+//
+int fsk_modulate( const unsigned char *msg, int len, double markLevel, double spaceLevel,
+                  double freqScale, int16_t *out, int max )
+{  /* Begin fsk_modulate */
+  int count = ( SEIZURE_BITS + MARK_BITS + len * 10 + TAIL_BITS ) * 20 / 3;
+  double phase = 0;
+  int s, b, k, bit;
+
+  if( count > max )
+    return( -1 );
+  for( s = 0; s < count; s++ )
+  {
+    b = s * 3 / 20;
+    k = b - SEIZURE_BITS - MARK_BITS;
+    if( b < SEIZURE_BITS )
+      bit = b & 1;
+    else if( k < 0 || k >= len * 10 )
+      bit = 1;
+    else if( k % 10 == 0 )
+      bit = 0;
+    else if( k % 10 == 9 )
+      bit = 1;
+    else
+      bit = ( msg[k / 10] >> ( k % 10 - 1 ) ) & 1;
+
+    phase += 2 * M_PI * ( bit ? MARK_HZ : SPACE_HZ ) * freqScale / FSK_RATE;
+    if( phase > 2 * M_PI )
+      phase -= 2 * M_PI;
+    out[s] = (int16_t)lrint( ( bit ? markLevel : spaceLevel ) * 32767 * sin( phase ) );
+  }
+  return( count );
+}  /* end fsk_modulate */
+
+//
+// Read a mono (or the first channel of a) WAV file of 8000 samples a second:
+// 8 or 16 bit PCM, A-law or u-law. *samples is malloc()ed. Returns 0, or -1
+// after printing why to stderr.
+//
+int fsk_read_wav( const char *path, int16_t **samples, int *count )
+{  /* Begin fsk_read_wav */
+  unsigned char *data = NULL, *fmt = NULL, *pcm = NULL;
+  unsigned int format = 0, channels = 0, rate = 0, align = 0, bits = 0;
+  unsigned long size, pcmSize = 0, pos, chunk;
+  const char *why = NULL;
+  int16_t *out;
+  FILE *fp;
+  long i, n;
+
+  if( ( fp = fopen( path, "rb" ) ) == NULL )
+  {
+    perror( path );
+    return( -1 );
+  }
+  fseek( fp, 0, SEEK_END );
+  size = ftell( fp );
+  rewind( fp );
+  if( ( data = malloc( size + 1 ) ) == NULL || fread( data, 1, size, fp ) != size )
+  {
+    fprintf( stderr, "%s: read failed\n", path );
+    free( data );
+    fclose( fp );
+    return( -1 );
+  }
+  fclose( fp );
+
+  if( size < 12 || memcmp( data, "RIFF", 4 ) != 0 || memcmp( data + 8, "WAVE", 4 ) != 0 )
+    why = "not a WAV file";
+  for( pos = 12; why == NULL && pos + 8 <= size; pos += 8 + chunk + ( chunk & 1 ) )
+  {
+    chunk = get32( data + pos + 4 );
+    if( chunk > size - pos - 8 )
+      chunk = size - pos - 8;
+    if( memcmp( data + pos, "fmt ", 4 ) == 0 && chunk >= 16 )
+    {
+      fmt = data + pos + 8;
+      format = get16( fmt );
+      channels = get16( fmt + 2 );
+      rate = get32( fmt + 4 );
+      align = get16( fmt + 12 );
+      bits = get16( fmt + 14 );
+      if( format == 0xFFFE && chunk >= 26 )   // WAVE_FORMAT_EXTENSIBLE
+        format = get16( fmt + 24 );
+    }
+    else if( memcmp( data + pos, "data", 4 ) == 0 )
+    {
+      pcm = data + pos + 8;
+      pcmSize = chunk;
+    }
+  }
+  if( why == NULL && ( fmt == NULL || pcm == NULL ) )
+    why = "no fmt or data chunk";
+  else if( why == NULL && rate != FSK_RATE )
+    why = "not 8000 samples a second (convert it with sox -r 8000)";
+  else if( why == NULL && ( channels == 0 || align < channels * ( bits / 8 ) ||
+                            !( ( format == 1 && ( bits == 8 || bits == 16 ) ) ||
+                               ( ( format == 6 || format == 7 ) && bits == 8 ) ) ) )
+    why = "not 8 or 16 bit PCM, A-law or u-law";
+  if( why != NULL )
+  {
+    fprintf( stderr, "%s: %s\n", path, why );
+    free( data );
+    return( -1 );
+  }
+
+  n = pcmSize / align;
+  if( ( out = malloc( ( n + 1 ) * sizeof( int16_t ) ) ) == NULL )
+  {
+    fprintf( stderr, "%s: out of memory\n", path );
+    free( data );
+    return( -1 );
+  }
+  for( i = 0; i < n; i++ )
+  {
+    const unsigned char *p = pcm + i * align;
+
+    if( format == 6 )
+      out[i] = alaw_sample( p[0] );
+    else if( format == 7 )
+      out[i] = ulaw_sample( p[0] );
+    else if( bits == 8 )
+      out[i] = ( p[0] - 128 ) << 8;
+    else
+      out[i] = (int16_t)get16( p );
+  }
+  free( data );
+  *samples = out;
+  *count = n;
+  return( 0 );
+}  /* end fsk_read_wav */
+
+//
+// Write samples as a mono WAV file of 8 or 16 bit PCM. Returns 0 or -1.
+//
+int fsk_write_wav( const char *path, const int16_t *samples, int count, int bits )
+{  /* Begin fsk_write_wav */
+  unsigned char header[44], b[2];
+  FILE *fp;
+  int bytes = bits / 8;
+  int i, ok;
+
+  memcpy( header, "RIFF", 4 );
+  put32( header + 4, 36 + count * bytes );
+  memcpy( header + 8, "WAVEfmt ", 8 );
+  put32( header + 16, 16 );
+  put16( header + 20, 1 );
+  put16( header + 22, 1 );
+  put32( header + 24, FSK_RATE );
+  put32( header + 28, FSK_RATE * bytes );
+  put16( header + 32, bytes );
+  put16( header + 34, bits );
+  memcpy( header + 36, "data", 4 );
+  put32( header + 40, count * bytes );
+
+  if( ( fp = fopen( path, "wb" ) ) == NULL )
+    return( -1 );
+  ok = fwrite( header, 1, sizeof( header ), fp ) == sizeof( header );
+  for( i = 0; i < count && ok; i++ )
+  {
+    if( bits == 8 )
+      b[0] = ( samples[i] >> 8 ) + 128;
+    else
+      put16( b, (uint16_t)samples[i] );
+    ok = fwrite( b, 1, bytes, fp ) == bytes;
+  }
+  if( fclose( fp ) != 0 )
+    ok = FALSE;
+  return( ok ? 0 : -1 );
+}  /* end fsk_write_wav */
+
+//
+// The name of the kernel fsk_feed() uses.
+//
+const char *fsk_kernel_name( void )
+{  /* Begin fsk_kernel_name */
+  return( pick_kernel()->name );
+}  /* end fsk_kernel_name */
+
+//
+// The names of the kernels this processor can use, best first. Returns
+// their number.
+//
+int fsk_kernels( const char **names, int max )
+{  /* Begin fsk_kernels */
+  int k, n = 0;
+
+  for( k = 0; k < NUM_KERNELS && n < max; k++ )
+  {
+    if( kernels[k].usable() )
+      names[n++] = kernels[k].name;
+  }
+  return( n );
+}  /* end fsk_kernels */
+
+//
+// Use the kernel of that name from now on (fskbench times each). Returns 0,
+// or -1 if there is none or the processor can not use it.
+//
+int fsk_use_kernel( const char *name )
+{  /* Begin fsk_use_kernel */
+  int k;
+
+  for( k = 0; k < NUM_KERNELS; k++ )
+  {
+    if( strcmp( kernels[k].name, name ) == 0 && kernels[k].usable() )
+    {
+      __atomic_store_n( &kernel, &kernels[k], __ATOMIC_RELEASE );
+      return( 0 );
+    }
+  }
+  return( -1 );
+}  /* end fsk_use_kernel */
+
+//
+// Correlate pseudo-random signals of every length up to FSK_CHUNK at every
+// phase of the tables with each usable kernel and compare the result with
+// the one sample at a time kernel. The sums are added in the same order, but
+// a compiler may fuse a multiply and an add in one of them, so they only
+// have to agree to a millionth of the energy. Returns 0, or -1 with the name
+// of the kernel that differs in *failed.
+//
+int fsk_self_check( const char **failed )
+{  /* Begin fsk_self_check */
+  float x[FSK_WINDOW - 1 + FSK_CHUNK];
+  float wantDiff[FSK_CHUNK], wantLevel[FSK_CHUNK], diff[FSK_CHUNK], level[FSK_CHUNK];
+  unsigned long seed = 12345;
+  int k, len, start, i;
+
+  make_tables();
+  for( i = 0; i < FSK_WINDOW - 1 + FSK_CHUNK; i++ )
+  {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    x[i] = (float)( (long)( seed >> 33 ) % 65536 - 32768 ) / 32768;
+  }
+  for( k = 0; k < NUM_KERNELS; k++ )
+  {
+    if( !kernels[k].usable() )
+      continue;
+    for( len = 0; len <= FSK_CHUNK; len += ( len < 20 ) ? 1 : 13 )
+    {
+      for( start = 0; start < FSK_PERIOD; start += 3 )
+      {
+        disc_scalar( x, lo + start, len, wantDiff, wantLevel );
+        kernels[k].disc( x, lo + start, len, diff, level );
+        for( i = 0; i < len; i++ )
+        {
+          if( fabsf( diff[i] - wantDiff[i] ) > 1e-6f * ( wantLevel[i] + 1e-3f ) ||
+              fabsf( level[i] - wantLevel[i] ) > 1e-6f * ( wantLevel[i] + 1e-3f ) )
+          {
+            *failed = kernels[k].name;
+            return( -1 );
+          }
+        }
+      }
+    }
+  }
+  return( 0 );
+}  /* end fsk_self_check */
+
+//
+// "jcblock decode [-k kernel] file.wav...": print the caller ID frames
+// found in each file the way a modem sends them, and how long the decoding
+// took. Returns 0, or 1 if a file could not be read or had no frame.
+//
+int decode_command( int argc, char **argv )
+{  /* Begin decode_command */
+  struct fsk_demod d;
+  struct caller_id cid;
+  struct timespec t0, t1;
+  int16_t *samples;
+  int count, used, pos, optChar;
+  int status = 0;
+  double msec;
+
+  optind = 0;
+  while( ( optChar = getopt( argc, argv, "k:" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 'k':
+        if( fsk_use_kernel( optarg ) != 0 )
+        {
+          fprintf( stderr, "%s: no such kernel on this processor\n", optarg );
+          return( 1 );
+        }
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if( optind >= argc )
+  {
+    fprintf( stderr, "Usage: jcblock decode [-k kernel] file.wav...\n" );
+    return( 1 );
+  }
+
+  for( ; optind < argc; optind++ )
+  {
+    if( fsk_read_wav( argv[optind], &samples, &count ) != 0 )
+    {
+      status = 1;
+      continue;
+    }
+    fsk_init( &d );
+    msec = 0;
+    for( pos = 0; pos < count; pos += used )
+    {
+      clock_gettime( CLOCK_MONOTONIC, &t0 );
+      if( fsk_feed( &d, samples + pos, count - pos, &cid, &used ) == CID_FRAME )
+      {
+        clock_gettime( CLOCK_MONOTONIC, &t1 );
+        printf( "%s at %.2f sec:\n", argv[optind], (double)( pos + used ) / FSK_RATE );
+        print_frame( &cid );
+      }
+      else
+        clock_gettime( CLOCK_MONOTONIC, &t1 );
+      msec += ( t1.tv_sec - t0.tv_sec ) * 1000.0 + ( t1.tv_nsec - t0.tv_nsec ) / 1e6;
+    }
+    printf( "%s: %ld frame(s), %ld bad; %.1f sec of audio decoded in %.2f msec (%s)\n",
+            argv[optind], d.frames, d.errors, (double)count / FSK_RATE, msec,
+            fsk_kernel_name() );
+    if( d.frames == 0 )
+      status = 1;
+    free( samples );
+  }
+  return( status );
+}  /* end decode_command */
+
+static const struct fsk_kernel *pick_kernel( void )
+{  /* Begin pick_kernel */
+  const struct fsk_kernel *k = __atomic_load_n( &kernel, __ATOMIC_ACQUIRE );
+  int i;
+
+  if( k != NULL )
+    return( k );
+  for( i = 0; !kernels[i].usable(); i++ )
+    ;
+  k = &kernels[i];
+  __atomic_store_n( &kernel, k, __ATOMIC_RELEASE );
+  return( k );
+}  /* end pick_kernel */
+
+//
+// Fill the tone tables (the same values every time, so two threads may).
+//
+static void make_tables( void )
+{  /* Begin make_tables */
+  int i;
+
+  if( __atomic_load_n( &tablesMade, __ATOMIC_ACQUIRE ) )
+    return;
+  for( i = 0; i < LO_LEN; i++ )
+  {
+    lo[i]              = cos( 2 * M_PI * MARK_HZ * i / FSK_RATE );
+    lo[LO_LEN + i]     = sin( 2 * M_PI * MARK_HZ * i / FSK_RATE );
+    lo[2 * LO_LEN + i] = cos( 2 * M_PI * SPACE_HZ * i / FSK_RATE );
+    lo[3 * LO_LEN + i] = sin( 2 * M_PI * SPACE_HZ * i / FSK_RATE );
+  }
+  __atomic_store_n( &tablesMade, 1, __ATOMIC_RELEASE );
+}  /* end make_tables */
+
+//
+// The next correlation: decide the bits and frame them into bytes. Returns
+// TRUE when it completes a message (decoded into *cid).
+//
+static bool fsk_sample( struct fsk_demod *d, float diff, float level, struct caller_id *cid )
+{  /* Begin fsk_sample */
+  bool carrier = level > MIN_LEVEL;
+  float v = carrier ? diff : 1;        // no carrier: idle, like a mark
+  float prev = d->v[1];
+  float vote, width;
+  int bit;
+
+  vote = d->v[0] + d->v[1] + v;
+  d->v[0] = d->v[1];
+  d->v[1] = v;
+
+  // Where the decision crosses zero is a little off the edge of a bit:
+  // later into the weaker tone (twist). A space that follows a mark
+  // looks longer than a bit by twice the difference, which moves the
+  // time each bit is decided at.
+  d->sinceFall += 1;
+  if( prev >= 0 && v < 0 )
+    d->sinceFall = -v / ( prev - v );
+  else if( prev < 0 && v >= 0 && carrier )
+  {
+    width = d->sinceFall - v / ( v - prev );
+    if( width > BIT_SAMPLES / 2 && width < BIT_SAMPLES * 3 / 2 )
+      d->spaceWidth += ( width - d->spaceWidth ) / 8;
+  }
+
+  // A message that stops is lost
+  if( carrier )
+    d->quiet = 0;
+  else if( ++d->quiet == QUIET_MAX && d->msgLen > 0 )
+  {
+    d->errors++;
+    d->msgLen = 0;
+  }
+
+  // Waiting for a start bit. Its edge is where the decision crossed zero
+  // between the last sample and this one; the bits are timed from there.
+  if( d->bit < 0 )
+  {
+    if( v >= 0 )
+    {
+      d->markRun = carrier ? d->markRun + 1 : 0;
+      return( FALSE );
+    }
+    d->bit = 0;
+    d->since = d->sinceFall;
+    d->lead = d->markRun;
+    d->byte = 0;
+    return( FALSE );
+  }
+
+  // Each bit is decided by the three windows around the one that holds
+  // just that bit (the sample before this one). Without twist that window
+  // ends a bit less half a window after the start edge; a quarter of a
+  // sample earlier was best with noise.
+  d->since += 1;
+  if( d->since < ( d->spaceWidth + BIT_SAMPLES ) / 2 - FSK_WINDOW / 2.0f - 0.25f +
+                 d->bit * BIT_SAMPLES + 1 )
+    return( FALSE );
+  bit = vote > 0;
+
+  // A start bit that is gone by its middle was noise
+  if( d->bit == 0 && bit )
+  {
+    d->bit = -1;
+    d->markRun = d->lead + (int)d->since;
+    return( FALSE );
+  }
+  if( d->bit >= 1 && d->bit <= 8 )
+    d->byte |= bit << ( d->bit - 1 );
+  if( d->bit < 9 )
+  {
+    d->bit++;
+    return( FALSE );
+  }
+
+  // The stop bit
+  d->bit = -1;
+  d->markRun = 0;
+  if( !bit )
+  {
+    if( d->msgLen > 0 )
+      d->errors++;
+    d->msgLen = 0;
+    return( FALSE );
+  }
+  return( message_byte( d, d->byte, cid ) );
+}  /* end fsk_sample */
+
+//
+// A byte was received. A message starts with its type after the mark
+// period; the seizure before it and noise are skipped.
+//
+static bool message_byte( struct fsk_demod *d, int c, struct caller_id *cid )
+{  /* Begin message_byte */
+  if( d->msgLen > 0 && d->lead >= MARK_RESTART )
+  {
+    d->errors++;
+    d->msgLen = 0;
+  }
+  if( d->msgLen == 0 )
+  {
+    if( ( c == FSK_SDMF || c == FSK_MDMF ) && d->lead >= MARK_MIN )
+      d->msg[d->msgLen++] = c;
+    return( FALSE );
+  }
+
+  // The length byte keeps a message within FSK_MSG_MAX; should it not, the
+  // message is dropped
+  if( d->msgLen < 0 || d->msgLen >= FSK_MSG_MAX )
+  {
+    d->errors++;
+    d->msgLen = 0;
+    return( FALSE );
+  }
+  d->msg[d->msgLen++] = c;
+  if( d->msgLen < 2 || d->msgLen < d->msg[1] + 3 )
+    return( FALSE );
+  d->msgLen = 0;
+  if( decode_message( d->msg, d->msg[1] + 3, cid ) != 0 )
+  {
+    d->errors++;
+    return( FALSE );
+  }
+  d->frames++;
+  return( TRUE );
+}  /* end message_byte */
+
+//
+// Check the checksum of a message and take its fields. Returns 0, or -1 if
+// the checksum is wrong, a parameter does not fit or there is no number.
+//
+static int decode_message( const unsigned char *msg, int len, struct caller_id *cid )
+{  /* Begin decode_message */
+  int end = len - 1;                   // the checksum is not data
+  int sum = 0, i, p, plen;
+
+  for( i = 0; i < len; i++ )
+    sum += msg[i];
+  if( ( sum & 0xFF ) != 0 )
+    return( -1 );
+
+  memset( cid, 0, sizeof( *cid ) );
+  if( msg[0] == FSK_SDMF )
+  {
+    if( end < 10 )
+      return( -1 );
+    copy_field( cid->date, sizeof( cid->date ), msg + 2, 4 );
+    copy_field( cid->time, sizeof( cid->time ), msg + 6, 4 );
+    copy_field( cid->number, sizeof( cid->number ), msg + 10, end - 10 );
+    cid->fields = CID_DATE | CID_TIME | CID_NMBR;
+  }
+  else
+  {
+    for( p = 2; p < end; p += 2 + plen )
+    {
+      if( p + 2 > end )
+        return( -1 );
+      plen = msg[p + 1];
+      if( p + 2 + plen > end )
+        return( -1 );
+      switch( msg[p] )
+      {
+        case PARAM_DATE:
+          if( plen != 8 )
+            return( -1 );
+          copy_field( cid->date, sizeof( cid->date ), msg + p + 2, 4 );
+          copy_field( cid->time, sizeof( cid->time ), msg + p + 6, 4 );
+          cid->fields |= CID_DATE | CID_TIME;
+          break;
+        case PARAM_NUMBER:
+        case PARAM_NO_NUMBER:
+          copy_field( cid->number, sizeof( cid->number ), msg + p + 2, plen );
+          cid->fields |= CID_NMBR;
+          break;
+        case PARAM_NAME:
+        case PARAM_NO_NAME:
+          copy_field( cid->name, sizeof( cid->name ), msg + p + 2, plen );
+          cid->fields |= CID_NAME;
+          break;
+      }
+    }
+  }
+  return( ( cid->fields & CID_NMBR ) && cid->number[0] != 0 ? 0 : -1 );
+}  /* end decode_message */
+
+//
+// Copy a field, truncated to its size and without trailing blanks. '|'
+// would break the record format of callerID.dat and control characters the
+// log, so they are replaced.
+//
+static void copy_field( char *field, int size, const unsigned char *data, int len )
+{  /* Begin copy_field */
+  int i;
+
+  if( len > size - 1 )
+    len = size - 1;
+  while( len > 0 && data[len - 1] == ' ' )
+    len--;
+  for( i = 0; i < len; i++ )
+    field[i] = ( data[i] == '|' ) ? '/' : ( data[i] < ' ' || data[i] > '~' ) ? '?' : data[i];
+  field[len] = 0;
+}  /* end copy_field */
+
+static int put_param( unsigned char *p, int type, const char *value )
+{  /* Begin put_param */
+  int len = strlen( value );
+
+  p[0] = type;
+  p[1] = len;
+  memcpy( p + 2, value, len );
+  return( len + 2 );
+}  /* end put_param */
+
+static void print_frame( const struct caller_id *cid )
+{  /* Begin print_frame */
+  if( cid->fields & CID_DATE )
+    printf( "DATE = %s\n", cid->date );
+  if( cid->fields & CID_TIME )
+    printf( "TIME = %s\n", cid->time );
+  printf( "NMBR = %s\n", cid->number );
+  if( cid->fields & CID_NAME )
+    printf( "NAME = %s\n", cid->name );
+  printf( "\n" );
+}  /* end print_frame */
+
+static unsigned int get16( const unsigned char *p )
+{  /* Begin get16 */
+  return( p[0] | p[1] << 8 );
+}  /* end get16 */
+
+static unsigned int get32( const unsigned char *p )
+{  /* Begin get32 */
+  return( p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24 );
+}  /* end get32 */
+
+static void put16( unsigned char *p, unsigned int v )
+{  /* Begin put16 */
+  p[0] = v;
+  p[1] = v >> 8;
+}  /* end put16 */
+
+static void put32( unsigned char *p, unsigned int v )
+{  /* Begin put32 */
+  put16( p, v );
+  put16( p + 2, v >> 16 );
+}  /* end put32 */
+
+static int16_t ulaw_sample( unsigned char u )
+{  /* Begin ulaw_sample */
+  int t;
+
+  u = ~u;
+  t = ( ( ( u & 0x0F ) << 3 ) + 0x84 ) << ( ( u & 0x70 ) >> 4 );
+  return( ( u & 0x80 ) ? 0x84 - t : t - 0x84 );
+}  /* end ulaw_sample */
+
+static int16_t alaw_sample( unsigned char a )
+{  /* Begin alaw_sample */
+  int t, seg;
+
+  a ^= 0x55;
+  t = ( a & 0x0F ) << 4;
+  seg = ( a & 0x70 ) >> 4;
+  if( seg == 0 )
+    t += 8;
+  else
+    t = ( t + 0x108 ) << ( seg - 1 );
+  return( ( a & 0x80 ) ? t : -t );
+}  /* end alaw_sample */
+
+//
+// The correlations of the samples ending at each of the n new ones (x holds
+// FSK_WINDOW - 1 older samples first; lo the tables from the phase of x[0]):
+// diff is the mark energy less the space energy, level their sum.
+//
+static void disc_scalar( const float *x, const float *lo, int n, float *diff, float *level )
+{  /* Begin disc_scalar */
+  float mc, ms, sc, ss;
+  int i, j;
+
+  for( i = 0; i < n; i++ )
+  {
+    mc = ms = sc = ss = 0;
+    for( j = 0; j < FSK_WINDOW; j++ )
+    {
+      mc += x[i + j] * lo[i + j];
+      ms += x[i + j] * lo[LO_LEN + i + j];
+      sc += x[i + j] * lo[2 * LO_LEN + i + j];
+      ss += x[i + j] * lo[3 * LO_LEN + i + j];
+    }
+    diff[i]  = ( mc * mc + ms * ms ) - ( sc * sc + ss * ss );
+    level[i] = ( mc * mc + ms * ms ) + ( sc * sc + ss * ss );
+  }
+}  /* end disc_scalar */
+
+static bool always( void )
+{  /* Begin always */
+  return( TRUE );
+}  /* end always */
+
+#ifdef FSK_X86
+__attribute__(( target( "sse2" ) ))
+static void disc_sse2( const float *x, const float *lo, int n, float *diff, float *level )
+{  /* Begin disc_sse2 */
+  __m128 mc, ms, sc, ss, xv, m2, s2;
+  int i, j;
+
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    mc = ms = sc = ss = _mm_setzero_ps();
+    for( j = 0; j < FSK_WINDOW; j++ )
+    {
+      xv = _mm_loadu_ps( x + i + j );
+      mc = _mm_add_ps( mc, _mm_mul_ps( xv, _mm_loadu_ps( lo + i + j ) ) );
+      ms = _mm_add_ps( ms, _mm_mul_ps( xv, _mm_loadu_ps( lo + LO_LEN + i + j ) ) );
+      sc = _mm_add_ps( sc, _mm_mul_ps( xv, _mm_loadu_ps( lo + 2 * LO_LEN + i + j ) ) );
+      ss = _mm_add_ps( ss, _mm_mul_ps( xv, _mm_loadu_ps( lo + 3 * LO_LEN + i + j ) ) );
+    }
+    m2 = _mm_add_ps( _mm_mul_ps( mc, mc ), _mm_mul_ps( ms, ms ) );
+    s2 = _mm_add_ps( _mm_mul_ps( sc, sc ), _mm_mul_ps( ss, ss ) );
+    _mm_storeu_ps( diff + i, _mm_sub_ps( m2, s2 ) );
+    _mm_storeu_ps( level + i, _mm_add_ps( m2, s2 ) );
+  }
+  disc_scalar( x + i, lo + i, n - i, diff + i, level + i );
+}  /* end disc_sse2 */
+
+__attribute__(( target( "avx" ) ))
+static void disc_avx( const float *x, const float *lo, int n, float *diff, float *level )
+{  /* Begin disc_avx */
+  __m256 mc, ms, sc, ss, xv, m2, s2;
+  int i, j;
+
+  for( i = 0; i + 8 <= n; i += 8 )
+  {
+    mc = ms = sc = ss = _mm256_setzero_ps();
+    for( j = 0; j < FSK_WINDOW; j++ )
+    {
+      xv = _mm256_loadu_ps( x + i + j );
+      mc = _mm256_add_ps( mc, _mm256_mul_ps( xv, _mm256_loadu_ps( lo + i + j ) ) );
+      ms = _mm256_add_ps( ms, _mm256_mul_ps( xv, _mm256_loadu_ps( lo + LO_LEN + i + j ) ) );
+      sc = _mm256_add_ps( sc, _mm256_mul_ps( xv, _mm256_loadu_ps( lo + 2 * LO_LEN + i + j ) ) );
+      ss = _mm256_add_ps( ss, _mm256_mul_ps( xv, _mm256_loadu_ps( lo + 3 * LO_LEN + i + j ) ) );
+    }
+    m2 = _mm256_add_ps( _mm256_mul_ps( mc, mc ), _mm256_mul_ps( ms, ms ) );
+    s2 = _mm256_add_ps( _mm256_mul_ps( sc, sc ), _mm256_mul_ps( ss, ss ) );
+    _mm256_storeu_ps( diff + i, _mm256_sub_ps( m2, s2 ) );
+    _mm256_storeu_ps( level + i, _mm256_add_ps( m2, s2 ) );
+  }
+  disc_sse2( x + i, lo + i, n - i, diff + i, level + i );
+}  /* end disc_avx */
+
+static bool have_sse2( void )
+{  /* Begin have_sse2 */
+  return( __builtin_cpu_supports( "sse2" ) );
+}  /* end have_sse2 */
+
+static bool have_avx( void )
+{  /* Begin have_avx */
+  return( __builtin_cpu_supports( "avx" ) );
+}  /* end have_avx */
+#endif
+
+#ifdef FSK_NEON
+static void disc_neon( const float *x, const float *lo, int n, float *diff, float *level )
+{  /* Begin disc_neon */
+  float32x4_t mc, ms, sc, ss, xv, m2, s2;
+  int i, j;
+
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    mc = ms = sc = ss = vdupq_n_f32( 0 );
+    for( j = 0; j < FSK_WINDOW; j++ )
+    {
+      xv = vld1q_f32( x + i + j );
+      mc = vmlaq_f32( mc, xv, vld1q_f32( lo + i + j ) );
+      ms = vmlaq_f32( ms, xv, vld1q_f32( lo + LO_LEN + i + j ) );
+      sc = vmlaq_f32( sc, xv, vld1q_f32( lo + 2 * LO_LEN + i + j ) );
+      ss = vmlaq_f32( ss, xv, vld1q_f32( lo + 3 * LO_LEN + i + j ) );
+    }
+    m2 = vmlaq_f32( vmulq_f32( mc, mc ), ms, ms );
+    s2 = vmlaq_f32( vmulq_f32( sc, sc ), ss, ss );
+    vst1q_f32( diff + i, vsubq_f32( m2, s2 ) );
+    vst1q_f32( level + i, vaddq_f32( m2, s2 ) );
+  }
+  disc_scalar( x + i, lo + i, n - i, diff + i, level + i );
+}  /* end disc_neon */
+#endif
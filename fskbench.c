@@ -0,0 +1,364 @@
+/*
+Program name: fskbench
+
+File name: fskbench.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+A test and benchmark of the FSK caller ID decoder (fsk.c). It writes a corpus
+of WAV files, each with one caller ID (SDMF or MDMF; with a name, without
+one, private or out of area) synthesized as a phone line would carry it:
+  - a level between -35 and -6 dBFS, a twist (mark to space level) of up to
+    6 dB either way and the tones up to 1% off their frequencies
+  - white noise at a signal to noise ratio of 40 down to 8 dB, from up to a
+    second before the signal to after it
+  - 16 bit PCM, every fifth file 8 bit (as a voice-mode modem sends)
+The corpus is the same every run; corpus.txt lists each file and what is in
+it, so the files can also be given to "jcblock decode". Then it decodes every
+file with every kernel the processor has and reports the frames decoded,
+missed and decoded wrong by signal to noise ratio, and how much faster than
+real time each kernel is. Before that it checks that the kernels correlate
+as the one sample at a time kernel does, and stops if one does not.
+
+Usage:
+  fskbench [-n files] [-d dir] [-k kernels]
+  -n  files in the corpus (default 240)
+  -d  directory of the corpus (default /tmp/fskbench)
+  -k  comma separated kernels (default all the processor has)
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+#define MAX_KERNELS     8
+#define MAX_SAMPLES     ( 4 * FSK_RATE )   // the longest file
+#define NUM_SNRS        ( (int)( sizeof( snrs ) / sizeof( snrs[0] ) ) )
+
+struct corpus_file
+{
+  char path[FILE_PATH_MAX];
+  struct caller_id cid;          // what was sent
+  int  snr;                      // signal to noise ratio, dB
+  long samples;
+};
+
+struct result
+{
+  int decoded, missed, wrong;
+};
+
+static const int snrs[] = { 40, 20, 15, 12, 10, 8 };
+
+static const char *names[] =
+{
+  "WIRELESS CALLER", "SMITH JOHN", "O'BRIEN PAT", "TOLL FREE CALL",
+  "V123456789012345", "CARD SERVICES", "ANYTOWN    ST", "P", "O", NULL
+};
+
+static struct corpus_file *files;
+static unsigned long seed = 88172645463325252UL;
+
+static int make_corpus( const char *dir, int nfiles );
+static void make_call( int i, struct caller_id *cid, int *type );
+static int decode_file( const struct corpus_file *f, double *msec );
+static bool selected( const char *list, const char *name );
+static double uniform( double low, double high );
+static double gaussian( void );
+static unsigned long next_random( void );
+
+//
+// Main function
+//
+int main( int argc, char **argv )
+{ /* Begin main */
+  char *dir = "/tmp/fskbench";
+  char *want = NULL;
+  const char *kernels[MAX_KERNELS];
+  const char *failed;
+  struct result bySnr[NUM_SNRS], total, first;
+  double msec, fileMsec, audioSec = 0;
+  int nfiles = 240;
+  int nkernels, k, i, s, r, optChar;
+
+  while( ( optChar = getopt( argc, argv, "n:d:k:" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 'n':
+        nfiles = atoi( optarg );
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      case 'k':
+        want = optarg;
+        break;
+      default:
+        fprintf( stderr, "Usage: %s [-n files] [-d dir] [-k kernels]\n", argv[0] );
+        exit( -1 );
+    }
+  }
+  if( nfiles < 1 )
+  {
+    fprintf( stderr, "%s: -n must be at least 1\n", argv[0] );
+    exit( -1 );
+  }
+
+  // The kernels must agree before they are timed
+  nkernels = fsk_kernels( kernels, MAX_KERNELS );
+  if( fsk_self_check( &failed ) != 0 )
+  {
+    fprintf( stderr, "FSK kernel %s does not correlate like the scalar one\n", failed );
+    exit( -1 );
+  }
+  printf( "kernels:" );
+  for( k = 0; k < nkernels; k++ )
+    printf( " %s", kernels[k] );
+  printf( " (self check passed)\n" );
+
+  if( make_corpus( dir, nfiles ) != 0 )
+    exit( -1 );
+  for( i = 0; i < nfiles; i++ )
+    audioSec += (double)files[i].samples / FSK_RATE;
+  printf( "corpus: %d files, %.1f sec of audio, in %s\n\n", nfiles, audioSec, dir );
+
+  memset( &first, 0, sizeof( first ) );
+  for( k = 0; k < nkernels; k++ )
+  {
+    if( want != NULL && !selected( want, kernels[k] ) )
+      continue;
+    fsk_use_kernel( kernels[k] );
+    memset( bySnr, 0, sizeof( bySnr ) );
+    memset( &total, 0, sizeof( total ) );
+    msec = 0;
+    for( i = 0; i < nfiles; i++ )
+    {
+      if( ( r = decode_file( &files[i], &fileMsec ) ) < 0 )
+        exit( -1 );
+      msec += fileMsec;
+      for( s = 0; snrs[s] != files[i].snr; s++ )
+        ;
+      if( r == 0 )
+        bySnr[s].missed++;
+      else if( r == 1 )
+        bySnr[s].decoded++;
+      else
+        bySnr[s].wrong++;
+    }
+    for( s = 0; s < NUM_SNRS; s++ )
+    {
+      total.decoded += bySnr[s].decoded;
+      total.missed += bySnr[s].missed;
+      total.wrong += bySnr[s].wrong;
+    }
+
+    // The decoding is the same with every kernel; it is shown once
+    if( first.decoded + first.missed + first.wrong == 0 )
+    {
+      first = total;
+      printf( "%-8s %7s %9s %8s %7s\n", "snr dB", "files", "decoded", "missed", "wrong" );
+      for( s = 0; s < NUM_SNRS; s++ )
+        printf( "%-8d %7d %9d %8d %7d\n", snrs[s],
+                bySnr[s].decoded + bySnr[s].missed + bySnr[s].wrong,
+                bySnr[s].decoded, bySnr[s].missed, bySnr[s].wrong );
+      printf( "\n%-8s %11s %12s %12s\n", "kernel", "decode msec", "x real time", "usec/chunk" );
+    }
+    printf( "%-8s %11.1f %12.0f %12.2f", kernels[k], msec, audioSec * 1000 / msec,
+            msec * 1000 / ( audioSec * FSK_RATE / FSK_CHUNK ) );
+    if( total.decoded != first.decoded || total.wrong != first.wrong )
+      printf( "  (decoded %d, wrong %d: differs)", total.decoded, total.wrong );
+    printf( "\n" );
+  }
+  return( 0 );
+}  /* end main */
+
+//
+// Write the corpus files and corpus.txt. Returns 0 or -1.
+//
+static int make_corpus( const char *dir, int nfiles )
+{  /* Begin make_corpus */
+  unsigned char msg[FSK_MSG_MAX];
+  char path[FILE_PATH_MAX];
+  int16_t *samples;
+  double level, twist, offset, noise, x;
+  FILE *index;
+  int i, len, lead, n, type, bits;
+  long j;
+
+  mkdir( dir, 0755 );
+  snprintf( path, sizeof( path ), "%s/corpus.txt", dir );
+  if( ( index = fopen( path, "w" ) ) == NULL )
+  {
+    perror( path );
+    return( -1 );
+  }
+  fprintf( index, "# file|snr dB|level dBFS|twist dB|offset %%|bits|type|date|time|number|name\n" );
+  if( ( files = calloc( nfiles, sizeof( *files ) ) ) == NULL ||
+      ( samples = malloc( MAX_SAMPLES * sizeof( int16_t ) ) ) == NULL )
+  {
+    fprintf( stderr, "out of memory\n" );
+    fclose( index );
+    return( -1 );
+  }
+
+  for( i = 0; i < nfiles; i++ )
+  {
+    struct corpus_file *f = &files[i];
+
+    make_call( i, &f->cid, &type );
+    f->snr = snrs[i % NUM_SNRS];
+    level = uniform( -35, -6 );
+    twist = uniform( -6, 6 );
+    offset = uniform( -1, 1 );
+    bits = ( i % 5 == 4 ) ? 8 : 16;
+
+    // Noise from up to a second before the signal to 0.3 sec after it
+    noise = pow( 10, level / 20 ) / sqrt( 2 ) / pow( 10, f->snr / 20.0 );
+    lead = (int)( uniform( 0.1, 1.0 ) * FSK_RATE );
+    memset( samples, 0, MAX_SAMPLES * sizeof( int16_t ) );
+    len = fsk_message( &f->cid, type, msg );
+    n = fsk_modulate( msg, len, pow( 10, ( level + twist / 2 ) / 20 ),
+                      pow( 10, ( level - twist / 2 ) / 20 ), 1 + offset / 100,
+                      samples + lead, MAX_SAMPLES - lead - FSK_RATE * 3 / 10 );
+    f->samples = lead + n + FSK_RATE * 3 / 10;
+    for( j = 0; j < f->samples; j++ )
+    {
+      x = samples[j] + noise * 32767 * gaussian();
+      samples[j] = x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)lrint( x );
+    }
+
+    snprintf( f->path, sizeof( f->path ), "%s/cid-%04d.wav", dir, i );
+    if( fsk_write_wav( f->path, samples, f->samples, bits ) != 0 )
+    {
+      perror( f->path );
+      fclose( index );
+      return( -1 );
+    }
+    fprintf( index, "cid-%04d.wav|%d|%.1f|%.1f|%.2f|%d|%s|%s|%s|%s|%s|\n", i, f->snr, level,
+             twist, offset, bits, type == FSK_SDMF ? "SDMF" : "MDMF", f->cid.date,
+             f->cid.time, f->cid.number, f->cid.name );
+  }
+  free( samples );
+  fclose( index );
+  return( 0 );
+}  /* end make_corpus */
+
+//
+// The caller ID of corpus file i.
+//
+static void make_call( int i, struct caller_id *cid, int *type )
+{  /* Begin make_call */
+  int nnames = sizeof( names ) / sizeof( names[0] );
+  const char *name = names[i % nnames];
+
+  memset( cid, 0, sizeof( *cid ) );
+  sprintf( cid->date, "%02d%02d", (int)( next_random() % 12 ) + 1, (int)( next_random() % 28 ) + 1 );
+  sprintf( cid->time, "%02d%02d", (int)( next_random() % 24 ), (int)( next_random() % 60 ) );
+  cid->fields = CID_DATE | CID_TIME | CID_NMBR;
+
+  // SDMF has neither a name nor a reason for one
+  *type = ( i % 3 == 2 || name == NULL ) ? FSK_SDMF : FSK_MDMF;
+  if( *type == FSK_MDMF && name != NULL && strcmp( name, "O" ) == 0 )
+    strcpy( cid->number, "O" );
+  else if( *type == FSK_MDMF && name != NULL && strcmp( name, "P" ) == 0 )
+    strcpy( cid->number, "P" );
+  else
+    sprintf( cid->number, "%lu", 2000000000UL + next_random() % 7999999999UL );
+  if( *type == FSK_MDMF )
+  {
+    snprintf( cid->name, sizeof( cid->name ), "%s", name );
+    cid->fields |= CID_NAME;
+  }
+}  /* end make_call */
+
+//
+// Decode one file (the decoding is timed, not the reading). Returns 1 if
+// exactly the frame that was sent came out, 0 if none, 2 if another or more
+// than one, -1 if the file can not be read.
+//
+static int decode_file( const struct corpus_file *f, double *msec )
+{  /* Begin decode_file */
+  struct fsk_demod d;
+  struct caller_id cid, got;
+  struct timespec t0, t1;
+  int16_t *samples;
+  int count, pos, used, frames = 0;
+  bool right = FALSE;
+
+  if( fsk_read_wav( f->path, &samples, &count ) != 0 )
+    return( -1 );
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  fsk_init( &d );
+  for( pos = 0; pos < count; pos += used )
+  {
+    if( fsk_feed( &d, samples + pos, count - pos, &cid, &used ) == CID_FRAME )
+    {
+      got = cid;
+      frames++;
+    }
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  *msec = ( t1.tv_sec - t0.tv_sec ) * 1000.0 + ( t1.tv_nsec - t0.tv_nsec ) / 1e6;
+  free( samples );
+
+  if( frames == 1 )
+    right = strcmp( got.number, f->cid.number ) == 0 && strcmp( got.name, f->cid.name ) == 0 &&
+            strcmp( got.date, f->cid.date ) == 0 && strcmp( got.time, f->cid.time ) == 0;
+  return( frames == 0 ? 0 : right ? 1 : 2 );
+}  /* end decode_file */
+
+static bool selected( const char *list, const char *name )
+{  /* Begin selected */
+  int len = strlen( name );
+  const char *p;
+
+  for( p = list; ( p = strstr( p, name ) ) != NULL; p += len )
+  {
+    if( ( p == list || p[-1] == ',' ) && ( p[len] == 0 || p[len] == ',' ) )
+      return( TRUE );
+  }
+  return( FALSE );
+}  /* end selected */
+
+static double uniform( double low, double high )
+{  /* Begin uniform */
+  return( low + ( high - low ) * ( next_random() % 1000001 ) / 1000000.0 );
+}  /* end uniform */
+
+//
+// A normally distributed number (Box-Muller).
+//
+static double gaussian( void )
+{  /* Begin gaussian */
+  double u = ( next_random() % 1000000 + 1 ) / 1000001.0;
+  double v = ( next_random() % 1000000 ) / 1000000.0;
+
+  return( sqrt( -2 * log( u ) ) * cos( 2 * M_PI * v ) );
+}  /* end gaussian */
+
+static unsigned long next_random( void )
+{  /* Begin next_random */
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return( seed );
+}  /* end next_random */
@@ -0,0 +1,1020 @@
+/*
+Program name: jcblock
+
+File name: history.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+The call history, kept in the history directory next to the lists instead of
+the flat callerID.dat file:
+  strings.dat   every number and name once, '\0' terminated; records refer
+                to them by offset (offset 0 is the empty string)
+  YYYY-MM.seg   one segment per month: a header with the first record of
+                every day, then fixed size records in time order
+  YYYY-MM.nix   the records of a segment sorted by normalized number, written
+                when the segment is closed (the month is over)
+Records are only ever appended. A time range is found through the day index
+of the segments of its months and a number through the number index of each
+segment (only the current month, which has no index yet, is scanned), so
+neither query reads years of data. The call time is the local time of the
+call, stored as seconds as if it were UTC, so that it is written out exactly
+as it was recorded whatever the time zone or daylight saving time.
+
+"jcblock history import" converts callerID.dat files into the store and
+"jcblock history export" writes records in the callerID.dat format.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+#define SEGMENT_MAGIC   "JCBHIST"
+#define INDEX_MAGIC     "JCBHNIX"
+#define HISTORY_VERSION 1
+#define NO_RECORD       0xFFFFFFFFU
+
+struct segment_header
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+  int32_t  year;
+  int32_t  month;
+  uint32_t dayFirst[32];         // first record of each day (1-31) or NO_RECORD
+};
+
+struct index_header
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t records;              // records of the segment when it was indexed
+};
+
+// Writer state (the persist.c writer thread, or an import)
+static int stringsFd = -1;
+static char *strTab;             // copy of strings.dat
+static size_t strLen, strCap;
+static uint32_t *strHash;        // offset + 1 of each string, 0: free
+static unsigned strHashMask;
+static unsigned strCount;
+static int segFd = -1;
+static int segYear, segMonth;
+static ino_t segIno;
+static long segCount;
+static uint32_t segDayFirst[32];
+
+static int split_entry( char *entry, char **date, char **number, char **name );
+static uint32_t intern( const char *s );
+static unsigned find_string( const char *s );
+static int grow_hash( void );
+static unsigned string_hash( const char *s );
+static int open_segment( int year, int month );
+static void close_segment( void );
+static int segment_path( char *path, int size, int year, int month, const char *suffix );
+static int write_segment_index( int year, int month );
+static int compare_entries( const void *a, const void *b );
+static int map_segment( struct history_segment *seg, const char *path );
+static void print_record( FILE *out, const struct history_store *hs, const struct history_record *r );
+static int import_file( const char *path );
+static int export_records( int argc, char **argv );
+
+//
+// Open the store for appending (creating it if needed). Returns 0 or -1.
+//
+int history_open( void )
+{  /* Begin history_open */
+  char path[FILE_PATH_MAX];
+  struct stat st;
+  size_t pos;
+  unsigned h;
+
+  if( mkdir( HISTORY_DIR, 0755 ) != 0 && errno != EEXIST )
+    return( -1 );
+
+  if( snprintf( path, sizeof( path ), "%s/strings.dat", HISTORY_DIR ) >= sizeof( path ) )
+    return( -1 );
+  if( ( stringsFd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 ) ) < 0 ||
+      fstat( stringsFd, &st ) != 0 )
+    return( -1 );
+
+  strCap = st.st_size + 4096;
+  if( ( strTab = malloc( strCap ) ) == NULL ||
+      pread( stringsFd, strTab, st.st_size, 0 ) != st.st_size )
+    return( -1 );
+  strLen = st.st_size;
+
+  // A string cut off by a crash is dropped; offset 0 is the empty string
+  while( strLen > 0 && strTab[strLen - 1] != 0 )
+    strLen--;
+  if( strLen == 0 )
+  {
+    strTab[strLen++] = 0;
+    if( pwrite( stringsFd, strTab, 1, 0 ) != 1 )
+      return( -1 );
+  }
+  if( strLen != (size_t)st.st_size && ftruncate( stringsFd, strLen ) != 0 )
+    return( -1 );
+
+  for( pos = 1; pos < strLen; pos += strlen( strTab + pos ) + 1 )
+  {
+    if( ( strCount + 1 ) * 2 > strHashMask && grow_hash() != 0 )
+      return( -1 );
+    h = find_string( strTab + pos );
+    if( strHash[h] == 0 )
+    {
+      strHash[h] = pos + 1;
+      strCount++;
+    }
+  }
+  return( 0 );
+}  /* end history_open */
+
+//
+// Append a call given as a callerID.dat record ("date|number|name|").
+// decision is CALL_... or HISTORY_UNKNOWN; line is the modem. Returns 0 or
+// -1 if the record is not understood or can not be written.
+//
+int history_append( const char *callerIDentry, int decision, int line )
+{  /* Begin history_append */
+  struct history_record r;
+  char entry[256];
+  char *date, *number, *name;
+  struct tm tm;
+  off_t pos;
+
+  snprintf( entry, sizeof( entry ), "%s", callerIDentry );
+  if( split_entry( entry, &date, &number, &name ) != 0 ||
+      history_parse_time( date, &r.time, &tm ) != 0 )
+    return( -1 );
+
+  memset( r.reserved, 0, sizeof( r.reserved ) );
+  r.numberKey = number_key( number, strlen( number ) );
+  r.decision  = decision;
+  r.line      = line;
+  if( ( r.number = intern( number ) ) == NO_RECORD || ( r.name = intern( name ) ) == NO_RECORD )
+    return( -1 );
+
+  if( open_segment( tm.tm_year + 1900, tm.tm_mon + 1 ) != 0 )
+    return( -1 );
+  if( segDayFirst[tm.tm_mday] == NO_RECORD )
+  {
+    segDayFirst[tm.tm_mday] = segCount;
+    pwrite( segFd, &segDayFirst[tm.tm_mday], sizeof( uint32_t ),
+            offsetof( struct segment_header, dayFirst ) + tm.tm_mday * sizeof( uint32_t ) );
+  }
+  pos = sizeof( struct segment_header ) + segCount * sizeof( r );
+  if( pwrite( segFd, &r, sizeof( r ), pos ) != sizeof( r ) )
+    return( -1 );
+  segCount++;
+  return( 0 );
+}  /* end history_append */
+
+//
+// Make the appended records durable.
+//
+void history_sync( void )
+{  /* Begin history_sync */
+  if( stringsFd >= 0 )
+    fdatasync( stringsFd );
+  if( segFd >= 0 )
+    fdatasync( segFd );
+}  /* end history_sync */
+
+void history_close( void )
+{  /* Begin history_close */
+  history_sync();
+  if( segFd >= 0 )
+    close( segFd );
+  if( stringsFd >= 0 )
+    close( stringsFd );
+  segFd = stringsFd = -1;
+  free( strTab );
+  free( strHash );
+  strTab = NULL;
+  strHash = NULL;
+  strLen = strCap = 0;
+  strHashMask = strCount = 0;
+}  /* end history_close */
+
+//
+// Map the whole store for reading (the pages are only read when used).
+// Returns 0 or -1.
+//
+int history_open_read( struct history_store *hs )
+{  /* Begin history_open_read */
+  char path[FILE_PATH_MAX];
+  struct dirent **names;
+  struct stat st;
+  int fd, n, i;
+
+  memset( hs, 0, sizeof( *hs ) );
+  if( snprintf( path, sizeof( path ), "%s/strings.dat", HISTORY_DIR ) >= sizeof( path ) )
+    return( -1 );
+  if( ( fd = open( path, O_RDONLY | O_CLOEXEC ) ) < 0 )
+    return( -1 );
+  if( fstat( fd, &st ) != 0 || st.st_size == 0 ||
+      ( hs->strings = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 ) ) == MAP_FAILED )
+  {
+    hs->strings = NULL;
+    close( fd );
+    return( -1 );
+  }
+  close( fd );
+  hs->stringsLen = st.st_size;
+
+  // YYYY-MM.seg: alphabetical order is time order
+  if( ( n = scandir( HISTORY_DIR, &names, NULL, alphasort ) ) < 0 )
+    return( -1 );
+  hs->segs = calloc( n ? n : 1, sizeof( *hs->segs ) );
+  for( i = 0; i < n; i++ )
+  {
+    if( hs->segs != NULL && strlen( names[i]->d_name ) == 11 &&
+        strcmp( names[i]->d_name + 7, ".seg" ) == 0 )
+    {
+      if( snprintf( path, sizeof( path ), "%s/%s", HISTORY_DIR, names[i]->d_name ) < sizeof( path ) &&
+          map_segment( &hs->segs[hs->nsegs], path ) == 0 )
+        hs->nsegs++;
+    }
+    free( names[i] );
+  }
+  free( names );
+  return( hs->segs != NULL ? 0 : -1 );
+}  /* end history_open_read */
+
+void history_close_read( struct history_store *hs )
+{  /* Begin history_close_read */
+  int i;
+
+  for( i = 0; i < hs->nsegs; i++ )
+  {
+    munmap( hs->segs[i].map, hs->segs[i].mapLen );
+    if( hs->segs[i].indexMap != NULL )
+      munmap( hs->segs[i].indexMap, hs->segs[i].indexMapLen );
+  }
+  free( hs->segs );
+  if( hs->strings != NULL )
+    munmap( (void *)hs->strings, hs->stringsLen );
+  memset( hs, 0, sizeof( *hs ) );
+}  /* end history_close_read */
+
+//
+// A number or name of a record ("" if the offset is not valid).
+//
+const char *history_string( const struct history_store *hs, uint32_t offset )
+{  /* Begin history_string */
+  if( offset >= hs->stringsLen || memchr( hs->strings + offset, 0, hs->stringsLen - offset ) == NULL )
+    return( "" );
+  return( hs->strings + offset );
+}  /* end history_string */
+
+//
+// Find the records of a segment from time from on (the day index gives the
+// first record of the day). Returns the index of the first record to look at.
+//
+long history_seek( const struct history_segment *seg, int64_t from )
+{  /* Begin history_seek */
+  struct tm tm;
+  time_t t = from;
+  int day;
+  long i;
+
+  gmtime_r( &t, &tm );
+  if( tm.tm_year + 1900 < seg->year ||
+      ( tm.tm_year + 1900 == seg->year && tm.tm_mon + 1 < seg->month ) )
+    return( 0 );
+  if( tm.tm_year + 1900 != seg->year || tm.tm_mon + 1 != seg->month )
+    return( seg->count );
+
+  for( day = tm.tm_mday; day < 32 && seg->dayFirst[day] == NO_RECORD; day++ )
+    ;
+  i = ( day < 32 && seg->dayFirst[day] < seg->count ) ? seg->dayFirst[day] : seg->count;
+  while( i < seg->count && seg->records[i].time < from )
+    i++;
+  return( i );
+}  /* end history_seek */
+
+//
+// "jcblock history import [file]..." and "jcblock history export ...".
+// Returns the exit status.
+//
+int history_command( int argc, char **argv )
+{  /* Begin history_command */
+  int failed = 0;
+  int i;
+
+  if( argc >= 2 && strcmp( argv[1], "import" ) == 0 )
+  {
+    if( history_open() != 0 )
+    {
+      fprintf( stderr, "can not open the history in %s: %s\n", HISTORY_DIR, strerror( errno ) );
+      return( 1 );
+    }
+    if( argc == 2 )
+      failed = import_file( CALLERID_FILE );
+    for( i = 2; i < argc; i++ )
+      failed |= import_file( argv[i] );
+    history_close();
+    return( failed ? 1 : 0 );
+  }
+  if( argc >= 2 && strcmp( argv[1], "export" ) == 0 )
+    return( export_records( argc - 1, argv + 1 ) );
+
+  fprintf( stderr, "Usage: jcblock [-d directory] history import [callerID.dat]...\n"
+                   "       jcblock [-d directory] history export [-f from] [-t to] [-n number]\n"
+                   "       (from and to: YYYY-MM-DD or YYYY-MM-DDThh:mm)\n" );
+  return( 1 );
+}  /* end history_command */
+
+//
+// Split a callerID.dat record into its fields. Old files have the name
+// before the number; the field of digits is taken as the number.
+//
+static int split_entry( char *entry, char **date, char **number, char **name )
+{  /* Begin split_entry */
+  char *f2, *f3, *end;
+
+  if( ( f2 = strchr( entry, '|' ) ) == NULL || ( f3 = strchr( f2 + 1, '|' ) ) == NULL )
+    return( -1 );
+  *f2++ = 0;
+  *f3++ = 0;
+  if( ( end = strchr( f3, '|' ) ) != NULL )
+    *end = 0;
+  else
+    f3[strcspn( f3, "\r\n" )] = 0;
+
+  *date = entry;
+  *number = f2;
+  *name = f3;
+  if( strspn( f2, "0123456789 -" ) != strlen( f2 ) && *f3 != 0 &&
+      strspn( f3, "0123456789 -" ) == strlen( f3 ) )
+  {
+    *number = f3;
+    *name = f2;
+  }
+  return( 0 );
+}  /* end split_entry */
+
+//
+// "YYYY-MM-DDThh:mm" (or just the date) to the stored time.
+//
+int history_parse_time( const char *date, int64_t *t, struct tm *tm )
+{  /* Begin history_parse_time */
+  int n;
+
+  memset( tm, 0, sizeof( *tm ) );
+  n = sscanf( date, "%4d-%2d-%2dT%2d:%2d", &tm->tm_year, &tm->tm_mon, &tm->tm_mday,
+              &tm->tm_hour, &tm->tm_min );
+  if( ( n != 3 && n != 5 ) || tm->tm_mon < 1 || tm->tm_mon > 12 || tm->tm_mday < 1 ||
+      tm->tm_mday > 31 || tm->tm_hour > 23 || tm->tm_min > 59 )
+    return( -1 );
+  tm->tm_year -= 1900;
+  tm->tm_mon--;
+  *t = timegm( tm );
+  return( 0 );
+}  /* end history_parse_time */
+
+//
+// Offset of a string in strings.dat, which it is added to if it is new (the
+// file is written before any record that uses the string). Returns
+// NO_RECORD if it can not be written.
+//
+static uint32_t intern( const char *s )
+{  /* Begin intern */
+  size_t len = strlen( s ) + 1;
+  unsigned h;
+  char *p;
+
+  if( *s == 0 )
+    return( 0 );
+  if( ( strCount + 1 ) * 2 > strHashMask && grow_hash() != 0 )
+    return( NO_RECORD );
+  if( strHash[h = find_string( s )] != 0 )
+    return( strHash[h] - 1 );
+
+  if( strLen + len > strCap )
+  {
+    strCap = ( strLen + len ) * 2;
+    if( ( p = realloc( strTab, strCap ) ) == NULL )
+      return( NO_RECORD );
+    strTab = p;
+  }
+  memcpy( strTab + strLen, s, len );
+  if( pwrite( stringsFd, strTab + strLen, len, strLen ) != (ssize_t)len )
+    return( NO_RECORD );
+  strHash[h] = strLen + 1;
+  strLen += len;
+  strCount++;
+  return( strHash[h] - 1 );
+}  /* end intern */
+
+//
+// Slot of a string in the hash table: where it is, or the free slot where
+// it goes.
+//
+static unsigned find_string( const char *s )
+{  /* Begin find_string */
+  unsigned h;
+
+  for( h = string_hash( s ) & strHashMask; strHash[h] != 0; h = ( h + 1 ) & strHashMask )
+  {
+    if( strcmp( strTab + strHash[h] - 1, s ) == 0 )
+      break;
+  }
+  return( h );
+}  /* end find_string */
+
+//
+// Double the hash table (it is kept at most half full).
+//
+static int grow_hash( void )
+{  /* Begin grow_hash */
+  uint32_t *old = strHash;
+  unsigned oldSize = old ? strHashMask + 1 : 0;
+  unsigned size = oldSize ? oldSize * 2 : 1024;
+  unsigned i, h;
+
+  if( ( strHash = calloc( size, sizeof( *strHash ) ) ) == NULL )
+  {
+    strHash = old;
+    return( -1 );
+  }
+  strHashMask = size - 1;
+  for( i = 0; i < oldSize; i++ )
+  {
+    if( old[i] == 0 )
+      continue;
+    for( h = string_hash( strTab + old[i] - 1 ) & strHashMask; strHash[h] != 0;
+         h = ( h + 1 ) & strHashMask )
+      ;
+    strHash[h] = old[i];
+  }
+  free( old );
+  return( 0 );
+}  /* end grow_hash */
+
+// FNV-1a
+static unsigned string_hash( const char *s )
+{  /* Begin string_hash */
+  unsigned h = 2166136261U;
+
+  for( ; *s; s++ )
+    h = ( h ^ (unsigned char)*s ) * 16777619U;
+  return( h );
+}  /* end string_hash */
+
+//
+// Make the segment of a month the one appended to. A new segment is
+// created with an empty day index; the segment of the month before is then
+// closed for good, so its number index is written.
+//
+static int open_segment( int year, int month )
+{  /* Begin open_segment */
+  char path[FILE_PATH_MAX];
+  struct segment_header hdr;
+  struct stat st;
+  int fd, day;
+
+  if( segment_path( path, sizeof( path ), year, month, "seg" ) != 0 )
+    return( -1 );
+  if( segFd >= 0 && year == segYear && month == segMonth )
+  {
+    // Still the same file? (an import replaces segments)
+    if( stat( path, &st ) == 0 && st.st_ino == segIno )
+      return( 0 );
+    close( segFd );
+    segFd = -1;
+  }
+  else if( segFd >= 0 )
+    close_segment();
+
+  if( ( fd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 ) ) < 0 || fstat( fd, &st ) != 0 )
+  {
+    if( fd >= 0 )
+      close( fd );
+    return( -1 );
+  }
+
+  if( st.st_size < (off_t)sizeof( hdr ) )
+  {
+    memset( &hdr, 0, sizeof( hdr ) );
+    memcpy( hdr.magic, SEGMENT_MAGIC, sizeof( hdr.magic ) );
+    hdr.version    = HISTORY_VERSION;
+    hdr.recordSize = sizeof( struct history_record );
+    hdr.year       = year;
+    hdr.month      = month;
+    for( day = 0; day < 32; day++ )
+      hdr.dayFirst[day] = NO_RECORD;
+    if( pwrite( fd, &hdr, sizeof( hdr ), 0 ) != sizeof( hdr ) )
+    {
+      close( fd );
+      return( -1 );
+    }
+    st.st_size = sizeof( hdr );
+
+    // The first call of a month: the month before is over
+    if( month == 1 )
+      write_segment_index( year - 1, 12 );
+    else
+      write_segment_index( year, month - 1 );
+  }
+  else if( pread( fd, &hdr, sizeof( hdr ), 0 ) != sizeof( hdr ) ||
+           memcmp( hdr.magic, SEGMENT_MAGIC, sizeof( hdr.magic ) ) != 0 ||
+           hdr.version != HISTORY_VERSION || hdr.recordSize != sizeof( struct history_record ) )
+  {
+    log_debug_info("history segment is not valid; call not recorded");
+    close( fd );
+    return( -1 );
+  }
+
+  // A record cut off by a crash is dropped
+  segCount = ( st.st_size - sizeof( hdr ) ) / sizeof( struct history_record );
+  if( st.st_size != (off_t)( sizeof( hdr ) + segCount * sizeof( struct history_record ) ) )
+    ftruncate( fd, sizeof( hdr ) + segCount * sizeof( struct history_record ) );
+
+  memcpy( segDayFirst, hdr.dayFirst, sizeof( segDayFirst ) );
+  segFd    = fd;
+  segYear  = year;
+  segMonth = month;
+  segIno   = st.st_ino;
+  return( 0 );
+}  /* end open_segment */
+
+//
+// The month of the segment is over: write its number index.
+//
+static void close_segment( void )
+{  /* Begin close_segment */
+  fdatasync( segFd );
+  close( segFd );
+  segFd = -1;
+  write_segment_index( segYear, segMonth );
+}  /* end close_segment */
+
+//
+// The path of the segment file of a month (or of its index). Returns 0, or
+// -1 if it does not fit in size.
+//
+static int segment_path( char *path, int size, int year, int month, const char *suffix )
+{  /* Begin segment_path */
+  if( snprintf( path, size, "%s/%04d-%02d.%s", HISTORY_DIR, year, month, suffix ) >= size )
+    return( -1 );
+  return( 0 );
+}  /* end segment_path */
+
+//
+// Write the number index of a segment (if it exists). Returns 0 or -1.
+//
+static int write_segment_index( int year, int month )
+{  /* Begin write_segment_index */
+  char path[FILE_PATH_MAX], tmpPath[FILE_PATH_MAX + 8];
+  struct history_segment seg;
+  struct index_header hdr;
+  struct history_index_entry *entries;
+  long i, n = 0;
+  int fd, rc;
+
+  if( segment_path( path, sizeof( path ), year, month, "seg" ) != 0 ||
+      map_segment( &seg, path ) != 0 )
+    return( -1 );
+  if( seg.index != NULL )
+  {
+    // Up to date
+    munmap( seg.indexMap, seg.indexMapLen );
+    munmap( seg.map, seg.mapLen );
+    return( 0 );
+  }
+
+  if( ( entries = malloc( ( seg.count ? seg.count : 1 ) * sizeof( *entries ) ) ) == NULL )
+  {
+    munmap( seg.map, seg.mapLen );
+    return( -1 );
+  }
+  for( i = 0; i < seg.count; i++ )
+  {
+    if( seg.records[i].numberKey == 0 )
+      continue;
+    entries[n].key = seg.records[i].numberKey;
+    entries[n].record = i;
+    entries[n].reserved = 0;
+    n++;
+  }
+  qsort( entries, n, sizeof( *entries ), compare_entries );
+
+  memset( &hdr, 0, sizeof( hdr ) );
+  memcpy( hdr.magic, INDEX_MAGIC, sizeof( hdr.magic ) );
+  hdr.version = HISTORY_VERSION;
+  hdr.records = seg.count;
+  munmap( seg.map, seg.mapLen );
+
+  if( segment_path( path, sizeof( path ), year, month, "nix" ) != 0 )
+  {
+    free( entries );
+    return( -1 );
+  }
+  snprintf( tmpPath, sizeof( tmpPath ), "%s.tmp", path );
+  if( ( fd = open( tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) < 0 )
+  {
+    free( entries );
+    return( -1 );
+  }
+  rc = ( write( fd, &hdr, sizeof( hdr ) ) == sizeof( hdr ) &&
+         write( fd, entries, n * sizeof( *entries ) ) == (ssize_t)( n * sizeof( *entries ) ) &&
+         fdatasync( fd ) == 0 ) ? 0 : -1;
+  free( entries );
+  if( close( fd ) != 0 || rc != 0 || rename( tmpPath, path ) != 0 )
+  {
+    unlink( tmpPath );
+    return( -1 );
+  }
+  return( 0 );
+}  /* end write_segment_index */
+
+// By number, then by record (that is, by time)
+static int compare_entries( const void *a, const void *b )
+{  /* Begin compare_entries */
+  const struct history_index_entry *ea = a, *eb = b;
+
+  if( ea->key != eb->key )
+    return( ea->key < eb->key ? -1 : 1 );
+  return( ea->record < eb->record ? -1 : ea->record > eb->record );
+}  /* end compare_entries */
+
+//
+// Map a segment and, if it is up to date, its number index. Returns 0 or -1.
+//
+static int map_segment( struct history_segment *seg, const char *path )
+{  /* Begin map_segment */
+  const struct segment_header *hdr;
+  const struct index_header *ihdr;
+  char indexPath[FILE_PATH_MAX];
+  struct stat st;
+  int fd;
+
+  memset( seg, 0, sizeof( *seg ) );
+  if( ( fd = open( path, O_RDONLY | O_CLOEXEC ) ) < 0 )
+    return( -1 );
+  if( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof( *hdr ) ||
+      ( seg->map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 ) ) == MAP_FAILED )
+  {
+    close( fd );
+    return( -1 );
+  }
+  close( fd );
+  seg->mapLen = st.st_size;
+  hdr = seg->map;
+  if( memcmp( hdr->magic, SEGMENT_MAGIC, sizeof( hdr->magic ) ) != 0 ||
+      hdr->version != HISTORY_VERSION || hdr->recordSize != sizeof( struct history_record ) )
+  {
+    munmap( seg->map, seg->mapLen );
+    return( -1 );
+  }
+  seg->year     = hdr->year;
+  seg->month    = hdr->month;
+  seg->dayFirst = hdr->dayFirst;
+  seg->records  = (const struct history_record *)( hdr + 1 );
+  seg->count    = ( st.st_size - sizeof( *hdr ) ) / sizeof( struct history_record );
+
+  // The index is only used if it covers every record
+  strcpy( indexPath, path );
+  strcpy( indexPath + strlen( indexPath ) - 3, "nix" );
+  if( ( fd = open( indexPath, O_RDONLY | O_CLOEXEC ) ) < 0 )
+    return( 0 );
+  if( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof( *ihdr ) &&
+      ( seg->indexMap = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 ) ) != MAP_FAILED )
+  {
+    seg->indexMapLen = st.st_size;
+    ihdr = seg->indexMap;
+    if( memcmp( ihdr->magic, INDEX_MAGIC, sizeof( ihdr->magic ) ) == 0 &&
+        ihdr->version == HISTORY_VERSION && ihdr->records == seg->count )
+    {
+      seg->index = (const struct history_index_entry *)( ihdr + 1 );
+      seg->indexCount = ( st.st_size - sizeof( *ihdr ) ) / sizeof( struct history_index_entry );
+    }
+    else
+    {
+      munmap( seg->indexMap, seg->indexMapLen );
+      seg->indexMap = NULL;
+    }
+  }
+  else
+    seg->indexMap = NULL;
+  close( fd );
+  return( 0 );
+}  /* end map_segment */
+
+//
+// Write a record in the callerID.dat format.
+//
+static void print_record( FILE *out, const struct history_store *hs, const struct history_record *r )
+{  /* Begin print_record */
+  char date[] = "YYYY-MM-DDTHH:MM:SS";
+  time_t t = r->time;
+  struct tm tm;
+
+  gmtime_r( &t, &tm );
+  strftime( date, sizeof( date ), "%FT%R", &tm );
+  fprintf( out, "%s|%s|%s|\n", date, history_string( hs, r->number ),
+           history_string( hs, r->name ) );
+}  /* end print_record */
+
+struct import_record
+{
+  struct history_record r;
+  int  year, month, mday;
+  long seq;                      // line order, for records of the same minute
+};
+
+static int compare_imports( const void *a, const void *b )
+{  /* Begin compare_imports */
+  const struct import_record *ia = a, *ib = b;
+
+  if( ia->r.time != ib->r.time )
+    return( ia->r.time < ib->r.time ? -1 : 1 );
+  return( ia->seq < ib->seq ? -1 : ia->seq > ib->seq );
+}  /* end compare_imports */
+
+//
+// Add the records of a callerID.dat file to the store. The records of each
+// month are merged with those already in its segment (a record that is
+// already there is skipped, so a file can be imported again) and the
+// segment is written anew. jcblock should not be recording calls of the
+// same months meanwhile. Returns 0 or -1.
+//
+static int import_file( const char *path )
+{  /* Begin import_file */
+  char line[256], segPath[FILE_PATH_MAX], tmpPath[FILE_PATH_MAX + 8];
+  char *date, *number, *name;
+  struct import_record *recs = NULL, *p;
+  struct history_record *merged;
+  struct history_segment seg;
+  struct segment_header hdr;
+  struct tm tm;
+  long n = 0, cap = 0, bad = 0, dup = 0, added = 0;
+  long first, last, i, j, m, k;
+  int segments = 0;
+  FILE *fp;
+  int fd, rc, day;
+  bool have, same;
+
+  if( ( fp = fopen( path, "r" ) ) == NULL )
+  {
+    fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+    return( -1 );
+  }
+  while( fgets( line, sizeof( line ), fp ) != NULL )
+  {
+    if( line[0] == '#' || line[0] == '\n' )
+      continue;
+    if( split_entry( line, &date, &number, &name ) != 0 )
+    {
+      bad++;
+      continue;
+    }
+    if( n == cap )
+    {
+      cap = cap ? cap * 2 : 4096;
+      if( ( p = realloc( recs, cap * sizeof( *recs ) ) ) == NULL )
+      {
+        fclose( fp );
+        free( recs );
+        return( -1 );
+      }
+      recs = p;
+    }
+    p = &recs[n];
+    memset( p, 0, sizeof( *p ) );
+    if( history_parse_time( date, &p->r.time, &tm ) != 0 )
+    {
+      bad++;
+      continue;
+    }
+    p->r.numberKey = number_key( number, strlen( number ) );
+    p->r.decision  = HISTORY_UNKNOWN;
+    if( ( p->r.number = intern( number ) ) == NO_RECORD ||
+        ( p->r.name = intern( name ) ) == NO_RECORD )
+    {
+      fclose( fp );
+      free( recs );
+      return( -1 );
+    }
+    p->year  = tm.tm_year + 1900;
+    p->month = tm.tm_mon + 1;
+    p->mday  = tm.tm_mday;
+    p->seq   = n++;
+  }
+  fclose( fp );
+  history_sync();
+  qsort( recs, n, sizeof( *recs ), compare_imports );
+
+  // One month at a time
+  for( first = 0; first < n; first = last )
+  {
+    for( last = first; last < n && recs[last].year == recs[first].year &&
+                       recs[last].month == recs[first].month; last++ )
+      ;
+    if( segment_path( segPath, sizeof( segPath ), recs[first].year, recs[first].month, "seg" ) != 0 )
+    {
+      free( recs );
+      return( -1 );
+    }
+    have = ( map_segment( &seg, segPath ) == 0 );
+    if( !have )
+      seg.count = 0;
+    if( ( merged = malloc( ( seg.count + last - first ) * sizeof( *merged ) ) ) == NULL )
+    {
+      free( recs );
+      return( -1 );
+    }
+
+    // Merge by time; the records already there come first
+    for( i = 0, j = first, m = 0; i < seg.count || j < last; )
+    {
+      if( j == last || ( i < seg.count && seg.records[i].time <= recs[j].r.time ) )
+      {
+        merged[m++] = seg.records[i++];
+        continue;
+      }
+      for( same = FALSE, k = i - 1; k >= 0 && seg.records[k].time == recs[j].r.time; k-- )
+      {
+        if( seg.records[k].number == recs[j].r.number && seg.records[k].name == recs[j].r.name )
+          same = TRUE;
+      }
+      if( same )
+        dup++;
+      else
+      {
+        merged[m++] = recs[j].r;
+        added++;
+      }
+      j++;
+    }
+
+    memset( &hdr, 0, sizeof( hdr ) );
+    memcpy( hdr.magic, SEGMENT_MAGIC, sizeof( hdr.magic ) );
+    hdr.version    = HISTORY_VERSION;
+    hdr.recordSize = sizeof( struct history_record );
+    hdr.year       = recs[first].year;
+    hdr.month      = recs[first].month;
+    for( day = 0; day < 32; day++ )
+      hdr.dayFirst[day] = NO_RECORD;
+    for( i = m - 1; i >= 0; i-- )
+    {
+      time_t t = merged[i].time;
+      gmtime_r( &t, &tm );
+      hdr.dayFirst[tm.tm_mday] = i;
+    }
+    if( have )
+    {
+      munmap( seg.map, seg.mapLen );
+      if( seg.indexMap != NULL )
+        munmap( seg.indexMap, seg.indexMapLen );
+    }
+
+    snprintf( tmpPath, sizeof( tmpPath ), "%s.tmp", segPath );
+    rc = -1;
+    if( ( fd = open( tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) >= 0 )
+    {
+      rc = ( write( fd, &hdr, sizeof( hdr ) ) == sizeof( hdr ) &&
+             write( fd, merged, m * sizeof( *merged ) ) == (ssize_t)( m * sizeof( *merged ) ) &&
+             fdatasync( fd ) == 0 ) ? 0 : -1;
+      if( close( fd ) != 0 || rc != 0 || rename( tmpPath, segPath ) != 0 )
+      {
+        unlink( tmpPath );
+        rc = -1;
+      }
+    }
+    free( merged );
+    if( rc != 0 )
+    {
+      fprintf( stderr, "%s: %s\n", segPath, strerror( errno ) );
+      free( recs );
+      return( -1 );
+    }
+    write_segment_index( recs[first].year, recs[first].month );
+    segments++;
+  }
+  free( recs );
+
+  printf( "%s: %ld calls imported into %d month(s), %ld already there, %ld lines not understood\n",
+          path, added, segments, dup, bad );
+  return( 0 );
+}  /* end import_file */
+
+//
+// history export [-f from] [-t to] [-n number]
+//
+static int export_records( int argc, char **argv )
+{  /* Begin export_records */
+  struct history_store hs;
+  const struct history_segment *seg;
+  const struct history_index_entry *e;
+  const struct history_record *r;
+  int64_t from = INT64_MIN, to = INT64_MAX, segStart, segEnd;
+  uint64_t key = 0;
+  struct tm tm;
+  long i, lo, hi;
+  int optChar, s;
+
+  optind = 0;                    // new argument vector: restart getopt()
+  while( ( optChar = getopt( argc, argv, "f:t:n:" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 'f':
+        if( history_parse_time( optarg, &from, &tm ) != 0 )
+        {
+          fprintf( stderr, "%s: not a date (YYYY-MM-DD or YYYY-MM-DDThh:mm)\n", optarg );
+          return( 1 );
+        }
+        break;
+      case 't':
+        if( history_parse_time( optarg, &to, &tm ) != 0 )
+        {
+          fprintf( stderr, "%s: not a date (YYYY-MM-DD or YYYY-MM-DDThh:mm)\n", optarg );
+          return( 1 );
+        }
+        to += strchr( optarg, 'T' ) ? 59 : 24 * 3600 - 1;     // inclusive
+        break;
+      case 'n':
+        if( ( key = number_key( optarg, strlen( optarg ) ) ) == 0 )
+        {
+          fprintf( stderr, "%s: not a telephone number\n", optarg );
+          return( 1 );
+        }
+        break;
+      default:
+        return( history_command( 0, NULL ) );
+    }
+  }
+
+  if( history_open_read( &hs ) != 0 )
+  {
+    fprintf( stderr, "no history in %s\n", HISTORY_DIR );
+    return( 1 );
+  }
+  for( s = 0; s < hs.nsegs; s++ )
+  {
+    seg = &hs.segs[s];
+    memset( &tm, 0, sizeof( tm ) );
+    tm.tm_year = seg->year - 1900;
+    tm.tm_mon  = seg->month - 1;
+    tm.tm_mday = 1;
+    segStart = timegm( &tm );
+    tm.tm_mon++;
+    segEnd = timegm( &tm );
+    if( segEnd <= from || segStart > to )
+      continue;
+
+    if( key != 0 && seg->index != NULL )
+    {
+      // First entry of the number
+      for( lo = 0, hi = seg->indexCount; lo < hi; )
+      {
+        i = ( lo + hi ) / 2;
+        if( seg->index[i].key < key )
+          lo = i + 1;
+        else
+          hi = i;
+      }
+      for( e = seg->index + lo; e < seg->index + seg->indexCount && e->key == key; e++ )
+      {
+        r = &seg->records[e->record];
+        if( r->time >= from && r->time <= to )
+          print_record( stdout, &hs, r );
+      }
+      continue;
+    }
+
+    for( i = history_seek( seg, from ); i < seg->count; i++ )
+    {
+      r = &seg->records[i];
+      if( r->time > to )
+        break;
+      if( key == 0 || r->numberKey == key )
+        print_record( stdout, &hs, r );
+    }
+  }
+  history_close_read( &hs );
+  return( 0 );
+}  /* end export_records */
@@ -0,0 +1,531 @@
+/*
+Program name: jcblock
+
+File name: hitlog.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+When whitelist and blacklist entries were last hit, and how often, kept apart
+from the lists so that jcblock never writes the files people edit:
+  hits.log   a journal: one fixed size record per hit, only ever appended
+             (by the writer thread of persist.c, synced once per batch)
+  hits.dat   a checkpoint: the hit count and last hit of every entry hit,
+             and the sequence number of the last journal record it includes
+Once the journal holds HITLOG_COMPACT records it is compacted: the counts are
+written to a new checkpoint, which is synced and renamed over the old one, and
+then the journal is emptied. Every record carries a sequence number and a
+check value, so after a power failure a half written record at the end of the
+journal is dropped, and records already in the checkpoint (the journal was not
+emptied yet) are not counted twice. Entries are known by list and test field,
+so hits stay with an entry when the list is edited around it.
+
+"jcblock hits" lists the entries of both lists with their hits.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+#define HITS_MAGIC      "JCBHITS"
+#define HITS_VERSION    1
+#define HITLOG_COMPACT  4096   // journal records before it is compacted
+
+struct hit_record              // hits.log
+{
+  uint64_t seq;
+  int64_t  time;               // of the call (local time as UTC, see history.c)
+  uint32_t check;              // of the record with check 0
+  char     list;               // 'W' or 'B'
+  char     token[LIST_TERM_MAX + 1];
+};
+
+struct hits_header             // hits.dat, followed by the entries
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t nentries;
+  uint64_t lastSeq;            // journal records up to this one are included
+  uint64_t check;              // of the entries
+};
+
+struct hit_entry
+{
+  int64_t  last;
+  uint32_t count;
+  char     list;               // 0: free slot
+  char     token[LIST_TERM_MAX + 1];
+};
+
+struct hit_table               // open addressing, cap is a power of two
+{
+  struct hit_entry *e;
+  int n, cap;
+};
+
+struct hits_row
+{
+  const struct match_list *ml;
+  int     rule;
+  int64_t last;                // hit, or the date in the list if never hit
+  long    count;
+};
+
+static struct hit_table table;
+static int journalFd = -1;
+static uint64_t nextSeq;
+static long journalRecords;
+
+static int  load_hits( struct hit_table *t, uint64_t *lastSeq, long *records, off_t *goodLen );
+static int  add_hits( struct hit_table *t, char list, const char *token, int64_t time, long count );
+static struct hit_entry *find_hits( const struct hit_table *t, char list, const char *token );
+static int  write_checkpoint( void );
+static uint32_t record_check( struct hit_record r );
+static uint64_t fnv64( const void *p, size_t len, uint64_t h );
+static int  compare_rows( const void *a, const void *b );
+static void format_hit_time( int64_t t, char *buf, int len );
+
+static bool byCount;           // "jcblock hits -c"
+
+//
+// Load the checkpoint and the journal, drop a half written record at the
+// end of the journal and open it for appending. Returns 0 or -1.
+//
+int hitlog_open( void )
+{  /* Begin hitlog_open */
+  uint64_t lastSeq;
+  off_t goodLen;
+  struct stat st;
+  char message[FILE_PATH_MAX + 80];
+
+  if( load_hits( &table, &lastSeq, &journalRecords, &goodLen ) != 0 )
+    return( -1 );
+  nextSeq = lastSeq + 1;
+  if( ( journalFd = open( HITS_LOG, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644 ) ) < 0 )
+    return( -1 );
+  if( fstat( journalFd, &st ) == 0 && st.st_size > goodLen )
+  {
+    sprintf( message, "%s: %ld bytes of a half written record dropped", HITS_LOG,
+             (long)( st.st_size - goodLen ) );
+    log_debug_info( message );
+    if( ftruncate( journalFd, goodLen ) != 0 )
+      log_debug_info("ftruncate() of the hit journal failed");
+  }
+  return( 0 );
+}  /* end hitlog_open */
+
+//
+// Append a hit of an entry (list 'W' or 'B', its test field) at the date of
+// a call ("YYYY-MM-DDThh:mm"). The record is synced by hitlog_sync().
+//
+int hitlog_append( char list, const char *token, const char *date )
+{  /* Begin hitlog_append */
+  struct hit_record r;
+  struct tm tm;
+
+  if( journalFd < 0 )
+    return( -1 );
+  memset( &r, 0, sizeof( r ) );
+  if( history_parse_time( date, &r.time, &tm ) != 0 )
+    return( -1 );
+  r.list = list;
+  strncpy( r.token, token, sizeof( r.token ) - 1 );
+  if( add_hits( &table, list, r.token, r.time, 1 ) != 0 )
+    return( -1 );
+  r.seq = nextSeq++;
+  r.check = record_check( r );
+  if( write( journalFd, &r, sizeof( r ) ) != sizeof( r ) )
+    return( -1 );
+  journalRecords++;
+  return( 0 );
+}  /* end hitlog_append */
+
+//
+// Sync the records appended, then compact the journal if it is long.
+//
+void hitlog_sync( void )
+{  /* Begin hitlog_sync */
+  if( journalFd < 0 )
+    return;
+  if( fdatasync( journalFd ) != 0 )
+    log_debug_info("fdatasync() of the hit journal failed");
+  if( journalRecords >= HITLOG_COMPACT && write_checkpoint() != 0 )
+    log_debug_info("compaction of the hit journal failed");
+}  /* end hitlog_sync */
+
+//
+// Compact the journal (if it holds anything) and close it.
+//
+void hitlog_close( void )
+{  /* Begin hitlog_close */
+  if( journalFd < 0 )
+    return;
+  if( journalRecords > 0 && write_checkpoint() != 0 )
+    log_debug_info("compaction of the hit journal failed");
+  close( journalFd );
+  journalFd = -1;
+  free( table.e );
+  memset( &table, 0, sizeof( table ) );
+}  /* end hitlog_close */
+
+//
+// "jcblock hits [-c] [-b date]": every entry of both lists with its hit
+// count and last hit, least recently hit first (-c: most hits first). -b
+// shows only the entries not hit since the date. Entries never hit show
+// the date in the list, marked with '*'.
+//
+int hits_command( int argc, char **argv )
+{  /* Begin hits_command */
+  struct hit_table hits;
+  struct match_list *lists[2];
+  struct hits_row *rows;
+  struct hit_entry *h;
+  struct stat before, after;
+  struct tm tm;
+  uint64_t lastSeq;
+  off_t goodLen;
+  long records, nrows = 0, i;
+  int64_t before_time = INT64_MAX, t;
+  char token[LIST_TERM_MAX + 1], date[32];
+  const char *listNames[2] = { "whitelist", "blacklist" };
+  int optChar, l, r, tries;
+
+  optind = 0;
+  while( ( optChar = getopt( argc, argv, "cb:" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 'c':
+        byCount = TRUE;
+        break;
+      case 'b':
+        if( history_parse_time( optarg, &before_time, &tm ) != 0 )
+        {
+          fprintf( stderr, "%s: not a date (YYYY-MM-DD or YYYY-MM-DDThh:mm)\n", optarg );
+          return( 1 );
+        }
+        break;
+      default:
+        fprintf( stderr, "Usage: jcblock [-d directory] hits [-c] [-b YYYY-MM-DD]\n" );
+        return( 1 );
+    }
+  }
+
+  // A compaction between reading the checkpoint and the journal would
+  // lose the records it moved; read both again if the checkpoint changed
+  for( tries = 0; ; tries++ )
+  {
+    memset( &hits, 0, sizeof( hits ) );
+    before.st_ino = after.st_ino = 0;
+    stat( HITS_FILE, &before );
+    if( load_hits( &hits, &lastSeq, &records, &goodLen ) != 0 )
+    {
+      fprintf( stderr, "can not read %s: %s\n", HITS_FILE, strerror( errno ) );
+      return( 1 );
+    }
+    stat( HITS_FILE, &after );
+    if( after.st_ino == before.st_ino || tries == 3 )
+      break;
+    free( hits.e );
+  }
+
+  lists[0] = open_list( WHITELIST_FILE, "whitelist" );
+  if( ( lists[1] = open_list( BLACKLIST_FILE, "blacklist" ) ) == NULL )
+  {
+    fprintf( stderr, "can not read %s\n", BLACKLIST_FILE );
+    return( 1 );
+  }
+  rows = malloc( ( ( lists[0] ? lists[0]->nrules : 0 ) + lists[1]->nrules + 1 ) *
+                 sizeof( *rows ) );
+  if( rows == NULL )
+  {
+    fprintf( stderr, "out of memory\n" );
+    return( 1 );
+  }
+
+  for( l = 0; l < 2; l++ )
+  {
+    for( r = 0; lists[l] != NULL && r < lists[l]->nrules; r++ )
+    {
+      list_rule_token( lists[l], r, token, sizeof( token ) );
+      rows[nrows].ml = lists[l];
+      rows[nrows].rule = r;
+      if( ( h = find_hits( &hits, l == 0 ? 'W' : 'B', token ) ) != NULL )
+      {
+        rows[nrows].last = h->last;
+        rows[nrows].count = h->count;
+      }
+      else
+      {
+        // The date field of the record (written by hand or by an older
+        // jcblock), or 0
+        snprintf( date, sizeof( date ), "%.*s", LIST_DATE_LEN,
+                  lists[l]->pool + lists[l]->rules[r].text_off + LIST_DATE_COL );
+        rows[nrows].last = history_parse_time( date, &t, &tm ) == 0 ? t : 0;
+        rows[nrows].count = 0;
+      }
+      if( rows[nrows].last < before_time )
+        nrows++;
+    }
+  }
+  qsort( rows, nrows, sizeof( *rows ), compare_rows );
+
+  printf( "List        Hits  Last hit           Entry\n" );
+  for( i = 0; i < nrows; i++ )
+  {
+    format_hit_time( rows[i].last, date, sizeof( date ) );
+    printf( "%-9s %6ld  %-16s%s  %s\n", rows[i].ml == lists[0] ? listNames[0] : listNames[1],
+            rows[i].count, date, rows[i].count == 0 && rows[i].last != 0 ? "*" : " ",
+            list_rule_token( rows[i].ml, rows[i].rule, token, sizeof( token ) ) );
+  }
+  printf( "(%ld entries; * no hits recorded, the date in the list is shown)\n", nrows );
+
+  free( rows );
+  free( hits.e );
+  if( lists[0] != NULL )
+    free_list( lists[0] );
+  free_list( lists[1] );
+  return( 0 );
+}  /* end hits_command */
+
+//
+// Read the checkpoint and add the journal records it does not include. A
+// missing file is empty; a damaged checkpoint is logged and left out. The
+// journal is read up to its first damaged record (*goodLen bytes). Returns
+// 0 or -1.
+//
+static int load_hits( struct hit_table *t, uint64_t *lastSeq, long *records, off_t *goodLen )
+{  /* Begin load_hits */
+  struct hits_header hdr;
+  struct hit_entry e;
+  struct hit_record r;
+  uint64_t check = 0;
+  FILE *fp;
+  uint32_t i;
+
+  *lastSeq = 0;
+  *records = 0;
+  *goodLen = 0;
+  if( ( fp = fopen( HITS_FILE, "r" ) ) != NULL )
+  {
+    if( fread( &hdr, sizeof( hdr ), 1, fp ) == 1 &&
+        memcmp( hdr.magic, HITS_MAGIC, sizeof( hdr.magic ) ) == 0 &&
+        hdr.version == HITS_VERSION )
+    {
+      for( i = 0; i < hdr.nentries && fread( &e, sizeof( e ), 1, fp ) == 1; i++ )
+      {
+        check = fnv64( &e, sizeof( e ), check );
+        if( add_hits( t, e.list, e.token, e.last, e.count ) != 0 )
+        {
+          fclose( fp );
+          return( -1 );
+        }
+      }
+      if( i == hdr.nentries && check == hdr.check )
+        *lastSeq = hdr.lastSeq;
+      else
+      {
+        log_debug_info("hits.dat is damaged; counting the journal only");
+        free( t->e );
+        memset( t, 0, sizeof( *t ) );
+      }
+    }
+    fclose( fp );
+  }
+  else if( errno != ENOENT )
+    return( -1 );
+
+  if( ( fp = fopen( HITS_LOG, "r" ) ) == NULL )
+    return( errno == ENOENT ? 0 : -1 );
+  while( fread( &r, sizeof( r ), 1, fp ) == 1 && r.check == record_check( r ) &&
+         r.token[LIST_TERM_MAX] == 0 )
+  {
+    *goodLen += sizeof( r );
+    (*records)++;
+    if( r.seq <= *lastSeq )
+      continue;               // already in the checkpoint
+    *lastSeq = r.seq;
+    if( add_hits( t, r.list, r.token, r.time, 1 ) != 0 )
+    {
+      fclose( fp );
+      return( -1 );
+    }
+  }
+  fclose( fp );
+  return( 0 );
+}  /* end load_hits */
+
+static int add_hits( struct hit_table *t, char list, const char *token, int64_t time, long count )
+{  /* Begin add_hits */
+  struct hit_entry *e, *old;
+  int oldCap, i;
+  unsigned h;
+
+  if( ( t->n + 1 ) * 2 > t->cap )
+  {
+    old = t->e;
+    oldCap = t->cap;
+    t->cap = t->cap ? t->cap * 2 : 256;
+    if( ( t->e = calloc( t->cap, sizeof( *t->e ) ) ) == NULL )
+    {
+      t->e = old;
+      t->cap = oldCap;
+      return( -1 );
+    }
+    t->n = 0;
+    for( i = 0; i < oldCap; i++ )
+    {
+      if( old[i].list != 0 )
+        add_hits( t, old[i].list, old[i].token, old[i].last, old[i].count );
+    }
+    free( old );
+  }
+
+  h = (unsigned)fnv64( token, strlen( token ), (unsigned char)list );
+  for( e = &t->e[h & ( t->cap - 1 )]; e->list != 0; )
+  {
+    if( e->list == list && strcmp( e->token, token ) == 0 )
+      break;
+    h++;
+    e = &t->e[h & ( t->cap - 1 )];
+  }
+  if( e->list == 0 )
+  {
+    e->list = list;
+    strncpy( e->token, token, sizeof( e->token ) - 1 );
+    t->n++;
+  }
+  e->count += count;
+  if( time > e->last )
+    e->last = time;
+  return( 0 );
+}  /* end add_hits */
+
+static struct hit_entry *find_hits( const struct hit_table *t, char list, const char *token )
+{  /* Begin find_hits */
+  struct hit_entry *e;
+  unsigned h;
+
+  if( t->cap == 0 )
+    return( NULL );
+  h = (unsigned)fnv64( token, strlen( token ), (unsigned char)list );
+  for( e = &t->e[h & ( t->cap - 1 )]; e->list != 0; )
+  {
+    if( e->list == list && strcmp( e->token, token ) == 0 )
+      return( e );
+    h++;
+    e = &t->e[h & ( t->cap - 1 )];
+  }
+  return( NULL );
+}  /* end find_hits */
+
+//
+// Write the counts to a new checkpoint, sync it and rename it into place,
+// then empty the journal. Returns 0 or -1.
+//
+static int write_checkpoint( void )
+{  /* Begin write_checkpoint */
+  char tmpPath[FILE_PATH_MAX + 8];
+  struct hits_header hdr;
+  FILE *fp;
+  int i, fd, rc = 0;
+
+  memset( &hdr, 0, sizeof( hdr ) );
+  memcpy( hdr.magic, HITS_MAGIC, sizeof( hdr.magic ) );
+  hdr.version = HITS_VERSION;
+  hdr.lastSeq = nextSeq - 1;
+  for( i = 0; i < table.cap; i++ )
+  {
+    if( table.e[i].list != 0 )
+    {
+      hdr.check = fnv64( &table.e[i], sizeof( table.e[i] ), hdr.check );
+      hdr.nentries++;
+    }
+  }
+
+  snprintf( tmpPath, sizeof( tmpPath ), "%s.tmp", HITS_FILE );
+  if( ( fp = fopen( tmpPath, "w" ) ) == NULL )
+    return( -1 );
+  if( fwrite( &hdr, sizeof( hdr ), 1, fp ) != 1 )
+    rc = -1;
+  for( i = 0; i < table.cap && rc == 0; i++ )
+  {
+    if( table.e[i].list != 0 && fwrite( &table.e[i], sizeof( table.e[i] ), 1, fp ) != 1 )
+      rc = -1;
+  }
+  if( fflush( fp ) != 0 || fsync( fileno( fp ) ) != 0 )
+    rc = -1;
+  if( fclose( fp ) != 0 || rc != 0 || rename( tmpPath, HITS_FILE ) != 0 )
+  {
+    unlink( tmpPath );
+    return( -1 );
+  }
+
+  // The rename must be on disk before the journal is emptied
+  if( ( fd = open( LIST_DIR, O_RDONLY | O_CLOEXEC ) ) >= 0 )
+  {
+    fsync( fd );
+    close( fd );
+  }
+  if( ftruncate( journalFd, 0 ) != 0 || fdatasync( journalFd ) != 0 )
+    return( -1 );
+  journalRecords = 0;
+  return( 0 );
+}  /* end write_checkpoint */
+
+static uint32_t record_check( struct hit_record r )
+{  /* Begin record_check */
+  r.check = 0;
+  return( (uint32_t)fnv64( &r, sizeof( r ), 0 ) );
+}  /* end record_check */
+
+// 64 bit FNV-1a, seeded with h
+static uint64_t fnv64( const void *p, size_t len, uint64_t h )
+{  /* Begin fnv64 */
+  const unsigned char *b = p;
+
+  h ^= 0xCBF29CE484222325ULL;
+  while( len-- > 0 )
+    h = ( h ^ *b++ ) * 0x100000001B3ULL;
+  return( h );
+}  /* end fnv64 */
+
+static int compare_rows( const void *a, const void *b )
+{  /* Begin compare_rows */
+  const struct hits_row *x = a, *y = b;
+
+  if( byCount && x->count != y->count )
+    return( x->count > y->count ? -1 : 1 );
+  if( x->last != y->last )
+    return( x->last < y->last ? -1 : 1 );
+  return( x->rule - y->rule );
+}  /* end compare_rows */
+
+static void format_hit_time( int64_t t, char *buf, int len )
+{  /* Begin format_hit_time */
+  time_t tt = t;
+  struct tm tm;
+
+  if( t == 0 )
+    snprintf( buf, len, "never" );
+  else
+    strftime( buf, len, "%Y-%m-%dT%H:%M", gmtime_r( &tt, &tm ) );
+}  /* end format_hit_time */
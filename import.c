@@ -0,0 +1,844 @@
+/*
+Program name: jcblock
+
+File name: import.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+"jcblock import": adds the numbers of large blocklists (the complaint data
+sets published as CSV files, or plain lists of numbers) to blacklist.dat.
+The input is cut into chunks at line ends that the threads take in turn, as
+report does; each thread keeps the number keys of its lines. The keys are
+then cut into ranges by splitters sampled from them, so each range can be
+sorted, deduplicated, checked against the lists and formatted by one thread
+without sharing anything. The new records are appended to blacklist.dat
+(the entries and comments written by hand are left as they are) and the
+list is compiled to its image, which a running jcblock maps.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+#define IMPORT_THREADS_MAX  64
+#define CHUNKS_PER_THREAD   4      // more chunks than threads evens out the work
+#define TEXT_CHUNK_MIN      ( 256 * 1024 )
+#define PARTS_PER_THREAD    8      // key ranges sorted on their own
+#define SAMPLES_MAX         65536  // keys sampled to choose the ranges
+#define FIELD_MAX           64     // longest CSV field that can hold a number
+#define COLUMN_AUTO         0      // the first field of a line that is a number
+#define COMMENT_DEFAULT     "import"
+
+// CSV field separators (plain lists have one field per line)
+#define SEPARATOR( c )      ( (c) == ',' || (c) == ';' || (c) == '\t' )
+
+struct chunk
+{
+  const char *text, *end;
+  int column;                      // 1-based, or COLUMN_AUTO
+};
+
+struct worker                      // the keys found by one thread
+{
+  uint64_t *keys;
+  long nkeys, keyCap;
+  long rows, bad;                  // lines, lines without a number
+  long *counts;                    // keys per range, then where they go
+  bool failed;                     // out of memory
+};
+
+struct part                        // one range of keys
+{
+  uint64_t *keys;                  // into the array of all keys
+  long nkeys;
+  long unique, onBlack, onWhite;
+  char *text;                      // the records to append
+  size_t len, cap;
+  bool failed;
+};
+
+static struct chunk *chunks;
+static int nchunks, chunkCap;
+static int nextChunk;              // taken with an atomic add
+static struct part *parts;
+static int nparts;
+static int nextPart;               // taken with an atomic add
+static uint64_t *splitters;        // nparts - 1, sorted
+static uint64_t *allKeys;
+static const struct match_list *white, *black;
+static const char *columnName;     // -c (NULL: COLUMN_AUTO)
+static const char *importComment = COMMENT_DEFAULT;
+static char importDate[LIST_DATE_LEN + 1];
+static bool dryRun;
+
+static int add_chunk( const char *text, const char *end, int column );
+static int add_text_chunks( const char *text, size_t len, int column, int nthreads );
+static int file_column( const char *path, const char *text, const char *end,
+                        const char **rows );
+static bool header_name( const char *field );
+static int run_threads( void *(*fn)( void * ), struct worker *workers, int nthreads );
+static void *parse_chunks( void *arg );
+static uint64_t line_number( const char *p, const char *end, int column );
+static const char *csv_field( const char *p, const char *end, char *field, int *len );
+static uint64_t phone_key( const char *field, int len );
+static void choose_splitters( struct worker *workers, int nthreads );
+static int part_of( uint64_t key );
+static void *count_parts( void *arg );
+static void *scatter_keys( void *arg );
+static void *finish_parts( void *arg );
+static int add_text( struct part *pt, const char *record );
+static int append_parts( const char *path );
+static int compile_blacklist( const char *path );
+static char *read_stdin( size_t *len );
+static double seconds_since( const struct timespec *t0 );
+static int compare_keys( const void *a, const void *b );
+
+//
+// jcblock import [-c column] [-m comment] [-j threads] [-n] file ...
+// Returns the exit status.
+//
+int import_command( int argc, char **argv )
+{  /* Begin import_command */
+  struct worker workers[IMPORT_THREADS_MAX];
+  struct timespec t0, t1;
+  struct stat st;
+  struct tm tm;
+  time_t now;
+  const char *rows;
+  char *text;
+  size_t len, bytes = 0;
+  long total = 0, at, n, rowCount = 0, bad = 0, unique = 0, onBlack = 0, onWhite = 0;
+  double parseSec, partSec, checkSec, appendSec = 0, sec;
+  int nthreads = sysconf( _SC_NPROCESSORS_ONLN );
+  int optChar, column, fd, nfiles = 0, t, p;
+
+  optind = 0;                    // new argument vector: restart getopt()
+  while( ( optChar = getopt( argc, argv, "c:m:j:n" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 'c':
+        columnName = optarg;
+        break;
+      case 'm':
+        importComment = optarg;
+        break;
+      case 'j':
+        nthreads = atoi( optarg );
+        break;
+      case 'n':
+        dryRun = TRUE;
+        break;
+      default:
+        fprintf( stderr, "Usage: jcblock [-d directory] import [-c column] [-m comment] "
+                         "[-j threads] [-n] file...\n"
+                         "       (column: a header name or a number from 1; without it the\n"
+                         "       \"phone\" or \"number\" column, or the first number of a line;\n"
+                         "       -n: count only, blacklist.dat is not changed; file - is stdin)\n" );
+        return( 1 );
+    }
+  }
+  if( optind == argc )
+  {
+    fprintf( stderr, "jcblock import: no files\n" );
+    return( 1 );
+  }
+  if( strchr( importComment, '|' ) != NULL || strchr( importComment, '\n' ) != NULL )
+  {
+    fprintf( stderr, "%s: a comment may not hold '|' or a line end\n", importComment );
+    return( 1 );
+  }
+  if( nthreads < 1 )
+    nthreads = 1;
+  if( nthreads > IMPORT_THREADS_MAX )
+    nthreads = IMPORT_THREADS_MAX;
+
+  // The lists the numbers are checked against
+  if( access( BLACKLIST_FILE, F_OK ) == 0 &&
+      ( black = open_list( BLACKLIST_FILE, "blacklist" ) ) == NULL )
+  {
+    fprintf( stderr, "%s: %s\n", BLACKLIST_FILE, errno ? strerror( errno ) : "out of memory" );
+    return( 1 );
+  }
+  if( access( WHITELIST_FILE, F_OK ) == 0 &&
+      ( white = open_list( WHITELIST_FILE, "whitelist" ) ) == NULL )
+  {
+    fprintf( stderr, "%s: %s\n", WHITELIST_FILE, errno ? strerror( errno ) : "out of memory" );
+    return( 1 );
+  }
+  now = time( NULL );
+  localtime_r( &now, &tm );
+  strftime( importDate, sizeof( importDate ), "%FT%R", &tm );
+
+  // Cut the input into chunks (the files stay mapped until the end)
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  for( ; optind < argc; optind++, nfiles++ )
+  {
+    if( strcmp( argv[optind], "-" ) == 0 )
+    {
+      if( ( text = read_stdin( &len ) ) == NULL )
+        return( 1 );
+    }
+    else
+    {
+      if( ( fd = open( argv[optind], O_RDONLY | O_CLOEXEC ) ) < 0 || fstat( fd, &st ) != 0 )
+      {
+        fprintf( stderr, "%s: %s\n", argv[optind], strerror( errno ) );
+        return( 1 );
+      }
+      len = st.st_size;
+      text = NULL;
+      if( len > 0 &&
+          ( text = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 ) ) == MAP_FAILED )
+      {
+        fprintf( stderr, "%s: %s\n", argv[optind], strerror( errno ) );
+        return( 1 );
+      }
+      close( fd );
+      if( len > 0 )
+        madvise( text, len, MADV_SEQUENTIAL );
+    }
+    if( len == 0 )
+      continue;
+    bytes += len;
+    if( ( column = file_column( argv[optind], text, text + len, &rows ) ) < 0 ||
+        add_text_chunks( rows, text + len - rows, column, nthreads ) != 0 )
+      return( 1 );
+  }
+
+  // Find the numbers on all threads (this one too)
+  if( nthreads > nchunks )
+    nthreads = nchunks > 0 ? nchunks : 1;
+  memset( workers, 0, sizeof( workers ) );
+  if( run_threads( parse_chunks, workers, nthreads ) != 0 )
+    return( 1 );
+  for( t = 0; t < nthreads; t++ )
+  {
+    if( workers[t].failed )
+    {
+      fprintf( stderr, "out of memory\n" );
+      return( 1 );
+    }
+    total += workers[t].nkeys;
+    rowCount += workers[t].rows;
+    bad += workers[t].bad;
+  }
+  parseSec = seconds_since( &t0 );
+
+  // Cut the keys into ranges: count the keys of every range per thread,
+  // then each thread copies its keys to their places
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  nparts = nthreads * PARTS_PER_THREAD;
+  parts = calloc( nparts, sizeof( *parts ) );
+  splitters = malloc( nparts * sizeof( *splitters ) );
+  allKeys = malloc( ( total + 1 ) * sizeof( *allKeys ) );
+  for( t = 0; t < nthreads; t++ )
+    workers[t].counts = calloc( nparts, sizeof( *workers[t].counts ) );
+  for( t = 0; t < nthreads; t++ )
+  {
+    if( parts == NULL || splitters == NULL || allKeys == NULL || workers[t].counts == NULL )
+    {
+      fprintf( stderr, "out of memory\n" );
+      return( 1 );
+    }
+  }
+  choose_splitters( workers, nthreads );
+  if( run_threads( count_parts, workers, nthreads ) != 0 )
+    return( 1 );
+  for( p = 0, at = 0; p < nparts; p++ )
+  {
+    parts[p].keys = allKeys + at;
+    for( t = 0; t < nthreads; t++ )
+    {
+      n = workers[t].counts[p];
+      workers[t].counts[p] = at;           // where the keys of thread t go
+      parts[p].nkeys += n;
+      at += n;
+    }
+  }
+  if( run_threads( scatter_keys, workers, nthreads ) != 0 )
+    return( 1 );
+  for( t = 0; t < nthreads; t++ )
+  {
+    free( workers[t].keys );
+    free( workers[t].counts );
+  }
+  partSec = seconds_since( &t1 );
+
+  // Sort, deduplicate, check and format every range
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  if( run_threads( finish_parts, workers, nthreads ) != 0 )
+    return( 1 );
+  for( p = 0; p < nparts; p++ )
+  {
+    if( parts[p].failed )
+    {
+      fprintf( stderr, "out of memory\n" );
+      return( 1 );
+    }
+    unique += parts[p].unique;
+    onBlack += parts[p].onBlack;
+    onWhite += parts[p].onWhite;
+  }
+  checkSec = seconds_since( &t1 );
+
+  if( !dryRun && unique > onBlack + onWhite )
+  {
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    if( append_parts( BLACKLIST_FILE ) != 0 )
+      return( 1 );
+    appendSec = seconds_since( &t1 );
+  }
+  sec = seconds_since( &t0 );
+
+  printf( "Imported %d file%s, %.1f MB in %.2f sec on %d thread%s (%.1f MB/s, %.2f M rows/s)\n",
+          nfiles, nfiles == 1 ? "" : "s", bytes / 1e6, sec, nthreads, nthreads == 1 ? "" : "s",
+          bytes / 1e6 / ( sec > 0 ? sec : 1e-9 ), rowCount / 1e6 / ( sec > 0 ? sec : 1e-9 ) );
+  printf( "  Rows:             %ld\n", rowCount );
+  printf( "  Numbers:          %ld\n", total );
+  printf( "  Not a number:     %ld\n", bad );
+  printf( "  Duplicates:       %ld\n", total - unique );
+  printf( "  On the blacklist: %ld\n", onBlack );
+  printf( "  On the whitelist: %ld (not added)\n", onWhite );
+  printf( "  %s %ld\n", dryRun ? "Would be added:  " : "Added:           ",
+          unique - onBlack - onWhite );
+  printf( "  Parse %.3f sec, partition %.3f sec, sort and check %.3f sec, append %.3f sec\n",
+          parseSec, partSec, checkSec, appendSec );
+
+  if( !dryRun && unique > onBlack + onWhite && compile_blacklist( BLACKLIST_FILE ) != 0 )
+    return( 1 );
+  return( 0 );
+}  /* end import_command */
+
+static int add_chunk( const char *text, const char *end, int column )
+{  /* Begin add_chunk */
+  struct chunk *p;
+
+  if( nchunks == chunkCap )
+  {
+    chunkCap = chunkCap ? chunkCap * 2 : 64;
+    if( ( p = realloc( chunks, chunkCap * sizeof( *chunks ) ) ) == NULL )
+    {
+      fprintf( stderr, "out of memory\n" );
+      return( -1 );
+    }
+    chunks = p;
+  }
+  p = &chunks[nchunks++];
+  p->text   = text;
+  p->end    = end;
+  p->column = column;
+  return( 0 );
+}  /* end add_chunk */
+
+//
+// Cut a text file into chunks that end at a line end. (A quoted CSV field
+// that holds a line end is not supported.)
+//
+static int add_text_chunks( const char *text, size_t len, int column, int nthreads )
+{  /* Begin add_text_chunks */
+  size_t size = len / ( nthreads * CHUNKS_PER_THREAD ) + 1;
+  const char *p = text, *end = text + len, *cut;
+
+  if( size < TEXT_CHUNK_MIN )
+    size = TEXT_CHUNK_MIN;
+  while( p < end )
+  {
+    cut = ( (size_t)( end - p ) > size ) ? p + size : end;
+    if( cut < end && ( cut = memchr( cut, '\n', end - cut ) ) != NULL )
+      cut++;
+    else
+      cut = end;
+    if( add_chunk( p, cut, column ) != 0 )
+      return( -1 );
+    p = cut;
+  }
+  return( 0 );
+}  /* end add_text_chunks */
+
+//
+// The column of the numbers of a file, from its first line: the column
+// named by -c (or numbered by it), or else the first one whose name holds
+// "phone" or "number". A first line without a number in that column is a
+// header and *rows is set past it. Returns the column (1-based), COLUMN_AUTO
+// if the file has no header, or -1 if the column named by -c is not there.
+//
+static int file_column( const char *path, const char *text, const char *end,
+                        const char **rows )
+{  /* Begin file_column */
+  char field[FIELD_MAX];
+  const char *eol, *p;
+  int column = COLUMN_AUTO, col, len;
+  bool byNumber = FALSE;
+
+  if( ( eol = memchr( text, '\n', end - text ) ) == NULL )
+    eol = end;
+  *rows = text;
+  if( columnName != NULL && strspn( columnName, "0123456789" ) == strlen( columnName ) )
+  {
+    column = atoi( columnName );
+    byNumber = TRUE;
+  }
+
+  for( col = 1, p = text; !byNumber && column == COLUMN_AUTO && p <= eol; col++ )
+  {
+    p = csv_field( p, eol, field, &len );
+    while( len > 0 && ( field[len - 1] == '\r' || field[len - 1] == ' ' ) )
+      field[--len] = 0;
+    if( len >= FIELD_MAX )
+      continue;
+    if( columnName != NULL ? strcasecmp( field, columnName ) == 0 :
+        phone_key( field, len ) == 0 && header_name( field ) )
+      column = col;
+  }
+  if( column == COLUMN_AUTO && columnName != NULL )
+  {
+    fprintf( stderr, "%s: no column %s\n", path, columnName );
+    return( -1 );
+  }
+
+  if( column != COLUMN_AUTO && line_number( text, eol, column ) == 0 )
+    *rows = eol < end ? eol + 1 : end;
+  return( column );
+}  /* end file_column */
+
+//
+// Does a header field name a column of phone numbers?
+//
+static bool header_name( const char *field )
+{  /* Begin header_name */
+  char lower[FIELD_MAX];
+  int i;
+
+  for( i = 0; field[i] != 0 && i < FIELD_MAX - 1; i++ )
+    lower[i] = tolower( (unsigned char)field[i] );
+  lower[i] = 0;
+  return( strstr( lower, "phone" ) != NULL || strstr( lower, "number" ) != NULL );
+}  /* end header_name */
+
+//
+// Run fn on nthreads threads (this one too), thread t with &workers[t].
+// Returns 0 or -1.
+//
+static int run_threads( void *(*fn)( void * ), struct worker *workers, int nthreads )
+{  /* Begin run_threads */
+  pthread_t threads[IMPORT_THREADS_MAX];
+  int t, started;
+
+  for( started = 1; started < nthreads; started++ )
+  {
+    if( pthread_create( &threads[started], NULL, fn, &workers[started] ) != 0 )
+    {
+      fprintf( stderr, "pthread_create() of import thread failed\n" );
+      break;
+    }
+  }
+  if( started == nthreads )
+    fn( &workers[0] );
+  for( t = 1; t < started; t++ )
+    pthread_join( threads[t], NULL );
+  return( started == nthreads ? 0 : -1 );
+}  /* end run_threads */
+
+//
+// Import thread: keep the number keys of the lines of chunks until there
+// are none left. Empty lines and '#' comment lines are not rows.
+//
+static void *parse_chunks( void *arg )
+{  /* Begin parse_chunks */
+  struct worker *w = arg;
+  const struct chunk *c;
+  const char *p, *eol, *end;
+  uint64_t *keys, key;
+  int k;
+
+  while( ( k = __atomic_fetch_add( &nextChunk, 1, __ATOMIC_RELAXED ) ) < nchunks )
+  {
+    c = &chunks[k];
+    for( p = c->text; p < c->end && !w->failed; p = eol + 1 )
+    {
+      if( ( eol = memchr( p, '\n', c->end - p ) ) == NULL )
+        eol = c->end;
+      end = ( eol > p && eol[-1] == '\r' ) ? eol - 1 : eol;
+      if( end == p || *p == '#' )
+        continue;
+      w->rows++;
+      if( ( key = line_number( p, end, c->column ) ) == 0 )
+      {
+        w->bad++;
+        continue;
+      }
+      if( w->nkeys == w->keyCap )
+      {
+        w->keyCap = w->keyCap ? w->keyCap * 2 : 65536;
+        if( ( keys = realloc( w->keys, w->keyCap * sizeof( *keys ) ) ) == NULL )
+        {
+          w->failed = TRUE;
+          break;
+        }
+        w->keys = keys;
+      }
+      w->keys[w->nkeys++] = key;
+    }
+  }
+  return( NULL );
+}  /* end parse_chunks */
+
+//
+// The number key of a line: of its field column, or with COLUMN_AUTO of the
+// first field that is a number. Returns 0 if there is none.
+//
+static uint64_t line_number( const char *p, const char *end, int column )
+{  /* Begin line_number */
+  char field[FIELD_MAX];
+  uint64_t key;
+  int col, len;
+
+  for( col = 1; p <= end; col++ )
+  {
+    p = csv_field( p, end, field, &len );
+    if( column != COLUMN_AUTO && col != column )
+      continue;
+    key = phone_key( field, len );
+    if( key != 0 || column != COLUMN_AUTO )
+      return( key );
+  }
+  return( 0 );
+}  /* end line_number */
+
+//
+// Copy the CSV field at p (quotes removed, "" is a quote) to field, with a
+// '\0' after it, and set *len to its length (FIELD_MAX or more: cut short).
+// Returns where the next field begins, or end + 1 after the last one.
+//
+static const char *csv_field( const char *p, const char *end, char *field, int *len )
+{  /* Begin csv_field */
+  bool quoted = ( p < end && *p == '"' );
+  int n = 0;
+
+  for( p += quoted; p < end; p++ )
+  {
+    if( quoted && *p == '"' )
+    {
+      if( p + 1 < end && p[1] == '"' )
+        p++;
+      else
+      {
+        quoted = FALSE;
+        continue;
+      }
+    }
+    else if( !quoted && SEPARATOR( *p ) )
+      break;
+    if( n < FIELD_MAX - 1 )
+      field[n] = *p;
+    n++;
+  }
+  field[n < FIELD_MAX - 1 ? n : FIELD_MAX - 1] = 0;
+  *len = n;
+  return( p + 1 );
+}  /* end csv_field */
+
+//
+// The number key of a field written as a phone number (digits and the
+// characters people write numbers with) of NUMBER_EXACT_MIN digits or more,
+// as numidx_lookup() matches it. Returns 0 if it is not one: dates, ZIP
+// codes and times have too few digits or other characters.
+//
+static uint64_t phone_key( const char *field, int len )
+{  /* Begin phone_key */
+  uint64_t key;
+  int i;
+
+  if( len >= FIELD_MAX )
+    return( 0 );
+  for( i = 0; i < len; i++ )
+  {
+    if( strchr( "0123456789-(). +", field[i] ) == NULL )
+      return( 0 );
+  }
+  if( ( key = number_key( field, len ) ) == 0 || number_digits( key, NULL ) < NUMBER_EXACT_MIN )
+    return( 0 );
+  return( key );
+}  /* end phone_key */
+
+//
+// The splitters of the ranges, from keys sampled evenly from all threads.
+//
+static void choose_splitters( struct worker *workers, int nthreads )
+{  /* Begin choose_splitters */
+  uint64_t samples[SAMPLES_MAX];
+  long total = 0, stride, i;
+  int n = 0, p, t;
+
+  for( t = 0; t < nthreads; t++ )
+    total += workers[t].nkeys;
+  stride = total / SAMPLES_MAX + 1;
+  for( t = 0; t < nthreads; t++ )
+  {
+    for( i = 0; i < workers[t].nkeys && n < SAMPLES_MAX; i += stride )
+      samples[n++] = workers[t].keys[i];
+  }
+  qsort( samples, n, sizeof( *samples ), compare_keys );
+  for( p = 1; p < nparts; p++ )
+    splitters[p - 1] = n > 0 ? samples[(long)p * n / nparts] : UINT64_MAX;
+}  /* end choose_splitters */
+
+//
+// The range of a key: the number of splitters not above it.
+//
+static int part_of( uint64_t key )
+{  /* Begin part_of */
+  int lo = 0, hi = nparts - 1, mid;
+
+  while( lo < hi )
+  {
+    mid = ( lo + hi ) / 2;
+    if( splitters[mid] <= key )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return( lo );
+}  /* end part_of */
+
+//
+// Import thread: count the keys of a thread per range.
+//
+static void *count_parts( void *arg )
+{  /* Begin count_parts */
+  struct worker *w = arg;
+  long i;
+
+  for( i = 0; i < w->nkeys; i++ )
+    w->counts[part_of( w->keys[i] )]++;
+  return( NULL );
+}  /* end count_parts */
+
+//
+// Import thread: copy the keys of a thread to the places of their ranges
+// (counts holds where the next key of every range goes).
+//
+static void *scatter_keys( void *arg )
+{  /* Begin scatter_keys */
+  struct worker *w = arg;
+  long i;
+
+  for( i = 0; i < w->nkeys; i++ )
+    allKeys[w->counts[part_of( w->keys[i] )]++] = w->keys[i];
+  return( NULL );
+}  /* end scatter_keys */
+
+//
+// Import thread: sort the keys of ranges until there are none left, count
+// the distinct ones, and format the records of those that no list entry
+// matches. (Only the number rules of the lists are checked: a number a
+// text rule matches is still added.)
+//
+static void *finish_parts( void *arg )
+{  /* Begin finish_parts */
+  struct part *pt;
+  char digits[NUMBER_DIGITS_MAX + 1];
+  char record[LIST_LINE_MAX];
+  long i;
+  int k, n;
+
+  while( ( k = __atomic_fetch_add( &nextPart, 1, __ATOMIC_RELAXED ) ) < nparts )
+  {
+    pt = &parts[k];
+    qsort( pt->keys, pt->nkeys, sizeof( *pt->keys ), compare_keys );
+    for( i = 0; i < pt->nkeys && !pt->failed; i++ )
+    {
+      if( i > 0 && pt->keys[i] == pt->keys[i - 1] )
+        continue;
+      pt->unique++;
+      n = number_digits( pt->keys[i], digits );
+      if( black != NULL && numidx_lookup( &black->numbers, digits, n ) != NO_MATCH )
+        pt->onBlack++;
+      else if( white != NULL && numidx_lookup( &white->numbers, digits, n ) != NO_MATCH )
+        pt->onWhite++;
+      else if( !dryRun &&
+               add_text( pt, list_format_record( record, sizeof( record ), digits,
+                                                 importDate, importComment ) ) != 0 )
+        pt->failed = TRUE;
+    }
+  }
+  return( NULL );
+}  /* end finish_parts */
+
+//
+// Add a record to the text of a range. Returns 0 or -1.
+//
+static int add_text( struct part *pt, const char *record )
+{  /* Begin add_text */
+  size_t len = strlen( record );
+  char *p;
+
+  if( pt->len + len > pt->cap )
+  {
+    pt->cap = pt->cap ? pt->cap * 2 : 64 * 1024;
+    if( ( p = realloc( pt->text, pt->cap ) ) == NULL )
+      return( -1 );
+    pt->text = p;
+  }
+  memcpy( pt->text + pt->len, record, len );
+  pt->len += len;
+  return( 0 );
+}  /* end add_text */
+
+//
+// Append the records of all ranges to a list file, in order, as the writer
+// of jcblock appends its records (so one running alongside adds its own
+// between them at worst, and they are all whole lines).
+//
+static int append_parts( const char *path )
+{  /* Begin append_parts */
+  struct stat before;
+  ssize_t n;
+  size_t done;
+  char last;
+  int fd, p;
+
+  if( ( fd = open( path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644 ) ) < 0 ||
+      fstat( fd, &before ) != 0 )
+  {
+    fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+    if( fd >= 0 )
+      close( fd );
+    return( -1 );
+  }
+
+  // A last line without its '\n' (the file was edited) is ended first
+  if( before.st_size > 0 && ( pread( fd, &last, 1, before.st_size - 1 ) != 1 || last != '\n' ) &&
+      write( fd, "\n", 1 ) != 1 )
+  {
+    fprintf( stderr, "%s: write failed: %s\n", path, strerror( errno ) );
+    close( fd );
+    return( -1 );
+  }
+  for( p = 0; p < nparts; p++ )
+  {
+    for( done = 0; done < parts[p].len; done += n )
+    {
+      if( ( n = write( fd, parts[p].text + done, parts[p].len - done ) ) <= 0 )
+      {
+        fprintf( stderr, "%s: write failed: %s\n", path, strerror( errno ) );
+        close( fd );
+        return( -1 );
+      }
+    }
+    free( parts[p].text );
+    parts[p].text = NULL;
+  }
+  if( fdatasync( fd ) != 0 || close( fd ) != 0 )
+  {
+    fprintf( stderr, "%s: write failed: %s\n", path, strerror( errno ) );
+    return( -1 );
+  }
+  return( 0 );
+}  /* end append_parts */
+
+//
+// Compile a list file to its image, as jcblock-compile does (a running
+// jcblock maps the new image instead of reading the file).
+//
+static int compile_blacklist( const char *path )
+{  /* Begin compile_blacklist */
+  char image[FILE_PATH_MAX];
+  struct match_list *ml;
+  struct timespec t0;
+
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  list_image_path( path, image, sizeof( image ) );
+  errno = 0;
+  if( ( ml = load_list( path, "blacklist" ) ) == NULL )
+  {
+    fprintf( stderr, "%s: %s\n", path, errno ? strerror( errno ) : "out of memory" );
+    return( -1 );
+  }
+  if( write_list_image( ml, image ) != 0 )
+  {
+    fprintf( stderr, "%s: write failed: %s\n", image, strerror( errno ) );
+    free_list( ml );
+    return( -1 );
+  }
+  printf( "%s: %d entries compiled to %s in %.2f sec\n", path, ml->nrules, image,
+          seconds_since( &t0 ) );
+  free_list( ml );
+  return( 0 );
+}  /* end compile_blacklist */
+
+//
+// Read standard input to the end. Returns the text (never freed) or NULL.
+//
+static char *read_stdin( size_t *len )
+{  /* Begin read_stdin */
+  size_t cap = 1024 * 1024;
+  char *text = malloc( cap ), *p;
+  ssize_t n;
+
+  for( *len = 0; text != NULL; *len += n )
+  {
+    if( *len == cap )
+    {
+      cap *= 2;
+      if( ( p = realloc( text, cap ) ) == NULL )
+        break;
+      text = p;
+    }
+    if( ( n = read( STDIN_FILENO, text + *len, cap - *len ) ) == 0 )
+      return( text );
+    if( n < 0 )
+    {
+      if( errno == EINTR )
+      {
+        n = 0;
+        continue;
+      }
+      fprintf( stderr, "stdin: %s\n", strerror( errno ) );
+      free( text );
+      return( NULL );
+    }
+  }
+  fprintf( stderr, "out of memory\n" );
+  free( text );
+  return( NULL );
+}  /* end read_stdin */
+
+static double seconds_since( const struct timespec *t0 )
+{  /* Begin seconds_since */
+  struct timespec t1;
+
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  return( ( t1.tv_sec - t0->tv_sec ) + ( t1.tv_nsec - t0->tv_nsec ) / 1e9 );
+}  /* end seconds_since */
+
+static int compare_keys( const void *a, const void *b )
+{  /* Begin compare_keys */
+  uint64_t k1 = *(const uint64_t *)a, k2 = *(const uint64_t *)b;
+
+  return( k1 < k2 ? -1 : k1 > k2 );
+}  /* end compare_keys */
@@ -0,0 +1,603 @@
+/*
+Program name: jcbench
+
+File name: jcbench.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+A benchmark of the whitelist/blacklist decision. For each list size it writes a
+blacklist.dat and a whitelist.dat (a tenth of the size) in the real column
+format, with comment lines and malformed records mixed in. Then it loads them
+with every matcher and times the decision for three kinds of caller ID string:
+  hit-early  - the number of one of the first 50 blacklist records
+  hit-late   - the number of one of the last 50 blacklist records
+  miss       - a number and name on neither list (both lists are scanned)
+It reports the load time, the memory of the loaded lists, the latency
+percentiles of one decision and the number of wrong decisions. Before that it
+checks that the case folding kernel matchers use (fold.c) folds exactly as the
+byte at a time one does, and stops if it does not.
+
+Matchers:
+  legacy     - the line-by-line scan jcblock used before the lists were kept in
+               memory: the file is re-opened for every call and read unbuffered
+               with fgets(), each token taken with strtok() and searched for
+               with strstr() (the baseline)
+  automaton  - decide_call() in lists.c, as used by process_caller_id()
+  image      - the same, with the lists compiled by jcblock-compile and mapped
+               (the load time is the time to map and check the images)
+Another matcher is added to the matchers[] table.
+
+Usage:
+  jcbench [-s sizes] [-m matchers] [-t msec] [-q calls] [-d dir]
+  -s  comma separated list sizes (default 100,1000,10000,100000,1000000)
+  -m  comma separated matchers (default all)
+  -t  time spent on each case (default 1000 msec, at least 5 calls are made)
+  -q  most calls per case (default 100000)
+  -d  directory for the generated lists (default /tmp/jcbench)
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "common.h"
+
+#define EDGE_RECORDS    50       // hit-early/hit-late use the first/last 50
+#define COMMENT_EVERY   53
+#define MALFORMED_EVERY 97
+#define NUMBER_RULE_EVERY 89  // prefix and range records (of numbers no case uses)
+#define PATTERN_RULE_EVERY 997 // glob and regular expression records (no case matches)
+#define MIN_CALLS        5
+
+struct matcher
+{
+  const char *name;
+  int  (*prepare)( const char *whitePath, const char *blackPath );  // untimed, may be NULL
+  int  (*load)( const char *whitePath, const char *blackPath );  // 0 or -1
+  int  (*decide)( const char *callstr );                 // CALL_...
+  long (*memory)( void );                                // bytes
+  void (*unload)( void );
+};
+
+struct bench_case
+{
+  const char *name;
+  int expected;
+};
+
+// lists.c logs rejected records; the messages are counted
+__thread struct timeval start, end;
+static long logMessages;
+
+static int  legacy_load( const char *whitePath, const char *blackPath );
+static int  legacy_decide( const char *callstr );
+static long legacy_memory( void );
+static void legacy_unload( void );
+static bool legacy_scan( const char *path, const char *callstr );
+static int  automaton_load( const char *whitePath, const char *blackPath );
+static int  automaton_decide( const char *callstr );
+static long automaton_memory( void );
+static void automaton_unload( void );
+static int  image_prepare( const char *whitePath, const char *blackPath );
+static int  image_load( const char *whitePath, const char *blackPath );
+
+static struct matcher matchers[] =
+{
+  { "legacy",    NULL, legacy_load, legacy_decide, legacy_memory, legacy_unload },
+  { "automaton", NULL, automaton_load, automaton_decide, automaton_memory, automaton_unload },
+  { "image",     image_prepare, image_load, automaton_decide, automaton_memory, automaton_unload },
+  { NULL }
+};
+
+static struct bench_case cases[] =
+{
+  { "hit-early", CALL_BLOCKED },
+  { "hit-late",  CALL_BLOCKED },
+  { "miss",      CALL_ACCEPTED },
+  { NULL }
+};
+
+static char legacyWhite[FILE_PATH_MAX], legacyBlack[FILE_PATH_MAX];
+static struct match_list *white, *black;
+static unsigned long seed = 88172645463325252UL;
+
+static int generate_list( const char *path, int entries, long numberBase, char **numbers );
+static void make_callstr( char *callstr, int size, int which, char **numbers, int entries );
+static void run_case( struct matcher *mt, int which, char **numbers, int entries,
+                      int budgetMsec, int maxCalls );
+static bool selected( const char *list, const char *name );
+static unsigned long next_random( void );
+static long rss_bytes( void );
+static long now_usec( void );
+static int compare_long( const void *a, const void *b );
+
+//
+// Main function
+//
+int main( int argc, char **argv )
+{ /* Begin main */
+  char *sizes = "100,1000,10000,100000,1000000";
+  char *names = NULL;
+  char *dir = "/tmp/jcbench";
+  char whitePath[FILE_PATH_MAX], blackPath[FILE_PATH_MAX];
+  char **numbers;
+  char *p;
+  const char *failed;
+  struct matcher *mt;
+  int budgetMsec = 1000;
+  int maxCalls = 100000;
+  int optChar;
+  int entries;
+  int i;
+  long t0, rss0, rss, loadUsec;
+
+  while( ( optChar = getopt( argc, argv, "s:m:t:q:d:" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 's':
+        sizes = optarg;
+        break;
+      case 'm':
+        names = optarg;
+        break;
+      case 't':
+        budgetMsec = atoi( optarg );
+        break;
+      case 'q':
+        maxCalls = atoi( optarg );
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      default:
+        fprintf( stderr, "Usage: %s [-s sizes] [-m matchers] [-t msec] [-q calls] [-d dir]\n", argv[0] );
+        exit( -1 );
+    }
+  }
+  if( fold_self_check( &failed ) != 0 )
+  {
+    fprintf( stderr, "case folding: the %s kernel differs from the scalar one\n", failed );
+    exit( -1 );
+  }
+  printf( "case folding: %s kernel (checked against scalar)\n", fold_kernel_name() );
+
+  mkdir( dir, 0755 );
+  snprintf( whitePath, sizeof( whitePath ), "%s/whitelist.dat", dir );
+  snprintf( blackPath, sizeof( blackPath ), "%s/blacklist.dat", dir );
+
+  printf( "%8s %-10s %9s %10s %10s  %-9s %8s %8s %8s %8s %7s %5s\n",
+          "entries", "matcher", "load ms", "list KB", "rss KB", "case",
+          "p50 us", "p90 us", "p99 us", "max us", "calls", "wrong" );
+
+  for( p = sizes; *p; )
+  {
+    entries = atoi( p );
+    p += strcspn( p, "," );
+    if( *p == ',' )
+      p++;
+    if( entries < EDGE_RECORDS )
+      continue;
+
+    // The blacklist numbers are kept (in file order) for the callers
+    if( ( numbers = calloc( entries, sizeof( char * ) ) ) == NULL ||
+        generate_list( blackPath, entries, 2000000000L, numbers ) != 0 ||
+        generate_list( whitePath, entries / 10, 5000000000L, NULL ) != 0 )
+    {
+      fprintf( stderr, "could not write the lists in %s\n", dir );
+      exit( -1 );
+    }
+
+    for( mt = matchers; mt->name != NULL; mt++ )
+    {
+      if( names != NULL && !selected( names, mt->name ) )
+        continue;
+
+      logMessages = 0;
+      if( mt->prepare != NULL && mt->prepare( whitePath, blackPath ) != 0 )
+      {
+        printf( "%8d %-10s prepare failed\n", entries, mt->name );
+        continue;
+      }
+      rss0 = rss_bytes();
+      t0 = now_usec();
+      if( mt->load( whitePath, blackPath ) != 0 )
+      {
+        printf( "%8d %-10s load failed\n", entries, mt->name );
+        continue;
+      }
+      loadUsec = now_usec() - t0;
+      rss = rss_bytes() - rss0;
+
+      for( i = 0; cases[i].name != NULL; i++ )
+      {
+        printf( "%8d %-10s %9.1f %10ld %10ld  ", entries, mt->name, loadUsec / 1000.0,
+                mt->memory() / 1024, rss / 1024 );
+        run_case( mt, i, numbers, entries, budgetMsec, maxCalls );
+      }
+      if( logMessages )
+        printf( "%8d %-10s (%ld messages about malformed records)\n", entries,
+                mt->name, logMessages );
+      mt->unload();
+    }
+
+    for( i = 0; i < entries; i++ )
+      free( numbers[i] );
+    free( numbers );
+  }
+  return( 0 );
+}  /* end main */
+
+//
+// Write a list file of entries records: mostly numbers, every fifth a name,
+// with comment lines, malformed records, number prefixes and ranges and
+// patterns in between. The number of record
+// i is 1 followed by numberBase + 37 * i; if numbers is not NULL the tokens of
+// the number records are saved in it (NULL for name records).
+//
+static int generate_list( const char *path, int entries, long numberBase, char **numbers )
+{  /* Begin generate_list */
+  FILE *fp;
+  char token[32];
+  char field[40];
+  int i;
+
+  if( ( fp = fopen( path, "w" ) ) == NULL )
+    return( -1 );
+
+  fprintf( fp, "# Generated by jcbench: %d entries\n", entries );
+  for( i = 0; i < entries; i++ )
+  {
+    if( i % COMMENT_EVERY == 0 )
+      fprintf( fp, "#SPAM%07d?       |2014-01-01T12:00|commented out|\n", i );
+
+    // Malformed records, rejected when the list is loaded
+    if( i % MALFORMED_EVERY == 0 )
+    {
+      switch( ( i / MALFORMED_EVERY ) % 3 )
+      {
+        case 0:
+          fprintf( fp, "SHORT%d?|2014|\n", i );
+          break;
+        case 1:
+          fprintf( fp, "NO TERMINATOR %07d|2014-01-01T12:00|missing ?|\n", i );
+          break;
+        default:
+          fprintf( fp, "TERMINATOR TOO LATE %07d?|2014-01-01T12:00|? past column 18|\n", i );
+          break;
+      }
+    }
+
+    if( i % NUMBER_RULE_EVERY == 0 )
+    {
+      if( ( i / NUMBER_RULE_EVERY ) % 2 == 0 )
+        fprintf( fp, "1-3%02d-%03d-*?      |2014-01-01T12:00|prefix|\n",
+                 i / NUMBER_RULE_EVERY % 100, i % 1000 );
+      else
+        fprintf( fp, "4%02d%03d0100..199? |2014-01-01T12:00|range|\n",
+                 i / NUMBER_RULE_EVERY % 100, i % 1000 );
+    }
+
+    if( i % PATTERN_RULE_EVERY == 0 )
+    {
+      if( ( i / PATTERN_RULE_EVERY ) % 2 == 0 )
+        fprintf( fp, "N~SPAM%03d\\d+X?    |2014-01-01T12:00|pattern|\n", i / PATTERN_RULE_EVERY % 1000 );
+      else
+        fprintf( fp, "P=17%03d*0000?      |2014-01-01T12:00|pattern|\n", i / PATTERN_RULE_EVERY % 1000 );
+    }
+
+    if( i % 5 == 4 )
+    {
+      sprintf( token, "SPAM%07d", i );
+      if( numbers != NULL )
+        numbers[i] = NULL;
+    }
+    else
+    {
+      sprintf( token, "1%010ld", numberBase + 37L * i );
+      if( numbers != NULL && ( numbers[i] = strdup( token ) ) == NULL )
+      {
+        fclose( fp );
+        return( -1 );
+      }
+    }
+    sprintf( field, "%s?", token );
+    fprintf( fp, "%-19s|2014-%02d-%02dT12:00|generated entry %d|\n",
+             field, i % 12 + 1, i % 28 + 1, i );
+  }
+  return( fclose( fp ) );
+}  /* end generate_list */
+
+//
+// Make a caller ID string (as process_caller_id() builds it) for a case.
+//
+static void make_callstr( char *callstr, int size, int which, char **numbers, int entries )
+{  /* Begin make_callstr */
+  const char *number = NULL;
+  int i;
+
+  if( which == 2 )
+  {
+    // Numbers starting with 19 and lower case names are on no list
+    snprintf( callstr, size, "2026-10-18T12:00|19%09lu|wireless caller|\n",
+              next_random() % 1000000000UL );
+    return;
+  }
+
+  // Pick a number record among the first (or last) EDGE_RECORDS
+  while( number == NULL )
+  {
+    i = next_random() % EDGE_RECORDS;
+    if( which == 1 )
+      i = entries - 1 - i;
+    number = numbers[i];
+  }
+  snprintf( callstr, size, "2026-10-18T12:00|%s|WIRELESS CALLER|\n", number );
+}  /* end make_callstr */
+
+//
+// Time one decision at a time until the budget is spent, then print the
+// latency percentiles.
+//
+static void run_case( struct matcher *mt, int which, char **numbers, int entries,
+                      int budgetMsec, int maxCalls )
+{  /* Begin run_case */
+  char callstr[128];
+  long *usec;
+  long t0, t1, until;
+  int n = 0;
+  int wrong = 0;
+
+  if( ( usec = malloc( ( maxCalls > MIN_CALLS ? maxCalls : MIN_CALLS ) * sizeof( long ) ) ) == NULL )
+  {
+    printf( "out of memory\n" );
+    return;
+  }
+
+  until = now_usec() + budgetMsec * 1000L;
+  while( n < MIN_CALLS || ( n < maxCalls && now_usec() < until ) )
+  {
+    make_callstr( callstr, sizeof( callstr ), which, numbers, entries );
+    t0 = now_usec();
+    if( mt->decide( callstr ) != cases[which].expected )
+      wrong++;
+    t1 = now_usec();
+    usec[n++] = t1 - t0;
+  }
+
+  qsort( usec, n, sizeof( long ), compare_long );
+  printf( "%-9s %8ld %8ld %8ld %8ld %7d %5d\n", cases[which].name,
+          usec[n * 50 / 100], usec[n * 90 / 100], usec[n * 99 / 100], usec[n - 1],
+          n, wrong );
+  fflush( stdout );
+  free( usec );
+}  /* end run_case */
+
+//
+// legacy: scan the files for every call, as check_whitelist() and
+// check_blacklist() did before lists.c.
+//
+static int legacy_load( const char *whitePath, const char *blackPath )
+{  /* Begin legacy_load */
+  snprintf( legacyWhite, sizeof( legacyWhite ), "%s", whitePath );
+  snprintf( legacyBlack, sizeof( legacyBlack ), "%s", blackPath );
+  return( access( legacyBlack, R_OK ) );
+}  /* end legacy_load */
+
+static int legacy_decide( const char *callstr )
+{  /* Begin legacy_decide */
+  if( legacy_scan( legacyWhite, callstr ) )
+    return( CALL_WHITELISTED );
+  if( legacy_scan( legacyBlack, callstr ) || strlen( callstr ) < CALLSTR_MIN )
+    return( CALL_BLOCKED );
+  return( CALL_ACCEPTED );
+}  /* end legacy_decide */
+
+static long legacy_memory( void )
+{  /* Begin legacy_memory */
+  return( 0 );
+}  /* end legacy_memory */
+
+static void legacy_unload( void )
+{  /* Begin legacy_unload */
+}  /* end legacy_unload */
+
+//
+// The old record loop (without its error messages). Returns TRUE if a token
+// of the file is present in the caller ID string.
+//
+static bool legacy_scan( const char *path, const char *callstr )
+{  /* Begin legacy_scan */
+  char buf[LIST_LINE_MAX];
+  char *bufptr;
+  char *strptr;
+  FILE *fp;
+
+  // Re-opened for every call, unbuffered
+  if( ( fp = fopen( path, "r+" ) ) == NULL )
+    return( FALSE );
+  setbuf( fp, NULL );
+  fseek( fp, 0, SEEK_SET );
+
+  while( fgets( buf, sizeof( buf ), fp ) != NULL )
+  {
+    if( buf[0] == '#' || buf[0] == '\n' )
+      continue;
+    if( strlen( buf ) < LIST_MIN_RECORD )
+      continue;
+    if( ( strptr = strstr( buf, "?" ) ) == NULL )
+      continue;
+    if( (int)( strptr - buf ) > LIST_TERM_MAX )
+      continue;
+    if( ( bufptr = strtok( buf, "?" ) ) == NULL )
+      continue;
+    if( strstr( callstr, bufptr ) != NULL )
+    {
+      fclose( fp );
+      return( TRUE );
+    }
+  }
+  fclose( fp );
+  return( FALSE );
+}  /* end legacy_scan */
+
+//
+// automaton: the lists as jcblock loads them, decided by decide_call().
+//
+static int automaton_load( const char *whitePath, const char *blackPath )
+{  /* Begin automaton_load */
+  white = load_list( whitePath, "whitelist" );
+  if( ( black = load_list( blackPath, "blacklist" ) ) == NULL )
+  {
+    free_list( white );
+    return( -1 );
+  }
+  return( 0 );
+}  /* end automaton_load */
+
+static int automaton_decide( const char *callstr )
+{  /* Begin automaton_decide */
+  int rule;
+
+  return( decide_call( white, black, callstr, &rule, NULL ) );
+}  /* end automaton_decide */
+
+static long automaton_memory( void )
+{  /* Begin automaton_memory */
+  return( ( white ? list_memory( white ) : 0 ) + list_memory( black ) );
+}  /* end automaton_memory */
+
+static void automaton_unload( void )
+{  /* Begin automaton_unload */
+  free_list( white );
+  free_list( black );
+  white = black = NULL;
+}  /* end automaton_unload */
+
+//
+// image: the lists compiled by jcblock-compile (done in image_prepare(), not
+// timed) and mapped as jcblock maps them; decided like the automaton.
+//
+static int image_prepare( const char *whitePath, const char *blackPath )
+{  /* Begin image_prepare */
+  const char *paths[2] = { whitePath, blackPath };
+  char image[FILE_PATH_MAX];
+  struct match_list *ml;
+  int i;
+
+  for( i = 0; i < 2; i++ )
+  {
+    if( ( ml = load_list( paths[i], i ? "blacklist" : "whitelist" ) ) == NULL )
+      return( -1 );
+    list_image_path( paths[i], image, sizeof( image ) );
+    if( write_list_image( ml, image ) != 0 )
+    {
+      free_list( ml );
+      return( -1 );
+    }
+    free_list( ml );
+  }
+  return( 0 );
+}  /* end image_prepare */
+
+static int image_load( const char *whitePath, const char *blackPath )
+{  /* Begin image_load */
+  const char *why;
+
+  white = map_list_image( whitePath, "whitelist", &why );
+  if( ( black = map_list_image( blackPath, "blacklist", &why ) ) == NULL || white == NULL )
+  {
+    free_list( white );
+    free_list( black );
+    white = black = NULL;
+    return( -1 );
+  }
+  return( 0 );
+}  /* end image_load */
+
+//
+// Messages from lists.c
+//
+int log_info( char *command )
+{  /* Begin log_info */
+  logMessages++;
+  return( 0 );
+}  /* end log_info */
+
+int log_debug_info( char *command )
+{  /* Begin log_debug_info */
+  logMessages++;
+  return( 0 );
+}  /* end log_debug_info */
+
+//
+// Return TRUE if name is in the comma separated list.
+//
+static bool selected( const char *list, const char *name )
+{  /* Begin selected */
+  int len = strlen( name );
+  const char *p;
+
+  for( p = list; ( p = strstr( p, name ) ) != NULL; p += len )
+  {
+    if( ( p == list || p[-1] == ',' ) && ( p[len] == ',' || p[len] == 0 ) )
+      return( TRUE );
+  }
+  return( FALSE );
+}  /* end selected */
+
+static unsigned long next_random( void )
+{  /* Begin next_random */
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return( seed );
+}  /* end next_random */
+
+//
+// Resident memory of the process.
+//
+static long rss_bytes( void )
+{  /* Begin rss_bytes */
+  FILE *fp;
+  long size, resident = 0;
+
+  if( ( fp = fopen( "/proc/self/statm", "r" ) ) == NULL )
+    return( 0 );
+  if( fscanf( fp, "%ld %ld", &size, &resident ) != 2 )
+    resident = 0;
+  fclose( fp );
+  return( resident * sysconf( _SC_PAGESIZE ) );
+}  /* end rss_bytes */
+
+static long now_usec( void )
+{  /* Begin now_usec */
+  struct timespec t;
+
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return( t.tv_sec * 1000000L + t.tv_nsec / 1000 );
+}  /* end now_usec */
+
+static int compare_long( const void *a, const void *b )
+{  /* Begin compare_long */
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+
+  return( x < y ? -1 : x > y );
+}  /* end compare_long */
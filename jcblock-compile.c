@@ -0,0 +1,155 @@
+/*
+Program name: jcblock-compile
+
+File name: jcblock-compile.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Compiles whitelist.dat and blacklist.dat into the binary images jcblock maps
+at startup and on every reload instead of parsing the text (see listimage.c).
+Run it after editing a list; until then jcblock reads the edited text file.
+A running jcblock picks up a new image by itself. Malformed records are
+reported here just as jcblock would log them.
+
+Usage:
+  jcblock-compile [-d dir] [-c] [list.dat ...]
+  -d  directory of the lists (default /home/pi/jcblock); compiles
+      whitelist.dat (if present) and blacklist.dat
+  -c  only check the images: report whether jcblock can use them
+Files named on the command line are compiled (or checked) instead.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "common.h"
+
+// lists.c reports malformed records with these
+__thread struct timeval start, end;
+
+static int compile_list( const char *path, bool check );
+
+int main( int argc, char **argv )
+{  /* Begin main */
+  char whitePath[FILE_PATH_MAX], blackPath[FILE_PATH_MAX];
+  const char *dir = DEFAULT_DIR;
+  bool check = FALSE;
+  int failed = 0;
+  int optChar, i;
+
+  while( ( optChar = getopt( argc, argv, "d:c" ) ) != EOF )
+  {
+    switch( optChar )
+    {
+      case 'd':
+        dir = optarg;
+        break;
+      case 'c':
+        check = TRUE;
+        break;
+      default:
+        fprintf( stderr, "Usage: jcblock-compile [-d dir] [-c] [list.dat ...]\n" );
+        exit( -1 );
+    }
+  }
+
+  if( optind < argc )
+  {
+    for( i = optind; i < argc; i++ )
+      failed |= compile_list( argv[i], check );
+    return( failed ? 1 : 0 );
+  }
+
+  snprintf( whitePath, sizeof( whitePath ), "%s/whitelist.dat", dir );
+  snprintf( blackPath, sizeof( blackPath ), "%s/blacklist.dat", dir );
+  if( access( whitePath, F_OK ) == 0 )
+    failed |= compile_list( whitePath, check );
+  failed |= compile_list( blackPath, check );
+  return( failed ? 1 : 0 );
+}  /* end main */
+
+//
+// Compile (or check) one list. Returns 0 or -1.
+//
+static int compile_list( const char *path, bool check )
+{  /* Begin compile_list */
+  char image[FILE_PATH_MAX], name[FILE_PATH_MAX];
+  struct match_list *ml;
+  const char *why;
+  struct timeval t0, t1;
+
+  // "blacklist" for blacklist.dat, as jcblock names it in messages
+  snprintf( name, sizeof( name ), "%s", strrchr( path, '/' ) ? strrchr( path, '/' ) + 1 : path );
+  if( strlen( name ) > 4 && strcmp( name + strlen( name ) - 4, ".dat" ) == 0 )
+    name[strlen( name ) - 4] = 0;
+  list_image_path( path, image, sizeof( image ) );
+
+  if( check )
+  {
+    gettimeofday( &t0, NULL );
+    ml = map_list_image( path, name, &why );
+    gettimeofday( &t1, NULL );
+    if( ml == NULL )
+    {
+      printf( "%s: not usable (%s)\n", image, why );
+      return( -1 );
+    }
+    printf( "%s: %d entries, %ld KB, mapped and checked in %ld usec\n", image, ml->nrules,
+            (long)( ml->imageLen / 1024 ),
+            ( t1.tv_sec - t0.tv_sec ) * 1000000L + ( t1.tv_usec - t0.tv_usec ) );
+    free_list( ml );
+    return( 0 );
+  }
+
+  errno = 0;
+  if( ( ml = load_list( path, name ) ) == NULL )
+  {
+    fprintf( stderr, "%s: %s\n", path, errno ? strerror( errno ) : "out of memory" );
+    return( -1 );
+  }
+  if( ml->partial || list_changed( ml ) )
+  {
+    fprintf( stderr, "%s: file is being written (or its last line has no newline)\n", path );
+    free_list( ml );
+    return( -1 );
+  }
+  if( write_list_image( ml, image ) != 0 )
+  {
+    fprintf( stderr, "%s: write failed: %s\n", image, strerror( errno ) );
+    free_list( ml );
+    return( -1 );
+  }
+  printf( "%s: %d entries compiled to %s\n", path, ml->nrules, image );
+  free_list( ml );
+  return( 0 );
+}  /* end compile_list */
+
+//
+// Messages from lists.c go to stderr.
+//
+int log_info( char *command )
+{  /* Begin log_info */
+  fputs( command, stderr );
+  return( 0 );
+}  /* end log_info */
+
+int log_debug_info( char *command )
+{  /* Begin log_debug_info */
+  fprintf( stderr, "%s\n", command );
+  return( 0 );
+}  /* end log_debug_info */
@@ -19,12 +19,12 @@ You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
 Description:
 A program to block telemarketing (junk) calls. This program connects to a serial
 port modem and listens for the caller ID string that is sent between the first
-and second rings. It records the string in file callerID.dat. It then reads 
-strings from file whitelist.dat and scans them against the caller ID string for
-a match. If it finds a match it accepts the call. If a match is not found, it
-reads strings from file blacklist.dat and scans them against the caller ID
-string for a match. If it finds a match to a string in the blacklist,  it sends
-modem commands that terminate the junk call. For more details, see README file.
+and second rings. It records the call in the history directory (history.c). The strings in
+files whitelist.dat and blacklist.dat are read once (and again, in the
+background, whenever a file is edited) into automatons that scan a caller ID string for all of them in one
+pass. If a whitelist string matches it accepts the call. If not, and a string in
+the blacklist matches, it sends modem commands that terminate the junk call.
+For more details, see README file.
 */
 
 #include <stdio.h>
@@ -36,245 +36,500 @@ modem commands that terminate the junk call. For more details, see README file.
 #include <termios.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
-typedef int bool;
-
-#ifndef TRUE
-  #define TRUE 1
-  #define FALSE 0
-#endif
-
-FILE *fpCa;                // callerID.dat file
-FILE *fpBl;               // blacklist.dat file
+#include "common.h"
 
 #define OUTPUT_TO_LOG  // will send printf output to jcblock.log
 
 #define OPEN_PORT_BLOCKED 1
 #define OPEN_PORT_POLLED  0
 
-#define DEBUG
-
 // Default serial port specifier.
-char *serialPort = "/dev/ttyACM0";
-int fd;                                  // the serial port
+#define DEFAULT_SERIAL_PORT "/dev/ttyACM0"
+
+// One phone line: a modem on its own serial port. Between calls the port is
+// in OPEN_PORT_POLLED mode and is watched by the event loop; the end of a
+// caller ID string is found with a per-line timer instead of VTIME.
+#define MAX_MODEMS      16
+#define STRING_GAP_MSEC 100    // a frame with no character for this long is complete
+
+// Modem commands are sent by a per-line state machine driven by the event
+// loop: the next step starts as soon as the modem answers OK (or ERROR), and
+// the step's timeout is only the fallback when no answer comes.
+#define STEP_END      0
+#define STEP_COMMAND  1        // send a command, wait for OK or ERROR
+#define STEP_DTR      2        // drop DTR for timeoutMsec, then raise it
+
+struct modem_step
+{
+  int   type;
+  char *command;
+  int   timeoutMsec;
+  bool  required;              // the sequence fails if this step gets no OK
+};
+
+#define MODEM_IDLE     0       // waiting for RING / caller ID strings
+#define MODEM_COMMAND  1       // running a command sequence
+#define MODEM_DOWN     2       // modem did not initialize; line out of service
+
+#define DTR_HOLD_MSEC  250
+
+struct modem
+{
+  char  *serialPort;           // from -p
+  int    fd;                   // the serial port (-1 if not open)
+  int    timerFd;              // inter-character and command timer
+  bool   modemInitialized;
+  int    state;
+  const struct modem_step *step;   // current step of the running sequence
+  struct timespec stepStart;   // when the current step was started
+  struct timespec seqStart;    // when the running sequence was started
+  struct timespec stringStart; // when the first character of a string came
+  struct timespec hangupDone;  // when ATH0 was answered
+  char   response[128];        // partial response line
+  int    responseLen;
+  struct cid_parser cid;       // caller ID being received
+  long   parseUsec;            // time spent parsing the current frame
+  bool   early;                // terminated on the number; frame still coming
+  struct timespec earlyAt;     // when the hang-up was started
+  struct caller_id earlyCid;   // the fields of that frame parsed so far
+  struct fsk_demod fsk;        // -v: the caller ID decoded from the audio
+  bool   dle;                  // -v: the last byte was a DLE
+  struct dtmf_detector dtmf;   // keys pressed on the line (-v or -t)
+  char   starToken[LIST_TERM_MAX + 1];  // the last caller accepted, for the star key
+  char   starDate[20];         // and the date of the call
+  struct timespec lastRing;    // of that call
+  struct timeval logStart;     // 'start' of the log timing of this line
+};
+
+// The event loop pointer of the -t sound command has this bit set
+#define SOUND_TAG      4UL
+
+// Initialize the modem. Reset it, make it terminate a call when its serial
+// port DTR line goes inactive (this is used to terminate a call found on the
+// blacklist; with some modems, "AT&D3\r" may be needed) and tell it to return
+// caller ID. Note: different modems use different commands for caller ID. If
+// this command fails, try these others: AT#CID=1,  AT#CLS=8#CID=1, AT#CID=2,
+// AT%CCID=1, AT%CCID=2,  AT#CC1,  AT*ID1 or check modem documentation.
+static const struct modem_step initSteps[] =
+{
+  { STEP_COMMAND, "AT\r",         1000, TRUE },
+  { STEP_COMMAND, "ATZ\r",        3000, TRUE },
+  { STEP_COMMAND, "AT&D2\r",      1000, TRUE },
+  { STEP_COMMAND, "AT+VCID=1\r",  1000, TRUE },
+  { STEP_END,     NULL,             0,    FALSE }
+};
+
+// Terminate a call: off hook (ATH1) and on hook (ATH0). Then drop DTR, which
+// returns the modem to command mode, and initialize it again for the next call.
+static const struct modem_step hangupSteps[] =
+{
+  { STEP_COMMAND, "ATH1\r",        1000, FALSE },
+  { STEP_COMMAND, "ATH0\r",        1000, FALSE },
+  { STEP_DTR,     NULL,  DTR_HOLD_MSEC, FALSE },
+  { STEP_COMMAND, "AT\r",          1000, FALSE },
+  { STEP_COMMAND, "ATZ\r",         3000, FALSE },
+  { STEP_COMMAND, "AT&D2\r",       1000, FALSE },
+  { STEP_COMMAND, "AT+VCID=1\r",   1000, FALSE },
+  { STEP_END,     NULL,             0,    FALSE }
+};
+
+// With -v the modem is put in voice mode instead and sends the line audio
+// (AT+VRX; answered with CONNECT): 8000 samples a second of 8 bit unsigned
+// linear PCM (AT+VSM=1,8000; AT+VSM=? lists what a modem supports, some
+// call this format 128). jcblock decodes the caller ID itself (fsk.c).
+// Not every voice modem sends audio while the line is on hook.
+static const struct modem_step voiceInitSteps[] =
+{
+  { STEP_COMMAND, "AT\r",          1000, TRUE },
+  { STEP_COMMAND, "ATZ\r",         3000, TRUE },
+  { STEP_COMMAND, "AT&D2\r",       1000, TRUE },
+  { STEP_COMMAND, "AT+FCLASS=8\r", 1000, TRUE },
+  { STEP_COMMAND, "AT+VSM=1,8000\r", 1000, TRUE },
+  { STEP_COMMAND, "AT+VRX\r",      1000, TRUE },
+  { STEP_END,     NULL,             0,    FALSE }
+};
+
+// DLE ! ends the audio before the modem takes commands again
+static const struct modem_step voiceHangupSteps[] =
+{
+  { STEP_COMMAND, "\x10!",          1000, FALSE },
+  { STEP_COMMAND, "ATH1\r",        1000, FALSE },
+  { STEP_COMMAND, "ATH0\r",        1000, FALSE },
+  { STEP_DTR,     NULL,  DTR_HOLD_MSEC, FALSE },
+  { STEP_COMMAND, "AT\r",          1000, FALSE },
+  { STEP_COMMAND, "ATZ\r",         3000, FALSE },
+  { STEP_COMMAND, "AT&D2\r",       1000, FALSE },
+  { STEP_COMMAND, "AT+FCLASS=8\r", 1000, FALSE },
+  { STEP_COMMAND, "AT+VSM=1,8000\r", 1000, FALSE },
+  { STEP_COMMAND, "AT+VRX\r",      1000, FALSE },
+  { STEP_END,     NULL,             0,    FALSE }
+};
+
+static const struct modem_step *initSequence = initSteps;
+static const struct modem_step *hangupSequence = hangupSteps;
+
+static struct modem modems[MAX_MODEMS];
+static int numModems;
+static int epollFd = -1;
+static int signalFd = -1;
+
+// Files (see common.h); set_data_dir() points them to another directory
+char listDir[FILE_PATH_MAX]       = DEFAULT_DIR;
+char callerIDFile[FILE_PATH_MAX]  = DEFAULT_DIR "/callerID.dat";
+char whitelistFile[FILE_PATH_MAX] = DEFAULT_DIR "/whitelist.dat";
+char blacklistFile[FILE_PATH_MAX] = DEFAULT_DIR "/blacklist.dat";
+char logFile[FILE_PATH_MAX]       = DEFAULT_DIR "/jcblock.log";
+char statsFile[FILE_PATH_MAX]     = DEFAULT_DIR "/jcblock.prom";
+char historyDir[FILE_PATH_MAX]    = DEFAULT_DIR "/history";
+char hitLogFile[FILE_PATH_MAX]    = DEFAULT_DIR "/hits.log";
+char hitsFile[FILE_PATH_MAX]      = DEFAULT_DIR "/hits.dat";
+char controlSocket[FILE_PATH_MAX] = DEFAULT_DIR "/jcblock.sock";
+char warmFile[FILE_PATH_MAX]      = DEFAULT_DIR "/jcblock.warm";
 
-FILE *fpWh;                              // whitelist.dat file
 static struct termios options;
-static time_t pollTime, pollStartTime;
-static bool modemInitialized = FALSE;
 static bool inBlockedReadCall = FALSE;
 static int numRings;
+static bool autoBlock = FALSE;   // -a: callers that call too often are blacklisted
+static bool voiceMode = FALSE;   // -v: decode the caller ID from the audio
+static char *soundCommand;       // -t: prints the audio of the first line
+static FILE *soundPipe;
+static int starWindow = 60;      // -w: seconds after the last ring the star key counts
+static unsigned char soundOdd;   // the first byte of a sample split between two reads
+static bool soundSplit = FALSE;
+
+// Startup: the lists are loaded while the modems are initialized
+static struct timespec processStart;
+static int listsEvent;           // its address is the event loop pointer of the load
+static bool listsLoaded = FALSE;
+static bool startupDone = FALSE; // the time until ready was logged
+static long listsUsec, modemsUsec;
+static char warmSummary[128];
 
 // Prototypes
 static void cleanup( int signo );
-int send_modem_command(int fd, char *command );
-static bool check_blacklist( char *callstr );
-static bool check_whitelist( char * callstr );
-static void open_port( int mode );
-static void close_open_port();
-int init_modem(int fd );
-struct timeval start, end;
-long mtime, seconds, useconds;    
-
+int send_modem_command( struct modem *m, char *command );
+static bool check_blacklist( struct modem *m, const struct match_list *blacklist, int rule, char *callstr );
+static bool check_whitelist( const struct match_list *whitelist, int rule, char *callstr );
+static bool check_velocity( struct modem *m, const struct caller_id *cid, const char *date, time_t now );
+static int open_port( struct modem *m, int mode );
+static void set_port_mode( struct modem *m, int mode );
+static int watch_port( struct modem *m );
+static void close_open_port( struct modem *m );
+static void read_modem( struct modem *m );
+static void read_voice( struct modem *m, const unsigned char *data, int nbytes );
+static int start_sound( struct modem *m );
+static void read_sound( struct modem *m );
+static void line_audio( struct modem *m, const int16_t *samples, int n );
+static void star_key( struct modem *m );
+static void frame_gap( struct modem *m );
+static void process_caller_id( struct modem *m );
+static bool early_decision( struct modem *m );
+static void early_bytes( struct modem *m, const char *data, int nbytes );
+static void early_frame( struct modem *m, bool complete );
+static void first_lists( void );
+static void check_ready( void );
+static void start_sequence( struct modem *m, const struct modem_step *steps );
+static void run_step( struct modem *m );
+static void step_done( struct modem *m, bool ok, const char *how );
+static void read_response( struct modem *m, char *data, int nbytes );
+static void set_timer( struct modem *m, int msec );
+static long msec_since( const struct timespec *then );
+static long usec_since( const struct timespec *then );
+static int set_data_dir( const char *dir );
+int wait_for_response( void );
 FILE *stdoutStream ;
 
 static char *copyright = "Running jcblock\n";
 
-//
-//  Log a command to the output
-//
-int log_debug_info(char *command )
-{  /* Begin log_debug_info */
-  time_t now = time(NULL);
-  struct tm *now_tm = localtime(&now);
-  char iso_8601[] = "YYYY-MM-DDTHH:MM:SS";
-
-#ifdef DEBUG
-  gettimeofday(&end, NULL);
-  seconds  = end.tv_sec  - start.tv_sec;
-  useconds = end.tv_usec - start.tv_usec;
-  mtime = ((seconds) * 1000 + useconds/1000.0);
-
-  now_tm = localtime(&now);
-  strftime(iso_8601, sizeof (iso_8601), "%FT%R:%S", now_tm);
-  printf("%s %12ld msec %s\n",iso_8601,mtime,command) ;
-  
-#ifdef OUTPUT_TO_LOG
-  // Flush anything in stdout (needed if stdout is redirected to a disk file).
-  fflush(stdout);     // flush C library buffers to kernel buffers
-  sync();             // flush kernel buffers to disk
-#endif
-#endif
-// use start=end ; to time event
-}  /* end   log_debug_info */
-
-
-int log_info(char *command )
-{  /* Begin log_info */
-  time_t now = time(NULL);
-  struct tm *now_tm = localtime(&now);
-  char iso_8601[] = "YYYY-MM-DDTHH:MM:SS";
-
-  gettimeofday(&end, NULL);
-  seconds  = end.tv_sec  - start.tv_sec;
-  useconds = end.tv_usec - start.tv_usec;
-  mtime = ((seconds) * 1000 + useconds/1000.0);
-  now_tm = localtime(&now);
-  strftime(iso_8601, sizeof (iso_8601), "%FT%R:%S", now_tm);
-  printf("%s %12ld msec %s",iso_8601,mtime,command) ;
-
-#ifdef OUTPUT_TO_LOG
-  // Flush anything in stdout (needed if stdout is redirected to a disk file).
-  fflush(stdout);     // flush C library buffers to kernel buffers
-  sync();             // flush kernel buffers to disk
-#endif
-}  /* end   log_info */
-
 //
 // Main function
 //
 int main(int argc, char **argv)
 { /* Begin main */
   int optChar;
-  time_t now = time(NULL);
-  struct tm *now_tm = localtime(&now);
-  char iso_8601[] = "YYYY-MM-DDTHH:MM:SS";  
+  int level = LOG_DEBUG;
+  int syncInterval = 0;
+  int statsInterval = 10;
+  int i, ready;
+  char message[256];
+  const char *numberLimit = "4/60", *sprayLimit = "3/60";
+  sigset_t mask;
+
+  // Each -p names the serial port of one phone line. -l sets the log
+  // level (info or debug) and -s how often (in seconds) jcblock.log is
+  // synced to disk; by default only when the program terminates. -d
+  // names the directory of the .dat files and jcblock.log (an absolute
+  // path; used with modemsim, for example). -S sets how often (in seconds)
+  // the statistics are written to jcblock.prom; 0 turns that off. -r
+  // (calls/minutes) sets when a number on neither list calls too often
+  // and -R (numbers/minutes) when a name calls from too many neighbouring
+  // numbers; -a adds such callers to the blacklist instead of only
+  // logging them. -v puts the modems in voice mode and decodes the caller
+  // ID from the line audio. -t names a command that prints the audio of
+  // the first line whose port opens (such as arecord with a microphone
+  // near the modem speaker; with -v the modem's audio is used). Pressing the star key
+  // within -w seconds of the last ring of an accepted call (0 turns this
+  // off) adds the caller to the blacklist. "history ...", "report ...",
+  // "import ...", "hits ...", "control ...", "decode ..." or "tones ..."
+  // after the options runs that command instead.
+  while( ( optChar = getopt( argc, argv, "+p:l:s:d:S:ar:R:vt:w:" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 't':
+        soundCommand = optarg;
+        break;
+      case 'w':
+        starWindow = atoi( optarg );
+        break;
+      case 'a':
+        autoBlock = TRUE;
+        break;
+      case 'v':
+        voiceMode = TRUE;
+        initSequence = voiceInitSteps;
+        hangupSequence = voiceHangupSteps;
+        break;
+      case 'r':
+        numberLimit = optarg;
+        break;
+      case 'R':
+        sprayLimit = optarg;
+        break;
+      case 'S':
+        statsInterval = atoi( optarg );
+        break;
+      case 'd':
+        if( set_data_dir( optarg ) != 0 )
+        {
+          fprintf( stderr, "%s: directory name too long\n", argv[0] );
+          exit( -1 );
+        }
+        break;
+      case 'l':
+        if( strcmp( optarg, "info" ) == 0 )
+          level = LOG_INFO;
+        else if( strcmp( optarg, "debug" ) == 0 )
+          level = LOG_DEBUG;
+        else
+        {
+          fprintf( stderr, "%s: log level must be info or debug\n", argv[0] );
+          exit( -1 );
+        }
+        break;
+      case 's':
+        syncInterval = atoi( optarg );
+        break;
+      case 'p':
+        if( numModems == MAX_MODEMS )
+        {
+          fprintf( stderr, "%s: at most %d serial ports\n", argv[0], MAX_MODEMS );
+          exit( -1 );
+        }
+        modems[numModems++].serialPort = optarg;
+        break;
+      default:
+        fprintf( stderr, "Usage: %s [-p serial-port]... [-l info|debug] [-s sync-seconds] [-d directory] [-S stats-seconds]\n"
+                         "       [-a] [-r calls/minutes] [-R numbers/minutes] [-v] [-t sound-command] [-w seconds]\n", argv[0] );
+        fprintf( stderr, "       %s [-d directory] history import|export ...\n", argv[0] );
+        fprintf( stderr, "       %s [-d directory] report ...\n", argv[0] );
+        fprintf( stderr, "       %s [-d directory] import [-c column] [-m comment] [-j threads] [-n] file...\n", argv[0] );
+        fprintf( stderr, "       %s [-d directory] hits [-c] [-b YYYY-MM-DD]\n", argv[0] );
+        fprintf( stderr, "       %s [-d directory] control command...\n", argv[0] );
+        fprintf( stderr, "       %s decode [-k kernel] file.wav...\n", argv[0] );
+        fprintf( stderr, "       %s tones [-k kernel] file.wav...\n", argv[0] );
+        exit( -1 );
+    }
+  }
+  if( optind < argc && strcmp( argv[optind], "history" ) == 0 )
+    exit( history_command( argc - optind, argv + optind ) );
+  if( optind < argc && strcmp( argv[optind], "report" ) == 0 )
+    exit( report_command( argc - optind, argv + optind ) );
+  if( optind < argc && strcmp( argv[optind], "import" ) == 0 )
+    exit( import_command( argc - optind, argv + optind ) );
+  if( optind < argc && strcmp( argv[optind], "hits" ) == 0 )
+    exit( hits_command( argc - optind, argv + optind ) );
+  if( optind < argc && strcmp( argv[optind], "control" ) == 0 )
+    exit( control_command( argc - optind, argv + optind ) );
+  if( optind < argc && strcmp( argv[optind], "decode" ) == 0 )
+    exit( decode_command( argc - optind, argv + optind ) );
+  if( optind < argc && strcmp( argv[optind], "tones" ) == 0 )
+    exit( tones_command( argc - optind, argv + optind ) );
+  if( velocity_limits( numberLimit, sprayLimit ) != 0 )
+  {
+    fprintf( stderr, "%s: -r and -R take calls/minutes (at least 2 calls), or 0\n", argv[0] );
+    exit( -1 );
+  }
+  if( numModems == 0 )
+    modems[numModems++].serialPort = DEFAULT_SERIAL_PORT;
+  for( i = 0; i < numModems; i++ )
+  {
+    modems[i].fd = -1;
+    modems[i].timerFd = -1;
+    dtmf_init( &modems[i].dtmf );
+  }
 
-  // Set Ctrl-C and kill terminator signal catchers
-  signal( SIGINT, cleanup );
-  signal( SIGKILL, cleanup );
+  // Ctrl-C and kill are handled as events of the loop. Block them before
+  // any thread is started so that no thread catches them on its own.
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  sigprocmask( SIG_BLOCK, &mask, NULL );
 
+  clock_gettime( CLOCK_MONOTONIC, &processStart );
   gettimeofday(&start, NULL);
   end=start;
 
   // If jcblock called from cron BE SURE TO USE ABSOLUTE PATHS FOR <ANY> FILES THAT ARE OPENED
 #ifdef OUTPUT_TO_LOG
-if((stdoutStream = freopen("/home/pi/jcblock/jcblock.log", "a+", stdout)) == NULL)
+if((stdoutStream = freopen(LOG_FILE, "a+", stdout)) == NULL)
   exit(-1);
 #endif
 
+  // Start the thread that writes log messages to the file
+  if( log_start( level, syncInterval ) != 0 )
+    exit(-1);
+
   // Display copyright notice
   log_info(copyright);
 
-  // Open or create a file to append caller ID strings to
+  // Start the thread that writes the statistics
+  if( stats_start( statsInterval ) != 0 )
+    log_debug_info("pthread_create() of statistics writer failed");
+
+  // Open (or create) the call history and start the thread that
+  // writes to it
   start=end ;
-  if( (fpCa = fopen( "/home/pi/jcblock/callerID.dat", "a+" ) ) == NULL )
+  if( persist_start() != 0 )
   {
-    log_debug_info("fopen() of callerID.dat failed");
-    return;
+    log_debug_info("open of the call history failed");
+    return(-1);
   }
 
-  // Open the whitelist file (for reading & writing)
+  // Read the whitelist and blacklist files, build their automatons and
+  // start watching the files for edits, on the watcher thread while the
+  // modems are initialized below. A whitelist is not required.
   start=end ;
-  if( (fpWh = fopen( "/home/pi/jcblock/whitelist.dat", "r+" ) ) == NULL )
+  if( start_list_watcher() != 0 )
   {
-    log_debug_info("fopen() of whitelist.dat failed. A whitelist is not required." );
+    log_debug_info("start of the list watcher failed");
+    return(-1);
   }
 
-  // Open the blacklist file (for reading & writing)
-  start=end ;
-  if( (fpBl = fopen( "/home/pi/jcblock/blacklist.dat", "r+" ) ) == NULL )
+  if( ( epollFd = epoll_create1( EPOLL_CLOEXEC ) ) < 0 )
   {
-    log_debug_info("fopen() of blacklist.dat failed. A blacklist must exist." );
-    return;
+    log_debug_info("epoll_create1() failed");
+    return(-1);
   }
 
-  // Open the serial port
-  open_port( OPEN_PORT_BLOCKED );
-
-  // Initialize the modem
-  start=end ;
-  if( init_modem( fd ) != 0 )
-  {
-    log_debug_info("init_modem() failed");
-    close(fd);
-    fclose(fpCa);
-    fclose(fpBl);
-    fclose(fpWh);
-    fflush(stdout);
-#ifdef OUTPUT_TO_LOG
-    fclose(stdoutStream) ;
-#endif	
-    fflush(stdout);
-    sync();
-    return;
+  // The event loop learns when the lists are loaded
+  {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listsEvent;
+    epoll_ctl( epollFd, EPOLL_CTL_ADD, lists_wait_fd(), &ev );
   }
 
-  modemInitialized = TRUE;
-
-  // Wait for calls to come in and process the calls...
-  wait_for_response(fd);
+  // Open the serial ports and start initializing the modems (the event
+  // loop runs the command sequences). A line whose modem does not respond
+  // is taken out of service; at least one must work.
+  ready = 0;
+  for( i = 0; i < numModems; i++ )
+  {
+    struct modem *m = &modems[i];
 
-  close( fd );
-  fclose(fpCa);
-  fclose(fpBl);
-  fclose(fpWh);
-  fflush(stdout);
-#ifdef OUTPUT_TO_LOG
-  fclose(stdoutStream) ;
-#endif	
-  sync();
-}  /* end main */
+    if( open_port( m, OPEN_PORT_POLLED ) != 0 )
+      continue;
 
-//
-// Initialize the modem.
-//
-int init_modem(int fd)
-{  /* Begin init_modem */
+    if( ( m->timerFd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC ) ) < 0 ||
+        watch_port( m ) != 0 )
+    {
+      log_debug_info("timerfd/epoll setup failed");
+      cleanup( 0 );
+    }
+    start_sequence( m, initSequence );
+    m->logStart = start;
+    ready++;
+  }
 
-  // Reset the modem
-  start=end ;
-  if( send_modem_command(fd, "AT\r") != 0 )
+  if( ready == 0 )
   {
-    log_debug_info("send_modem_command AT failed") ;
+    sprintf( message, "no serial port could be opened" );
+    log_debug_info( message );
+    control_stop();
+    persist_drain();
     return(-1);
   }
-  
-  if( send_modem_command(fd, "ATZ\r") != 0 )
+
+  // The sound of the first line that opened, for the star key
+  for( i = 0; soundCommand != NULL && modems[i].fd < 0; i++ )
+    ;
+  if( soundCommand != NULL && start_sound( &modems[i] ) != 0 )
+    log_debug_info("the sound command could not be started; no star key");
+  else if( soundCommand != NULL )
   {
-    log_debug_info("send_modem_command ATZ failed") ;
-    return(-1);
+    sprintf( message, "%s: the star key is heard on this line", modems[i].serialPort );
+    log_debug_info( message );
   }
 
-  usleep(100000);
-  log_debug_info("send modem AT, send modem ATZ, usleep 100000");
-
-  start=end ;
-  // Initialize the modem to terminate a call when its serial port DTR line goes
-  // inactive. DTR goes inactive when the connection to its serial port is closed.
-  // This will be used to terminate a call found on the blacklist
-  // (with some modems, "AT&D3\r" may be needed).
-  if( send_modem_command(fd, "AT&D2\r") != 0 )
+  // From here on Ctrl-C and kill are events of the loop
+  if( ( signalFd = signalfd( -1, &mask, SFD_CLOEXEC ) ) >= 0 )
   {
-    log_debug_info("send_modem_command AT&D2 failed");
-    return(-1);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl( epollFd, EPOLL_CTL_ADD, signalFd, &ev );
   }
 
-  // Tell modem to return caller ID Note: different modems use different commands
-  // here. If this command hangs the program, try these others: AT#CID=1,  AT#CLS=8#CID=1,
-  // AT#CID=2,  AT%CCID=1, AT%CCID=2,  AT#CC1,  AT*ID1 or check modem documentation.
-  start=end ;
-  if( send_modem_command(fd, "AT+VCID=1\r") != 0 )
-  {
-    log_debug_info("send_modem_command AT+VCID=1 failed");
+  // Wait for calls to come in and process the calls...
+  wait_for_response();
+
+  cleanup( 0 );
+  return(0);
+}  /* end main */
+
+//
+// Keep the data files and the log in dir instead of DEFAULT_DIR.
+// Returns 0 or -1 if a path would be too long.
+//
+static int set_data_dir( const char *dir )
+{  /* Begin set_data_dir */
+  if( strlen( dir ) + sizeof( "/whitelist.dat" ) > FILE_PATH_MAX )
     return(-1);
-  }
-  usleep(100000);
-  log_debug_info("send modem AT&DT, send modem AT+VCID=1, usleep 100000");
-  
+  strcpy( listDir, dir );
+  sprintf( callerIDFile,  "%s/callerID.dat",  dir );
+  sprintf( whitelistFile, "%s/whitelist.dat", dir );
+  sprintf( blacklistFile, "%s/blacklist.dat", dir );
+  sprintf( logFile,       "%s/jcblock.log",   dir );
+  sprintf( statsFile,     "%s/jcblock.prom",  dir );
+  sprintf( historyDir,    "%s/history",       dir );
+  sprintf( hitLogFile,    "%s/hits.log",      dir );
+  sprintf( hitsFile,      "%s/hits.dat",      dir );
+  sprintf( controlSocket, "%s/jcblock.sock",  dir );
+  sprintf( warmFile,      "%s/jcblock.warm",  dir );
   return(0);
-} /* end init_modem */
+}  /* end set_data_dir */
 
 //
-// Send command string to the modem
+// Send command string to the modem and wait for its OK (used when the event
+// loop is not running). The port is switched to blocked reads for the
+// duration of the command.
 //
-int send_modem_command(int fd, char *command )
+int send_modem_command( struct modem *m, char *command )
 {  /* Begin send_modem_command */
   char buffer[255];     // Input buffer
   char *bufptr;         // Current char in buffer
   int nbytes;           // Number of bytes read
   int tries;            // Number of tries so far
-  int i;
+  int fd = m->fd;
+
+  set_port_mode( m, OPEN_PORT_BLOCKED );
 
   // Send command
   if( write(fd, command, strlen(command) ) != strlen(command) )
@@ -302,528 +557,969 @@ int send_modem_command(int fd, char *command )
     // Scan for string "OK"
     if( strstr( buffer, "OK" ) != NULL )
     {
+      if( m->timerFd >= 0 )
+        set_port_mode( m, OPEN_PORT_POLLED );
       return( 0 );
     }
   }
   log_debug_info("did not get command OK");
+  if( m->timerFd >= 0 )
+    set_port_mode( m, OPEN_PORT_POLLED );
   return( -1 );
 }  /* end send_modem_command */
 
 
 //
-// Wait (forever!) for calls...
+// Wait (forever!) for calls on all lines...
 //
-int wait_for_response(fd)
+int wait_for_response( void )
 { //Begin of wait_for_response
-  char buffer[255];     // Input buffers
-  char callerIDentry[255];
-  char bufferString[128];
-  int nbytes;           // Number of bytes read
-  int i, j;
-  int  cch = '-';
-  char *callID, *callNumber ;
-  char *p1callID, *p2callID ;
-  char *p1N, *p2N ;
-
-  time_t now = time(NULL);
-  struct tm *now_tm = localtime(&now);
-  char iso_8601[] = "YYYY-MM-DDTHH:MM:SS";  
+  struct epoll_event events[MAX_MODEMS * 2 + 1];
+  struct signalfd_siginfo si;
+  struct modem *m;
+  uint64_t expirations;
+  int n, i;
 
   log_info("Waiting for a call ...\n") ;
 
-  // Get a string of characters from the modem
   while(1)
   {
-    start=end ;
-    // Flush anything in stdout (needed if stdout is redirected to a disk file).
-    fflush(stdout);     // flush C library buffers to kernel buffers
-    sync();             // flush kernel buffers to disk
-    log_info("Waiting for modem event ...\n") ;
-
-    // Block until at least one character is available. After first character is
-    // received, continue reading characters until inter-character timeout
-    // (VTIME) occurs (or VMIN characters are received, which shouldn't happen,
-    // since VMIN is set larger than the longest string expected).
-
-    inBlockedReadCall = TRUE;
-    nbytes = read( fd, buffer, 250 );
-    inBlockedReadCall = FALSE;
-    start=end ;
-
-    sprintf(bufferString,"received %d buffer bytes",nbytes) ;
-    log_debug_info(bufferString);
-
-    // Occasionally a call comes in that has a caller ID field that is too long
-    // Truncate it to the standard length (15 chars):
-    if( nbytes > 81 )
+    if( ( n = epoll_wait( epollFd, events, MAX_MODEMS * 2 + 1, -1 ) ) < 0 )
     {
-      nbytes = 81;
-      buffer[79] = '\r';
-      buffer[80] = '\n';
-      buffer[81] = 0;
-      log_debug_info("Truncated buffer because > 81 bytes");
+      if( errno == EINTR )
+        continue;
+      log_debug_info("epoll_wait() failed");
+      return(-1);
     }
-    start=end;
 
-    // Replace '\n' and '\r' characters with '-' characters
-    for( i = 0; i < nbytes; i++ )
+    for( i = 0; i < n; i++ )
     {
-      if( ( buffer[i] == '\n' ) || ( buffer[i] == '\r' ) )
+      // Ctrl-C or kill
+      if( events[i].data.ptr == NULL )
       {
-        buffer[i] = '-';
+        if( read( signalFd, &si, sizeof( si ) ) == sizeof( si ) )
+          cleanup( si.ssi_signo );
+        continue;
       }
-    }
 
-    // Put a '\n' at buffer end and null-terminate it
-    buffer[nbytes] = '\n';
-    buffer[nbytes + 1] = 0;
-    log_debug_info(buffer) ;
+      // The first lists are loaded (or could not be)
+      if( events[i].data.ptr == &listsEvent )
+      {
+        if( read( lists_wait_fd(), &expirations, sizeof( expirations ) ) > 0 )
+          epoll_ctl( epollFd, EPOLL_CTL_DEL, lists_wait_fd(), NULL );
+        first_lists();
+        continue;
+      }
 
-    // A string was received. If its a 'RING' string, just ignore it.
-    if( strstr( buffer, "RING" ) != NULL )
-    {
-      continue;
-    }
+      // A command on the control socket
+      if( (unsigned long)events[i].data.ptr & CONTROL_TAG )
+      {
+        control_event( (void *)( (unsigned long)events[i].data.ptr & ~CONTROL_TAG ) );
+        continue;
+      }
 
-    // Ignore a string "AT+VCID=1" returned from the modem.
-    if( strncmp( buffer, "AT+VCID=1", 9 ) == 0 )
-    {
-      continue;
-    }
+      // The audio of the -t command
+      if( (unsigned long)events[i].data.ptr & SOUND_TAG )
+      {
+        m = (struct modem *)( (unsigned long)events[i].data.ptr & ~SOUND_TAG );
+        start = m->logStart;
+        read_sound( m );
+        m->logStart = start;
+        continue;
+      }
 
-    // Caller ID data was received after the first ring.
-    numRings = 1;
+      // The low bit of the pointer tells the timer from the serial port.
+      // Each line keeps its own log timing ('start'), as calls on two
+      // lines interleave here.
+      m = (struct modem *)( (unsigned long)events[i].data.ptr & ~1UL );
+      start = m->logStart;
+      if( (unsigned long)events[i].data.ptr & 1UL )
+      {
+        if( read( m->timerFd, &expirations, sizeof( expirations ) ) <= 0 )
+          continue;
+        if( m->state == MODEM_COMMAND )
+          step_done( m, m->step->type == STEP_DTR, "timeout" );
+        else if( m->state == MODEM_IDLE )
+          frame_gap( m );
+      }
+      else
+      {
+        read_modem( m );
+      }
+      m->logStart = start;
+    }
+  }
+} // End of wait_for_response
 
-    //  Create a caller ID string
+//
+// Once the first lists are loaded: take back the warm state of the last
+// jcblock and start the control socket. A call that comes in before the
+// event loop learns of the lists waits for them here.
+//
+static void first_lists( void )
+{  /* Begin first_lists */
+  if( listsLoaded )
+    return;
+  if( lists_wait() != 0 )
+  {
+    log_debug_info("load of blacklist.dat failed. A blacklist must exist." );
+    cleanup( 0 );
+  }
+  listsLoaded = TRUE;
+  listsUsec = usec_since( &processStart );
+  warm_load( warmSummary, sizeof( warmSummary ) );
 
-    // Create callTime from current time
-    now = time(NULL);
-    now_tm = localtime(&now);
-    strftime(iso_8601, sizeof (iso_8601), "%FT%R", now_tm);
+  // Other programs edit the lists through the control socket (served by
+  // the event loop); jcblock works without it
+  control_start( epollFd );
+  check_ready();
+}  /* end first_lists */
 
-    const char *NAME = strstr(buffer, "NAME")+7;
-    const char *NMBR = strstr(buffer, "NMBR")+7;
-    size_t p1 = NAME-NMBR;
-    size_t p2 = NMBR-NAME;
-    
-/*  There are different caller ID strings with different order
---DATE = 1217--TIME = 1650--NMBR = 12345678901--NAME = WIRELESS CALLER--
---DATE = 1217--TIME = 2211--NAME = WIRELESS CALLER--NMBR = 12345678902--
-*/
+//
+// Log how long after the start jcblock was ready to block calls: the lists
+// loaded and every modem initialized (or out of service).
+//
+static void check_ready( void )
+{  /* Begin check_ready */
+  char message[256];
+  long usec;
+  int i;
 
-    if ((int)p1 < (int)p2) // --DATE = 1217--TIME = 2211--NAME = WIRELESS CALLER--NMBR = 12345678901--
-    {
-      p1callID = strstr(buffer, "NAME")+7;
-      p2callID = strstr(buffer, "NMBR")-2;
-      p1N = strstr(buffer, "NMBR")+7;
-      p2N = strrchr(buffer, cch)-1;
-    }
-    else //--DATE = 1217--TIME = 1650--NMBR = 17346349060--NAME = WIRELESS CALLER-
-    {
-      p1callID = strstr(buffer, "NAME")+7;
-      p2callID = strrchr(buffer, cch)-1;
-      p1N = strstr(buffer, "NMBR")+7;
-      p2N = strstr(buffer, "NAME")-2;
-    }
-    // set the caller ID name string callID and terminate it
-    size_t lencallID = p2callID-p1callID;
-    callID = (char*)malloc(sizeof(char)*(lencallID+1));
-    strncpy(callID, p1callID, lencallID);
-    callID[lencallID] = '\0';
-
-    // set the caller number string callNumber and terminate it
-    size_t lenN = p2N-p1N;
-    callNumber = (char*)malloc(sizeof(char)*(lenN+1));
-    strncpy(callNumber, p1N, lenN);
-    callNumber[lenN] = '\0';
-
-    // set the callIDentry, put '\n' at end and null-terminate it    
-    sprintf(callerIDentry,"%s|%s|%s|",iso_8601,callNumber,callID) ;
-    size_t lenID = strlen(callerIDentry);
-    callerIDentry[lenID] = '\n';
-    callerIDentry[lenID + 1] = 0;
-    log_info( callerIDentry );
-
-    // Close and re-open file 'callerID.dat' (in case it was
-    // edited while the program was running!).
-    start=end ;
-    fclose(fpCa);
-    if( (fpCa = fopen( "/home/pi/jcblock/callerID.dat", "a+" ) ) == NULL )
-    {
-      log_debug_info("re-fopen() of callerID.dat failed");
-      return(-1);
-    }
+  if( startupDone || !listsLoaded )
+    return;
+  for( i = 0; i < numModems; i++ )
+  {
+    if( modems[i].fd >= 0 && modems[i].state == MODEM_COMMAND )
+      return;
+  }
+  startupDone = TRUE;
+  usec = usec_since( &processStart );
+  snprintf( message, sizeof( message ),
+            "ready to block calls %ld msec after the start (lists %ld msec, modems %ld msec); %s\n",
+            usec / 1000, listsUsec / 1000, modemsUsec / 1000, warmSummary );
+  log_info( message );
+  stats_record( STAGE_STARTUP, usec );
+}  /* end check_ready */
 
-    // Write the record to the file
-    start=end ;
-    if( fputs( (const char *)callerIDentry, fpCa ) == EOF )
-    {
-      log_debug_info("fputs( (const char *)callerIDentry, fpCa ) failed");
-      return(-1);
-    }
+//
+// Start a command sequence on a line.
+//
+static void start_sequence( struct modem *m, const struct modem_step *steps )
+{  /* Begin start_sequence */
+  m->state = MODEM_COMMAND;
+  m->step = steps;
+  cid_init( &m->cid );
+  fsk_init( &m->fsk );
+  m->dle = FALSE;
+  clock_gettime( CLOCK_MONOTONIC, &m->seqStart );
+  m->hangupDone.tv_sec = 0;
+  m->hangupDone.tv_nsec = 0;
+  run_step( m );
+}  /* end start_sequence */
 
-    // Flush the record to the file
-    start=end ;
-    if( fflush(fpCa) == EOF )
-    {
-      log_debug_info("fflush(fpCa) failed");
-      return(-1);
-    }
+//
+// Start the current step: send its command (or drop DTR) and arm its timeout.
+//
+static void run_step( struct modem *m )
+{  /* Begin run_step */
+  int dtr = TIOCM_DTR;
+  int len;
 
-    // If a whitelist.dat file was present, compare the caller ID string to entries
-    // in the whitelist. If a match is found, accept call and bypass blacklist check
-    if( fpWh != NULL )
-    {
-      if( check_whitelist( callerIDentry ) == TRUE )
-      {
-        // Caller ID match was found (or an error occurred), so accept the call
-        continue;
-      }
-    }
+  m->responseLen = 0;
+  clock_gettime( CLOCK_MONOTONIC, &m->stepStart );
 
-    // Compare the caller ID string to entries in the blacklist. If
-    // a match is found, answer (i.e., terminate) the call.
-    if( check_blacklist( callerIDentry ) == TRUE )
-    {
-      // Blacklist entry was found. //
-      continue;
-    }
-    fflush(stdout);
+  if( m->step->type == STEP_DTR )
+  {
+    // Drop DTR; the timer raises it again
+    ioctl( m->fd, TIOCMBIC, &dtr );
   }
-} // End of wait_for_response
+  else
+  {
+    len = strlen( m->step->command );
+    if( write( m->fd, m->step->command, len ) != len )
+      log_debug_info("send_modem_command failed" );
+  }
+  set_timer( m, m->step->timeoutMsec );
+}  /* end run_step */
 
 //
-// Compare strings in the 'whitelist.dat' file to fields in the received caller ID string. 
-// If a whitelist string is present (or an error occurred), return TRUE; otherwise return FALSE.
+// The current step ended (ok is FALSE for ERROR or a timeout). Log how long
+// it took and go on with the next step.
 //
-static bool check_whitelist( char *callstr )
-{  /* Begin check_whitelist */
-  char whitebuf[100];
-  char whitebufsave[100];
-  char whitelistMessage[256];
-  char *whitebufptr;
-  char call_date[18];
-  char *dateptr;
-  char *strptr;
+static void step_done( struct modem *m, bool ok, const char *how )
+{  /* Begin step_done */
+  char message[128];
+  char name[16];
+  int dtr = TIOCM_DTR;
   int i;
-  long file_pos_last, file_pos_next;
-
-  // Close and re-open the whitelist.dat file. Note: this seems to be necessary 
-  // to be able to write records back into the file. The write works the first
-  // time after the file is opened but not subsequently! :-( This also allows
-  // whitelist changes made while the program is running to be recognized.
-  fclose( fpWh );
 
-  // Re-open for reading and writing
-  start=end;
-  if( (fpWh = fopen( "/home/pi/jcblock/whitelist.dat", "r+" ) ) == NULL )
+  if( m->step->type == STEP_DTR )
+  {
+    ioctl( m->fd, TIOCMBIS, &dtr );
+    strcpy( name, "DTR drop" );
+  }
+  else
   {
-    log_debug_info("Re-open of whitelist.dat file failed" );
-    return(TRUE);           // accept the call
+    for( i = 0; m->step->command[i] != '\r' && m->step->command[i] != 0 &&
+                i < sizeof( name ) - 1; i++ )
+      name[i] = m->step->command[i] < ' ' ? '^' : m->step->command[i];
+    name[i] = 0;
   }
+  sprintf( message, "%s: %s %s after %ld msec", m->serialPort, name, how,
+           msec_since( &m->stepStart ) );
+  log_debug_info( message );
+  if( !ok && m->step->type == STEP_COMMAND )
+    stats_count( COUNT_MODEM_FAILED );
 
-  // Disable buffering for whitelist.dat writes
-  setbuf( fpWh, NULL );
+  if( !ok && m->step->required )
+  {
+    // The modem does not respond properly; take the line out of service
+    sprintf( message, "%s: modem initialization failed, line is out of service", m->serialPort );
+    log_info( message );
+    log_info( "\n" );
+    set_timer( m, 0 );
+    m->state = MODEM_DOWN;
+    m->modemInitialized = FALSE;
+    if( !startupDone )
+      modemsUsec = usec_since( &processStart );
+    check_ready();
+    for( i = 0; i < numModems; i++ )
+    {
+      if( modems[i].state != MODEM_DOWN )
+        return;
+    }
+    log_debug_info("no modem could be initialized");
+    cleanup( 0 );
+  }
 
-  // Seek to beginning of list
-  fseek( fpWh, 0, SEEK_SET );
+  // ATH0 answered: the call is terminated
+  if( m->step->type == STEP_COMMAND && strcmp( m->step->command, "ATH0\r" ) == 0 )
+  {
+    sprintf( message, "%s: call terminated %ld msec after the blacklist match",
+             m->serialPort, msec_since( &m->seqStart ) );
+    log_debug_info( message );
+    stats_record( STAGE_HANGUP, usec_since( &m->seqStart ) );
+    clock_gettime( CLOCK_MONOTONIC, &m->hangupDone );
+  }
 
-  // Save the file's current access location
-  start=end;
-  if( file_pos_next = ftell( fpWh ) == -1L )
+  m->step++;
+  if( m->step->type != STEP_END )
   {
-    log_debug_info("ftell(fpWh) failed");
-    return(TRUE);           // accept the call
+    run_step( m );
+    return;
   }
 
-  // Read and process records from the file
-  while( fgets( whitebuf, sizeof( whitebuf ), fpWh ) != NULL )
+  // Sequence complete: wait for the next call
+  set_timer( m, 0 );
+  m->state = MODEM_IDLE;
+  m->modemInitialized = TRUE;
+
+  // The frame of a call terminated on its number that the hang-up cut
+  // short. If the parser has no frame left of it, the call is recorded
+  // from the fields parsed before (the number, the name if any came).
+  if( m->early )
+  {
+    if( cid_parse_end( &m->cid ) != CID_FRAME )
+      m->cid.frame = m->earlyCid;
+    early_frame( m, FALSE );
+  }
+  cid_init( &m->cid );
+  sprintf( message, "%s: modem ready %ld msec after the sequence started",
+           m->serialPort, msec_since( &m->seqStart ) );
+  log_debug_info( message );
+
+  // After a hang-up only the re-initialization counts
+  if( m->hangupDone.tv_sec != 0 )
+    stats_record( STAGE_MODEM_INIT, usec_since( &m->hangupDone ) );
+  else
+    stats_record( STAGE_MODEM_INIT, usec_since( &m->seqStart ) );
+
+  if( !startupDone )
   {
-    // Save the start location of the string just read and get
-    // the location of the start of the next string in the file.
-    file_pos_last = file_pos_next;
-    file_pos_next = ftell( fpWh );
+    modemsUsec = usec_since( &processStart );
+    check_ready();
+  }
+}  /* end step_done */
 
-    // Ignore lines that start with a '#' character (comment lines)
-    if( whitebuf[0] == '#' )
-      continue;
+//
+// Collect the modem's answer to a command a line at a time. Echoed
+// commands, RING and anything else except OK, CONNECT (the answer to
+// AT+VRX) and ERROR are ignored.
+//
+static void read_response( struct modem *m, char *data, int nbytes )
+{  /* Begin read_response */
+  int i;
 
-    // Ignore lines containing just a '\n'
-    if( whitebuf[0] == '\n' )
+  for( i = 0; i < nbytes && m->state == MODEM_COMMAND; i++ )
+  {
+    if( data[i] != '\r' && data[i] != '\n' )
     {
+      if( m->responseLen < sizeof( m->response ) - 1 )
+        m->response[m->responseLen++] = data[i];
       continue;
     }
+    m->response[m->responseLen] = 0;
+    m->responseLen = 0;
 
-    // Ignore records that are too short (don't have room for the date)
-    if( strlen( whitebuf ) < 26 )
-    {
-      log_info("\nERROR: whitelist.dat record is too short to hold date field.\n");
-      log_info(whitebuf);
-      log_info("record is ignored (edit file and fix it).\n");
+    if( m->step->type != STEP_COMMAND )
       continue;
-    }
+    if( strcmp( m->response, "OK" ) == 0 || strcmp( m->response, "CONNECT" ) == 0 )
+      step_done( m, TRUE, m->response );
+    else if( strcmp( m->response, "ERROR" ) == 0 )
+      step_done( m, FALSE, "ERROR" );
+  }
+}  /* end read_response */
+
+//
+// Arm the line's timer to expire once after msec (0 disarms it).
+//
+static void set_timer( struct modem *m, int msec )
+{  /* Begin set_timer */
+  struct itimerspec t;
+
+  memset( &t, 0, sizeof( t ) );
+  t.it_value.tv_sec  = msec / 1000;
+  t.it_value.tv_nsec = ( msec % 1000 ) * 1000000L;
+  timerfd_settime( m->timerFd, 0, &t, NULL );
+}  /* end set_timer */
+
+static long msec_since( const struct timespec *then )
+{  /* Begin msec_since */
+  struct timespec now;
 
-    // Save the string (for writing back to the file later)
-    strcpy( whitebufsave, whitebuf );
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return( ( now.tv_sec - then->tv_sec ) * 1000 + ( now.tv_nsec - then->tv_nsec ) / 1000000 );
+}  /* end msec_since */
 
-    // Make sure a '?' char is present in the string
-    if( ( strptr = strstr( whitebuf, "?" ) ) == NULL )
+static long usec_since( const struct timespec *then )
+{  /* Begin usec_since */
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return( ( now.tv_sec - then->tv_sec ) * 1000000 + ( now.tv_nsec - then->tv_nsec ) / 1000 );
+}  /* end usec_since */
+
+//
+// Read what the modem has sent. While the modem is idle the characters go to
+// the caller ID parser; a frame is processed as soon as it is complete.
+//
+static void read_modem( struct modem *m )
+{  /* Begin read_modem */
+  char buffer[256];
+  char message[128];
+  struct timespec t0;
+  int nbytes;
+  int i, event;
+
+  nbytes = read( m->fd, buffer, sizeof( buffer ) - 1 );
+  if( nbytes < 0 && ( errno == EAGAIN || errno == EINTR ) )
+    return;
+  if( nbytes <= 0 )
+  {
+    sprintf( message, "read() of %s failed; re-opening the port", m->serialPort );
+    log_debug_info( message );
+    close_open_port( m );
+    return;
+  }
+
+  // While a command sequence runs, everything is a command response (and
+  // the rest of the caller ID of a call being terminated on its number)
+  if( m->state != MODEM_IDLE )
+  {
+    if( m->state == MODEM_COMMAND )
     {
-      log_info("\nERROR: all whitelist.dat entry first fields *must be*\n");
-      log_info("terminated with a \'?\' character!! Entry is:\n");
-      log_info(whitebuf);
-      log_info("Entry was ignored!\n");
-      continue;
+      if( m->early )
+        early_bytes( m, buffer, nbytes );
+      read_response( m, buffer, nbytes );
     }
+    return;
+  }
+  if( voiceMode )
+  {
+    read_voice( m, (unsigned char *)buffer, nbytes );
+    return;
+  }
 
-    // Make sure the '?' character is within the first twenty characters
-    if( (int)( strptr - whitebuf ) > 18 )
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  if( m->cid.pending == 0 )
+  {
+    m->stringStart = t0;
+    m->parseUsec = 0;
+  }
+  for( i = 0; i < nbytes; i++ )
+  {
+    event = cid_parse_byte( &m->cid, buffer[i] );
+    if( event == CID_FRAME )
     {
-      log_info("\nERROR: terminator '?' is not within first 20 characters\n" );
-      log_info(whitebuf);
-      log_info("Entry was ignored!\n");
-      continue;
+      m->parseUsec += usec_since( &t0 );
+      set_timer( m, 0 );
+      process_caller_id( m );
+
+      // The rest (if any) belongs to the next frame, unless the call
+      // is being terminated
+      if( m->state != MODEM_IDLE )
+        return;
+      clock_gettime( CLOCK_MONOTONIC, &t0 );
+      m->stringStart = t0;
+      m->parseUsec = 0;
     }
-
-    // Get a pointer to the search token in the string
-    if( ( whitebufptr = strtok( whitebuf, "?" ) ) == NULL )
+    else if( event == CID_RING )
     {
-      log_debug_info("whitebuf strtok() failed");
-      return(TRUE);         // accept the call
+      sprintf( message, "%s: RING", m->serialPort );
+      log_debug_info( message );
+      clock_gettime( CLOCK_MONOTONIC, &m->lastRing );
     }
-
-    // Scan the call string for the whitelist entry
-    if( strstr( callstr, whitebufptr ) != NULL )
+    else if( event == CID_NUMBER && early_decision( m ) )
     {
-      sprintf(whitelistMessage,"*** whitelist match on: %s ***\n",whitebuf) ;
-      log_info(whitelistMessage) ;
-
-      // Get the current timestsamp from the caller ID string
-      strncpy( call_date, &callstr[0], 16 );
-
-      // Terminate the string
-      call_date[16] = 0;
-
-      // Update the date in the whitebufsave record
-      strncpy( &whitebufsave[20], call_date, 16 );
+      // The call is being terminated; the rest of the frame is still
+      // read for the history
+      m->parseUsec += usec_since( &t0 );
+      early_bytes( m, buffer + i + 1, nbytes - i - 1 );
+      return;
+    }
+  }
+  m->parseUsec += usec_since( &t0 );
 
-      // Write the record back to the whitelist.dat file
-      fseek( fpWh, file_pos_last, SEEK_SET );
-      if( fputs( whitebufsave, fpWh ) == EOF )
-      {
-        log_debug_info("fputs(whitebufsave, fpWh) failed" );
-        return(TRUE);         // accept the call
-      }
+  // A frame without a NAME (SDMF) may not be followed by a blank line:
+  // it is complete when nothing more arrives for STRING_GAP_MSEC
+  set_timer( m, m->cid.pending > 0 ? STRING_GAP_MSEC : 0 );
+}  /* end read_modem */
 
-      // Flush the string to the file
-      if( fflush(fpWh) == EOF )
+//
+// Audio from a modem in voice mode: 8 bit unsigned samples in which DLE
+// (0x10) starts a code; DLE DLE is the sample 0x10 and DLE R a ring. The
+// demodulator completes the frame when the message has been received.
+//
+static void read_voice( struct modem *m, const unsigned char *data, int nbytes )
+{  /* Begin read_voice */
+  int16_t samples[256];
+  char message[128];
+  struct timespec t0;
+  long errors = m->fsk.errors;
+  int n = 0, done, used, i;
+
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  for( i = 0; i < nbytes; i++ )
+  {
+    if( m->dle )
+    {
+      m->dle = FALSE;
+      if( data[i] == 'R' )
       {
-        log_debug_info("fflush(fpWh) failed");
-        return(TRUE);         // accept the call
+        sprintf( message, "%s: RING", m->serialPort );
+        log_debug_info( message );
+        clock_gettime( CLOCK_MONOTONIC, &m->lastRing );
       }
+      if( data[i] != 0x10 )
+        continue;
+    }
+    else if( data[i] == 0x10 )
+    {
+      m->dle = TRUE;
+      continue;
+    }
+    samples[n++] = ( data[i] - 128 ) << 8;
+  }
+  line_audio( m, samples, n );
 
-      fflush(stdout);
-      sync();
-      // A whitelist.dat entry matched, so return TRUE
-      return(TRUE);             // accept the call
+  // A message that starts in these samples is timed from their arrival
+  if( m->fsk.msgLen == 0 )
+  {
+    m->stringStart = t0;
+    m->parseUsec = 0;
+  }
+  for( done = 0; done < n; done += used )
+  {
+    if( fsk_feed( &m->fsk, samples + done, n - done, &m->cid.frame, &used ) == CID_FRAME )
+    {
+      m->parseUsec += usec_since( &t0 );
+      process_caller_id( m );
+      if( m->state != MODEM_IDLE )
+        return;
+      clock_gettime( CLOCK_MONOTONIC, &t0 );
+      m->stringStart = t0;
+      m->parseUsec = 0;
     }
-  }                               // end of while()
+  }
+  m->parseUsec += usec_since( &t0 );
 
-  // No whitelist.dat entry matched, so return FALSE.
-  return(FALSE);
-}  /* end check_whitelist */
+  if( m->fsk.errors != errors )
+  {
+    sprintf( message, "%s: caller ID signal with a bad checksum or cut short; ignored", m->serialPort );
+    log_debug_info( message );
+    stats_count( COUNT_PARSE_FAILED );
+  }
+}  /* end read_voice */
 
 //
-// Compare strings in the 'blacklist.dat' file to fields in the received caller 
-// ID string. If a blacklist string is present, send off-hook (ATH1) and
-// on-hook (ATH0) to the modem to terminate the call...
+// Start the -t command; its output is the audio of line m (16 bit little
+// endian samples, 8000 a second). Returns 0 or -1.
 //
-static bool check_blacklist( char *callstr )
-{  /* Begin check_blacklist */
-  char blackbuf[100];
-  char blackbufsave[100];
-  char blacklistMessage[256];
-  char *blackbufptr;
-  char call_date[18];
-  char *dateptr;
-  char *strptr;
-  int i;
-  long file_pos_last, file_pos_next;
-  char yearStr[10];
-
-  // Close and re-open the blacklist.dat file. Note: this seems to be necessary
-  // to be able to write records back into the file. The write works the first
-  // time after the file is opened but not subsequently! :-( This also allows
-  // blacklist changes made while the program is running to be recognized.
-  fclose( fpBl );
-  // Re-open for reading and writing
-  if( (fpBl = fopen( "/home/pi/jcblock/blacklist.dat", "r+" ) ) == NULL )
-  {
-    log_debug_info("re-open fopen( blacklist) failed" );
-    return(FALSE);
+static int start_sound( struct modem *m )
+{  /* Begin start_sound */
+  struct epoll_event ev;
+  int fd;
+
+  if( ( soundPipe = popen( soundCommand, "re" ) ) == NULL )
+    return(-1);
+  fd = fileno( soundPipe );
+  fcntl( fd, F_SETFL, O_NONBLOCK );
+  ev.events = EPOLLIN;
+  ev.data.ptr = (void *)( (unsigned long)m | SOUND_TAG );
+  if( epoll_ctl( epollFd, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+  {
+    pclose( soundPipe );
+    soundPipe = NULL;
+    return(-1);
+  }
+  return(0);
+}  /* end start_sound */
+
+//
+// Read the audio of the -t command. If the command ends, the star key is
+// no longer available.
+//
+static void read_sound( struct modem *m )
+{  /* Begin read_sound */
+  unsigned char buffer[1024];
+  int16_t samples[sizeof( buffer ) / 2];
+  int nbytes, start, n, i;
+
+  start = soundSplit ? 1 : 0;
+  buffer[0] = soundOdd;
+  nbytes = read( fileno( soundPipe ), buffer + start, sizeof( buffer ) - start );
+  if( nbytes < 0 && ( errno == EAGAIN || errno == EINTR ) )
+    return;
+  if( nbytes <= 0 )
+  {
+    log_debug_info("the sound command ended; no star key");
+    epoll_ctl( epollFd, EPOLL_CTL_DEL, fileno( soundPipe ), NULL );
+    pclose( soundPipe );
+    soundPipe = NULL;
+    return;
   }
+  nbytes += start;
+  n = nbytes / 2;
+  for( i = 0; i < n; i++ )
+    samples[i] = (int16_t)( buffer[2 * i] | buffer[2 * i + 1] << 8 );
+  soundSplit = ( nbytes & 1 );
+  soundOdd = buffer[nbytes - 1];
+  line_audio( m, samples, n );
+}  /* end read_sound */
 
-  // Disable buffering for blacklist.dat writes
-  setbuf( fpBl, NULL );
+//
+// Audio of a line (from the modem in voice mode or the -t command): look for
+// keys pressed.
+//
+static void line_audio( struct modem *m, const int16_t *samples, int n )
+{  /* Begin line_audio */
+  char keys[8];
+  char message[64];
+  int found, i;
+
+  found = dtmf_feed( &m->dtmf, samples, n, keys, sizeof( keys ) );
+  for( i = 0; i < found; i++ )
+  {
+    sprintf( message, "%s: key %c pressed", m->serialPort, keys[i] );
+    log_debug_info( message );
+    if( keys[i] == '*' )
+      star_key( m );
+  }
+}  /* end line_audio */
 
-  // Seek to beginning of list
-  fseek( fpBl, 0, SEEK_SET );
+//
+// The star key was pressed. If it comes within starWindow seconds of the last
+// ring of an accepted call, add the caller to 'blacklist.dat' with a "star
+// key" comment (as -a does), so that the next call is terminated.
+//
+static void star_key( struct modem *m )
+{  /* Begin star_key */
+  char record[LIST_LINE_MAX];
+  char message[LIST_TERM_MAX + 64];
 
-  // Save the file's current access location
-  if( file_pos_next = ftell( fpBl ) == -1L )
+  if( starWindow <= 0 || m->starToken[0] == 0 ||
+      msec_since( &m->lastRing ) > starWindow * 1000L )
   {
-    log_debug_info("ftell(fpBl) failed");
-    return(FALSE);
+    log_debug_info("star key, but no accepted call to blacklist");
+    return;
   }
+  sprintf( message, "***  star key: %s added to blacklist ***\n", m->starToken );
+  log_info( message );
+  stats_count( COUNT_STAR_KEYS );
+  persist_list_add( BLACKLIST_FILE,
+                    list_format_record( record, sizeof( record ), m->starToken, m->starDate,
+                                        "star key" ) );
 
-  start=end;
-  // Read and process records from the file
-  while( fgets( blackbuf, sizeof( blackbuf ), fpBl ) != NULL )
+  // Once for each call
+  m->starToken[0] = 0;
+}  /* end star_key */
+
+//
+// Nothing was received for STRING_GAP_MSEC in the middle of a frame.
+//
+static void frame_gap( struct modem *m )
+{  /* Begin frame_gap */
+  char message[128];
+
+  switch( cid_parse_end( &m->cid ) )
   {
-    // Save the start location of the string just read and get
-    // the location of the start of the next string in the file.
-    file_pos_last = file_pos_next;
-    file_pos_next = ftell( fpBl );
+    case CID_FRAME:
+      process_caller_id( m );
+      break;
+    case CID_PARTIAL:
+      sprintf( message, "%s: caller ID without a number; ignored", m->serialPort );
+      log_debug_info( message );
+      stats_count( COUNT_PARSE_FAILED );
+      break;
+  }
+}  /* end frame_gap */
 
-    // Ignore lines that start with a '#' character (comment lines)
-    if( blackbuf[0] == '#' )
-      continue;
+//
+// A complete caller ID frame was received: record it and check it against
+// the lists.
+//
+static void process_caller_id( struct modem *m )
+{ /* Begin process_caller_id */
+  struct caller_id *cid = &m->cid.frame;
+  char callerIDentry[CID_FIELD_MAX * 2 + 32];
+  char message[CID_FIELD_MAX + 128];
+  const char *starToken;
+  struct list_snapshot *lists;
+  const struct match_list *matched;
+  unsigned long generation;
+  int decision, rule;
+  bool autoBlocked;
+  long checkUsec[2], cachedUsec;
+  struct timespec received, parseStart, lookupStart;
+
+  time_t now;
+  struct tm now_tm;
+  char iso_8601[] = "YYYY-MM-DDTHH:MM:SS";
 
-    // Ignore lines containing just a '\n'
-    if( blackbuf[0] == '\n' )
+  start=end ;
+  clock_gettime( CLOCK_MONOTONIC, &received );
+  stats_record( STAGE_SERIAL_READ, usec_since( &m->stringStart ) );
+  stats_count( COUNT_CALLS );
+
+  // Caller ID data was received after the first ring.
+  numRings = 1;
+
+  //  Create a caller ID string, with the call time from the current time
+  //  (the DATE and TIME of the frame are not used)
+  parseStart = received;
+  now = time(NULL);
+  localtime_r( &now, &now_tm );
+  strftime(iso_8601, sizeof (iso_8601), "%FT%R", &now_tm);
+
+  // set the callIDentry, put '\n' at end and null-terminate it
+  sprintf( callerIDentry, "%s|%s|%s|\n", iso_8601, cid->number, cid->name );
+  stats_record( STAGE_PARSE, m->parseUsec + usec_since( &parseStart ) );
+  log_info( callerIDentry );
+
+  // Get the current lists (the watcher thread keeps them up to date)
+  first_lists();
+  lists = lists_acquire();
+
+  // A caller seen since the lists were last loaded (or edited through the
+  // control socket) is decided as before, unless an entry could match the
+  // date, which changes every call
+  start=end;
+  clock_gettime( CLOCK_MONOTONIC, &lookupStart );
+  generation = control_generation( lists );
+  if( generation != 0 &&
+      cache_lookup( generation, cid->number, cid->name, &decision, &rule, &cachedUsec ) )
+  {
+    matched = decision == CALL_WHITELISTED ? lists->white : lists->black;
+    stats_record( STAGE_DECISION, usec_since( &received ) );
+    stats_count( COUNT_CACHE_HITS );
+    stats_add( COUNT_CACHE_SAVED, cachedUsec - usec_since( &lookupStart ) );
+  }
+  else
+  {
+    // Compare the caller ID string to the whitelist (if a whitelist.dat
+    // file was present) and then the blacklist, with the edits of the
+    // control socket
+    decision = control_decide( lists, callerIDentry, &matched, &rule, checkUsec );
+    stats_record( STAGE_DECISION, usec_since( &received ) );
+    if( checkUsec[0] >= 0 )
+      stats_record( STAGE_WHITELIST, checkUsec[0] );
+    if( checkUsec[1] >= 0 )
+      stats_record( STAGE_BLACKLIST, checkUsec[1] );
+    if( generation != 0 )
     {
-      continue;
+      stats_count( COUNT_CACHE_MISSES );
+      cache_store( generation, cid->number, cid->name, decision, rule,
+                   ( checkUsec[0] > 0 ? checkUsec[0] : 0 ) + ( checkUsec[1] > 0 ? checkUsec[1] : 0 ) );
     }
+  }
+
+  // A call terminated on its number is blocked whatever the full check
+  // says (it can only differ if the lists changed in between)
+  if( m->early && decision != CALL_BLOCKED )
+  {
+    log_info("***  the lists changed after the call was terminated on its number ***\n");
+    decision = CALL_BLOCKED;
+    matched = NULL;
+    rule = NO_MATCH;
+  }
 
-    // Ignore records that are too short (don't have room for the date)
-    if( strlen( blackbuf ) < 26 )
+  // A caller on neither list may be calling too often
+  autoBlocked = ( decision == CALL_ACCEPTED && check_velocity( m, cid, iso_8601, now ) );
+  if( autoBlocked )
+    decision = CALL_BLOCKED;
+  stats_count( decision == CALL_WHITELISTED ? COUNT_WHITELISTED :
+               decision == CALL_BLOCKED ? COUNT_BLOCKED : COUNT_ACCEPTED );
+  control_note_call( callerIDentry, decision, matched, autoBlocked ? NO_MATCH : rule );
+
+  // The star key may blacklist an accepted caller: by the number, or by
+  // the name if the number was withheld. A token that does not fit the
+  // test field whole, or that would break the record, is not offered (cut
+  // short it would block more callers than this one).
+  m->starToken[0] = 0;
+  if( decision == CALL_ACCEPTED )
+  {
+    starToken = NULL;
+    if( strcmp( cid->number, "O" ) != 0 && strcmp( cid->number, "P" ) != 0 )
+      starToken = cid->number;
+    else if( cid->name[0] != 0 && strcmp( cid->name, "O" ) != 0 && strcmp( cid->name, "P" ) != 0 )
+      starToken = cid->name;
+    if( starToken != NULL &&
+        ( strlen( starToken ) > LIST_TERM_MAX || starToken[0] == '#' ||
+          strpbrk( starToken, "?|\t" ) != NULL ) )
     {
-      log_info("\nERROR: blacklist.dat record is too short to hold date field.\n");
-      log_info( blackbuf );
-      log_info("record is ignored (edit file and fix it).\n");
-      continue;
+      snprintf( message, sizeof( message ), "%s: the star key cannot blacklist \"%s\" (too long, or '#', '?', '|' or a tab in it)",
+                m->serialPort, starToken );
+      log_debug_info( message );
+      starToken = NULL;
     }
+    if( starToken != NULL )
+      strcpy( m->starToken, starToken );
+    strcpy( m->starDate, iso_8601 );
+    m->lastRing = received;
+  }
 
-    // Save the string (for writing back to the file later)
-    strcpy( blackbufsave, blackbuf );
+  // Queue the call for the history (written by the writer thread, so
+  // the call is not held up by the disk)
+  start=end ;
+  persist_history( callerIDentry, decision, m - modems );
 
-    // Make sure a '?' char is present in the string
-    if( ( strptr = strstr( blackbuf, "?" ) ) == NULL )
-    {
-      log_info("\nERROR: all blacklist.dat entry first fields *must be*\n");
-      log_info("       terminated with a \'?\' character!! Entry is:\n");
-      log_info(blackbuf);
-      log_info("Entry was ignored!\n");
-      continue;
-    }
+  // If a whitelist entry matched, accept the call (the blacklist is not checked)
+  if( decision == CALL_WHITELISTED )
+    check_whitelist( matched, rule, callerIDentry );
+
+  // If a blacklist entry matched, answer (i.e., terminate) the call.
+  if( decision == CALL_BLOCKED && !autoBlocked && matched != NULL )
+    check_blacklist( m, matched, rule, callerIDentry );
+  lists_release();
+} // End of process_caller_id
+
+//
+// The number of a frame is complete and the rest (the name) is still
+// coming. If the number alone decides that the call is blocked (a number
+// rule of the blacklist matches and no whitelist entry could match once the
+// name is known) start terminating the call now instead of when the frame
+// is complete. Returns TRUE if it did.
+//
+static bool early_decision( struct modem *m )
+{  /* Begin early_decision */
+  struct caller_id partial = m->cid.cid;
+  struct list_snapshot *lists;
+  const struct match_list *matched;
+  char message[LIST_LINE_MAX + 96];
+  char token[LIST_LINE_MAX];
+  bool definite;
+  int rule;
+
+  first_lists();
+  lists = lists_acquire();
+  definite = control_decide_number( lists, partial.number, &matched, &rule );
+  if( definite )
+    list_rule_token( matched, rule, token, sizeof( token ) );
+  lists_release();
+  if( !definite )
+    return(FALSE);
+
+  sprintf( message, "%s: blacklist number match on %s before the caller ID was complete; terminating the call\n",
+           m->serialPort, token );
+  log_info( message );
+  stats_count( COUNT_EARLY_HANGUPS );
+
+  // The hang-up sequence starts over the parser; the frame is kept
+  start=end;
+  start_sequence( m, hangupSequence );
+  m->cid.cid = partial;
+  m->cid.pending = 1;
+  m->earlyCid = partial;
+  m->early = TRUE;
+  clock_gettime( CLOCK_MONOTONIC, &m->earlyAt );
+  return(TRUE);
+}  /* end early_decision */
+
+//
+// Characters that came while a call terminated on its number is being hung
+// up: the rest of its frame, mixed with the modem's answers to the hang-up
+// commands (which the parser skips). The blank line of an echoed command
+// would end the frame, so only the name completes it; without one it is
+// processed when the hang-up is done.
+//
+static void early_bytes( struct modem *m, const char *data, int nbytes )
+{  /* Begin early_bytes */
+  int i;
 
-    // Make sure the '?' character is within the first twenty characters
-    // (could not be if the previous record was only partially written).
-    if( (int)( strptr - blackbuf ) > 18 )
+  for( i = 0; i < nbytes && m->early; i++ )
+  {
+    if( cid_parse_byte( &m->cid, data[i] ) != CID_FRAME )
     {
-      log_info("ERROR: terminator '?' is not within first 20 characters\n" );
-      log_info(blackbuf);
-      log_info("Entry was ignored!\n");
+      // At the end of a line, keep what has come of the frame should the
+      // parser lose it
+      if( ( data[i] == '\r' || data[i] == '\n' ) && ( m->cid.cid.fields & CID_NMBR ) &&
+          strcmp( m->cid.cid.number, m->earlyCid.number ) == 0 )
+        m->earlyCid = m->cid.cid;
       continue;
     }
-
-    // Get a pointer to the search token in the string
-    if( ( blackbufptr = strtok( blackbuf, "?" ) ) == NULL )
+    if( m->cid.frame.fields & CID_NAME )
+      early_frame( m, TRUE );
+    else
     {
-      log_debug_info("blackbuf strtok() failed");
-      return(FALSE);
+      m->cid.cid = m->cid.frame;
+      m->cid.pending = 1;
     }
+  }
+}  /* end early_bytes */
 
-    // Scan the call string for the blacklist entry or if the caller ID string
-    // is less than 23 characters in length (number is one character and caller
-    // ID string is one in length)
-    // 2013-10-01T19:12|1|O| = 21 characters in length
-    if( (strstr( callstr, blackbufptr ) != NULL ) || (strlen(callstr) < 23))
-    {
-      sprintf(blacklistMessage,"***  blacklist match on: %s ***\n",blackbuf) ;
-      log_info(blacklistMessage) ;
-
-      // At this point, the modem is in data mode. It must be returned to command mode to
-      // send it the off-hook and on-hook commands.  Close, open and reinitialize the
-      // connection. This clears the DTR line which resets the modem to command
-      // mode. To accomplish this in time (before the next ring), the caller ID
-      // command is not sent. Later, the modem is again reinitialized with
-      // caller ID activated. This is all kind of crude, but it works...
-      // Terminate the call by closing the modem serial port. and by sending off hook and
-      // on hook commands Then re-open it andre-initialize the modem to prepare for the next call.
-      start=end;
-      usleep( 100000 );
-      send_modem_command(fd, "ATH1\r"); // off hook
-      usleep( 250000 );    // quarter second
-      send_modem_command(fd, "ATH0\r"); // on hook
-      usleep( 250000 );    // quarter second
-      log_debug_info("usleep 100000, send ATH1, usleep 250000, send ATH0, usleep 250000");
-
-      start=end;  
-      close_open_port( );
-      usleep( 250000 );
-      log_debug_info("close_open_port(), usleep 250000" ) ;
-
-      // Get the current date from the caller ID string
-      strncpy( call_date, &callstr[0], 16 );
-
-      // Terminate the string
-      call_date[16] = 0;
-
-      // Update the date in the blackbufsave record
-      strncpy( &blackbufsave[20], call_date, 16 );
-
-      // Write the record back to the blacklist.dat file
-      start=end;
-      fseek( fpBl, file_pos_last, SEEK_SET );
-      if( fputs( blackbufsave, fpBl ) == EOF )
-      {
-        log_debug_info("fputs(blackbufsave, fpBl) failed" );
-        return(FALSE);
-      }
+//
+// The frame of a call terminated on its number got its name (complete), or
+// the hang-up is done without it: log the time gained and process the frame
+// like any other (the hang-up is not started again).
+//
+static void early_frame( struct modem *m, bool complete )
+{  /* Begin early_frame */
+  char message[160];
+  long gainUsec = usec_since( &m->earlyAt );
+
+  // Without the name (an SDMF frame, or one the hang-up cut short, as it
+  // does with most modems) there is no end to measure the gain to
+  if( complete )
+  {
+    sprintf( message, "%s: hang-up started %ld msec before the caller ID was complete",
+             m->serialPort, gainUsec / 1000 );
+    stats_record( STAGE_EARLY_GAIN, gainUsec );
+  }
+  else
+    sprintf( message, "%s: no name came after the number (SDMF, or cut short by the hang-up)",
+             m->serialPort );
+  log_debug_info( message );
 
-      // Flush the string to the file
-      start=end;
-      if( fflush(fpBl) == EOF )
-      {
-        log_debug_info("fflush(fpBl) failed");
-        return(FALSE);
-      }
+  process_caller_id( m );
+  m->early = FALSE;
+}  /* end early_frame */
 
-      // Force kernel file buffers to the disk
-      // (probably not necessary)
-      sync();
+//
+// A token of a 'whitelist.dat' record (rule) is present in the received
+// caller ID string: log it and record the hit. Returns TRUE.
+//
+static bool check_whitelist( const struct match_list *whitelist, int rule, char *callstr )
+{  /* Begin check_whitelist */
+  char whitelistMessage[256];
+  char token[LIST_LINE_MAX];
 
-      // A blacklist.dat entry matched, so return TRUE
-      fflush(stdout);
-      start=end;
-      return(TRUE);
-    }
-  }  // end of while()
+  sprintf(whitelistMessage,"*** whitelist match on: %s ***\n",
+          list_rule_token( whitelist, rule, token, sizeof( token ) ) ) ;
+  log_info(whitelistMessage) ;
 
-  /* A blacklist.dat entry was not matched, so return FALSE */
-  return(FALSE);
+  // Queue the hit, at the date of the caller ID string
+  persist_list_hit( whitelist, rule, callstr );
+
+  // A whitelist.dat entry matched, so return TRUE
+  return(TRUE);             // accept the call
+}  /* end check_whitelist */
+
+//
+// A token of a 'blacklist.dat' record (rule) is present in the received
+// caller ID string, or the string is too short (rule is NO_MATCH). Send
+// off-hook (ATH1) and on-hook (ATH0) to the modem to terminate the call...
+//
+static bool check_blacklist( struct modem *m, const struct match_list *blacklist, int rule, char *callstr )
+{  /* Begin check_blacklist */
+  char blacklistMessage[256];
+  char token[LIST_LINE_MAX];
+
+  if( rule != NO_MATCH )
+    list_rule_token( blacklist, rule, token, sizeof( token ) );
+  else
+    strcpy( token, "short caller ID" );
+  sprintf(blacklistMessage,"***  blacklist match on: %s ***\n",token) ;
+  log_info(blacklistMessage) ;
+
+  // Queue the hit, at the date of the caller ID string (the writer thread
+  // records it while the call is being terminated)
+  if( rule != NO_MATCH )
+    persist_list_hit( blacklist, rule, callstr );
+
+  // Terminate the call by sending off hook and on hook commands. Then drop
+  // DTR, which resets the modem to command mode, and re-initialize the modem
+  // to prepare for the next call. The event loop runs the sequence; each
+  // step starts as soon as the modem has answered the one before. (A call
+  // terminated on its number alone is being hung up already.)
+  start=end;
+  if( !m->early )
+    start_sequence( m, hangupSequence );
+
+  // A blacklist.dat entry matched, so return TRUE
+  start=end;
+  return(TRUE);
 }  /* end check_blacklist */
 
 //
-// Open the serial port.
+// Count a call on neither list (see velocity.c). A caller that calls too
+// often is logged and, with -a, added to 'blacklist.dat' with an "auto"
+// comment and the call terminated. Returns TRUE if it was.
 //
-static void open_port(int mode )
+static bool check_velocity( struct modem *m, const struct caller_id *cid, const char *date, time_t now )
+{  /* Begin check_velocity */
+  char token[LIST_TERM_MAX + 1];
+  char why[80], comment[90], message[160], record[LIST_LINE_MAX];
+
+  if( velocity_check( cid->number, cid->name, now, token, sizeof( token ), why,
+                      sizeof( why ) ) == VELOCITY_OK )
+    return(FALSE);
+  stats_count( COUNT_FAST_CALLERS );
+  sprintf( message, "***  calls too often: %s (%s)%s ***\n", token, why,
+           autoBlock ? "; added to blacklist" : "" );
+  log_info( message );
+  if( !autoBlock )
+    return(FALSE);
+
+  sprintf( comment, "auto: %s", why );
+  persist_list_add( BLACKLIST_FILE,
+                    list_format_record( record, sizeof( record ), token, date, comment ) );
+  velocity_added( token );
+
+  // Terminate the call as for a blacklist match
+  start=end;
+  start_sequence( m, hangupSequence );
+  return(TRUE);
+}  /* end check_velocity */
+
+//
+// Open the serial port. Returns 0 or -1.
+//
+static int open_port( struct modem *m, int mode )
 {  /* Begin open_port */
   // Open modem device for reading and writing and not as the controlling
   // tty (so the program does not get terminated if line noise sends CTRL-C).
   //
   start=end;
-  if( ( fd = open( serialPort, O_RDWR | O_NOCTTY ) ) < 0 )
+  if( ( m->fd = open( m->serialPort, O_RDWR | O_NOCTTY | O_CLOEXEC ) ) < 0 )
   {
-    perror( serialPort );
+    perror( m->serialPort );
     log_debug_info("failed to open serial port") ;
-    _exit(-1);
+    return(-1);
   }
-  fcntl(fd, F_SETFL, 0);
+  fcntl(m->fd, F_SETFL, 0);
 
   // Get the current options
-  tcgetattr(fd, &options);
+  tcgetattr(m->fd, &options);
 
   // Set eight bits, no parity, one stop bit
   options.c_cflag       &= ~PARENB;
@@ -840,6 +1536,24 @@ static void open_port(int mode )
   options.c_lflag       &= ~(ICANON | ECHO |ECHOE | ISIG);
   options.c_oflag       &=~OPOST;
 
+  // Set the baud rate (caller ID is sent at 1200 baud; the audio of
+  // voice mode needs 8000 bytes a second)
+  cfsetispeed( &options, voiceMode ? B115200 : B1200 );
+  cfsetospeed( &options, voiceMode ? B115200 : B1200 );
+
+  // Set options
+  tcsetattr(m->fd, TCSANOW, &options);
+  set_port_mode( m, mode );
+  return(0);
+}  /* end open_port */
+
+//
+// Switch the port between blocked reads (used while a command waits for its
+// response) and polled reads (used by the event loop).
+//
+static void set_port_mode( struct modem *m, int mode )
+{  /* Begin set_port_mode */
+  tcgetattr(m->fd, &options);
   if( mode == OPEN_PORT_BLOCKED )
   {
     // Block read until a character is available or inter-character
@@ -854,56 +1568,116 @@ static void open_port(int mode )
     options.c_cc[VMIN]    = 0;
     options.c_cc[VTIME]   = 0;
   }
+  tcsetattr(m->fd, TCSANOW, &options);
+}  /* end set_port_mode */
 
-  // Set the baud rate (caller ID is sent at 1200 baud)
-  cfsetispeed( &options, B1200 );
-  cfsetospeed( &options, B1200 );
+//
+// Hand an initialized port and its timer to the event loop. The timer is
+// registered with the low bit of the modem pointer set.
+//
+static int watch_port( struct modem *m )
+{  /* Begin watch_port */
+  struct epoll_event ev;
 
-  // Set options
-  tcsetattr(fd, TCSANOW, &options);
-}  /* end open_port */
+  set_port_mode( m, OPEN_PORT_POLLED );
+  cid_init( &m->cid );
+  m->early = FALSE;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = m;
+  if( epoll_ctl( epollFd, EPOLL_CTL_ADD, m->fd, &ev ) != 0 )
+    return(-1);
+
+  ev.data.ptr = (void *)( (unsigned long)m | 1UL );
+  if( epoll_ctl( epollFd, EPOLL_CTL_ADD, m->timerFd, &ev ) != 0 &&
+      errno != EEXIST )
+    return(-1);
+  return(0);
+}  /* end watch_port */
 
 //
-// Function to close and open the serial port to disable the DTR
-// line. Needed to switch the modem from data mode back into command mode.
+// Function to close and open the serial port after a read error, and
+// initialize the modem again.
 //
-static void close_open_port()
+static void close_open_port( struct modem *m )
 {  /* Begin close_open_port */
-  // Close the port
-  close(fd);
+  char message[128];
+
+  // Close the port (this also removes it from the event loop)
+  close(m->fd);
+  m->fd = -1;
+  set_timer( m, 0 );
   start=end;
-  usleep( 250000 );   // quarter second
-  open_port( OPEN_PORT_BLOCKED );
-  usleep( 250000 );   // quarter second
-  log_debug_info("usleep(250000), open port, usleep 250000") ;
-  init_modem(fd );
+  if( open_port( m, OPEN_PORT_POLLED ) != 0 || watch_port( m ) != 0 )
+  {
+    sprintf( message, "%s could not be re-opened; line is out of service", m->serialPort );
+    log_debug_info( message );
+    if( m->fd >= 0 )
+      close( m->fd );
+    m->fd = -1;
+    m->state = MODEM_DOWN;
+    m->modemInitialized = FALSE;
+    return;
+  }
+  log_debug_info("re-opened serial port") ;
+  start_sequence( m, initSequence );
 } /* end close_open_port */
 
 //
-// SIGINT (Ctrl-C) and SIGKILL signal handler
+// Called from the event loop on SIGINT (Ctrl-C) and SIGTERM (kill), and on
+// fatal errors.
 //
 static void cleanup( int signo )
 { /* Begin cleanup */
+  sigset_t mask;
+  int i;
+
   start=end;
   log_debug_info("in cleanup()...wait for kill...");
 
-  if( modemInitialized )
+  // A second Ctrl-C or kill terminates the program at once (if a modem
+  // does not answer ATZ, for example)
+  signal( SIGINT, SIG_DFL );
+  signal( SIGTERM, SIG_DFL );
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  sigprocmask( SIG_UNBLOCK, &mask, NULL );
+
+  for( i = 0; i < numModems; i++ )
   {
-    // Reset the modem
-    send_modem_command(fd, "ATZ\r");
-    log_debug_info("sent ATZ command...\n");
+    if( modems[i].modemInitialized && modems[i].fd >= 0 )
+    {
+      // Reset the modem (in voice mode, end the audio first)
+      if( voiceMode )
+        send_modem_command( &modems[i], "\x10!" );
+      send_modem_command( &modems[i], "ATZ\r" );
+      log_debug_info("sent ATZ command...\n");
+    }
+
+    // Close everything
+    if( modems[i].fd >= 0 )
+      close( modems[i].fd );
   }
 
-  // Close everything
-  close(fd);
-  fclose(fpCa);
-  fclose(fpBl);
-  fclose(fpWh);
-  fflush(stdout);     // flush C library buffers to kernel buffers
+  // The sound command ends when it next writes
+  if( soundPipe != NULL )
+    close( fileno( soundPipe ) );
+
+  // Save what was learned for the next start, then write out queued
+  // callerID.dat records and list edits, and the statistics
+  if( listsLoaded )
+    warm_save();
+  control_stop();
+  persist_drain();
+  stats_stop();
+  log_info("\n\nProgram Terminated\n\n") ;
+
+  // Write out the log and sync it to disk
+  log_stop();
 #ifdef OUTPUT_TO_LOG
   fclose(stdoutStream) ;
 #endif	  
-  sync();             // flush kernel buffers to disk
 
   // If program is in a blocked read(...) call, use kill() to
   // terminate program (happens when modem is not connected!).
@@ -911,8 +1685,6 @@ static void cleanup( int signo )
   {
     kill( 0, SIGKILL );
   }
-  log_info("\n\nProgram Terminated\n\n") ;
   // Otherwise terminate normally
   _exit(0);
 } /* Begin cleanup */
-
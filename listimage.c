@@ -0,0 +1,353 @@
+/*
+Program name: jcblock
+
+File name: listimage.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Compiled list images. jcblock-compile writes a loaded list (its records, string
+pool, automaton, number index and pattern rules) to blacklist.jcb/whitelist.jcb next to the
+.dat file, as the arrays are laid out in memory. jcblock maps the image
+read-only instead of parsing the text file, so nothing is built or allocated
+per record and every process using the image shares one copy of it in the
+page cache. The .dat file stays the one that is edited: an image is only used
+if it was compiled from the .dat file as it is now (same mtime, size and
+inode), its version and structure sizes match this build and its checksum is
+right. Otherwise the text file is loaded as before.
+
+Image layout: a struct image_header, then the sections listed in it, each
+starting on an 8 byte boundary. The checksum covers everything after the
+header. The patterns themselves are compiled again when an image is mapped
+(there are few of them, and their DFA is built as calls come anyway).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+#define IMAGE_MAGIC   "JCBLIST"
+#define IMAGE_VERSION 3        // 2: tokens folded to upper case, 3: patterns
+
+#define SEC_RULES      0
+#define SEC_POOL       1
+#define SEC_NODES      2
+#define SEC_KEYS       3
+#define SEC_EXACT      4
+#define SEC_DIGITS     5
+#define SEC_RANGES     6
+#define SEC_PATTERNS   7
+#define NUM_SECTIONS   8
+
+struct image_header
+{
+  char     magic[8];
+  uint32_t version;
+  uint16_t sizes[6];             // long and the structs (see image_sizes())
+  uint64_t imageLen;             // whole file
+  uint64_t checksum;             // of everything after the header
+  int64_t  mtime;                // the .dat file compiled
+  int64_t  size;
+  int64_t  ino;
+  int32_t  nrules;
+  int32_t  poolLen;
+  int32_t  nnodes;
+  int32_t  numRules;             // number index
+  int32_t  nexact;
+  uint32_t hashMask;
+  int32_t  ndigits;
+  int32_t  nranges;
+  int32_t  npatterns;
+  uint64_t off[NUM_SECTIONS];
+  uint64_t len[NUM_SECTIONS];
+  int32_t  rootNext[256];
+};
+
+static void image_sizes( uint16_t *sizes );
+static uint64_t image_checksum( const unsigned char *p, uint64_t len );
+
+//
+// Name of the image of a list file: its .dat suffix replaced by .jcb.
+//
+void list_image_path( const char *path, char *image, int size )
+{  /* Begin list_image_path */
+  int len = strlen( path );
+
+  if( len > 4 && strcmp( path + len - 4, ".dat" ) == 0 )
+    len -= 4;
+  snprintf( image, size, "%.*s.jcb", len, path );
+}  /* end list_image_path */
+
+//
+// Write the image of a loaded list. It is written under a temporary name
+// and renamed into place, so jcblock never maps a partial image. Returns
+// 0 or -1.
+//
+int write_list_image( const struct match_list *ml, const char *image )
+{  /* Begin write_list_image */
+  const struct number_index *ni = &ml->numbers;
+  struct image_header hdr;
+  const void *data[NUM_SECTIONS];
+  char tmpPath[FILE_PATH_MAX + 8];
+  unsigned char *buf;
+  uint64_t pos;
+  int fd, s, rc;
+
+  memset( &hdr, 0, sizeof( hdr ) );
+  memcpy( hdr.magic, IMAGE_MAGIC, sizeof( hdr.magic ) );
+  hdr.version  = IMAGE_VERSION;
+  image_sizes( hdr.sizes );
+  hdr.mtime    = ml->mtime;
+  hdr.size     = ml->size;
+  hdr.ino      = ml->ino;
+  hdr.nrules   = ml->nrules;
+  hdr.poolLen  = ml->poolLen;
+  hdr.nnodes   = ml->nnodes;
+  hdr.numRules = ni->nrules;
+  hdr.nexact   = ni->nexact;
+  hdr.hashMask = ni->hashMask;
+  hdr.ndigits  = ni->nnodes;
+  hdr.nranges  = ni->nranges;
+  hdr.npatterns = ml->npatterns;
+  memcpy( hdr.rootNext, ml->rootNext, sizeof( hdr.rootNext ) );
+
+  data[SEC_RULES]  = ml->rules;
+  hdr.len[SEC_RULES]  = (uint64_t)ml->nrules * sizeof( struct list_rule );
+  data[SEC_POOL]   = ml->pool;
+  hdr.len[SEC_POOL]   = ml->poolLen;
+  data[SEC_NODES]  = ml->nodes;
+  hdr.len[SEC_NODES]  = (uint64_t)ml->nnodes * sizeof( struct ac_node );
+  data[SEC_KEYS]   = ni->keys;
+  hdr.len[SEC_KEYS]   = ni->hashMask ? ( ni->hashMask + 1ULL ) * sizeof( uint64_t ) : 0;
+  data[SEC_EXACT]  = ni->exactRule;
+  hdr.len[SEC_EXACT]  = ni->hashMask ? ( ni->hashMask + 1ULL ) * sizeof( int ) : 0;
+  data[SEC_DIGITS] = ni->nodes;
+  hdr.len[SEC_DIGITS] = (uint64_t)ni->nnodes * sizeof( struct digit_node );
+  data[SEC_RANGES] = ni->ranges;
+  hdr.len[SEC_RANGES] = (uint64_t)ni->nranges * sizeof( struct number_range );
+  data[SEC_PATTERNS] = ml->patternRules;
+  hdr.len[SEC_PATTERNS] = (uint64_t)ml->npatterns * sizeof( int );
+
+  for( pos = sizeof( hdr ), s = 0; s < NUM_SECTIONS; s++ )
+  {
+    hdr.off[s] = pos;
+    pos = ( pos + hdr.len[s] + 7 ) & ~7ULL;
+  }
+  hdr.imageLen = pos;
+
+  // The image is built in memory so the checksum can go in the header
+  if( ( buf = calloc( 1, hdr.imageLen ) ) == NULL )
+    return( -1 );
+  for( s = 0; s < NUM_SECTIONS; s++ )
+  {
+    if( hdr.len[s] > 0 )
+      memcpy( buf + hdr.off[s], data[s], hdr.len[s] );
+  }
+  hdr.checksum = image_checksum( buf + sizeof( hdr ), hdr.imageLen - sizeof( hdr ) );
+  memcpy( buf, &hdr, sizeof( hdr ) );
+
+  snprintf( tmpPath, sizeof( tmpPath ), "%s.tmp", image );
+  if( ( fd = open( tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) < 0 )
+  {
+    free( buf );
+    return( -1 );
+  }
+  rc = ( write( fd, buf, hdr.imageLen ) == (ssize_t)hdr.imageLen && fsync( fd ) == 0 ) ? 0 : -1;
+  free( buf );
+  if( close( fd ) != 0 || rc != 0 || rename( tmpPath, image ) != 0 )
+  {
+    unlink( tmpPath );
+    return( -1 );
+  }
+  return( 0 );
+}  /* end write_list_image */
+
+//
+// Map the image of a list file. Returns NULL (and the reason in why) if there
+// is no image or it can not be used for the list file as it is now.
+//
+struct match_list *map_list_image( const char *path, const char *name, const char **why )
+{  /* Begin map_list_image */
+  char image[FILE_PATH_MAX];
+  const struct image_header *hdr;
+  struct match_list *ml;
+  struct stat st, ist;
+  uint16_t sizes[6];
+  unsigned char *map;
+  int fd, s, i, r;
+
+  *why = "no image";
+  list_image_path( path, image, sizeof( image ) );
+  if( ( fd = open( image, O_RDONLY ) ) < 0 )
+    return( NULL );
+  if( fstat( fd, &ist ) != 0 || ist.st_size < (off_t)sizeof( *hdr ) )
+  {
+    *why = "image is too short";
+    close( fd );
+    return( NULL );
+  }
+  map = mmap( NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( map == MAP_FAILED )
+  {
+    *why = "mmap() of image failed";
+    return( NULL );
+  }
+  hdr = (const struct image_header *)map;
+
+  image_sizes( sizes );
+  if( memcmp( hdr->magic, IMAGE_MAGIC, sizeof( hdr->magic ) ) != 0 ||
+      hdr->version != IMAGE_VERSION || memcmp( hdr->sizes, sizes, sizeof( sizes ) ) != 0 ||
+      hdr->imageLen != (uint64_t)ist.st_size )
+  {
+    *why = "image is of another version or machine";
+    goto unusable;
+  }
+
+  // The text file is the one that counts
+  if( stat( path, &st ) != 0 || st.st_mtime != hdr->mtime || st.st_size != hdr->size ||
+      st.st_ino != (ino_t)hdr->ino )
+  {
+    *why = "list was edited after the image was compiled";
+    goto unusable;
+  }
+
+  for( s = 0; s < NUM_SECTIONS; s++ )
+  {
+    if( hdr->off[s] < sizeof( *hdr ) || hdr->off[s] > hdr->imageLen ||
+        hdr->len[s] > hdr->imageLen - hdr->off[s] )
+    {
+      *why = "image sections are not valid";
+      goto unusable;
+    }
+  }
+  if( hdr->checksum != image_checksum( map + sizeof( *hdr ), hdr->imageLen - sizeof( *hdr ) ) )
+  {
+    *why = "image checksum is wrong";
+    goto unusable;
+  }
+
+  if( ( ml = calloc( 1, sizeof( *ml ) ) ) == NULL )
+  {
+    *why = "out of memory";
+    goto unusable;
+  }
+  ml->path     = strdup( path );
+  ml->name     = strdup( name );
+  ml->image    = map;
+  ml->imageLen = hdr->imageLen;
+  ml->mtime    = hdr->mtime;
+  ml->size     = hdr->size;
+  ml->ino      = hdr->ino;
+  ml->nrules   = hdr->nrules;
+  ml->poolLen  = hdr->poolLen;
+  ml->nnodes   = hdr->nnodes;
+  ml->rules    = (struct list_rule *)( map + hdr->off[SEC_RULES] );
+  ml->pool     = (char *)( map + hdr->off[SEC_POOL] );
+  ml->nodes    = (struct ac_node *)( map + hdr->off[SEC_NODES] );
+  memcpy( ml->rootNext, hdr->rootNext, sizeof( ml->rootNext ) );
+
+  ml->numbers.nrules    = hdr->numRules;
+  ml->numbers.nexact    = hdr->nexact;
+  ml->numbers.hashMask  = hdr->hashMask;
+  ml->numbers.keys      = (uint64_t *)( map + hdr->off[SEC_KEYS] );
+  ml->numbers.exactRule = (int *)( map + hdr->off[SEC_EXACT] );
+  ml->numbers.nnodes    = ml->numbers.nodeCap = hdr->ndigits;
+  ml->numbers.nodes     = (struct digit_node *)( map + hdr->off[SEC_DIGITS] );
+  ml->numbers.nranges   = ml->numbers.rangeCap = hdr->nranges;
+  ml->numbers.ranges    = (struct number_range *)( map + hdr->off[SEC_RANGES] );
+
+  ml->npatterns    = hdr->npatterns;
+  ml->patternRules = (int *)( map + hdr->off[SEC_PATTERNS] );
+  for( i = 0; i < ml->npatterns; i++ )
+  {
+    r = ml->patternRules[i];
+    if( r < 0 || r >= ml->nrules ||
+        pattern_add( &ml->patterns, ml->pool + ml->rules[r].text_off, ml->rules[r].token_len,
+                     r ) != PATTERN_RULE )
+      break;
+  }
+  if( i < ml->npatterns || ( ml->patterns != NULL && pattern_finish( ml->patterns ) != 0 ) )
+  {
+    *why = "image patterns are not valid";
+    free_list( ml );      // unmaps the image
+    return( NULL );
+  }
+  return( ml );
+
+unusable:
+  munmap( map, ist.st_size );
+  return( NULL );
+}  /* end map_list_image */
+
+//
+// Get a list: its image if there is a usable one, otherwise the text file
+// (NULL if that can not be read either).
+//
+struct match_list *open_list( const char *path, const char *name )
+{  /* Begin open_list */
+  struct match_list *ml;
+  const char *why;
+  char message[FILE_PATH_MAX + 80];
+
+  if( ( ml = map_list_image( path, name, &why ) ) != NULL )
+  {
+    sprintf( message, "%s: using compiled image (%d entries)", name, ml->nrules );
+    log_debug_info( message );
+    return( ml );
+  }
+  if( strcmp( why, "no image" ) != 0 )
+  {
+    sprintf( message, "%s: %s; reading %s", name, why, path );
+    log_debug_info( message );
+  }
+  return( load_list( path, name ) );
+}  /* end open_list */
+
+//
+// Sizes that must be the same in the compiler and in jcblock.
+//
+static void image_sizes( uint16_t *sizes )
+{  /* Begin image_sizes */
+  sizes[0] = sizeof( long );
+  sizes[1] = sizeof( int );
+  sizes[2] = sizeof( struct list_rule );
+  sizes[3] = sizeof( struct ac_node );
+  sizes[4] = sizeof( struct digit_node );
+  sizes[5] = sizeof( struct number_range );
+}  /* end image_sizes */
+
+//
+// 64 bit FNV-1a, taken over 8 byte words (the sections are padded to 8 bytes).
+//
+static uint64_t image_checksum( const unsigned char *p, uint64_t len )
+{  /* Begin image_checksum */
+  uint64_t h = 0xCBF29CE484222325ULL;
+  uint64_t w;
+
+  for( ; len >= 8; p += 8, len -= 8 )
+  {
+    memcpy( &w, p, 8 );
+    h = ( h ^ w ) * 0x100000001B3ULL;
+  }
+  for( ; len > 0; p++, len-- )
+    h = ( h ^ *p ) * 0x100000001B3ULL;
+  return( h );
+}  /* end image_checksum */
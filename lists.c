@@ -0,0 +1,791 @@
+/*
+Program name: jcblock
+
+File name: lists.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Reads whitelist.dat or blacklist.dat once and builds an Aho-Corasick automaton
+over the "Test field?" tokens of all of its records. A caller ID string is then
+checked against every record of the list in a single pass, so the time needed
+depends on the length of the caller ID string and not on the length of the list.
+When several records match, the one nearest the top of the file wins (the same
+record the old line-by-line scan would have found). Test fields that are
+telephone numbers, number prefixes or number ranges are not put in the
+automaton; they are compared with the number of the call only (numidx.c).
+Neither are globs and regular expressions, which are matched against the whole
+number or name of the call (pattern.c).
+Letters of the name match in either case: the tokens are put in the
+automaton in upper case and the name field of the caller ID string is folded
+to upper case as it is scanned (fold.c); the date and number fields are
+scanned as they are.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+// The sizes the arrays of a list being built are allocated with
+struct list_caps
+{
+  int rules, nodes, pool, patterns;
+};
+
+#define RECORD_IGNORED  0      // add_record() results
+#define RECORD_TEXT     1      // in the automaton
+#define RECORD_NUMBER   2      // in the number index
+#define RECORD_PATTERN  3      // in the pattern set
+
+static int add_record( struct match_list *ml, struct list_caps *caps, char *buf,
+                       long file_pos );
+static int add_node( struct match_list *ml, int *nodeCap, unsigned char c );
+static int ac_insert( struct match_list *ml, int *nodeCap, const char *token, int len, int rule );
+static void ac_build_fail_links( struct match_list *ml );
+static int ac_goto( const struct match_list *ml, int state, unsigned char c );
+static int ac_scan( const struct match_list *ml, int state, const unsigned char *text, int len,
+                    int *found );
+static long usec_now( void );
+static struct match_list *read_list( FILE *fp, const char *path, const char *name );
+
+//
+// Read a list file and build its automaton. Returns NULL if the file
+// can not be opened or memory runs out.
+//
+struct match_list *load_list( const char *path, const char *name )
+{  /* Begin load_list */
+  FILE *fp;
+
+  if( ( fp = fopen( path, "r" ) ) == NULL )
+    return( NULL );
+  return( read_list( fp, path, name ) );
+}  /* end load_list */
+
+//
+// Build a list from records held in memory (each ending with '\n'), as if
+// they were the list file path. Used for the entries added through the
+// control socket (control.c) until the file has them. Returns NULL if
+// memory runs out.
+//
+struct match_list *load_list_records( const char *records, const char *path, const char *name )
+{  /* Begin load_list_records */
+  FILE *fp;
+
+  if( ( fp = fmemopen( (void *)records, strlen( records ), "r" ) ) == NULL )
+    return( NULL );
+  return( read_list( fp, path, name ) );
+}  /* end load_list_records */
+
+//
+// Format a list record: the token followed by '?', the date and the
+// comment in their columns (the comment is cut to end by column 80).
+// Returns record.
+//
+char *list_format_record( char *record, int size, const char *token, const char *date,
+                          const char *comment )
+{  /* Begin list_format_record */
+  char field[LIST_TERM_MAX + 2];
+
+  // Test field?        |YYYY-MM-DDThh:mm|Comment string|
+  snprintf( field, sizeof( field ), "%s?", token );
+  snprintf( record, size, "%-*s|%.*s|%.*s|\n", LIST_DATE_COL - 1, field,
+            LIST_DATE_LEN, date, 80 - LIST_DATE_COL - LIST_DATE_LEN - 2, comment );
+  return( record );
+}  /* end list_format_record */
+
+//
+// Read the records of fp (closed before returning) and build the automaton.
+//
+static struct match_list *read_list( FILE *fp, const char *path, const char *name )
+{  /* Begin read_list */
+  struct match_list *ml;
+  struct stat st;
+  char buf[LIST_LINE_MAX];
+  struct list_caps caps = { 0, 0, 0, 0 };
+  int len;
+  long file_pos_last, file_pos_next = 0;
+
+  if( ( ml = calloc( 1, sizeof( *ml ) ) ) == NULL )
+  {
+    fclose( fp );
+    return( NULL );
+  }
+  ml->path = strdup( path );
+  ml->name = strdup( name );
+
+  if( fstat( fileno( fp ), &st ) == 0 )
+  {
+    ml->mtime = st.st_mtime;
+    ml->size  = st.st_size;
+    ml->ino   = st.st_ino;
+  }
+
+  // Node 0 is the root
+  if( add_node( ml, &caps.nodes, 0 ) < 0 )
+    goto failed;
+
+  // Read and process records from the file
+  while( fgets( buf, sizeof( buf ), fp ) != NULL )
+  {
+    // Save the start location of the string just read and get
+    // the location of the start of the next string in the file.
+    file_pos_last = file_pos_next;
+    file_pos_next = ftell( fp );
+
+    // A last line without a '\n' may still be being written (a line that
+    // starts with a '\0', in a damaged file, has no length at all)
+    len = strlen( buf );
+    ml->partial = ( len > 0 && buf[len - 1] != '\n' );
+
+    if( add_record( ml, &caps, buf, file_pos_last ) < 0 )
+      goto failed;
+  }
+  fclose( fp );
+
+  if( numidx_finish( &ml->numbers ) < 0 ||
+      ( ml->patterns != NULL && pattern_finish( ml->patterns ) < 0 ) )
+  {
+    fp = NULL;
+    goto failed;
+  }
+  ac_build_fail_links( ml );
+  return( ml );
+
+failed:
+  log_debug_info("out of memory building list automaton");
+  if( fp != NULL )
+    fclose( fp );
+  free_list( ml );
+  return( NULL );
+}  /* end read_list */
+
+//
+// Check a record (a line of the list file) and add it to the list being
+// built as rule ml->nrules. Returns RECORD_IGNORED (not a valid record; the
+// reason is logged), where it was added (RECORD_TEXT, _NUMBER, _PATTERN) or
+// -1 (out of memory).
+//
+static int add_record( struct match_list *ml, struct list_caps *caps, char *buf,
+                       long file_pos )
+{  /* Begin add_record */
+  char token[LIST_TERM_MAX + 1];
+  char message[256];
+  char *strptr;
+  int len, kind, pattern;
+
+  // Ignore lines that start with a '#' character (comment lines)
+  if( buf[0] == '#' )
+    return( RECORD_IGNORED );
+
+  // Ignore lines containing just a '\n'
+  if( buf[0] == '\n' )
+    return( RECORD_IGNORED );
+
+  // Ignore records that are too short (don't have room for the date)
+  if( strlen( buf ) < LIST_MIN_RECORD )
+  {
+    sprintf( message, "\nERROR: %s.dat record is too short to hold date field.\n", ml->name );
+    log_info( message );
+    log_info( buf );
+    log_info("record is ignored (edit file and fix it).\n");
+    return( RECORD_IGNORED );
+  }
+
+  // Make sure a '?' char is present in the string
+  if( ( strptr = strchr( buf, '?' ) ) == NULL )
+  {
+    sprintf( message, "\nERROR: all %s.dat entry first fields *must be*\n", ml->name );
+    log_info( message );
+    log_info("       terminated with a \'?\' character!! Entry is:\n");
+    log_info( buf );
+    log_info("Entry was ignored!\n");
+    return( RECORD_IGNORED );
+  }
+
+  // Make sure the '?' character is within the first twenty characters
+  // (could not be if the previous record was only partially written).
+  if( (int)( strptr - buf ) > LIST_TERM_MAX )
+  {
+    log_info("\nERROR: terminator '?' is not within first 20 characters\n" );
+    log_info( buf );
+    log_info("Entry was ignored!\n");
+    return( RECORD_IGNORED );
+  }
+
+  // An empty test field would match every call
+  if( strptr == buf )
+  {
+    log_info("\nERROR: test field is empty\n" );
+    log_info( buf );
+    log_info("Entry was ignored!\n");
+    return( RECORD_IGNORED );
+  }
+
+  // Globs and regular expressions go to the pattern set
+  if( ( pattern = pattern_add( &ml->patterns, buf, strptr - buf, ml->nrules ) ) < 0 )
+    return( -1 );
+  if( pattern == BAD_PATTERN_RULE )
+  {
+    log_info("\nERROR: pattern is not valid (see README)\n" );
+    log_info( buf );
+    log_info("Entry was ignored!\n");
+    return( RECORD_IGNORED );
+  }
+
+  // Telephone numbers, prefixes and ranges go to the number index
+  kind = NOT_NUMBER_RULE;
+  if( pattern == NOT_PATTERN_RULE &&
+      ( kind = numidx_add( &ml->numbers, buf, strptr - buf, ml->nrules ) ) < 0 )
+    return( -1 );
+  if( kind == BAD_NUMBER_RULE )
+  {
+    log_info("\nERROR: number, prefix (digits then '*') or range (a..b) is not valid\n" );
+    log_info( buf );
+    log_info("Entry was ignored!\n");
+    return( RECORD_IGNORED );
+  }
+
+  // Save the record text (without its '\n')
+  len = strcspn( buf, "\r\n" );
+  if( ml->poolLen + len + 1 > caps->pool )
+  {
+    char *p;
+    caps->pool = caps->pool ? caps->pool * 2 : 4096;
+    while( caps->pool < ml->poolLen + len + 1 )
+      caps->pool *= 2;
+    if( ( p = realloc( ml->pool, caps->pool ) ) == NULL )
+      return( -1 );
+    ml->pool = p;
+  }
+
+  if( ml->nrules == caps->rules )
+  {
+    struct list_rule *r;
+    caps->rules = caps->rules ? caps->rules * 2 : 256;
+    if( ( r = realloc( ml->rules, caps->rules * sizeof( *r ) ) ) == NULL )
+      return( -1 );
+    ml->rules = r;
+  }
+
+  ml->rules[ml->nrules].file_pos  = file_pos;
+  ml->rules[ml->nrules].text_off  = ml->poolLen;
+  ml->rules[ml->nrules].text_len  = len;
+  ml->rules[ml->nrules].token_len = strptr - buf;
+  memcpy( ml->pool + ml->poolLen, buf, len );
+  ml->pool[ml->poolLen + len] = 0;
+  ml->poolLen += len + 1;
+
+  if( pattern == PATTERN_RULE )
+  {
+    if( ml->npatterns == caps->patterns )
+    {
+      int *p;
+      caps->patterns = caps->patterns ? caps->patterns * 2 : 16;
+      if( ( p = realloc( ml->patternRules, caps->patterns * sizeof( int ) ) ) == NULL )
+        return( -1 );
+      ml->patternRules = p;
+    }
+    ml->patternRules[ml->npatterns++] = ml->nrules;
+  }
+  else if( kind == NOT_NUMBER_RULE )
+  {
+    fold_upper( token, buf, strptr - buf );
+    if( ac_insert( ml, &caps->nodes, token, strptr - buf, ml->nrules ) < 0 )
+      return( -1 );
+  }
+  ml->nrules++;
+  return( pattern == PATTERN_RULE ? RECORD_PATTERN :
+          kind == NUMBER_RULE ? RECORD_NUMBER : RECORD_TEXT );
+}  /* end add_record */
+
+//
+// An empty list, for list_add_record(). Returns NULL if memory runs out.
+//
+struct match_list *new_list( const char *path, const char *name )
+{  /* Begin new_list */
+  struct match_list *ml;
+  int nodeCap = 0;
+
+  if( ( ml = calloc( 1, sizeof( *ml ) ) ) == NULL )
+    return( NULL );
+  ml->path = strdup( path );
+  ml->name = strdup( name );
+  if( add_node( ml, &nodeCap, 0 ) < 0 )
+  {
+    free_list( ml );
+    return( NULL );
+  }
+  return( ml );
+}  /* end new_list */
+
+//
+// Add one record to a list built from records (new_list() or
+// load_list_records(), not a mapped image) as its last rule, without
+// building the list again: the record goes into the number index, the
+// pattern set or the trie, and only what it changed is finished again (the
+// range segments, the pattern byte classes or the failure links). Meant
+// for the small lists of control.c. Returns 0, 1 if the record is not one
+// the list file would accept, or -1 (out of memory; the list may then have
+// part of the record and should be built again).
+//
+int list_add_record( struct match_list *ml, const char *record )
+{  /* Begin list_add_record */
+  struct list_caps caps;
+  char buf[LIST_LINE_MAX];
+
+  snprintf( buf, sizeof( buf ), "%s", record );
+
+  // The arrays are as large as they are full: the first record added
+  // doubles them
+  caps.rules    = ml->nrules;
+  caps.nodes    = ml->nnodes;
+  caps.pool     = ml->poolLen;
+  caps.patterns = ml->npatterns;
+  switch( add_record( ml, &caps, buf, 0 ) )
+  {
+    case RECORD_IGNORED:
+      return( 1 );
+    case RECORD_TEXT:
+      ac_build_fail_links( ml );
+      return( 0 );
+    case RECORD_NUMBER:
+      return( numidx_finish( &ml->numbers ) );
+    case RECORD_PATTERN:
+      return( pattern_finish( ml->patterns ) );
+  }
+  return( -1 );
+}  /* end list_add_record */
+
+//
+// A copy of a list without the rules whose test field drop() picks (it is
+// given the test field and arg), the other rules in the same order. Used
+// by control.c to match the entries that are left when the first entry a
+// call matches was removed. Returns NULL if memory runs out.
+//
+struct match_list *list_without( const struct match_list *ml,
+                                 bool (*drop)( const char *token, void *arg ), void *arg )
+{  /* Begin list_without */
+  struct match_list *out;
+  struct list_caps caps = { 0, 0, 0, 0 };
+  char buf[LIST_LINE_MAX];
+  char token[LIST_TERM_MAX + 1];
+  int r;
+
+  if( ( out = new_list( ml->path, ml->name ) ) == NULL )
+    return( NULL );
+  caps.nodes = out->nnodes;
+  for( r = 0; r < ml->nrules; r++ )
+  {
+    if( drop( list_rule_token( ml, r, token, sizeof( token ) ), arg ) )
+      continue;
+    snprintf( buf, sizeof( buf ), "%.*s", ml->rules[r].text_len, ml->pool + ml->rules[r].text_off );
+    if( add_record( out, &caps, buf, ml->rules[r].file_pos ) < 0 )
+      break;
+  }
+  if( r < ml->nrules || numidx_finish( &out->numbers ) < 0 ||
+      ( out->patterns != NULL && pattern_finish( out->patterns ) < 0 ) )
+  {
+    log_debug_info("out of memory building list automaton");
+    free_list( out );
+    return( NULL );
+  }
+  ac_build_fail_links( out );
+  return( out );
+}  /* end list_without */
+
+//
+// Release a list returned by load_list() or map_list_image().
+//
+void free_list( struct match_list *ml )
+{  /* Begin free_list */
+  if( ml == NULL )
+    return;
+  free( ml->path );
+  free( ml->name );
+  pattern_free( ml->patterns );
+  if( ml->image != NULL )
+  {
+    // The arrays are in the image
+    munmap( ml->image, ml->imageLen );
+    free( ml );
+    return;
+  }
+  free( ml->rules );
+  free( ml->pool );
+  free( ml->nodes );
+  free( ml->patternRules );
+  numidx_free( &ml->numbers );
+  free( ml );
+}  /* end free_list */
+
+//
+// Return TRUE if the list file was edited (or replaced) after it was loaded.
+//
+bool list_changed( const struct match_list *ml )
+{  /* Begin list_changed */
+  struct stat st;
+
+  if( stat( ml->path, &st ) != 0 )
+    return( FALSE );        // keep using what we have
+  return( st.st_mtime != ml->mtime || st.st_size != ml->size ||
+          st.st_ino != ml->ino );
+}  /* end list_changed */
+
+//
+// Scan the caller ID string once, look up its number field
+// ("date|number|name|") and run the patterns on the number and name.
+// Returns the index of the first record (in file order) whose token occurs
+// in the string (in any case within the name), whose number rule matches
+// the number or whose pattern matches, or NO_MATCH.
+//
+int match_list( const struct match_list *ml, const char *callstr )
+{  /* Begin match_list */
+  unsigned char folded[FOLD_CHUNK];
+  const char *number, *numberEnd, *nameEnd;
+  int state;
+  int next;
+  int found = INT_MAX;
+  int len = strlen( callstr );
+  int nameOff = len, nameLen = 0;
+  int off, n;
+
+  if( ml->numbers.nrules > 0 && ( number = strchr( callstr, '|' ) ) != NULL &&
+      ( numberEnd = strchr( ++number, '|' ) ) != NULL &&
+      ( next = numidx_lookup( &ml->numbers, number, numberEnd - number ) ) != NO_MATCH )
+    found = next;
+
+  // Only the name field is folded; the date and the number are scanned as
+  // the modem sent them (digits, separators and upper case letters)
+  if( ( number = strchr( callstr, '|' ) ) != NULL &&
+      ( numberEnd = strchr( number + 1, '|' ) ) != NULL )
+  {
+    nameOff = numberEnd + 1 - callstr;
+    nameEnd = strchr( numberEnd + 1, '|' );
+    nameLen = ( nameEnd != NULL ? nameEnd - callstr : len ) - nameOff;
+  }
+  state = ac_scan( ml, 0, (const unsigned char *)callstr, nameOff, &found );
+
+  // The automaton keeps its state from one folded chunk to the next
+  for( off = nameOff; off < nameOff + nameLen; off += n )
+  {
+    n = nameOff + nameLen - off < FOLD_CHUNK ? nameOff + nameLen - off : FOLD_CHUNK;
+    fold_upper( (char *)folded, callstr + off, n );
+    state = ac_scan( ml, state, folded, n, &found );
+  }
+  ac_scan( ml, state, (const unsigned char *)callstr + nameOff + nameLen,
+           len - nameOff - nameLen, &found );
+
+  if( ml->patterns != NULL && ( number = strchr( callstr, '|' ) ) != NULL &&
+      ( numberEnd = strchr( ++number, '|' ) ) != NULL )
+  {
+    nameEnd = strchr( numberEnd + 1, '|' );
+    next = pattern_match( ml->patterns, number, numberEnd - number,
+                          nameEnd != NULL ? numberEnd + 1 : NULL,
+                          nameEnd != NULL ? nameEnd - numberEnd - 1 : 0 );
+    if( next != NO_MATCH && next < found )
+      found = next;
+  }
+  return( found == INT_MAX ? NO_MATCH : found );
+}  /* end match_list */
+
+//
+// Decide what to do with a call: CALL_WHITELISTED if a whitelist record
+// matches (white may be NULL), CALL_BLOCKED if a blacklist record matches or
+// the caller ID string is too short, otherwise CALL_ACCEPTED. *rule is set to
+// the matching record (NO_MATCH for a short string). If checkUsec is not NULL
+// the time of the whitelist and blacklist checks is stored in checkUsec[0]
+// and checkUsec[1] (-1 for a check that was not needed).
+//
+int decide_call( const struct match_list *white, const struct match_list *black,
+                 const char *callstr, int *rule, long *checkUsec )
+{  /* Begin decide_call */
+  long t0 = 0;
+
+  if( checkUsec != NULL )
+  {
+    checkUsec[0] = checkUsec[1] = -1;
+    t0 = usec_now();
+  }
+
+  *rule = NO_MATCH;
+  if( white != NULL )
+  {
+    *rule = match_list( white, callstr );
+    if( checkUsec != NULL )
+      checkUsec[0] = usec_now() - t0;
+    if( *rule != NO_MATCH )
+      return( CALL_WHITELISTED );
+  }
+
+  if( checkUsec != NULL )
+    t0 = usec_now();
+  *rule = match_list( black, callstr );
+  if( checkUsec != NULL )
+    checkUsec[1] = usec_now() - t0;
+  if( *rule != NO_MATCH || strlen( callstr ) < CALLSTR_MIN )
+    return( CALL_BLOCKED );
+  return( CALL_ACCEPTED );
+}  /* end decide_call */
+
+static long usec_now( void )
+{  /* Begin usec_now */
+  struct timespec t;
+
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return( t.tv_sec * 1000000L + t.tv_nsec / 1000 );
+}  /* end usec_now */
+
+//
+// Bytes of memory used by a list (records, their text, the automaton, the
+// number index and the patterns).
+//
+long list_memory( const struct match_list *ml )
+{  /* Begin list_memory */
+  return( sizeof( *ml ) + strlen( ml->path ) + strlen( ml->name ) + 2 +
+          (long)ml->nrules * sizeof( struct list_rule ) + ml->poolLen +
+          (long)ml->nnodes * sizeof( struct ac_node ) + numidx_memory( &ml->numbers ) +
+          (long)ml->npatterns * sizeof( int ) +
+          ( ml->patterns != NULL ? pattern_memory( ml->patterns ) : 0 ) );
+}  /* end list_memory */
+
+//
+// Whether a token of the list could occur in the date that starts every
+// caller ID string ("YYYY-MM-DDThh:mm|"), so that a check depends on when
+// the call came and not only on its number and name (see cache.c).
+//
+bool list_matches_dates( const struct match_list *ml )
+{  /* Begin list_matches_dates */
+  static const char date[] = "0000-00-00T00:00|";     // '0': any digit
+  char token[LIST_TERM_MAX + 1];
+  int r, o, i, len;
+
+  for( r = 0; r < ml->nrules; r++ )
+  {
+    len = ml->rules[r].token_len;
+    fold_upper( token, ml->pool + ml->rules[r].text_off, len );
+    for( o = 0; o < (int)sizeof( date ) - 1; o++ )
+    {
+      for( i = 0; i < len && o + i < (int)sizeof( date ) - 1; i++ )
+      {
+        if( date[o + i] == '0' ? ( token[i] < '0' || token[i] > '9' ) : token[i] != date[o + i] )
+          break;
+      }
+      if( i == len || o + i == (int)sizeof( date ) - 1 )
+        return( TRUE );
+    }
+  }
+  return( FALSE );
+}  /* end list_matches_dates */
+
+//
+// Whether every entry of the list is a number rule, so that only the
+// number of a call can match it (not its name or date).
+//
+bool list_numbers_only( const struct match_list *ml )
+{  /* Begin list_numbers_only */
+  return( ml->nnodes <= 1 && ml->npatterns == 0 );
+}  /* end list_numbers_only */
+
+//
+// A hash of the tokens of the list, in order: equal for lists that differ
+// only in their dates and comments, which decide every call the same way.
+//
+uint64_t list_fingerprint( const struct match_list *ml )
+{  /* Begin list_fingerprint */
+  uint64_t h = 14695981039346656037ULL;
+  const char *token;
+  int r, i;
+
+  for( r = 0; r < ml->nrules; r++ )
+  {
+    token = ml->pool + ml->rules[r].text_off;
+    for( i = 0; i < ml->rules[r].token_len; i++ )
+      h = ( h ^ (unsigned char)token[i] ) * 1099511628211ULL;
+    h = ( h ^ '\n' ) * 1099511628211ULL;
+  }
+  return( h );
+}  /* end list_fingerprint */
+
+//
+// Copy the token of a record into buf (for messages).
+//
+const char *list_rule_token( const struct match_list *ml, int rule, char *buf, int bufLen )
+{  /* Begin list_rule_token */
+  int len = ml->rules[rule].token_len;
+
+  if( len > bufLen - 1 )
+    len = bufLen - 1;
+  memcpy( buf, ml->pool + ml->rules[rule].text_off, len );
+  buf[len] = 0;
+  return( buf );
+}  /* end list_rule_token */
+
+//
+// Append a node to the automaton. Returns its index or -1.
+//
+static int add_node( struct match_list *ml, int *nodeCap, unsigned char c )
+{  /* Begin add_node */
+  struct ac_node *n;
+
+  if( ml->nnodes == *nodeCap )
+  {
+    *nodeCap = *nodeCap ? *nodeCap * 2 : 1024;
+    if( ( n = realloc( ml->nodes, *nodeCap * sizeof( *n ) ) ) == NULL )
+      return( -1 );
+    ml->nodes = n;
+  }
+  n = &ml->nodes[ml->nnodes];
+  n->child   = 0;
+  n->sibling = 0;
+  n->fail    = 0;
+  n->best    = INT_MAX;
+  n->c       = c;
+  return( ml->nnodes++ );
+}  /* end add_node */
+
+//
+// Add a token to the trie. Children are kept sorted by byte so that
+// ac_goto() can stop early.
+//
+static int ac_insert( struct match_list *ml, int *nodeCap, const char *token, int len, int rule )
+{  /* Begin ac_insert */
+  int state = 0;
+  int i, prev, cur, n;
+  unsigned char c;
+
+  for( i = 0; i < len; i++ )
+  {
+    c = (unsigned char)token[i];
+    prev = 0;
+    cur = ml->nodes[state].child;
+    while( cur && ml->nodes[cur].c < c )
+    {
+      prev = cur;
+      cur = ml->nodes[cur].sibling;
+    }
+    if( cur && ml->nodes[cur].c == c )
+    {
+      state = cur;
+      continue;
+    }
+
+    if( ( n = add_node( ml, nodeCap, c ) ) < 0 )
+      return( -1 );
+    ml->nodes[n].sibling = cur;
+    if( prev )
+      ml->nodes[prev].sibling = n;
+    else
+      ml->nodes[state].child = n;
+    state = n;
+  }
+
+  // Duplicate tokens: the first record keeps the match
+  if( rule < ml->nodes[state].best )
+    ml->nodes[state].best = rule;
+  return( 0 );
+}  /* end ac_insert */
+
+//
+// Breadth first pass that sets the failure links, folds the best rule of
+// each failure chain into its nodes and fills the root transition table.
+//
+static void ac_build_fail_links( struct match_list *ml )
+{  /* Begin ac_build_fail_links */
+  struct ac_node *nodes = ml->nodes;
+  int *queue;
+  int head = 0, tail = 0;
+  int s, t, f, next;
+
+  for( s = 0; s < 256; s++ )
+    ml->rootNext[s] = 0;
+  for( t = nodes[0].child; t; t = nodes[t].sibling )
+    ml->rootNext[nodes[t].c] = t;
+
+  if( ( queue = malloc( ml->nnodes * sizeof( int ) ) ) == NULL )
+  {
+    // Without the queue the automaton still works as a plain trie on
+    // the root; this only happens if memory is exhausted.
+    log_debug_info("out of memory building failure links");
+    return;
+  }
+
+  for( t = nodes[0].child; t; t = nodes[t].sibling )
+  {
+    nodes[t].fail = 0;
+    queue[tail++] = t;
+  }
+
+  while( head < tail )
+  {
+    s = queue[head++];
+    for( t = nodes[s].child; t; t = nodes[t].sibling )
+    {
+      f = nodes[s].fail;
+      while( ( next = ac_goto( ml, f, nodes[t].c ) ) < 0 )
+        f = nodes[f].fail;
+      nodes[t].fail = next;
+      if( nodes[nodes[t].fail].best < nodes[t].best )
+        nodes[t].best = nodes[nodes[t].fail].best;
+      queue[tail++] = t;
+    }
+  }
+  free( queue );
+}  /* end ac_build_fail_links */
+
+//
+// Trie transition. Returns -1 if the state has no edge for c (the root
+// always has one, falling back to itself).
+//
+static int ac_goto( const struct match_list *ml, int state, unsigned char c )
+{  /* Begin ac_goto */
+  int t;
+
+  if( state == 0 )
+    return( ml->rootNext[c] );
+
+  for( t = ml->nodes[state].child; t && ml->nodes[t].c <= c; t = ml->nodes[t].sibling )
+  {
+    if( ml->nodes[t].c == c )
+      return( t );
+  }
+  return( -1 );
+}  /* end ac_goto */
+
+//
+// Run the automaton over len bytes of text from state, lowering *found to
+// the best rule seen. Returns the state it ends in.
+//
+static int ac_scan( const struct match_list *ml, int state, const unsigned char *text, int len,
+                    int *found )
+{  /* Begin ac_scan */
+  const struct ac_node *nodes = ml->nodes;
+  int next, i;
+
+  for( i = 0; i < len; i++ )
+  {
+    while( ( next = ac_goto( ml, state, text[i] ) ) < 0 )
+      state = nodes[state].fail;
+    state = next;
+    if( nodes[state].best < *found )
+      *found = nodes[state].best;
+  }
+  return( state );
+}  /* end ac_scan */
@@ -0,0 +1,249 @@
+/*
+Program name: jcblock
+
+File name: log.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Logging for jcblock. log_info() and log_debug_info() format their message into
+a slot of an in-memory ring and return; they never call fflush() or sync(). The
+ring is lock-free (any thread may log) and a flusher thread copies what it
+holds to stdout (jcblock.log) every LOG_FLUSH_MSEC. The file is only synced at
+shutdown and, if set with -s, every so many seconds. If the ring fills up a
+message is dropped and counted instead of making the caller wait.
+
+Each message starts with the wall clock time, formatted at most once per second
+per thread, and the msec elapsed since the last 'start=end;' of the caller.
+'start' and 'end' are per thread; the event loop keeps a 'start' for each
+modem line, so the steps of one call are not timed from another.
+Debug messages are written only at log level LOG_DEBUG (set with -l).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "common.h"
+
+#define LOG_RING_SIZE  1024            // a power of two
+#define LOG_SLOT_SIZE  384
+#define LOG_FLUSH_MSEC 50
+
+struct log_slot
+{
+  unsigned long seq;                   // ring position this slot is ready for
+  int  len;
+  char text[LOG_SLOT_SIZE];
+};
+
+// Event timing: 'start=end;' before a step, the next message shows its msec
+__thread struct timeval start, end;
+
+static struct log_slot ring[LOG_RING_SIZE];
+static unsigned long enqueuePos, dequeuePos;
+static unsigned long droppedMessages;
+static int logLevel = LOG_DEBUG;
+static int syncSeconds;                // 0: only at shutdown
+static bool flusherRunning, flusherStop;
+static pthread_t flusherThread;
+
+static void log_message( const char *command, bool newline );
+static void *flush_log( void *arg );
+static int write_ring( void );
+
+//
+// Set the ring up and start the flusher thread. Messages logged before
+// this are kept in the ring.
+//
+int log_start( int level, int syncInterval )
+{  /* Begin log_start */
+  logLevel = level;
+  syncSeconds = syncInterval;
+  if( pthread_create( &flusherThread, NULL, flush_log, NULL ) != 0 )
+    return( -1 );
+  flusherRunning = TRUE;
+  atexit( log_stop );
+  return( 0 );
+}  /* end log_start */
+
+//
+// Write out everything still in the ring and sync the log file (called at
+// termination; also registered with atexit()).
+//
+void log_stop( void )
+{  /* Begin log_stop */
+  if( flusherRunning )
+  {
+    __atomic_store_n( &flusherStop, TRUE, __ATOMIC_RELEASE );
+    pthread_join( flusherThread, NULL );
+    flusherRunning = FALSE;
+  }
+  while( write_ring() > 0 )
+    ;
+  fsync( STDOUT_FILENO );
+}  /* end log_stop */
+
+//
+//  Log a command to the output (at log level LOG_DEBUG only)
+//
+int log_debug_info( char *command )
+{  /* Begin log_debug_info */
+  if( logLevel >= LOG_DEBUG )
+    log_message( command, TRUE );
+  return( 0 );
+// use start=end ; to time event
+}  /* end   log_debug_info */
+
+int log_info( char *command )
+{  /* Begin log_info */
+  log_message( command, FALSE );
+  return( 0 );
+}  /* end   log_info */
+
+//
+// Format a message into the next free slot of the ring.
+//
+static void log_message( const char *command, bool newline )
+{  /* Begin log_message */
+  static __thread time_t cachedSecond = -1;
+  static __thread char iso_8601[] = "YYYY-MM-DDTHH:MM:SS";
+  struct log_slot *slot;
+  struct tm now_tm;
+  unsigned long pos, seq;
+  long mtime, seconds, useconds;
+  long diff;
+  int len;
+
+  gettimeofday(&end, NULL);
+  if( start.tv_sec == 0 )
+    start = end;                       // the first message of this thread
+  seconds  = end.tv_sec  - start.tv_sec;
+  useconds = end.tv_usec - start.tv_usec;
+  mtime = ((seconds) * 1000 + useconds/1000.0);
+
+  // The date and time only change once per second
+  if( end.tv_sec != cachedSecond )
+  {
+    cachedSecond = end.tv_sec;
+    localtime_r( &cachedSecond, &now_tm );
+    strftime(iso_8601, sizeof (iso_8601), "%FT%R:%S", &now_tm);
+  }
+
+  // Claim a slot
+  pos = __atomic_load_n( &enqueuePos, __ATOMIC_RELAXED );
+  for( ;; )
+  {
+    slot = &ring[pos & ( LOG_RING_SIZE - 1 )];
+    seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
+    diff = (long)seq - (long)pos;
+    if( diff == 0 )
+    {
+      if( __atomic_compare_exchange_n( &enqueuePos, &pos, pos + 1, TRUE,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        break;
+    }
+    else if( diff < 0 )
+    {
+      // Ring is full
+      __atomic_add_fetch( &droppedMessages, 1, __ATOMIC_RELAXED );
+      return;
+    }
+    else
+    {
+      pos = __atomic_load_n( &enqueuePos, __ATOMIC_RELAXED );
+    }
+  }
+
+  len = snprintf( slot->text, LOG_SLOT_SIZE, newline ? "%s %12ld msec %s\n" : "%s %12ld msec %s",
+                  iso_8601, mtime, command );
+  if( len >= LOG_SLOT_SIZE )
+  {
+    len = LOG_SLOT_SIZE - 1;
+    slot->text[len - 1] = '\n';
+  }
+  slot->len = len;
+  __atomic_store_n( &slot->seq, pos + 1, __ATOMIC_RELEASE );
+}  /* end log_message */
+
+//
+// Flusher thread.
+//
+static void *flush_log( void *arg )
+{  /* Begin flush_log */
+  time_t lastSync = time( NULL );
+  time_t now;
+
+  while( !__atomic_load_n( &flusherStop, __ATOMIC_ACQUIRE ) )
+  {
+    if( write_ring() == 0 )
+      usleep( LOG_FLUSH_MSEC * 1000 );
+
+    if( syncSeconds > 0 && ( now = time( NULL ) ) - lastSync >= syncSeconds )
+    {
+      fsync( STDOUT_FILENO );
+      lastSync = now;
+    }
+  }
+  return( NULL );
+}  /* end flush_log */
+
+//
+// Copy the messages in the ring to stdout with one write(). Only the
+// flusher (or log_stop() after it has stopped) calls this. Returns the
+// number of messages written.
+//
+static int write_ring( void )
+{  /* Begin write_ring */
+  static char out[64 * 1024];
+  struct log_slot *slot;
+  unsigned long dropped;
+  int outLen = 0;
+  int n = 0;
+
+  while( outLen + LOG_SLOT_SIZE <= sizeof( out ) )
+  {
+    slot = &ring[dequeuePos & ( LOG_RING_SIZE - 1 )];
+    if( __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) != dequeuePos + 1 )
+      break;
+    memcpy( out + outLen, slot->text, slot->len );
+    outLen += slot->len;
+    __atomic_store_n( &slot->seq, dequeuePos + LOG_RING_SIZE, __ATOMIC_RELEASE );
+    dequeuePos++;
+    n++;
+  }
+
+  if( ( dropped = __atomic_exchange_n( &droppedMessages, 0, __ATOMIC_RELAXED ) ) != 0 )
+    outLen += snprintf( out + outLen, sizeof( out ) - outLen,
+                        "(%lu log messages dropped, log ring was full)\n", dropped );
+
+  if( outLen > 0 && write( STDOUT_FILENO, out, outLen ) < 0 )
+    return( 0 );
+  return( n );
+}  /* end write_ring */
+
+//
+// The ring slots start out ready for the first LOG_RING_SIZE positions.
+//
+static void __attribute__ ((constructor)) init_ring( void )
+{  /* Begin init_ring */
+  unsigned long i;
+
+  for( i = 0; i < LOG_RING_SIZE; i++ )
+    ring[i].seq = i;
+}  /* end init_ring */
@@ -0,0 +1,753 @@
+/*
+Program name: modemsim
+
+File name: modemsim.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+A modem emulator and benchmark for jcblock that needs no modem or phone line.
+For each simulated line it creates a pseudo-terminal with openpty() and plays
+the modem: it answers AT, ATZ, AT&D2, AT+VCID=1, ATH1 and ATH0 with OK (after
+echoing them, like a modem does) and sends RING and caller ID frames
+(DATE/TIME/NMBR/NAME, each line ending in "\r\n") paced at 1200 baud.
+
+The calls come from a file: either a callerID.dat to replay, or a script in
+the same format. Lines starting with '#' are ignored; the date may be left out
+("number|name|") and the number and name may be in either order (the field of
+digits is the number). An empty name sends a frame without NAME (SDMF).
+
+modemsim starts jcblock on the slave side of the ptys (-j, -d and anything
+after "--" are passed on), waits for every line to be initialized, then plays
+the calls round robin over the lines. A call is counted as blocked if jcblock
+sends ATH1 before the next ring would be due, otherwise as accepted. At the
+end it stops jcblock and reports the blocked/accepted counts and the latency
+distributions:
+  ring to ATH1           - start of the first RING to the ATH1 command
+  caller ID to ATH1      - last byte of the caller ID sent to ATH1 (the frame
+                           is cut short when ATH1 comes before its end)
+  ATH1 to modem ready    - the hang-up and re-initialization (AT+VCID=1 OK)
+
+With -v it plays a modem in voice mode instead (for jcblock -v): it answers
+AT+FCLASS=8 and AT+VSM with OK and AT+VRX with CONNECT, then sends a ring as
+DLE R and the caller ID as its Bell 202 FSK signal (fsk.c), 8 bit unsigned
+samples paced at 8000 a second with DLE shielded, until DLE ! ends the audio.
+With -s as well, the star key is pressed on each accepted call (jcblock then
+adds the caller to the blacklist, so that the next call from it is blocked).
+
+Usage:
+  modemsim [-n lines] [-c calls] [-i interval-msec] [-j jcblock] [-d dir] [-m]
+           [-v [-s]] file [-- jcblock options]
+With -m jcblock is not started: the pty names are printed and modemsim waits
+for a jcblock started by hand to initialize them.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "common.h"
+
+#define MAX_LINES          16
+#define BYTE_USEC        8333    // 1200 baud, 8N1: ten bits per character
+#define CID_DELAY_MSEC    500    // caller ID starts this long after the first ring
+#define RING_CYCLE_MSEC  6000    // the next ring; no ATH1 by then: call accepted
+#define READY_WAIT_MSEC 15000    // longest wait for a modem (re)initialization
+#define STOP_WAIT_MSEC   5000    // longest wait for jcblock to terminate
+#define VOICE_BLOCK       160    // -v: samples sent at a time (20 msec)
+#define STAR_MSEC         100    // -s: how long the star key is pressed
+#define DLE              0x10
+
+struct call
+{
+  char date[5];                  // MMDD
+  char time[5];                  // hhmm
+  char number[32];
+  char name[32];
+  bool nameFirst;                // NAME before NMBR in the frame
+};
+
+struct line
+{
+  int  master;
+  int  slave;                    // kept open so the pty survives port re-opens
+  char ptsName[64];
+  pthread_t thread;
+  int  index;
+  char cmd[64];                  // command being received
+  int  cmdLen;
+  bool ready;                    // AT+VCID=1 answered since the last ATH1
+  long tAth1;                    // usec of the last ATH1, 0 if none
+  long tReady;                   // usec of the last AT+VCID=1
+  bool receiving;                // -v: AT+VRX answered; audio until DLE !
+  bool dle;                      // -v: the last byte received was a DLE
+};
+
+struct samples
+{
+  long *usec;
+  int   n;
+};
+
+static struct line lines[MAX_LINES];
+static int numLines = 1;
+static struct call *calls;
+static int numCalls;
+static int intervalMsec = 2000;
+static bool voiceMode = FALSE;
+static bool starKey = FALSE;
+static int starKeys;
+static int blocked, accepted, notReady;
+static struct samples ringToAth1, cidToAth1, ath1ToReady;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int load_calls( const char *path, int maxCalls );
+static bool parse_record( char *text, struct call *c );
+static bool all_digits( const char *s );
+static void *play_line( void *arg );
+static void serve( struct line *l, long until );
+static void serve_command( struct line *l );
+static long send_paced( struct line *l, const char *text, long stopIfAth1After );
+static long send_audio( struct line *l, const struct call *c, long stopIfAth1After );
+static long send_samples( struct line *l, const int16_t *samples, int count, long stopIfAth1After );
+static bool wait_ready( struct line *l, long until );
+static void add_sample( struct samples *s, long usec );
+static void report( const char *title, struct samples *s );
+static int compare_long( const void *a, const void *b );
+static long now_usec( void );
+
+//
+// Main function
+//
+int main( int argc, char **argv )
+{ /* Begin main */
+  char *jcblock = "./jcblock";
+  char *dir = NULL;
+  char *args[8 + 2 * MAX_LINES + 64];
+  bool manual = FALSE;
+  int maxCalls = 0;
+  int optChar;
+  int nargs = 0;
+  int status;
+  long until;
+  pid_t child = -1;
+  int i;
+
+  while( ( optChar = getopt( argc, argv, "n:c:i:j:d:mvs" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 'n':
+        numLines = atoi( optarg );
+        break;
+      case 'c':
+        maxCalls = atoi( optarg );
+        break;
+      case 'i':
+        intervalMsec = atoi( optarg );
+        break;
+      case 'j':
+        jcblock = optarg;
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      case 'm':
+        manual = TRUE;
+        break;
+      case 'v':
+        voiceMode = TRUE;
+        break;
+      case 's':
+        starKey = TRUE;
+        break;
+      default:
+        optind = argc;
+        break;
+    }
+  }
+  if( optind >= argc || numLines < 1 || numLines > MAX_LINES )
+  {
+    fprintf( stderr, "Usage: %s [-n lines] [-c calls] [-i interval-msec] [-j jcblock] [-d dir] [-m] [-v [-s]] file [-- jcblock options]\n", argv[0] );
+    exit( -1 );
+  }
+
+  if( load_calls( argv[optind], maxCalls ) != 0 )
+    exit( -1 );
+
+  // Create the ptys. The slave side is put in raw mode until jcblock
+  // sets it up.
+  for( i = 0; i < numLines; i++ )
+  {
+    struct termios t;
+
+    if( openpty( &lines[i].master, &lines[i].slave, lines[i].ptsName, NULL, NULL ) != 0 )
+    {
+      perror( "openpty" );
+      exit( -1 );
+    }
+    tcgetattr( lines[i].slave, &t );
+    cfmakeraw( &t );
+    tcsetattr( lines[i].slave, TCSANOW, &t );
+    fcntl( lines[i].master, F_SETFL, O_NONBLOCK );
+    lines[i].index = i;
+  }
+
+  if( manual )
+  {
+    printf( "modem ports:" );
+    for( i = 0; i < numLines; i++ )
+      printf( " %s", lines[i].ptsName );
+    printf( "\n" );
+    fflush( stdout );
+  }
+  else
+  {
+    // Start jcblock on the ptys
+    args[nargs++] = jcblock;
+    if( voiceMode )
+      args[nargs++] = "-v";
+    if( dir != NULL )
+    {
+      args[nargs++] = "-d";
+      args[nargs++] = dir;
+    }
+    for( i = 0; i < numLines; i++ )
+    {
+      args[nargs++] = "-p";
+      args[nargs++] = lines[i].ptsName;
+    }
+    for( i = optind + 1; i < argc && nargs < sizeof( args ) / sizeof( args[0] ) - 1; i++ )
+      args[nargs++] = argv[i];
+    args[nargs] = NULL;
+
+    if( ( child = fork() ) == 0 )
+    {
+      execv( jcblock, args );
+      perror( jcblock );
+      _exit( 127 );
+    }
+    if( child < 0 )
+    {
+      perror( "fork" );
+      exit( -1 );
+    }
+  }
+
+  // Play the calls on all lines at once
+  for( i = 0; i < numLines; i++ )
+    pthread_create( &lines[i].thread, NULL, play_line, &lines[i] );
+  for( i = 0; i < numLines; i++ )
+    pthread_join( lines[i].thread, NULL );
+
+  // Stop jcblock; it resets the modems on the way out
+  if( child > 0 )
+  {
+    kill( child, SIGTERM );
+    until = now_usec() + STOP_WAIT_MSEC * 1000L;
+    while( waitpid( child, &status, WNOHANG ) == 0 )
+    {
+      if( now_usec() > until )
+      {
+        fprintf( stderr, "jcblock did not terminate; killing it\n" );
+        kill( child, SIGKILL );
+        waitpid( child, &status, 0 );
+        break;
+      }
+      for( i = 0; i < numLines; i++ )
+        serve( &lines[i], now_usec() + 10000 / numLines );
+    }
+  }
+
+  printf( "%d calls on %d line(s): %d blocked, %d accepted", numCalls, numLines,
+          blocked, accepted );
+  if( notReady )
+    printf( ", %d not played (modem not ready)", notReady );
+  if( starKey && voiceMode )
+    printf( ", star key pressed %d time(s)", starKeys );
+  printf( "\n" );
+  report( "ring to ATH1", &ringToAth1 );
+  report( "caller ID to ATH1", &cidToAth1 );
+  report( "ATH1 to modem ready", &ath1ToReady );
+  return( 0 );
+}  /* end main */
+
+//
+// Read the calls to play from a callerID.dat file or a script.
+// Returns 0 or -1.
+//
+static int load_calls( const char *path, int maxCalls )
+{  /* Begin load_calls */
+  char text[256];
+  FILE *fp;
+  int size = 0;
+
+  if( ( fp = fopen( path, "r" ) ) == NULL )
+  {
+    perror( path );
+    return( -1 );
+  }
+  while( fgets( text, sizeof( text ), fp ) != NULL )
+  {
+    if( maxCalls > 0 && numCalls == maxCalls )
+      break;
+    if( numCalls == size )
+    {
+      size = size ? size * 2 : 256;
+      if( ( calls = realloc( calls, size * sizeof( *calls ) ) ) == NULL )
+      {
+        fprintf( stderr, "out of memory\n" );
+        fclose( fp );
+        return( -1 );
+      }
+    }
+    if( parse_record( text, &calls[numCalls] ) )
+      numCalls++;
+  }
+  fclose( fp );
+
+  if( numCalls == 0 )
+  {
+    fprintf( stderr, "%s: no calls\n", path );
+    return( -1 );
+  }
+  return( 0 );
+}  /* end load_calls */
+
+//
+// Parse "YYYY-MM-DDThh:mm|field|field|" or "field|field|" into a call.
+// Returns FALSE for comments and lines that are not records.
+//
+static bool parse_record( char *text, struct call *c )
+{  /* Begin parse_record */
+  char *field[2];
+  char *p;
+  int nfields = 0, i;
+  time_t now;
+  struct tm now_tm;
+
+  if( text[0] == '#' || text[0] == '\n' )
+    return( FALSE );
+  memset( c, 0, sizeof( *c ) );
+
+  // The date is optional; without it the current date and time are sent
+  if( strlen( text ) > 17 && text[4] == '-' && text[10] == 'T' && text[16] == '|' )
+  {
+    sprintf( c->date, "%.2s%.2s", text + 5, text + 8 );
+    sprintf( c->time, "%.2s%.2s", text + 11, text + 14 );
+    text += 17;
+  }
+  else
+  {
+    now = time( NULL );
+    localtime_r( &now, &now_tm );
+    strftime( c->date, sizeof( c->date ), "%m%d", &now_tm );
+    strftime( c->time, sizeof( c->time ), "%H%M", &now_tm );
+  }
+
+  for( p = text; nfields < 2; p++ )
+  {
+    field[nfields++] = p;
+    if( ( p = strchr( p, '|' ) ) == NULL )
+      return( FALSE );
+    *p = 0;
+  }
+
+  // Names are padded with blanks in old files
+  for( i = 0; i < 2; i++ )
+  {
+    for( p = field[i] + strlen( field[i] ); p > field[i] && p[-1] == ' '; p-- )
+      p[-1] = 0;
+  }
+
+  // A field too long for the caller ID is not cut short: the record is
+  // skipped
+  if( strlen( field[0] ) >= sizeof( c->number ) || strlen( field[1] ) >= sizeof( c->name ) )
+  {
+    fprintf( stderr, "record skipped, a field is longer than %d characters: %s|%s|\n",
+             (int)sizeof( c->name ) - 1, field[0], field[1] );
+    return( FALSE );
+  }
+
+  // callerID.dat has had both "number|name" and "name|number"
+  if( !all_digits( field[0] ) && all_digits( field[1] ) )
+  {
+    c->nameFirst = TRUE;
+    strcpy( c->name, field[0] );
+    strcpy( c->number, field[1] );
+  }
+  else
+  {
+    strcpy( c->number, field[0] );
+    strcpy( c->name, field[1] );
+  }
+  return( c->number[0] != 0 );
+}  /* end parse_record */
+
+static bool all_digits( const char *s )
+{  /* Begin all_digits */
+  if( *s == 0 )
+    return( FALSE );
+  for( ; *s; s++ )
+  {
+    if( ( *s < '0' || *s > '9' ) && *s != '-' )
+      return( FALSE );
+  }
+  return( TRUE );
+}  /* end all_digits */
+
+//
+// Line thread: wait for the modem to be initialized, then ring with every
+// numLines'th call.
+//
+static void *play_line( void *arg )
+{  /* Begin play_line */
+  struct line *l = arg;
+  struct call *c;
+  char frame[256];
+  long tRing, tCid, until;
+  int i;
+
+  if( !wait_ready( l, now_usec() + READY_WAIT_MSEC * 1000L ) )
+  {
+    fprintf( stderr, "%s: modem was not initialized\n", l->ptsName );
+    pthread_mutex_lock( &statsLock );
+    for( i = l->index; i < numCalls; i += numLines )
+      notReady++;
+    pthread_mutex_unlock( &statsLock );
+    return( NULL );
+  }
+
+  for( i = l->index; i < numCalls; i += numLines )
+  {
+    c = &calls[i];
+    serve( l, now_usec() + intervalMsec * 1000L );
+
+    // Build the frame the way the modem sends it after AT+VCID=1
+    if( c->nameFirst )
+      sprintf( frame, "\r\nDATE = %s\r\nTIME = %s\r\nNAME = %s\r\nNMBR = %s\r\n\r\n",
+               c->date, c->time, c->name, c->number );
+    else if( c->name[0] != 0 )
+      sprintf( frame, "\r\nDATE = %s\r\nTIME = %s\r\nNMBR = %s\r\nNAME = %s\r\n\r\n",
+               c->date, c->time, c->number, c->name );
+    else
+      sprintf( frame, "\r\nDATE = %s\r\nTIME = %s\r\nNMBR = %s\r\n\r\n",
+               c->date, c->time, c->number );
+
+    // First ring, then the caller ID between the first and second ring
+    l->tAth1 = 0;
+    tRing = now_usec();
+    if( voiceMode )
+    {
+      send_paced( l, "\x10R", tRing );
+      serve( l, now_usec() + CID_DELAY_MSEC * 1000L );
+      tCid = send_audio( l, c, tRing );
+    }
+    else
+    {
+      send_paced( l, "\r\nRING\r\n", tRing );
+      serve( l, now_usec() + CID_DELAY_MSEC * 1000L );
+      tCid = send_paced( l, frame, tRing );
+    }
+
+    // Blocked if jcblock goes off hook before the next ring
+    until = tRing + RING_CYCLE_MSEC * 1000L;
+    while( l->tAth1 == 0 && now_usec() < until )
+      serve( l, until );
+
+    pthread_mutex_lock( &statsLock );
+    if( l->tAth1 != 0 )
+    {
+      blocked++;
+      add_sample( &ringToAth1, l->tAth1 - tRing );
+      add_sample( &cidToAth1, l->tAth1 - tCid );
+    }
+    else
+    {
+      accepted++;
+    }
+    pthread_mutex_unlock( &statsLock );
+
+    // The call was answered: press the star key
+    if( l->tAth1 == 0 && starKey && voiceMode && l->receiving )
+    {
+      static int16_t star[FSK_RATE * STAR_MSEC / 1000];
+
+      dtmf_tone( '*', STAR_MSEC, 0.25, star, sizeof( star ) / sizeof( star[0] ) );
+      send_samples( l, star, sizeof( star ) / sizeof( star[0] ), now_usec() );
+      pthread_mutex_lock( &statsLock );
+      starKeys++;
+      pthread_mutex_unlock( &statsLock );
+    }
+
+    // After a hang-up wait for the modem to be initialized again
+    if( l->tAth1 != 0 )
+    {
+      if( !wait_ready( l, now_usec() + READY_WAIT_MSEC * 1000L ) )
+      {
+        fprintf( stderr, "%s: modem was not re-initialized after ATH1\n", l->ptsName );
+        continue;
+      }
+      pthread_mutex_lock( &statsLock );
+      add_sample( &ath1ToReady, l->tReady - l->tAth1 );
+      pthread_mutex_unlock( &statsLock );
+    }
+  }
+  return( NULL );
+}  /* end play_line */
+
+//
+// Answer commands from jcblock until the time until (in usec).
+//
+static void serve( struct line *l, long until )
+{  /* Begin serve */
+  struct pollfd pfd;
+  char buffer[256];
+  long left;
+  int n, i;
+
+  pfd.fd = l->master;
+  pfd.events = POLLIN;
+  while( ( left = until - now_usec() ) > 0 )
+  {
+    if( poll( &pfd, 1, ( left + 999 ) / 1000 ) <= 0 )
+      continue;
+    if( ( n = read( l->master, buffer, sizeof( buffer ) ) ) <= 0 )
+    {
+      // No process has the slave open yet (or EAGAIN)
+      usleep( 1000 );
+      continue;
+    }
+    for( i = 0; i < n; i++ )
+    {
+      // DLE ! (voice mode) ends the audio
+      if( l->dle )
+      {
+        l->dle = FALSE;
+        if( buffer[i] == '!' && l->receiving )
+        {
+          l->receiving = FALSE;
+          if( write( l->master, "\x10\x03\r\nOK\r\n", 8 ) != 8 )
+            fprintf( stderr, "%s: write failed\n", l->ptsName );
+        }
+        continue;
+      }
+      if( buffer[i] == DLE )
+      {
+        l->dle = TRUE;
+        continue;
+      }
+      if( buffer[i] == '\r' || buffer[i] == '\n' )
+      {
+        l->cmd[l->cmdLen] = 0;
+        if( l->cmdLen > 0 )
+          serve_command( l );
+        l->cmdLen = 0;
+      }
+      else if( l->cmdLen < sizeof( l->cmd ) - 1 )
+      {
+        l->cmd[l->cmdLen++] = buffer[i];
+      }
+    }
+  }
+}  /* end serve */
+
+//
+// Echo a command and answer it. A modem in voice mode is ready when it
+// sends the audio (AT+VRX).
+//
+static void serve_command( struct line *l )
+{  /* Begin serve_command */
+  char answer[96];
+  int len;
+
+  if( strcmp( l->cmd, "ATH1" ) == 0 )
+  {
+    l->tAth1 = now_usec();
+    l->ready = FALSE;
+  }
+  else if( strcmp( l->cmd, voiceMode ? "AT+VRX" : "AT+VCID=1" ) == 0 )
+  {
+    l->tReady = now_usec();
+    l->ready = TRUE;
+  }
+
+  if( strcmp( l->cmd, "AT+VRX" ) == 0 )
+  {
+    len = sprintf( answer, "%s\r\r\nCONNECT\r\n", l->cmd );
+    l->receiving = TRUE;
+  }
+  else if( strncmp( l->cmd, "AT", 2 ) == 0 )
+    len = sprintf( answer, "%s\r\r\nOK\r\n", l->cmd );
+  else
+    len = sprintf( answer, "%s\r\r\nERROR\r\n", l->cmd );
+  if( write( l->master, answer, len ) != len )
+    fprintf( stderr, "%s: write failed\n", l->ptsName );
+}  /* end serve_command */
+
+//
+// Send text at 1200 baud, answering commands in between. Stops if ATH1
+// arrives after the time stopIfAth1After (the call is being terminated).
+// Returns the time the last character was sent.
+//
+static long send_paced( struct line *l, const char *text, long stopIfAth1After )
+{  /* Begin send_paced */
+  long next = now_usec();
+  long sent = next;
+
+  for( ; *text; text++ )
+  {
+    if( l->tAth1 > stopIfAth1After )
+      break;
+    if( write( l->master, text, 1 ) != 1 )
+      break;
+    sent = now_usec();
+    next += BYTE_USEC;
+    serve( l, next );
+  }
+  return( sent );
+}  /* end send_paced */
+
+//
+// Send the FSK signal of a call's caller ID as a voice-mode modem does. An
+// MDMF message is sent, or SDMF if the call has no name. Returns the time
+// the last sample was sent.
+//
+static long send_audio( struct line *l, const struct call *c, long stopIfAth1After )
+{  /* Begin send_audio */
+  static int16_t signal[FSK_RATE * 2];
+  unsigned char msg[FSK_MSG_MAX];
+  struct caller_id cid;
+  int count, len;
+
+  memset( &cid, 0, sizeof( cid ) );
+  snprintf( cid.date, sizeof( cid.date ), "%s", c->date );
+  snprintf( cid.time, sizeof( cid.time ), "%s", c->time );
+  snprintf( cid.number, sizeof( cid.number ), "%s", c->number );
+  snprintf( cid.name, sizeof( cid.name ), "%s", c->name );
+  cid.fields = CID_DATE | CID_TIME | CID_NUMBER | ( c->name[0] ? CID_NAME : 0 );
+  len = fsk_message( &cid, c->name[0] ? FSK_MDMF : FSK_SDMF, msg );
+  if( ( count = fsk_modulate( msg, len, 0.25, 0.25, 1.0, signal, FSK_RATE * 2 ) ) < 0 )
+    return( now_usec() );
+  return( send_samples( l, signal, count, stopIfAth1After ) );
+}  /* end send_audio */
+
+//
+// Send audio as a voice-mode modem does, VOICE_BLOCK samples at a time in
+// real time, answering commands in between. Stops when the audio is ended
+// or ATH1 arrives after stopIfAth1After. Returns the time the last sample
+// was sent.
+//
+static long send_samples( struct line *l, const int16_t *samples, int count, long stopIfAth1After )
+{  /* Begin send_samples */
+  unsigned char data[VOICE_BLOCK * 2];
+  long next = now_usec();
+  long sent = next;
+  int n, s, i;
+
+  for( s = 0; s < count && l->receiving; s += VOICE_BLOCK )
+  {
+    if( l->tAth1 > stopIfAth1After )
+      break;
+    for( n = 0, i = s; i < s + VOICE_BLOCK && i < count; i++ )
+    {
+      data[n] = ( samples[i] >> 8 ) + 128;
+      if( data[n++] == DLE )
+        data[n++] = DLE;
+    }
+    if( write( l->master, data, n ) != n )
+      break;
+    sent = now_usec();
+    next += VOICE_BLOCK * 1000000L / FSK_RATE;
+    serve( l, next );
+  }
+  return( sent );
+}  /* end send_samples */
+
+//
+// Answer commands until the modem has been initialized (AT+VCID=1) or the
+// time until has passed. Returns TRUE if initialized.
+//
+static bool wait_ready( struct line *l, long until )
+{  /* Begin wait_ready */
+  long step;
+
+  while( !l->ready && now_usec() < until )
+  {
+    step = now_usec() + 10000;
+    serve( l, step < until ? step : until );
+  }
+  if( !l->ready )
+    return( FALSE );
+
+  // Let the modem's last OK reach jcblock
+  serve( l, now_usec() + 100000 );
+  return( TRUE );
+}  /* end wait_ready */
+
+static void add_sample( struct samples *s, long usec )
+{  /* Begin add_sample */
+  long *p;
+
+  if( ( p = realloc( s->usec, ( s->n + 1 ) * sizeof( long ) ) ) == NULL )
+    return;
+  s->usec = p;
+  s->usec[s->n++] = usec;
+}  /* end add_sample */
+
+//
+// Print the distribution of a latency in msec.
+//
+static void report( const char *title, struct samples *s )
+{  /* Begin report */
+  if( s->n == 0 )
+  {
+    printf( "%-20s no samples\n", title );
+    return;
+  }
+  qsort( s->usec, s->n, sizeof( long ), compare_long );
+  printf( "%-20s msec: min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f  (%d)\n",
+          title, s->usec[0] / 1000.0,
+          s->usec[s->n * 50 / 100] / 1000.0,
+          s->usec[s->n * 90 / 100] / 1000.0,
+          s->usec[s->n * 99 / 100] / 1000.0,
+          s->usec[s->n - 1] / 1000.0, s->n );
+}  /* end report */
+
+static int compare_long( const void *a, const void *b )
+{  /* Begin compare_long */
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+
+  return( x < y ? -1 : x > y );
+}  /* end compare_long */
+
+static long now_usec( void )
+{  /* Begin now_usec */
+  struct timespec t;
+
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return( t.tv_sec * 1000000L + t.tv_nsec / 1000 );
+}  /* end now_usec */
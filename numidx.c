@@ -0,0 +1,536 @@
+/*
+Program name: jcblock
+
+File name: numidx.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Telephone number rules of a list. Instead of being searched for anywhere in
+the caller ID string, these test fields are compared with the number of the
+call only:
+  1-202-599-4793?     the number itself (10 or more digits)
+  1-855-*?            any number that starts with the digits before the '*'
+  2025550100..199?    any number from 2025550100 to 2025550199 (the missing
+                      leading digits of the upper end are those of the lower)
+Numbers are normalized before they are stored or looked up: everything but
+the digits is dropped and the leading 1 of an 11 digit North American number
+is removed, so "1-202-599-4793", "(202) 599-4793" and "12025994793" are the
+same number. A number is kept as an integer key (its digits, with the digit
+count in the high bits so that leading zeros count). Exact numbers are kept
+in a hash table, prefixes in a trie with one branch per digit and ranges in
+a sorted list of non-overlapping segments, so a lookup takes time
+proportional to the number of digits, whatever the number of rules.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "common.h"
+
+#define KEY_LEN_SHIFT 50     // 10^15 < 2^50
+
+static int normalize( const char *s, int len, char *digits, bool prefix );
+static int digits_of( const char *s, int len, char *digits );
+static int drop_country_code( char *digits, int n, bool prefix );
+static uint64_t make_key( const char *digits, int n );
+static unsigned hash_slot( uint64_t key, unsigned mask );
+static int add_exact( struct number_index *ni, uint64_t key, int rule );
+static int add_prefix( struct number_index *ni, const char *digits, int n, int rule );
+static int add_range( struct number_index *ni, uint64_t lo, uint64_t hi, int rule );
+static int add_digit_node( struct number_index *ni );
+static int compare_ranges( const void *a, const void *b );
+static int compare_keys( const void *a, const void *b );
+static void heap_push( int *heap, int *n, int r, const struct number_range *ranges );
+static void heap_pop( int *heap, int *n, const struct number_range *ranges );
+
+//
+// Add the test field of a record if it is a number rule. Returns
+// NUMBER_RULE (added), NOT_NUMBER_RULE (a text rule, token is not used),
+// BAD_NUMBER_RULE (looks like a number rule but is not valid) or -1 (out
+// of memory).
+//
+int numidx_add( struct number_index *ni, const char *token, int len, int rule )
+{  /* Begin numidx_add */
+  char lo[NUMBER_DIGITS_MAX + 1], hi[NUMBER_DIGITS_MAX + 1];
+  char tail[NUMBER_DIGITS_MAX + 1];
+  const char *dots;
+  int i, n, nlo, nhi;
+
+  // Only digits and the characters people write numbers with
+  for( i = 0; i < len; i++ )
+  {
+    if( strchr( "0123456789-(). +*", token[i] ) == NULL )
+      return( NOT_NUMBER_RULE );
+  }
+
+  // Prefix: digits followed by '*'
+  if( token[len - 1] == '*' )
+  {
+    if( memchr( token, '*', len - 1 ) != NULL ||
+        ( n = normalize( token, len - 1, lo, TRUE ) ) <= 0 )
+      return( BAD_NUMBER_RULE );
+    return( add_prefix( ni, lo, n, rule ) );
+  }
+  if( memchr( token, '*', len ) != NULL )
+    return( BAD_NUMBER_RULE );
+
+  // Range: lo..hi
+  for( dots = NULL, i = 0; i + 1 < len; i++ )
+  {
+    if( token[i] == '.' && token[i + 1] == '.' )
+    {
+      dots = token + i;
+      break;
+    }
+  }
+  if( dots != NULL )
+  {
+    // The upper end is completed with the leading digits of the lower end
+    // before either is normalized
+    nlo = digits_of( token, dots - token, lo );
+    nhi = digits_of( dots + 2, len - ( dots - token ) - 2, tail );
+    if( nlo <= 0 || nhi <= 0 || nhi > nlo )
+      return( BAD_NUMBER_RULE );
+    memcpy( hi, lo, nlo - nhi );
+    memcpy( hi + nlo - nhi, tail, nhi );
+    nhi = drop_country_code( hi, nlo, FALSE );
+    nlo = drop_country_code( lo, nlo, FALSE );
+    if( nlo > NUMBER_DIGITS_MAX || nhi != nlo || memcmp( lo, hi, nlo ) > 0 )
+      return( BAD_NUMBER_RULE );
+    return( add_range( ni, make_key( lo, nlo ), make_key( hi, nhi ), rule ) );
+  }
+
+  // A whole number. Fewer digits stay text rules: they may be part of a
+  // number (or of a name) on purpose.
+  if( ( n = digits_of( token, len, lo ) ) < 0 )
+    return( BAD_NUMBER_RULE );
+  if( n < NUMBER_EXACT_MIN )
+    return( NOT_NUMBER_RULE );
+  if( ( n = drop_country_code( lo, n, FALSE ) ) > NUMBER_DIGITS_MAX )
+    return( BAD_NUMBER_RULE );
+  return( add_exact( ni, make_key( lo, n ), rule ) );
+}  /* end numidx_add */
+
+//
+// All rules are added: turn the ranges into non-overlapping segments, each
+// holding the lowest rule that covers it. Returns 0 or -1.
+//
+int numidx_finish( struct number_index *ni )
+{  /* Begin numidx_finish */
+  struct number_range *ranges = ni->ranges;
+  struct number_range *segs;
+  uint64_t *bounds;
+  int *heap;
+  int nbounds, nheap = 0, nsegs = 0;
+  int i, b, next;
+
+  if( ni->nranges == 0 )
+    return( 0 );
+
+  bounds = malloc( 2 * ni->nranges * sizeof( *bounds ) );
+  heap = malloc( ni->nranges * sizeof( *heap ) );
+  segs = malloc( 2 * ni->nranges * sizeof( *segs ) );
+  if( bounds == NULL || heap == NULL || segs == NULL )
+  {
+    free( bounds );
+    free( heap );
+    free( segs );
+    return( -1 );
+  }
+
+  // Every range start and every end + 1 starts a new segment
+  qsort( ranges, ni->nranges, sizeof( *ranges ), compare_ranges );
+  for( i = 0; i < ni->nranges; i++ )
+  {
+    bounds[2 * i] = ranges[i].lo;
+    bounds[2 * i + 1] = ranges[i].hi + 1;
+  }
+  qsort( bounds, 2 * ni->nranges, sizeof( *bounds ), compare_keys );
+  for( nbounds = 0, i = 0; i < 2 * ni->nranges; i++ )
+  {
+    if( nbounds == 0 || bounds[i] != bounds[nbounds - 1] )
+      bounds[nbounds++] = bounds[i];
+  }
+
+  // Sweep: the heap holds the ranges covering the segment, lowest rule first
+  for( next = 0, b = 0; b < nbounds - 1; b++ )
+  {
+    while( next < ni->nranges && ranges[next].lo <= bounds[b] )
+      heap_push( heap, &nheap, next++, ranges );
+    while( nheap > 0 && ranges[heap[0]].hi < bounds[b] )
+      heap_pop( heap, &nheap, ranges );
+    if( nheap == 0 )
+      continue;
+
+    // Neighbouring segments of the same rule are joined
+    if( nsegs > 0 && segs[nsegs - 1].hi + 1 == bounds[b] &&
+        segs[nsegs - 1].rule == ranges[heap[0]].rule )
+    {
+      segs[nsegs - 1].hi = bounds[b + 1] - 1;
+      continue;
+    }
+    segs[nsegs].lo = bounds[b];
+    segs[nsegs].hi = bounds[b + 1] - 1;
+    segs[nsegs].rule = ranges[heap[0]].rule;
+    nsegs++;
+  }
+
+  free( bounds );
+  free( heap );
+  free( ni->ranges );
+  ni->ranges = segs;
+  ni->rangeCap = 2 * ni->nranges;
+  ni->nranges = nsegs;
+  return( 0 );
+}  /* end numidx_finish */
+
+//
+// Look up the number field of a caller ID. Returns the lowest rule that
+// matches it or NO_MATCH.
+//
+int numidx_lookup( const struct number_index *ni, const char *number, int len )
+{  /* Begin numidx_lookup */
+  char digits[NUMBER_DIGITS_MAX + 1];
+  uint64_t key;
+  unsigned h;
+  int found = INT_MAX;
+  int n, i, node, lo, hi, mid;
+
+  if( ni->nrules == 0 || ( n = normalize( number, len, digits, FALSE ) ) <= 0 )
+    return( NO_MATCH );
+  key = make_key( digits, n );
+
+  if( ni->hashMask != 0 )
+  {
+    for( h = hash_slot( key, ni->hashMask ); ni->keys[h] != 0; h = ( h + 1 ) & ni->hashMask )
+    {
+      if( ni->keys[h] == key )
+      {
+        found = ni->exactRule[h];
+        break;
+      }
+    }
+  }
+
+  // Walk the trie as far as the digits go; every node passed is a prefix
+  if( ni->nnodes > 0 )
+  {
+    for( node = 0, i = 0; i < n && ( node = ni->nodes[node].child[digits[i] - '0'] ) != 0; i++ )
+    {
+      if( ni->nodes[node].best < found )
+        found = ni->nodes[node].best;
+    }
+  }
+
+  // The last segment that starts at or before the key
+  for( lo = 0, hi = ni->nranges - 1; lo <= hi; )
+  {
+    mid = ( lo + hi ) / 2;
+    if( ni->ranges[mid].lo <= key )
+    {
+      if( key <= ni->ranges[mid].hi )
+      {
+        if( ni->ranges[mid].rule < found )
+          found = ni->ranges[mid].rule;
+        break;
+      }
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+
+  return( found == INT_MAX ? NO_MATCH : found );
+}  /* end numidx_lookup */
+
+//
+// Bytes of memory used by the index.
+//
+long numidx_memory( const struct number_index *ni )
+{  /* Begin numidx_memory */
+  long mem = (long)ni->nodeCap * sizeof( struct digit_node ) +
+             (long)ni->rangeCap * sizeof( struct number_range );
+
+  if( ni->hashMask != 0 )
+    mem += ( ni->hashMask + 1L ) * ( sizeof( uint64_t ) + sizeof( int ) );
+  return( mem );
+}  /* end numidx_memory */
+
+void numidx_free( struct number_index *ni )
+{  /* Begin numidx_free */
+  free( ni->keys );
+  free( ni->exactRule );
+  free( ni->nodes );
+  free( ni->ranges );
+  memset( ni, 0, sizeof( *ni ) );
+}  /* end numidx_free */
+
+//
+// The normalized form of a number (as numidx_lookup() matches it), to file
+// calls by number. Returns 0 if the field is not a number.
+//
+uint64_t number_key( const char *number, int len )
+{  /* Begin number_key */
+  char digits[NUMBER_DIGITS_MAX + 1];
+  int n;
+
+  if( ( n = normalize( number, len, digits, FALSE ) ) <= 0 )
+    return( 0 );
+  return( make_key( digits, n ) );
+}  /* end number_key */
+
+//
+// The digits of a number key (to digits, if not NULL, with a '\0' after
+// them). Returns their number.
+//
+int number_digits( uint64_t key, char *digits )
+{  /* Begin number_digits */
+  int n = (int)( key >> KEY_LEN_SHIFT );
+  uint64_t value = key & ( ( (uint64_t)1 << KEY_LEN_SHIFT ) - 1 );
+  int i;
+
+  if( digits != NULL )
+  {
+    for( i = n - 1; i >= 0; i-- )
+    {
+      digits[i] = '0' + value % 10;
+      value /= 10;
+    }
+    digits[n] = 0;
+  }
+  return( n );
+}  /* end number_digits */
+
+//
+// Copy the digits of s to digits and drop the country code. Returns the
+// number of digits, or -1 if there are none or too many.
+//
+static int normalize( const char *s, int len, char *digits, bool prefix )
+{  /* Begin normalize */
+  int n;
+
+  if( ( n = digits_of( s, len, digits ) ) <= 0 ||
+      ( n = drop_country_code( digits, n, prefix ) ) > NUMBER_DIGITS_MAX )
+    return( -1 );
+  return( n );
+}  /* end normalize */
+
+//
+// Copy the digits of s to digits (room for NUMBER_DIGITS_MAX + 1, one more
+// than a number may have before its country code is dropped). Returns their
+// number, or -1 if there are more.
+//
+static int digits_of( const char *s, int len, char *digits )
+{  /* Begin digits_of */
+  int i, n = 0;
+
+  for( i = 0; i < len; i++ )
+  {
+    if( s[i] < '0' || s[i] > '9' )
+      continue;
+    if( n == NUMBER_DIGITS_MAX + 1 )
+      return( -1 );
+    digits[n++] = s[i];
+  }
+  return( n );
+}  /* end digits_of */
+
+//
+// The leading 1 of an 11 digit number (of any prefix if prefix is TRUE) is
+// the North American country code. Returns the number of digits left.
+//
+static int drop_country_code( char *digits, int n, bool prefix )
+{  /* Begin drop_country_code */
+  if( n > 0 && digits[0] == '1' && ( prefix ? n > 1 : n == 11 ) )
+    memmove( digits, digits + 1, --n );
+  return( n );
+}  /* end drop_country_code */
+
+static uint64_t make_key( const char *digits, int n )
+{  /* Begin make_key */
+  uint64_t value = 0;
+  int i;
+
+  for( i = 0; i < n; i++ )
+    value = value * 10 + ( digits[i] - '0' );
+  return( (uint64_t)n << KEY_LEN_SHIFT | value );
+}  /* end make_key */
+
+//
+// Multiplicative hashing: the high bits of the product are the best mixed.
+//
+static unsigned hash_slot( uint64_t key, unsigned mask )
+{  /* Begin hash_slot */
+  return( (unsigned)( ( key * 0x9E3779B97F4A7C15ULL ) >> 32 ) & mask );
+}  /* end hash_slot */
+
+//
+// Open addressing with linear probing; the table is kept at most half full.
+// A key is never 0 (it holds the digit count), so 0 marks a free slot.
+//
+static int add_exact( struct number_index *ni, uint64_t key, int rule )
+{  /* Begin add_exact */
+  unsigned h, cap;
+
+  if( ni->hashMask == 0 || ( ni->nexact + 1 ) * 2 > (int)( ni->hashMask + 1 ) )
+  {
+    uint64_t *keys, *oldKeys = ni->keys;
+    int *rules, *oldRules = ni->exactRule;
+    unsigned oldCap = ni->hashMask ? ni->hashMask + 1 : 0;
+    unsigned i;
+
+    cap = oldCap ? oldCap * 2 : 1024;
+    keys = calloc( cap, sizeof( *keys ) );
+    rules = malloc( cap * sizeof( *rules ) );
+    if( keys == NULL || rules == NULL )
+    {
+      free( keys );
+      free( rules );
+      return( -1 );
+    }
+    ni->keys = keys;
+    ni->exactRule = rules;
+    ni->hashMask = cap - 1;
+    for( i = 0; i < oldCap; i++ )
+    {
+      if( oldKeys[i] == 0 )
+        continue;
+      for( h = hash_slot( oldKeys[i], ni->hashMask ); keys[h] != 0; h = ( h + 1 ) & ni->hashMask )
+        ;
+      keys[h] = oldKeys[i];
+      rules[h] = oldRules[i];
+    }
+    free( oldKeys );
+    free( oldRules );
+  }
+
+  for( h = hash_slot( key, ni->hashMask ); ni->keys[h] != 0; h = ( h + 1 ) & ni->hashMask )
+  {
+    // Duplicate numbers: the first record keeps the match
+    if( ni->keys[h] == key )
+    {
+      ni->nrules++;
+      return( NUMBER_RULE );
+    }
+  }
+  ni->keys[h] = key;
+  ni->exactRule[h] = rule;
+  ni->nexact++;
+  ni->nrules++;
+  return( NUMBER_RULE );
+}  /* end add_exact */
+
+static int add_prefix( struct number_index *ni, const char *digits, int n, int rule )
+{  /* Begin add_prefix */
+  int node, next, i;
+
+  if( ni->nnodes == 0 && add_digit_node( ni ) < 0 )
+    return( -1 );
+  for( node = 0, i = 0; i < n; i++, node = next )
+  {
+    if( ( next = ni->nodes[node].child[digits[i] - '0'] ) != 0 )
+      continue;
+    if( ( next = add_digit_node( ni ) ) < 0 )
+      return( -1 );
+    ni->nodes[node].child[digits[i] - '0'] = next;
+  }
+  if( rule < ni->nodes[node].best )
+    ni->nodes[node].best = rule;
+  ni->nrules++;
+  return( NUMBER_RULE );
+}  /* end add_prefix */
+
+static int add_range( struct number_index *ni, uint64_t lo, uint64_t hi, int rule )
+{  /* Begin add_range */
+  struct number_range *r;
+
+  if( ni->nranges == ni->rangeCap )
+  {
+    ni->rangeCap = ni->rangeCap ? ni->rangeCap * 2 : 64;
+    if( ( r = realloc( ni->ranges, ni->rangeCap * sizeof( *r ) ) ) == NULL )
+      return( -1 );
+    ni->ranges = r;
+  }
+  r = &ni->ranges[ni->nranges++];
+  r->lo = lo;
+  r->hi = hi;
+  r->rule = rule;
+  ni->nrules++;
+  return( NUMBER_RULE );
+}  /* end add_range */
+
+static int add_digit_node( struct number_index *ni )
+{  /* Begin add_digit_node */
+  struct digit_node *n;
+
+  if( ni->nnodes == ni->nodeCap )
+  {
+    ni->nodeCap = ni->nodeCap ? ni->nodeCap * 2 : 64;
+    if( ( n = realloc( ni->nodes, ni->nodeCap * sizeof( *n ) ) ) == NULL )
+      return( -1 );
+    ni->nodes = n;
+  }
+  n = &ni->nodes[ni->nnodes];
+  memset( n->child, 0, sizeof( n->child ) );
+  n->best = INT_MAX;
+  return( ni->nnodes++ );
+}  /* end add_digit_node */
+
+static int compare_ranges( const void *a, const void *b )
+{  /* Begin compare_ranges */
+  const struct number_range *ra = a, *rb = b;
+
+  return( ra->lo < rb->lo ? -1 : ra->lo > rb->lo );
+}  /* end compare_ranges */
+
+static int compare_keys( const void *a, const void *b )
+{  /* Begin compare_keys */
+  uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+
+  return( ka < kb ? -1 : ka > kb );
+}  /* end compare_keys */
+
+//
+// Binary min-heap of range indexes ordered by rule.
+//
+static void heap_push( int *heap, int *n, int r, const struct number_range *ranges )
+{  /* Begin heap_push */
+  int i = (*n)++, parent;
+
+  while( i > 0 && ranges[heap[parent = ( i - 1 ) / 2]].rule > ranges[r].rule )
+  {
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = r;
+}  /* end heap_push */
+
+static void heap_pop( int *heap, int *n, const struct number_range *ranges )
+{  /* Begin heap_pop */
+  int last = heap[--(*n)];
+  int i = 0, child;
+
+  while( ( child = 2 * i + 1 ) < *n )
+  {
+    if( child + 1 < *n && ranges[heap[child + 1]].rule < ranges[heap[child]].rule )
+      child++;
+    if( ranges[heap[child]].rule >= ranges[last].rule )
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+}  /* end heap_pop */
@@ -0,0 +1,900 @@
+/*
+Program name: jcblock
+
+File name: pattern.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Pattern rules: list records whose test field is a glob or a regular expression
+that must match the whole number or the whole name of the call:
+  N=glob?  P=glob?   the name (N) or the number (P) matches a glob: '*' is
+                     any characters, '#' a digit, [...] one of a set
+  N~re?    P~re?     the name or the number matches a regular expression:
+                     literals, '.', [...] and [^...], \d \w \s, (...), a|b,
+                     and a repeat after an atom: * + {m} {m,} {m,n}
+Letters match in either case, as in the other rules. ('?' ends the test field,
+so {0,1} is written for an optional atom.)
+
+Every pattern of a list is compiled (Thompson's construction) into one NFA with
+a start for each field. The NFA is run as a DFA that is built lazily: a DFA
+state is the set of NFA states a field could be in, and its transition for a
+byte is worked out the first time that byte is seen in that state and kept, so
+a field is matched in one pass over its bytes whatever the number of patterns.
+Bytes that every pattern treats alike share one column of the transition table.
+The DFA states kept take at most PATTERN_DFA_MAX bytes; when they would take
+more, they are all dropped and built again as needed. Only the thread that
+decides calls runs a list's patterns, so the DFA needs no locks.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "common.h"
+
+#define PATTERN_DFA_MAX    ( 256 * 1024 )  // bytes of DFA states per list
+#define PATTERN_STATES_MAX 1024    // NFA states of one pattern
+#define PATTERN_REPEAT_MAX 32      // largest count of a {m,n} repeat
+
+#define NFA_SET    0               // takes a byte of the set sets[arg]
+#define NFA_MATCH  1               // the pattern of rule arg matched
+#define NFA_SPLIT  2               // goes on to out and out1
+#define NFA_EMPTY  3               // goes on to out
+
+#define FIELD_NUMBER 0
+#define FIELD_NAME   1
+
+#define DFA_DEAD     (-1)          // no pattern can match any more
+#define DFA_UNKNOWN  (-2)          // transition not worked out yet
+#define DFA_FAILED   (-3)          // out of memory
+#define DFA_BUCKETS  1024
+
+struct nfa_state
+{
+  int type;
+  int out, out1;                   // next states (-1: none yet)
+  int arg;
+};
+
+struct dfa_state
+{
+  int      setOff;                 // its NFA states in setPool
+  int      setLen;
+  int      best;                   // lowest rule matched here (INT_MAX: none)
+  unsigned hash;
+  int      chain;                  // next state of the hash bucket
+};
+
+struct pattern_set
+{
+  int       nstates, stateCap;
+  struct nfa_state *states;
+  int       nsets, setCap;
+  uint32_t (*sets)[8];             // 256 bit byte sets
+  int       literalSet[256];       // set of one byte (-1: none yet)
+  int       nstarts[2], startCap[2];
+  int      *starts[2];             // NFA start of each pattern, by field
+
+  // Built by pattern_finish()
+  unsigned char classOf[256];      // byte class of each byte
+  unsigned char classRep[256];     // a byte of each class
+  int       nclasses;
+  int      *stack, *moves, *set;   // work arrays (nstates)
+  unsigned *mark;
+  unsigned  markGen;
+
+  // The lazy DFA
+  int       ndfa, dfaCap;
+  struct dfa_state *dfa;
+  int      *next;                  // ndfa * nclasses transitions
+  int      *setPool;
+  int       poolLen, poolCap;
+  int       buckets[DFA_BUCKETS];
+  int       dfaStart[2];
+  long      dfaBytes;
+  unsigned long flushes;
+};
+
+struct frag
+{
+  int start, end;                  // end is an NFA_EMPTY state to link on
+};
+
+struct parser
+{
+  struct pattern_set *ps;
+  const char *s;
+  int  len, pos;
+  bool glob;
+  int  firstState;                 // the pattern's states start here
+  bool bad;
+};
+
+static struct frag parse_alt( struct parser *p );
+static struct frag parse_concat( struct parser *p );
+static struct frag parse_repeat( struct parser *p );
+static struct frag parse_atom( struct parser *p );
+static int  parse_class( struct parser *p, uint32_t *bits );
+static int  parse_escape( struct parser *p, uint32_t *bits );
+static struct frag frag_set( struct parser *p, const uint32_t *bits );
+static struct frag frag_empty( struct parser *p );
+static struct frag frag_concat( struct parser *p, struct frag a, struct frag b );
+static struct frag frag_alt( struct parser *p, struct frag a, struct frag b );
+static struct frag frag_repeat( struct parser *p, struct frag a, bool again, bool skip );
+static int  new_state( struct parser *p, int type, int out, int out1, int arg );
+static int  add_set( struct pattern_set *ps, const uint32_t *bits );
+static void set_range( uint32_t *bits, int lo, int hi );
+static int  closure( struct pattern_set *ps, const int *from, int nfrom );
+static int  dfa_add( struct pattern_set *ps, int n );
+static int  dfa_step( struct pattern_set *ps, int d, int c );
+static void dfa_flush( struct pattern_set *ps );
+static int  match_field( struct pattern_set *ps, int field, const char *text, int len );
+static int  compare_int( const void *a, const void *b );
+
+#define HAS_BYTE( bits, b )  ( ( (bits)[(b) >> 5] >> ( (b) & 31 ) ) & 1 )
+#define IS_LOWER( b )        ( (b) >= 'a' && (b) <= 'z' )
+
+//
+// Add the test field of a record if it is a pattern rule (the set is
+// created by the first one). Returns PATTERN_RULE (added), NOT_PATTERN_RULE
+// (token is not used), BAD_PATTERN_RULE (not a valid pattern) or -1 (out of
+// memory).
+//
+int pattern_add( struct pattern_set **psp, const char *token, int len, int rule )
+{  /* Begin pattern_add */
+  struct pattern_set *ps = *psp;
+  struct parser p;
+  struct frag f;
+  int field, match, i, *s;
+
+  if( len < 3 || ( token[0] != 'N' && token[0] != 'P' ) || ( token[1] != '=' && token[1] != '~' ) )
+    return( NOT_PATTERN_RULE );
+  field = token[0] == 'N' ? FIELD_NAME : FIELD_NUMBER;
+
+  if( ps == NULL )
+  {
+    if( ( ps = calloc( 1, sizeof( *ps ) ) ) == NULL )
+      return( -1 );
+    for( i = 0; i < 256; i++ )
+      ps->literalSet[i] = -1;
+    *psp = ps;
+  }
+
+  p.ps    = ps;
+  p.s     = token + 2;
+  p.len   = len - 2;
+  p.pos   = 0;
+  p.glob  = ( token[1] == '=' );
+  p.firstState = ps->nstates;
+  p.bad   = FALSE;
+  f = parse_alt( &p );
+  if( !p.bad && p.pos < p.len )
+    p.bad = TRUE;          // a ')' without its '('
+  if( !p.bad )
+    match = new_state( &p, NFA_MATCH, -1, -1, rule );
+  if( p.bad )
+  {
+    ps->nstates = p.firstState;
+    return( ps->states == NULL ? -1 : BAD_PATTERN_RULE );
+  }
+  ps->states[f.end].out = match;
+
+  if( ps->nstarts[field] == ps->startCap[field] )
+  {
+    ps->startCap[field] = ps->startCap[field] ? ps->startCap[field] * 2 : 16;
+    if( ( s = realloc( ps->starts[field], ps->startCap[field] * sizeof( int ) ) ) == NULL )
+      return( -1 );
+    ps->starts[field] = s;
+  }
+  ps->starts[field][ps->nstarts[field]++] = f.start;
+  return( PATTERN_RULE );
+}  /* end pattern_add */
+
+//
+// Make the byte classes and the work arrays once every pattern is added
+// (again if patterns were added after that). Returns 0 or -1.
+//
+int pattern_finish( struct pattern_set *ps )
+{  /* Begin pattern_finish */
+  int b, prev, s, i;
+
+  // The DFA states are laid out for the byte classes they were made with
+  free( ps->stack );
+  free( ps->moves );
+  free( ps->set );
+  free( ps->mark );
+  free( ps->dfa );
+  free( ps->next );
+  ps->dfa = NULL;
+  ps->next = NULL;
+  ps->ndfa = ps->dfaCap = 0;
+
+  // A new class starts where some set holds a byte and not the one before
+  // (lower case letters are matched as upper case)
+  ps->nclasses = 0;
+  for( b = 0, prev = -1; b < 256; b++ )
+  {
+    if( IS_LOWER( b ) )
+      continue;
+    for( s = 0; prev >= 0 && s < ps->nsets; s++ )
+    {
+      if( HAS_BYTE( ps->sets[s], b ) != HAS_BYTE( ps->sets[s], prev ) )
+        break;
+    }
+    if( prev < 0 || s < ps->nsets )
+      ps->classRep[ps->nclasses++] = b;
+    ps->classOf[b] = ps->nclasses - 1;
+    prev = b;
+  }
+  for( b = 'a'; b <= 'z'; b++ )
+    ps->classOf[b] = ps->classOf[b - ( 'a' - 'A' )];
+
+  // A state is expanded once and pushes at most two more
+  ps->stack = malloc( ( 3 * ps->nstates + 2 ) * sizeof( int ) );
+  ps->moves = malloc( ( ps->nstates + 1 ) * sizeof( int ) );
+  ps->set   = malloc( ( ps->nstates + 1 ) * sizeof( int ) );
+  ps->mark  = calloc( ps->nstates + 1, sizeof( unsigned ) );
+  if( ps->stack == NULL || ps->moves == NULL || ps->set == NULL || ps->mark == NULL )
+    return( -1 );
+  for( i = 0; i < DFA_BUCKETS; i++ )
+    ps->buckets[i] = -1;
+  dfa_flush( ps );
+  ps->flushes = 0;
+  return( 0 );
+}  /* end pattern_finish */
+
+//
+// The lowest rule whose pattern matches the whole number or the whole name
+// of a call, or NO_MATCH.
+//
+int pattern_match( struct pattern_set *ps, const char *number, int numberLen,
+                   const char *name, int nameLen )
+{  /* Begin pattern_match */
+  int best = INT_MAX, rule;
+
+  if( ps->nstarts[FIELD_NUMBER] > 0 && number != NULL )
+    best = match_field( ps, FIELD_NUMBER, number, numberLen );
+  if( ps->nstarts[FIELD_NAME] > 0 && name != NULL &&
+      ( rule = match_field( ps, FIELD_NAME, name, nameLen ) ) < best )
+    best = rule;
+  return( best == INT_MAX ? NO_MATCH : best );
+}  /* end pattern_match */
+
+//
+// Bytes of memory used by the NFA and the DFA states kept.
+//
+long pattern_memory( const struct pattern_set *ps )
+{  /* Begin pattern_memory */
+  return( sizeof( *ps ) + (long)ps->stateCap * sizeof( struct nfa_state ) +
+          (long)ps->setCap * sizeof( ps->sets[0] ) +
+          ( (long)ps->startCap[0] + ps->startCap[1] ) * sizeof( int ) +
+          ( 6L * ps->nstates + 5 ) * sizeof( int ) +
+          (long)ps->dfaCap * ( sizeof( struct dfa_state ) + ps->nclasses * sizeof( int ) ) +
+          (long)ps->poolCap * sizeof( int ) );
+}  /* end pattern_memory */
+
+void pattern_free( struct pattern_set *ps )
+{  /* Begin pattern_free */
+  if( ps == NULL )
+    return;
+  free( ps->states );
+  free( ps->sets );
+  free( ps->starts[0] );
+  free( ps->starts[1] );
+  free( ps->stack );
+  free( ps->moves );
+  free( ps->set );
+  free( ps->mark );
+  free( ps->dfa );
+  free( ps->next );
+  free( ps->setPool );
+  free( ps );
+}  /* end pattern_free */
+
+//
+// alt := concat ( '|' concat )*     (globs have no alternatives)
+//
+static struct frag parse_alt( struct parser *p )
+{  /* Begin parse_alt */
+  struct frag f = parse_concat( p );
+
+  while( !p->bad && !p->glob && p->pos < p->len && p->s[p->pos] == '|' )
+  {
+    p->pos++;
+    f = frag_alt( p, f, parse_concat( p ) );
+  }
+  return( f );
+}  /* end parse_alt */
+
+static struct frag parse_concat( struct parser *p )
+{  /* Begin parse_concat */
+  struct frag f = frag_empty( p );
+
+  while( !p->bad && p->pos < p->len &&
+         ( p->glob || ( p->s[p->pos] != '|' && p->s[p->pos] != ')' ) ) )
+    f = frag_concat( p, f, parse_repeat( p ) );
+  return( f );
+}  /* end parse_concat */
+
+//
+// repeat := atom [ '*' | '+' | '{m}' | '{m,}' | '{m,n}' ]
+// A counted repeat is made of copies of the atom, parsed again for each.
+//
+static struct frag parse_repeat( struct parser *p )
+{  /* Begin parse_repeat */
+  struct frag f, r, copy;
+  int atomPos = p->pos, endPos;
+  int m, n, i;
+  char c;
+
+  f = parse_atom( p );
+  if( p->bad || p->glob || p->pos >= p->len )
+    return( f );
+
+  c = p->s[p->pos];
+  if( c == '*' || c == '+' )
+  {
+    p->pos++;
+    f = frag_repeat( p, f, TRUE, c == '*' );
+  }
+  else if( c == '{' )
+  {
+    p->pos++;
+    for( m = 0; p->pos < p->len && p->s[p->pos] >= '0' && p->s[p->pos] <= '9'; p->pos++ )
+      m = m * 10 + ( p->s[p->pos] - '0' );
+    n = m;
+    if( p->pos < p->len && p->s[p->pos] == ',' )
+    {
+      p->pos++;
+      if( p->pos < p->len && p->s[p->pos] == '}' )
+        n = -1;
+      for( i = 0; p->pos < p->len && p->s[p->pos] >= '0' && p->s[p->pos] <= '9'; p->pos++ )
+        n = i = i * 10 + ( p->s[p->pos] - '0' );
+    }
+    if( p->pos >= p->len || p->s[p->pos] != '}' || m > PATTERN_REPEAT_MAX ||
+        n > PATTERN_REPEAT_MAX || ( n >= 0 && n < m ) )
+    {
+      p->bad = TRUE;
+      return( f );
+    }
+    endPos = ++p->pos;
+
+    // m copies, then n - m optional ones (or one repeated any number of times)
+    r = frag_empty( p );
+    for( i = 0; !p->bad && ( i < m || ( n < 0 ? i == m : i < n ) ); i++ )
+    {
+      if( i == 0 )
+        copy = f;
+      else
+      {
+        p->pos = atomPos;
+        copy = parse_atom( p );
+      }
+      if( i >= m )
+        copy = frag_repeat( p, copy, n < 0, TRUE );
+      r = frag_concat( p, r, copy );
+    }
+    p->pos = endPos;
+    f = r;
+  }
+  else
+    return( f );
+
+  // One repeat per atom: a** or a*{2} need parentheses
+  if( p->pos < p->len && strchr( "*+{", p->s[p->pos] ) != NULL )
+    p->bad = TRUE;
+  return( f );
+}  /* end parse_repeat */
+
+static struct frag parse_atom( struct parser *p )
+{  /* Begin parse_atom */
+  uint32_t bits[8];
+  struct frag f;
+  unsigned char c;
+
+  memset( bits, 0, sizeof( bits ) );
+  if( p->pos >= p->len )
+  {
+    p->bad = TRUE;
+    return( frag_empty( p ) );
+  }
+  c = p->s[p->pos++];
+
+  if( p->glob )
+  {
+    if( c == '*' )
+    {
+      set_range( bits, 0, 255 );
+      return( frag_repeat( p, frag_set( p, bits ), TRUE, TRUE ) );
+    }
+    if( c == '#' )
+      set_range( bits, '0', '9' );
+    else if( c == '[' )
+      parse_class( p, bits );
+    else
+      set_range( bits, c, c );
+    return( frag_set( p, bits ) );
+  }
+
+  switch( c )
+  {
+    case '(':
+      f = parse_alt( p );
+      if( p->pos >= p->len || p->s[p->pos] != ')' )
+        p->bad = TRUE;
+      p->pos++;
+      return( f );
+    case '.':
+      set_range( bits, 0, 255 );
+      break;
+    case '[':
+      parse_class( p, bits );
+      break;
+    case '\\':
+      parse_escape( p, bits );
+      break;
+    case '*': case '+': case '{': case '}': case ')': case '|': case '^': case '$':
+      p->bad = TRUE;          // '^' and '$': patterns always match whole fields
+      return( frag_empty( p ) );
+    default:
+      set_range( bits, c, c );
+      break;
+  }
+  return( frag_set( p, bits ) );
+}  /* end parse_atom */
+
+//
+// [...] or [^...] after the '[': single bytes, ranges a-b and escapes; a
+// ']' first is a byte of the set. Returns 0 or -1 (p->bad is set).
+//
+static int parse_class( struct parser *p, uint32_t *bits )
+{  /* Begin parse_class */
+  uint32_t esc[8];
+  bool negate = FALSE;
+  int lo, hi, i, start;
+
+  if( p->pos < p->len && p->s[p->pos] == '^' )
+  {
+    negate = TRUE;
+    p->pos++;
+  }
+  start = p->pos;
+  for( ;; )
+  {
+    if( p->pos >= p->len )
+    {
+      p->bad = TRUE;
+      return( -1 );
+    }
+    lo = (unsigned char)p->s[p->pos++];
+    if( lo == ']' && p->pos - 1 > start )
+      break;
+    if( lo == '\\' && !p->glob )
+    {
+      memset( esc, 0, sizeof( esc ) );
+      if( parse_escape( p, esc ) != 0 )
+        return( -1 );
+      for( i = 0; i < 8; i++ )
+        bits[i] |= esc[i];
+      continue;
+    }
+    hi = lo;
+    if( p->pos + 1 < p->len && p->s[p->pos] == '-' && p->s[p->pos + 1] != ']' )
+    {
+      hi = (unsigned char)p->s[p->pos + 1];
+      p->pos += 2;
+      if( hi < lo )
+      {
+        p->bad = TRUE;
+        return( -1 );
+      }
+    }
+    set_range( bits, lo, hi );
+  }
+
+  // Letters in either case; a negated set then leaves both out
+  for( i = 'a'; i <= 'z'; i++ )
+  {
+    if( HAS_BYTE( bits, i ) || HAS_BYTE( bits, i - ( 'a' - 'A' ) ) )
+    {
+      set_range( bits, i, i );
+      set_range( bits, i - ( 'a' - 'A' ), i - ( 'a' - 'A' ) );
+    }
+  }
+  if( negate )
+  {
+    for( i = 0; i < 8; i++ )
+      bits[i] = ~bits[i];
+  }
+  return( 0 );
+}  /* end parse_class */
+
+//
+// \d \w \s or a punctuation character after the '\'. Returns 0 or -1 (p->bad
+// is set).
+//
+static int parse_escape( struct parser *p, uint32_t *bits )
+{  /* Begin parse_escape */
+  unsigned char c;
+
+  if( p->pos >= p->len )
+  {
+    p->bad = TRUE;
+    return( -1 );
+  }
+  c = p->s[p->pos++];
+  switch( c )
+  {
+    case 'd':
+      set_range( bits, '0', '9' );
+      break;
+    case 'w':
+      set_range( bits, '0', '9' );
+      set_range( bits, 'A', 'Z' );
+      break;
+    case 's':
+      set_range( bits, ' ', ' ' );
+      set_range( bits, '\t', '\t' );
+      break;
+    default:
+      if( ( c >= '0' && c <= '9' ) || ( c >= 'A' && c <= 'Z' ) || IS_LOWER( c ) )
+      {
+        p->bad = TRUE;
+        return( -1 );
+      }
+      set_range( bits, c, c );
+      break;
+  }
+  return( 0 );
+}  /* end parse_escape */
+
+//
+// Fragments. Each ends in an NFA_EMPTY state whose out is linked to what
+// follows. Out of memory or too many states sets p->bad.
+//
+static struct frag frag_set( struct parser *p, const uint32_t *bits )
+{  /* Begin frag_set */
+  struct frag f;
+  int set = add_set( p->ps, bits );
+
+  f.end = new_state( p, NFA_EMPTY, -1, -1, 0 );
+  f.start = new_state( p, NFA_SET, f.end, -1, set );
+  if( set < 0 )
+    p->bad = TRUE;
+  return( f );
+}  /* end frag_set */
+
+static struct frag frag_empty( struct parser *p )
+{  /* Begin frag_empty */
+  struct frag f;
+
+  f.start = f.end = new_state( p, NFA_EMPTY, -1, -1, 0 );
+  return( f );
+}  /* end frag_empty */
+
+static struct frag frag_concat( struct parser *p, struct frag a, struct frag b )
+{  /* Begin frag_concat */
+  if( p->bad )
+    return( a );
+  p->ps->states[a.end].out = b.start;
+  a.end = b.end;
+  return( a );
+}  /* end frag_concat */
+
+static struct frag frag_alt( struct parser *p, struct frag a, struct frag b )
+{  /* Begin frag_alt */
+  struct frag f;
+
+  f.end = new_state( p, NFA_EMPTY, -1, -1, 0 );
+  f.start = new_state( p, NFA_SPLIT, a.start, b.start, 0 );
+  if( p->bad )
+    return( a );
+  p->ps->states[a.end].out = f.end;
+  p->ps->states[b.end].out = f.end;
+  return( f );
+}  /* end frag_alt */
+
+//
+// a again (if again) and a skipped (if skip): a+ is (TRUE, FALSE), a* is
+// (TRUE, TRUE) and a{0,1} is (FALSE, TRUE).
+//
+static struct frag frag_repeat( struct parser *p, struct frag a, bool again, bool skip )
+{  /* Begin frag_repeat */
+  struct frag f;
+  int split;
+
+  f.end = new_state( p, NFA_EMPTY, -1, -1, 0 );
+  split = new_state( p, NFA_SPLIT, a.start, f.end, 0 );
+  if( p->bad )
+    return( a );
+  p->ps->states[a.end].out = again ? split : f.end;
+  f.start = skip ? split : a.start;
+  return( f );
+}  /* end frag_repeat */
+
+static int new_state( struct parser *p, int type, int out, int out1, int arg )
+{  /* Begin new_state */
+  struct pattern_set *ps = p->ps;
+  struct nfa_state *s;
+
+  if( p->bad )
+    return( 0 );
+  if( ps->nstates - p->firstState >= PATTERN_STATES_MAX )
+  {
+    p->bad = TRUE;
+    return( 0 );
+  }
+  if( ps->nstates == ps->stateCap )
+  {
+    ps->stateCap = ps->stateCap ? ps->stateCap * 2 : 256;
+    if( ( s = realloc( ps->states, ps->stateCap * sizeof( *s ) ) ) == NULL )
+    {
+      free( ps->states );
+      ps->states = NULL;
+      ps->nstates = ps->stateCap = 0;
+      p->bad = TRUE;
+      return( 0 );
+    }
+    ps->states = s;
+  }
+  s = &ps->states[ps->nstates];
+  s->type = type;
+  s->out  = out;
+  s->out1 = out1;
+  s->arg  = arg;
+  return( ps->nstates++ );
+}  /* end new_state */
+
+//
+// Add a byte set (lower case letters in it also match as upper case).
+// Sets of one byte are kept once. Returns its index or -1.
+//
+static int add_set( struct pattern_set *ps, const uint32_t *bits )
+{  /* Begin add_set */
+  uint32_t (*s)[8];
+  int b, n = 0, one = -1;
+
+  for( b = 0; b < 256; b++ )
+  {
+    if( HAS_BYTE( bits, b ) )
+    {
+      n++;
+      one = b;
+    }
+  }
+  if( n == 1 && IS_LOWER( one ) )
+    one -= 'a' - 'A';
+  if( n == 1 && ps->literalSet[one] >= 0 )
+    return( ps->literalSet[one] );
+
+  if( ps->nsets == ps->setCap )
+  {
+    ps->setCap = ps->setCap ? ps->setCap * 2 : 64;
+    if( ( s = realloc( ps->sets, ps->setCap * sizeof( *s ) ) ) == NULL )
+      return( -1 );
+    ps->sets = s;
+  }
+  memcpy( ps->sets[ps->nsets], bits, sizeof( ps->sets[0] ) );
+  for( b = 'a'; b <= 'z'; b++ )
+  {
+    if( HAS_BYTE( bits, b ) )
+      set_range( ps->sets[ps->nsets], b - ( 'a' - 'A' ), b - ( 'a' - 'A' ) );
+  }
+  if( n == 1 )
+  {
+    memset( ps->sets[ps->nsets], 0, sizeof( ps->sets[0] ) );
+    set_range( ps->sets[ps->nsets], one, one );
+    ps->literalSet[one] = ps->nsets;
+  }
+  return( ps->nsets++ );
+}  /* end add_set */
+
+static void set_range( uint32_t *bits, int lo, int hi )
+{  /* Begin set_range */
+  int b;
+
+  for( b = lo; b <= hi; b++ )
+    bits[b >> 5] |= 1U << ( b & 31 );
+}  /* end set_range */
+
+//
+// The NFA_SET and NFA_MATCH states reachable from the states in from
+// without taking a byte, sorted, into ps->set. Returns their number.
+//
+static int closure( struct pattern_set *ps, const int *from, int nfrom )
+{  /* Begin closure */
+  const struct nfa_state *st;
+  int top = 0, n = 0, s, i;
+
+  if( ++ps->markGen == 0 )
+  {
+    memset( ps->mark, 0, ps->nstates * sizeof( unsigned ) );
+    ps->markGen = 1;
+  }
+  for( i = 0; i < nfrom; i++ )
+    ps->stack[top++] = from[i];
+  while( top > 0 )
+  {
+    s = ps->stack[--top];
+    if( s < 0 || ps->mark[s] == ps->markGen )
+      continue;
+    ps->mark[s] = ps->markGen;
+    st = &ps->states[s];
+    switch( st->type )
+    {
+      case NFA_SPLIT:
+        ps->stack[top++] = st->out1;
+        ps->stack[top++] = st->out;
+        break;
+      case NFA_EMPTY:
+        ps->stack[top++] = st->out;
+        break;
+      default:
+        ps->set[n++] = s;
+        break;
+    }
+  }
+  qsort( ps->set, n, sizeof( int ), compare_int );
+  return( n );
+}  /* end closure */
+
+//
+// The DFA state of the n NFA states in ps->set: found, or added (after
+// dropping every state if the new one would not fit). Returns its index,
+// DFA_DEAD for no states or DFA_FAILED.
+//
+static int dfa_add( struct pattern_set *ps, int n )
+{  /* Begin dfa_add */
+  struct dfa_state *d;
+  unsigned hash = 2166136261U;
+  long cost;
+  int i, *p;
+
+  if( n == 0 )
+    return( DFA_DEAD );
+  for( i = 0; i < n; i++ )
+    hash = ( hash ^ ps->set[i] ) * 16777619U;
+  for( i = ps->buckets[hash % DFA_BUCKETS]; i >= 0; i = ps->dfa[i].chain )
+  {
+    d = &ps->dfa[i];
+    if( d->hash == hash && d->setLen == n &&
+        memcmp( ps->setPool + d->setOff, ps->set, n * sizeof( int ) ) == 0 )
+      return( i );
+  }
+
+  cost = sizeof( struct dfa_state ) + ( ps->nclasses + n ) * sizeof( int );
+  if( ps->ndfa > 0 && ps->dfaBytes + cost > PATTERN_DFA_MAX )
+    dfa_flush( ps );
+
+  if( ps->ndfa == ps->dfaCap )
+  {
+    i = ps->dfaCap ? ps->dfaCap * 2 : 64;
+    if( ( d = realloc( ps->dfa, i * sizeof( *d ) ) ) == NULL )
+      return( DFA_FAILED );
+    ps->dfa = d;
+    if( ( p = realloc( ps->next, (long)i * ps->nclasses * sizeof( int ) ) ) == NULL )
+      return( DFA_FAILED );
+    ps->next = p;
+    ps->dfaCap = i;
+  }
+  if( ps->poolLen + n > ps->poolCap )
+  {
+    for( i = ps->poolCap ? ps->poolCap * 2 : 1024; i < ps->poolLen + n; i *= 2 )
+      ;
+    if( ( p = realloc( ps->setPool, i * sizeof( int ) ) ) == NULL )
+      return( DFA_FAILED );
+    ps->setPool = p;
+    ps->poolCap = i;
+  }
+
+  d = &ps->dfa[ps->ndfa];
+  d->setOff = ps->poolLen;
+  d->setLen = n;
+  d->hash   = hash;
+  d->best   = INT_MAX;
+  memcpy( ps->setPool + ps->poolLen, ps->set, n * sizeof( int ) );
+  ps->poolLen += n;
+  for( i = 0; i < n; i++ )
+  {
+    if( ps->states[ps->set[i]].type == NFA_MATCH && ps->states[ps->set[i]].arg < d->best )
+      d->best = ps->states[ps->set[i]].arg;
+  }
+  for( i = 0; i < ps->nclasses; i++ )
+    ps->next[(long)ps->ndfa * ps->nclasses + i] = DFA_UNKNOWN;
+  d->chain = ps->buckets[hash % DFA_BUCKETS];
+  ps->buckets[hash % DFA_BUCKETS] = ps->ndfa;
+  ps->dfaBytes += cost;
+  return( ps->ndfa++ );
+}  /* end dfa_add */
+
+//
+// Work out the transition of DFA state d for byte class c. It is kept
+// unless the states were dropped to make room for the new one.
+//
+static int dfa_step( struct pattern_set *ps, int d, int c )
+{  /* Begin dfa_step */
+  const int *set = ps->setPool + ps->dfa[d].setOff;
+  int n = ps->dfa[d].setLen;
+  unsigned long flushes = ps->flushes;
+  const struct nfa_state *st;
+  int i, nmoves = 0, next;
+
+  for( i = 0; i < n; i++ )
+  {
+    st = &ps->states[set[i]];
+    if( st->type == NFA_SET && HAS_BYTE( ps->sets[st->arg], ps->classRep[c] ) )
+      ps->moves[nmoves++] = st->out;
+  }
+  next = dfa_add( ps, closure( ps, ps->moves, nmoves ) );
+  if( next != DFA_FAILED && ps->flushes == flushes )
+    ps->next[(long)d * ps->nclasses + c] = next;
+  return( next );
+}  /* end dfa_step */
+
+//
+// Drop every DFA state; they are built again as fields are matched.
+//
+static void dfa_flush( struct pattern_set *ps )
+{  /* Begin dfa_flush */
+  int i;
+
+  for( i = 0; i < ps->ndfa; i++ )
+    ps->buckets[ps->dfa[i].hash % DFA_BUCKETS] = -1;
+  ps->ndfa = 0;
+  ps->poolLen = 0;
+  ps->dfaBytes = 0;
+  ps->dfaStart[FIELD_NUMBER] = ps->dfaStart[FIELD_NAME] = DFA_UNKNOWN;
+  ps->flushes++;
+}  /* end dfa_flush */
+
+//
+// The lowest rule whose pattern matches the whole field, or INT_MAX.
+//
+static int match_field( struct pattern_set *ps, int field, const char *text, int len )
+{  /* Begin match_field */
+  int d, next, i;
+
+  if( ( d = ps->dfaStart[field] ) == DFA_UNKNOWN )
+  {
+    d = dfa_add( ps, closure( ps, ps->starts[field], ps->nstarts[field] ) );
+    if( d == DFA_FAILED )
+    {
+      log_debug_info("out of memory matching list patterns");
+      return( INT_MAX );
+    }
+    ps->dfaStart[field] = d;
+  }
+  for( i = 0; i < len && d >= 0; i++ )
+  {
+    next = ps->next[(long)d * ps->nclasses + ps->classOf[(unsigned char)text[i]]];
+    if( next == DFA_UNKNOWN )
+      next = dfa_step( ps, d, ps->classOf[(unsigned char)text[i]] );
+    if( next == DFA_FAILED )
+    {
+      log_debug_info("out of memory matching list patterns");
+      return( INT_MAX );
+    }
+    d = next;
+  }
+  return( d >= 0 ? ps->dfa[d].best : INT_MAX );
+}  /* end match_field */
+
+static int compare_int( const void *a, const void *b )
+{  /* Begin compare_int */
+  int x = *(const int *)a, y = *(const int *)b;
+
+  return( x < y ? -1 : x > y );
+}  /* end compare_int */
@@ -0,0 +1,543 @@
+/*
+Program name: jcblock
+
+File name: persist.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Takes file writes off the call path. The call path queues call history records
+and whitelist/blacklist hits in a bounded queue and returns at once; it never
+waits on the SD card. A writer thread takes everything that is queued, appends
+the call records to the history store (history.c) and the hits to the hit
+journal (hitlog.c) and then syncs each file it touched once (group commit). The
+lists themselves are only written to add a record (jcblock -a, or the control
+socket) or to remove the records of a test field (the control socket; the file
+is rewritten and renamed into place). Each list write has a sequence number;
+once it is on disk persist_lists_written() returns it, so that the edits the
+control socket keeps in memory can be dropped when a snapshot of the lists
+read after that number includes them (see control.c and watch.c). A list
+write that leaves the file as it was (a removal no record matched, or any
+write that failed) is never seen by the watcher; persist_list_unchanged()
+tells the control socket about it instead. A removal rewrites the file
+under a temporary name and only renames it into place if the list was not
+changed meanwhile. If the queue is full the record is dropped and counted
+rather than delaying the call. persist_drain() writes whatever is still
+queued when the program terminates.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+#define PERSIST_QUEUE_SIZE 256
+#define PERSIST_UNCHANGED  1024  // list writes that changed nothing kept
+                                 // (no fewer than EDITS_MAX of control.c)
+
+#define PERSIST_HISTORY    1   // append a call to the history store
+#define PERSIST_LIST_HIT   2   // a list record matched a call
+#define PERSIST_LIST_ADD   3   // append a record to a list file
+#define PERSIST_LIST_REMOVE 4  // remove the records of a test field
+
+struct persist_item
+{
+  int  type;
+  int  len;                            // length of text
+  int  decision;                       // PERSIST_HISTORY: CALL_...
+  int  line;                           // PERSIST_HISTORY: modem
+  char list;                           // PERSIST_LIST_HIT: 'W' or 'B'
+  unsigned long seq;                   // PERSIST_LIST_ADD/REMOVE: list write
+  char path[FILE_PATH_MAX];            // PERSIST_LIST_ADD/REMOVE: list file
+  char text[256];                      // record text (LIST_HIT, LIST_REMOVE:
+                                       // test field)
+  char date[LIST_DATE_LEN + 1];
+};
+
+static struct persist_item queue[PERSIST_QUEUE_SIZE];
+static int queueHead, queueCount;
+static unsigned long dropped;
+static unsigned long listSeq;          // last list write queued
+static unsigned long listWritten;      // last list write done (atomic)
+static unsigned long unchanged[PERSIST_UNCHANGED]; // list writes that changed
+                                       // nothing, the last ones (queueLock)
+static unsigned long unchangedCount;   // how many there were (atomic)
+static bool stopping;
+static bool started;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queueCond = PTHREAD_COND_INITIALIZER;
+static pthread_t writerThread;
+
+static struct persist_item *reserve_item( int type );
+static void *write_queued( void *arg );
+static void commit_batch( struct persist_item *batch, int n );
+static bool append_record( const struct persist_item *item );
+static bool remove_records( const struct persist_item *items, int n );
+static int  rewrite_list( const struct persist_item *items, int n );
+
+//
+// Open the history store and the hit journal and start the writer thread.
+// Returns 0 or -1.
+//
+int persist_start( void )
+{  /* Begin persist_start */
+  if( history_open() != 0 )
+  {
+    log_debug_info("open of the history store failed");
+    return( -1 );
+  }
+  if( hitlog_open() != 0 )
+  {
+    log_debug_info("open of the hit journal failed");
+    return( -1 );
+  }
+
+  if( pthread_create( &writerThread, NULL, write_queued, NULL ) != 0 )
+  {
+    log_debug_info("pthread_create() of writer failed");
+    return( -1 );
+  }
+  started = TRUE;
+  return( 0 );
+}  /* end persist_start */
+
+//
+// Queue a call record (callerID.dat format, including its '\n') with the
+// decision taken and the modem it came in on.
+//
+void persist_history( const char *callerIDentry, int decision, int line )
+{  /* Begin persist_history */
+  struct persist_item *item;
+
+  pthread_mutex_lock( &queueLock );
+  if( ( item = reserve_item( PERSIST_HISTORY ) ) != NULL )
+  {
+    strncpy( item->text, callerIDentry, sizeof( item->text ) - 1 );
+    item->text[sizeof( item->text ) - 1] = 0;
+    item->len = strlen( item->text );
+    item->decision = decision;
+    item->line = line;
+    pthread_cond_signal( &queueCond );
+  }
+  pthread_mutex_unlock( &queueLock );
+}  /* end persist_history */
+
+//
+// Queue a hit of a list record at the date of the call (the first 16
+// characters of the caller ID string).
+//
+void persist_list_hit( const struct match_list *ml, int rule, const char *callstr )
+{  /* Begin persist_list_hit */
+  struct persist_item *item;
+
+  pthread_mutex_lock( &queueLock );
+  if( ( item = reserve_item( PERSIST_LIST_HIT ) ) != NULL )
+  {
+    item->list = strcmp( ml->name, "whitelist" ) == 0 ? 'W' : 'B';
+    list_rule_token( ml, rule, item->text, LIST_TERM_MAX + 1 );
+    item->len = strlen( item->text );
+    strncpy( item->date, callstr, LIST_DATE_LEN );
+    item->date[LIST_DATE_LEN] = 0;
+    pthread_cond_signal( &queueCond );
+  }
+  pthread_mutex_unlock( &queueLock );
+}  /* end persist_list_hit */
+
+//
+// Queue a new record (including its '\n') for the end of a list file.
+// Returns the sequence number of the write, or 0 if it was dropped.
+//
+unsigned long persist_list_add( const char *path, const char *record )
+{  /* Begin persist_list_add */
+  struct persist_item *item;
+  unsigned long seq = 0;
+
+  if( strlen( path ) >= sizeof( item->path ) || strlen( record ) >= sizeof( item->text ) )
+    return( 0 );
+
+  pthread_mutex_lock( &queueLock );
+  if( ( item = reserve_item( PERSIST_LIST_ADD ) ) != NULL )
+  {
+    strcpy( item->path, path );
+    strcpy( item->text, record );
+    item->len = strlen( record );
+    item->seq = seq = ++listSeq;
+    pthread_cond_signal( &queueCond );
+  }
+  pthread_mutex_unlock( &queueLock );
+  return( seq );
+}  /* end persist_list_add */
+
+//
+// Queue the removal of every record of a list file whose test field is
+// token (in any case). Returns the sequence number of the write, or 0 if
+// it was dropped.
+//
+unsigned long persist_list_remove( const char *path, const char *token )
+{  /* Begin persist_list_remove */
+  struct persist_item *item;
+  unsigned long seq = 0;
+
+  if( strlen( path ) >= sizeof( item->path ) || strlen( token ) > LIST_TERM_MAX )
+    return( 0 );
+
+  pthread_mutex_lock( &queueLock );
+  if( ( item = reserve_item( PERSIST_LIST_REMOVE ) ) != NULL )
+  {
+    strcpy( item->path, path );
+    strcpy( item->text, token );
+    item->len = strlen( token );
+    item->seq = seq = ++listSeq;
+    pthread_cond_signal( &queueCond );
+  }
+  pthread_mutex_unlock( &queueLock );
+  return( seq );
+}  /* end persist_list_remove */
+
+//
+// The sequence number of the last list write that is on disk.
+//
+unsigned long persist_lists_written( void )
+{  /* Begin persist_lists_written */
+  return( __atomic_load_n( &listWritten, __ATOMIC_ACQUIRE ) );
+}  /* end persist_lists_written */
+
+//
+// The number of list writes so far that left their file as it was: when it
+// changes persist_list_unchanged() has more to tell.
+//
+unsigned long persist_unchanged_count( void )
+{  /* Begin persist_unchanged_count */
+  return( __atomic_load_n( &unchangedCount, __ATOMIC_ACQUIRE ) );
+}  /* end persist_unchanged_count */
+
+//
+// Whether list write seq is done and left its file as it was (only the
+// last PERSIST_UNCHANGED of them are known).
+//
+bool persist_list_unchanged( unsigned long seq )
+{  /* Begin persist_list_unchanged */
+  unsigned long count, i;
+  bool found = FALSE;
+
+  pthread_mutex_lock( &queueLock );
+  count = unchangedCount;
+  // Newest first; the sequence numbers grow
+  for( i = 0; i < count && i < PERSIST_UNCHANGED; i++ )
+  {
+    if( unchanged[( count - 1 - i ) % PERSIST_UNCHANGED] <= seq )
+    {
+      found = unchanged[( count - 1 - i ) % PERSIST_UNCHANGED] == seq;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &queueLock );
+  return( found );
+}  /* end persist_list_unchanged */
+
+//
+// Write everything still queued and stop the writer (called by cleanup()).
+//
+void persist_drain( void )
+{  /* Begin persist_drain */
+  char message[128];
+
+  if( !started )
+    return;
+  pthread_mutex_lock( &queueLock );
+  stopping = TRUE;
+  pthread_cond_signal( &queueCond );
+  pthread_mutex_unlock( &queueLock );
+  pthread_join( writerThread, NULL );
+  started = FALSE;
+  history_close();
+  hitlog_close();
+
+  if( dropped )
+  {
+    sprintf( message, "%lu records were dropped because the write queue was full", dropped );
+    log_debug_info( message );
+  }
+}  /* end persist_drain */
+
+//
+// Get the next free queue slot (queueLock held). Returns NULL, and counts
+// the record as dropped, if the queue is full.
+//
+static struct persist_item *reserve_item( int type )
+{  /* Begin reserve_item */
+  struct persist_item *item;
+
+  if( queueCount == PERSIST_QUEUE_SIZE || stopping )
+  {
+    dropped++;
+    return( NULL );
+  }
+  item = &queue[( queueHead + queueCount ) % PERSIST_QUEUE_SIZE];
+  queueCount++;
+  item->type = type;
+  return( item );
+}  /* end reserve_item */
+
+//
+// Writer thread: take all queued items at once and commit them together.
+//
+static void *write_queued( void *arg )
+{  /* Begin write_queued */
+  static struct persist_item batch[PERSIST_QUEUE_SIZE];
+  int n;
+
+  for( ;; )
+  {
+    pthread_mutex_lock( &queueLock );
+    while( queueCount == 0 && !stopping )
+      pthread_cond_wait( &queueCond, &queueLock );
+    if( queueCount == 0 && stopping )
+    {
+      pthread_mutex_unlock( &queueLock );
+      break;
+    }
+    for( n = 0; queueCount > 0; n++ )
+    {
+      batch[n] = queue[queueHead];
+      queueHead = ( queueHead + 1 ) % PERSIST_QUEUE_SIZE;
+      queueCount--;
+    }
+    pthread_mutex_unlock( &queueLock );
+
+    commit_batch( batch, n );
+  }
+  return( NULL );
+}  /* end write_queued */
+
+//
+// Append the call records to the history store and the hits to the hit
+// journal and add and remove list records, then sync each file touched once.
+//
+static void commit_batch( struct persist_item *batch, int n )
+{  /* Begin commit_batch */
+  int historyCount = 0, hitCount = 0;
+  unsigned long seq = 0;
+  struct timespec t0, t1;
+  bool changed;
+  int i, j, k;
+
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  for( i = 0; i < n; i++ )
+  {
+    if( batch[i].type != PERSIST_HISTORY )
+      continue;
+    if( history_append( batch[i].text, batch[i].decision, batch[i].line ) != 0 )
+      log_debug_info("append to the history store failed");
+    historyCount++;
+  }
+  if( historyCount > 0 )
+  {
+    history_sync();
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    stats_record( STAGE_HISTORY, ( t1.tv_sec - t0.tv_sec ) * 1000000 +
+                                 ( t1.tv_nsec - t0.tv_nsec ) / 1000 );
+  }
+
+  // Hits, appended to the journal and synced together
+  for( i = 0; i < n; i++ )
+  {
+    if( batch[i].type != PERSIST_LIST_HIT )
+      continue;
+    if( hitlog_append( batch[i].list, batch[i].text, batch[i].date ) != 0 )
+      log_debug_info("append to the hit journal failed");
+    hitCount++;
+  }
+  if( hitCount > 0 )
+    hitlog_sync();
+
+  // New and removed records, in the order they were queued (removals
+  // from one file that follow each other take one rewrite)
+  for( i = 0; i < n; i = j )
+  {
+    j = i + 1;
+    if( batch[i].type == PERSIST_LIST_ADD )
+      changed = append_record( &batch[i] );
+    else if( batch[i].type == PERSIST_LIST_REMOVE )
+    {
+      while( j < n && batch[j].type == PERSIST_LIST_REMOVE &&
+             strcmp( batch[j].path, batch[i].path ) == 0 )
+        j++;
+      changed = remove_records( &batch[i], j - i );
+    }
+    else
+      continue;
+    if( !changed )
+    {
+      // The watcher will not see these; tell the control socket
+      pthread_mutex_lock( &queueLock );
+      for( k = i; k < j; k++ )
+        unchanged[( unchangedCount + k - i ) % PERSIST_UNCHANGED] = batch[k].seq;
+      __atomic_store_n( &unchangedCount, unchangedCount + j - i, __ATOMIC_RELEASE );
+      pthread_mutex_unlock( &queueLock );
+    }
+    seq = batch[j - 1].seq;
+  }
+  if( seq != 0 )
+    __atomic_store_n( &listWritten, seq, __ATOMIC_RELEASE );
+}  /* end commit_batch */
+
+//
+// Append a record to the end of a list file. Returns FALSE if it is not
+// there.
+//
+static bool append_record( const struct persist_item *item )
+{  /* Begin append_record */
+  int fdl;
+  char last;
+  struct stat before;
+
+  // (A whitelist is created by its first entry)
+  if( ( fdl = open( item->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644 ) ) < 0 ||
+      fstat( fdl, &before ) != 0 )
+  {
+    log_debug_info("open() of list for a new record failed");
+    if( fdl >= 0 )
+      close( fdl );
+    return( FALSE );
+  }
+
+  // A last line without its '\n' (the file was edited) is ended first
+  if( ( before.st_size > 0 && ( pread( fdl, &last, 1, before.st_size - 1 ) != 1 || last != '\n' ) &&
+        write( fdl, "\n", 1 ) != 1 ) ||
+      write( fdl, item->text, item->len ) != item->len || fdatasync( fdl ) != 0 )
+  {
+    log_debug_info("write() of a new list record failed");
+    close( fdl );
+    return( FALSE );
+  }
+  close( fdl );
+  return( TRUE );
+}  /* end append_record */
+
+//
+// Remove the records of n test fields (all removals from the same file)
+// from a list file. A file that is edited while it is rewritten is read
+// again, a few times. Returns FALSE if the list was left as it was.
+//
+static bool remove_records( const struct persist_item *items, int n )
+{  /* Begin remove_records */
+  char message[FILE_PATH_MAX + 80];
+  int removed, tries = 0, fd;
+
+  while( ( removed = rewrite_list( items, n ) ) == -2 && ++tries < 3 )
+    ;
+  if( removed == -2 )
+    log_debug_info("list kept changing while records were removed; not removed");
+  if( removed <= 0 )
+    return( FALSE );
+  if( ( fd = open( LIST_DIR, O_RDONLY | O_CLOEXEC ) ) >= 0 )
+  {
+    fsync( fd );
+    close( fd );
+  }
+  sprintf( message, "%d record%s removed from %s", removed, removed == 1 ? "" : "s",
+           strrchr( items->path, '/' ) + 1 );
+  log_debug_info( message );
+  return( TRUE );
+}  /* end remove_records */
+
+//
+// Copy a list file without the records of the n test fields to a new file,
+// sync it and rename it over the list (the watcher sees the rename), unless
+// the list was changed since it was read (an edit by hand would be lost).
+// Comment lines and every other line are copied as they are. Returns the
+// number of records removed (0: the list was left alone), -1 if it could
+// not be rewritten or -2 if it changed meanwhile.
+//
+static int rewrite_list( const struct persist_item *items, int n )
+{  /* Begin rewrite_list */
+  char tmpPath[FILE_PATH_MAX + 8];
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t len;
+  struct stat st, now;
+  FILE *in, *out;
+  char *mark;
+  int removed = 0, rc = 0, i;
+
+  if( ( in = fopen( items->path, "r" ) ) == NULL || fstat( fileno( in ), &st ) != 0 )
+  {
+    log_debug_info("open() of list to remove a record failed");
+    if( in != NULL )
+      fclose( in );
+    return( -1 );
+  }
+  sprintf( tmpPath, "%s.tmp", items->path );
+  if( ( out = fopen( tmpPath, "w" ) ) == NULL )
+  {
+    log_debug_info("open() of new list file failed");
+    fclose( in );
+    return( -1 );
+  }
+  fchmod( fileno( out ), st.st_mode & 07777 );
+
+  while( ( len = getline( &line, &lineCap, in ) ) > 0 )
+  {
+    i = n;
+    if( line[0] != '#' && ( mark = strchr( line, '?' ) ) != NULL )
+    {
+      for( i = 0; i < n; i++ )
+      {
+        if( mark - line == items[i].len && strncasecmp( line, items[i].text, items[i].len ) == 0 )
+          break;
+      }
+    }
+    if( i < n )
+    {
+      removed++;
+      continue;
+    }
+    if( fwrite( line, 1, len, out ) != (size_t)len )
+      rc = -1;
+  }
+  free( line );
+  fclose( in );
+  if( fflush( out ) != 0 || fsync( fileno( out ) ) != 0 )
+    rc = -1;
+  if( fclose( out ) != 0 || rc != 0 || removed == 0 )
+  {
+    if( removed > 0 )
+      log_debug_info("write of list without removed records failed");
+    unlink( tmpPath );
+    return( removed == 0 && rc == 0 ? 0 : -1 );
+  }
+
+  // (An edit that lands between this check and the rename is still lost;
+  // the window is a system call wide instead of the whole copy)
+  if( stat( items->path, &now ) != 0 || now.st_ino != st.st_ino || now.st_size != st.st_size ||
+      now.st_mtim.tv_sec != st.st_mtim.tv_sec || now.st_mtim.tv_nsec != st.st_mtim.tv_nsec )
+  {
+    unlink( tmpPath );
+    return( -2 );
+  }
+  if( rename( tmpPath, items->path ) != 0 )
+  {
+    log_debug_info("write of list without removed records failed");
+    unlink( tmpPath );
+    return( -1 );
+  }
+  return( removed );
+}  /* end rewrite_list */
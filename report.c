@@ -0,0 +1,1060 @@
+/*
+Program name: jcblock
+
+File name: report.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+"jcblock report": the call frequency report of CreateCallerIDReport.sh, and
+the calls and block rate of every whitelist and blacklist entry and the top
+callers of every day, week, month or year, from the history store or from
+callerID.dat files. The input is cut into chunks (runs of history records,
+or of text lines cut at a line boundary) that the threads take in turn from
+a shared counter. Each thread counts into its own hash tables, so nothing is
+shared while counting; the tables are merged at the end. Only the distinct
+callers are sorted and checked against the lists, so the work after
+counting does not grow with the number of calls.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+#define REPORT_THREADS_MAX  64
+#define CHUNKS_PER_THREAD   4      // more chunks than threads evens out the work
+#define TEXT_CHUNK_MIN      ( 256 * 1024 )
+#define RECORD_CHUNK_MIN    8192
+#define TOP_DEFAULT         10
+
+// The characters of the number field of callerID.dat
+#define NUMBER_CHAR( c )    ( ( (c) >= '0' && (c) <= '9' ) || (c) == ' ' || (c) == '-' )
+
+#define PERIOD_DAY          0
+#define PERIOD_WEEK         1      // Monday to Sunday
+#define PERIOD_MONTH        2
+#define PERIOD_YEAR         3
+
+struct field
+{
+  const char *s;                   // not '\0' terminated
+  int len;
+};
+
+struct caller                      // calls from one number with one name
+{
+  struct field number, name;
+  uint64_t key;                    // number_key() of the number, 0: not a number
+  unsigned hash;
+  long    calls;                   // 0: free slot
+  long    blocked;                 // calls recorded as blocked
+  long    known;                   // calls with a recorded decision
+  int64_t first, last;
+};
+
+struct period_caller               // calls from one number in one period
+{
+  struct field number;
+  uint64_t key;
+  unsigned hash;
+  int     period;
+  long    calls;                   // 0: free slot
+  int64_t first;
+};
+
+struct aggregate                   // the counts of one thread
+{
+  struct caller *callers;          // hash tables, kept at most half full
+  unsigned callerMask;
+  long     ncallers;
+  struct period_caller *periods;
+  unsigned periodMask;
+  long     nperiods;
+  long     calls, blocked, whitelisted, accepted, unknown, bad;
+  int64_t  first, last;
+  bool     failed;                 // out of memory
+};
+
+struct chunk
+{
+  const struct history_store *hs;  // history records, or text if NULL
+  const struct history_segment *seg;
+  long begin, end;
+  const char *text, *textEnd;
+};
+
+struct number_count                // for the frequency report
+{
+  struct field text;
+  long calls;
+};
+
+struct entry_count                 // calls matched by a list entry
+{
+  long calls, blocked, known;
+};
+
+static struct chunk *chunks;
+static int nchunks, chunkCap;
+static int nextChunk;              // taken with an atomic add
+static int64_t reportFrom = INT64_MIN, reportTo = INT64_MAX;
+static int reportPeriod = PERIOD_MONTH;
+
+static int add_chunk( const struct history_store *hs, const struct history_segment *seg,
+                      long begin, long end, const char *text, const char *textEnd );
+static int add_text_chunks( const char *text, size_t len, int nthreads );
+static void *count_chunks( void *arg );
+static void count_text( struct aggregate *a, const char *p, const char *end );
+static void count_call( struct aggregate *a, struct field number, struct field name,
+                        uint64_t key, int64_t t, int decision );
+static struct caller *find_caller( struct aggregate *a, const struct caller *c );
+static struct period_caller *find_period_caller( struct aggregate *a, const struct period_caller *pc );
+static int grow_callers( struct aggregate *a );
+static int grow_periods( struct aggregate *a );
+static void merge_aggregate( struct aggregate *dst, const struct aggregate *src );
+static bool same_number( const struct field *n1, uint64_t k1, const struct field *n2, uint64_t k2 );
+static unsigned number_hash( const struct field *number, uint64_t key );
+static unsigned field_hash( const struct field *f );
+static int text_time( const char *s, int len, int64_t *t );
+static long days_from_civil( int y, int m, int d );
+static void civil_from_days( long days, int *y, int *m, int *d );
+static long days_of( int64_t t );
+static int period_of( int64_t t );
+static void period_label( int period, char *buf, int size );
+static void format_time( int64_t t, char *buf, int size, bool withTime );
+static void print_frequency( struct caller *callers, long n );
+static void print_list_entries( const struct caller *callers, long n );
+static void print_top_callers( struct aggregate *a, int top );
+static long count_by( struct caller *callers, long n, bool byName, struct number_count **out );
+static int compare_caller_numbers( const void *a, const void *b );
+static int compare_caller_names( const void *a, const void *b );
+static int compare_counts( const void *a, const void *b );
+static int compare_period_callers( const void *a, const void *b );
+static int compare_fields( const struct field *f1, const struct field *f2 );
+
+//
+// jcblock report [-f from] [-t to] [-p day|week|month|year] [-n top]
+//                [-j threads] [callerID.dat ...]
+// Returns the exit status.
+//
+int report_command( int argc, char **argv )
+{  /* Begin report_command */
+  struct history_store hs;
+  struct aggregate agg[REPORT_THREADS_MAX];
+  pthread_t threads[REPORT_THREADS_MAX];
+  struct caller *callers;
+  struct tm tm;
+  struct stat st;
+  char firstDate[32], lastDate[32];
+  const char *periodNames[] = { "day", "week", "month", "year" };
+  void **maps;
+  size_t *mapLens;
+  long perChunk, total, n, i;
+  int nthreads = sysconf( _SC_NPROCESSORS_ONLN );
+  int top = TOP_DEFAULT;
+  int optChar, s, t, fd, nmaps = 0;
+  bool fromHistory;
+
+  optind = 0;                    // new argument vector: restart getopt()
+  while( ( optChar = getopt( argc, argv, "f:t:p:n:j:" ) ) != -1 )
+  {
+    switch( optChar )
+    {
+      case 'f':
+      case 't':
+        if( history_parse_time( optarg, optChar == 'f' ? &reportFrom : &reportTo, &tm ) != 0 )
+        {
+          fprintf( stderr, "%s: not a date (YYYY-MM-DD or YYYY-MM-DDThh:mm)\n", optarg );
+          return( 1 );
+        }
+        if( optChar == 't' )
+          reportTo += strchr( optarg, 'T' ) ? 59 : 24 * 3600 - 1;     // inclusive
+        break;
+      case 'p':
+        for( reportPeriod = PERIOD_YEAR; reportPeriod >= 0; reportPeriod-- )
+        {
+          if( strcmp( optarg, periodNames[reportPeriod] ) == 0 )
+            break;
+        }
+        if( reportPeriod < 0 )
+        {
+          fprintf( stderr, "%s: period must be day, week, month or year\n", optarg );
+          return( 1 );
+        }
+        break;
+      case 'n':
+        top = atoi( optarg );
+        break;
+      case 'j':
+        nthreads = atoi( optarg );
+        break;
+      default:
+        fprintf( stderr, "Usage: jcblock [-d directory] report [-f from] [-t to] "
+                         "[-p day|week|month|year] [-n top] [-j threads] [callerID.dat]...\n"
+                         "       (from and to: YYYY-MM-DD or YYYY-MM-DDThh:mm; without files\n"
+                         "       the report is made from the call history)\n" );
+        return( 1 );
+    }
+  }
+  if( nthreads < 1 )
+    nthreads = 1;
+  if( nthreads > REPORT_THREADS_MAX )
+    nthreads = REPORT_THREADS_MAX;
+
+  // Cut the input into chunks
+  maps = malloc( ( argc + 1 ) * sizeof( *maps ) );
+  mapLens = malloc( ( argc + 1 ) * sizeof( *mapLens ) );
+  if( maps == NULL || mapLens == NULL )
+    return( 1 );
+  fromHistory = ( optind == argc );
+  if( fromHistory )
+  {
+    if( history_open_read( &hs ) != 0 )
+    {
+      fprintf( stderr, "no history in %s (see jcblock history import)\n", HISTORY_DIR );
+      return( 1 );
+    }
+    for( s = 0, total = 0; s < hs.nsegs; s++ )
+      total += hs.segs[s].count;
+    perChunk = total / ( nthreads * CHUNKS_PER_THREAD ) + 1;
+    if( perChunk < RECORD_CHUNK_MIN )
+      perChunk = RECORD_CHUNK_MIN;
+    for( s = 0; s < hs.nsegs; s++ )
+    {
+      for( i = history_seek( &hs.segs[s], reportFrom ); i < hs.segs[s].count; i += perChunk )
+      {
+        if( add_chunk( &hs, &hs.segs[s], i, i + perChunk < hs.segs[s].count ?
+                       i + perChunk : hs.segs[s].count, NULL, NULL ) != 0 )
+          return( 1 );
+      }
+    }
+  }
+  for( ; optind < argc; optind++ )
+  {
+    if( ( fd = open( argv[optind], O_RDONLY | O_CLOEXEC ) ) < 0 || fstat( fd, &st ) != 0 )
+    {
+      fprintf( stderr, "%s: %s\n", argv[optind], strerror( errno ) );
+      return( 1 );
+    }
+    if( st.st_size > 0 )
+    {
+      if( ( maps[nmaps] = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) ) == MAP_FAILED )
+      {
+        fprintf( stderr, "%s: %s\n", argv[optind], strerror( errno ) );
+        return( 1 );
+      }
+      madvise( maps[nmaps], st.st_size, MADV_SEQUENTIAL );
+      mapLens[nmaps] = st.st_size;
+      if( add_text_chunks( maps[nmaps], st.st_size, nthreads ) != 0 )
+        return( 1 );
+      nmaps++;
+    }
+    close( fd );
+  }
+
+  // Count on all threads (this one too)
+  if( nthreads > nchunks )
+    nthreads = nchunks > 0 ? nchunks : 1;
+  memset( agg, 0, sizeof( agg ) );
+  for( t = 1; t < nthreads; t++ )
+  {
+    if( pthread_create( &threads[t], NULL, count_chunks, &agg[t] ) != 0 )
+    {
+      fprintf( stderr, "pthread_create() of report thread failed\n" );
+      return( 1 );
+    }
+  }
+  count_chunks( &agg[0] );
+  for( t = 1; t < nthreads; t++ )
+  {
+    pthread_join( threads[t], NULL );
+    merge_aggregate( &agg[0], &agg[t] );
+    free( agg[t].callers );
+    free( agg[t].periods );
+  }
+  if( agg[0].failed )
+  {
+    fprintf( stderr, "out of memory\n" );
+    return( 1 );
+  }
+
+  // The distinct callers
+  if( ( callers = malloc( ( agg[0].ncallers + 1 ) * sizeof( *callers ) ) ) == NULL )
+    return( 1 );
+  for( i = 0, n = 0; agg[0].callers != NULL && i <= (long)agg[0].callerMask; i++ )
+  {
+    if( agg[0].callers[i].calls > 0 )
+      callers[n++] = agg[0].callers[i];
+  }
+
+  format_time( agg[0].first, firstDate, sizeof( firstDate ), FALSE );
+  format_time( agg[0].last, lastDate, sizeof( lastDate ), FALSE );
+  printf( "Report By Call Frequency for %s from %s through %s\n",
+          fromHistory ? HISTORY_DIR : argv[argc - 1], agg[0].calls ? firstDate : "-",
+          agg[0].calls ? lastDate : "-" );
+  printf( "Total Calls: %ld\n", agg[0].calls );
+  if( agg[0].calls > agg[0].unknown )
+    printf( "Blocked: %ld  Whitelisted: %ld  Accepted: %ld  (not recorded: %ld)\n",
+            agg[0].blocked, agg[0].whitelisted, agg[0].accepted, agg[0].unknown );
+  if( agg[0].bad > 0 )
+    printf( "Lines not understood: %ld\n", agg[0].bad );
+
+  print_frequency( callers, n );
+  print_list_entries( callers, n );
+  if( top > 0 )
+  {
+    printf( "\nTop %d callers per %s\n", top, periodNames[reportPeriod] );
+    print_top_callers( &agg[0], top );
+  }
+
+  free( callers );
+  free( agg[0].callers );
+  free( agg[0].periods );
+  free( chunks );
+  for( i = 0; i < nmaps; i++ )
+    munmap( maps[i], mapLens[i] );
+  free( maps );
+  free( mapLens );
+  if( fromHistory )
+    history_close_read( &hs );
+  return( 0 );
+}  /* end report_command */
+
+static int add_chunk( const struct history_store *hs, const struct history_segment *seg,
+                      long begin, long end, const char *text, const char *textEnd )
+{  /* Begin add_chunk */
+  struct chunk *p;
+
+  if( nchunks == chunkCap )
+  {
+    chunkCap = chunkCap ? chunkCap * 2 : 64;
+    if( ( p = realloc( chunks, chunkCap * sizeof( *chunks ) ) ) == NULL )
+    {
+      fprintf( stderr, "out of memory\n" );
+      return( -1 );
+    }
+    chunks = p;
+  }
+  p = &chunks[nchunks++];
+  p->hs      = hs;
+  p->seg     = seg;
+  p->begin   = begin;
+  p->end     = end;
+  p->text    = text;
+  p->textEnd = textEnd;
+  return( 0 );
+}  /* end add_chunk */
+
+//
+// Cut a text file into chunks that end at a line end.
+//
+static int add_text_chunks( const char *text, size_t len, int nthreads )
+{  /* Begin add_text_chunks */
+  size_t size = len / ( nthreads * CHUNKS_PER_THREAD ) + 1;
+  const char *p = text, *end = text + len, *cut;
+
+  if( size < TEXT_CHUNK_MIN )
+    size = TEXT_CHUNK_MIN;
+  while( p < end )
+  {
+    cut = ( (size_t)( end - p ) > size ) ? p + size : end;
+    if( cut < end && ( cut = memchr( cut, '\n', end - cut ) ) != NULL )
+      cut++;
+    else
+      cut = end;
+    if( add_chunk( NULL, NULL, 0, 0, p, cut ) != 0 )
+      return( -1 );
+    p = cut;
+  }
+  return( 0 );
+}  /* end add_text_chunks */
+
+//
+// Report thread: count chunks until there are none left.
+//
+static void *count_chunks( void *arg )
+{  /* Begin count_chunks */
+  struct aggregate *a = arg;
+  const struct history_record *r;
+  const struct chunk *c;
+  struct field number, name;
+  long i;
+  int k;
+
+  a->first = INT64_MAX;
+  a->last = INT64_MIN;
+  while( ( k = __atomic_fetch_add( &nextChunk, 1, __ATOMIC_RELAXED ) ) < nchunks )
+  {
+    c = &chunks[k];
+    if( c->hs == NULL )
+    {
+      count_text( a, c->text, c->textEnd );
+      continue;
+    }
+    for( i = c->begin; i < c->end; i++ )
+    {
+      r = &c->seg->records[i];
+      if( r->time > reportTo )
+        break;
+      number.s = history_string( c->hs, r->number );
+      number.len = strlen( number.s );
+      name.s = history_string( c->hs, r->name );
+      name.len = strlen( name.s );
+      count_call( a, number, name, r->numberKey, r->time, r->decision );
+    }
+  }
+  return( NULL );
+}  /* end count_chunks */
+
+//
+// Count the calls of callerID.dat lines. Old files have the name before the
+// number; the field of digits is taken as the number (as history import does).
+//
+static void count_text( struct aggregate *a, const char *p, const char *end )
+{  /* Begin count_text */
+  const char *line, *lineEnd, *bar1, *bar2, *bar3;
+  struct field number, name, swap;
+  int64_t t;
+  int i;
+
+  for( line = p; line < end; line = lineEnd + 1 )
+  {
+    if( ( lineEnd = memchr( line, '\n', end - line ) ) == NULL )
+      lineEnd = end;
+    if( line == lineEnd || *line == '#' || *line == '\r' )
+      continue;
+    if( ( bar1 = memchr( line, '|', lineEnd - line ) ) == NULL ||
+        ( bar2 = memchr( bar1 + 1, '|', lineEnd - bar1 - 1 ) ) == NULL ||
+        text_time( line, bar1 - line, &t ) != 0 )
+    {
+      a->bad++;
+      continue;
+    }
+    if( ( bar3 = memchr( bar2 + 1, '|', lineEnd - bar2 - 1 ) ) == NULL )
+    {
+      for( bar3 = lineEnd; bar3 > bar2 + 1 && bar3[-1] == '\r'; bar3-- )
+        ;
+    }
+    number.s = bar1 + 1;
+    number.len = bar2 - bar1 - 1;
+    name.s = bar2 + 1;
+    name.len = bar3 - bar2 - 1;
+
+    for( i = 0; i < number.len && NUMBER_CHAR( number.s[i] ); i++ )
+      ;
+    if( i < number.len && name.len > 0 )
+    {
+      for( i = 0; i < name.len && NUMBER_CHAR( name.s[i] ); i++ )
+        ;
+      if( i == name.len )
+      {
+        swap = number;
+        number = name;
+        name = swap;
+      }
+    }
+    count_call( a, number, name, number_key( number.s, number.len ), t, HISTORY_UNKNOWN );
+  }
+}  /* end count_text */
+
+static void count_call( struct aggregate *a, struct field number, struct field name,
+                        uint64_t key, int64_t t, int decision )
+{  /* Begin count_call */
+  struct caller c, *cp;
+  struct period_caller pc, *pp;
+
+  if( t < reportFrom || t > reportTo )
+    return;
+
+  c.number = number;
+  c.name   = name;
+  c.key    = key;
+  c.hash   = number_hash( &number, key ) * 31 + field_hash( &name );
+  if( ( cp = find_caller( a, &c ) ) == NULL )
+  {
+    a->failed = TRUE;
+    return;
+  }
+  if( cp->calls++ == 0 )
+  {
+    *cp = c;
+    cp->calls = 1;
+    cp->blocked = cp->known = 0;
+    cp->first = cp->last = t;
+  }
+  if( t < cp->first )
+    cp->first = t;
+  if( t > cp->last )
+    cp->last = t;
+  if( decision != HISTORY_UNKNOWN )
+  {
+    cp->known++;
+    if( decision == CALL_BLOCKED )
+      cp->blocked++;
+  }
+
+  pc.number = number;
+  pc.key    = key;
+  pc.period = period_of( t );
+  pc.hash   = number_hash( &number, key ) ^ pc.period * 2654435761U;
+  if( ( pp = find_period_caller( a, &pc ) ) == NULL )
+  {
+    a->failed = TRUE;
+    return;
+  }
+  if( pp->calls++ == 0 )
+  {
+    *pp = pc;
+    pp->calls = 1;
+    pp->first = t;
+  }
+  if( t < pp->first )
+  {
+    pp->first = t;
+    pp->number = number;
+  }
+
+  a->calls++;
+  if( t < a->first )
+    a->first = t;
+  if( t > a->last )
+    a->last = t;
+  if( decision == CALL_BLOCKED )
+    a->blocked++;
+  else if( decision == CALL_WHITELISTED )
+    a->whitelisted++;
+  else if( decision == CALL_ACCEPTED )
+    a->accepted++;
+  else
+    a->unknown++;
+}  /* end count_call */
+
+//
+// The slot of a caller: where it is counted, or the free slot for it.
+// Returns NULL if the table can not grow.
+//
+static struct caller *find_caller( struct aggregate *a, const struct caller *c )
+{  /* Begin find_caller */
+  struct caller *p;
+  unsigned h;
+
+  if( ( a->ncallers + 1 ) * 2 > (long)a->callerMask && grow_callers( a ) != 0 )
+    return( NULL );
+  for( h = c->hash & a->callerMask; ( p = &a->callers[h] )->calls > 0; h = ( h + 1 ) & a->callerMask )
+  {
+    if( p->hash == c->hash && same_number( &p->number, p->key, &c->number, c->key ) &&
+        compare_fields( &p->name, &c->name ) == 0 )
+      return( p );
+  }
+  a->ncallers++;
+  return( p );
+}  /* end find_caller */
+
+static struct period_caller *find_period_caller( struct aggregate *a, const struct period_caller *pc )
+{  /* Begin find_period_caller */
+  struct period_caller *p;
+  unsigned h;
+
+  if( ( a->nperiods + 1 ) * 2 > (long)a->periodMask && grow_periods( a ) != 0 )
+    return( NULL );
+  for( h = pc->hash & a->periodMask; ( p = &a->periods[h] )->calls > 0; h = ( h + 1 ) & a->periodMask )
+  {
+    if( p->hash == pc->hash && p->period == pc->period &&
+        same_number( &p->number, p->key, &pc->number, pc->key ) )
+      return( p );
+  }
+  a->nperiods++;
+  return( p );
+}  /* end find_period_caller */
+
+//
+// Double a table (the entries are moved to their slots in the new one).
+//
+static int grow_callers( struct aggregate *a )
+{  /* Begin grow_callers */
+  struct caller *old = a->callers;
+  unsigned oldSize = old ? a->callerMask + 1 : 0;
+  unsigned size = oldSize ? oldSize * 2 : 1024;
+  unsigned i, h;
+
+  if( ( a->callers = calloc( size, sizeof( *a->callers ) ) ) == NULL )
+  {
+    a->callers = old;
+    return( -1 );
+  }
+  a->callerMask = size - 1;
+  for( i = 0; i < oldSize; i++ )
+  {
+    if( old[i].calls == 0 )
+      continue;
+    for( h = old[i].hash & a->callerMask; a->callers[h].calls > 0; h = ( h + 1 ) & a->callerMask )
+      ;
+    a->callers[h] = old[i];
+  }
+  free( old );
+  return( 0 );
+}  /* end grow_callers */
+
+static int grow_periods( struct aggregate *a )
+{  /* Begin grow_periods */
+  struct period_caller *old = a->periods;
+  unsigned oldSize = old ? a->periodMask + 1 : 0;
+  unsigned size = oldSize ? oldSize * 2 : 1024;
+  unsigned i, h;
+
+  if( ( a->periods = calloc( size, sizeof( *a->periods ) ) ) == NULL )
+  {
+    a->periods = old;
+    return( -1 );
+  }
+  a->periodMask = size - 1;
+  for( i = 0; i < oldSize; i++ )
+  {
+    if( old[i].calls == 0 )
+      continue;
+    for( h = old[i].hash & a->periodMask; a->periods[h].calls > 0; h = ( h + 1 ) & a->periodMask )
+      ;
+    a->periods[h] = old[i];
+  }
+  free( old );
+  return( 0 );
+}  /* end grow_periods */
+
+//
+// Add the counts of another thread. A number written in several ways is
+// shown as it was written in its first call, whichever thread counted it.
+//
+static void merge_aggregate( struct aggregate *dst, const struct aggregate *src )
+{  /* Begin merge_aggregate */
+  const struct caller *c;
+  const struct period_caller *pc;
+  struct caller *cp;
+  struct period_caller *pp;
+  long i;
+
+  for( i = 0; src->callers != NULL && i <= (long)src->callerMask; i++ )
+  {
+    if( ( c = &src->callers[i] )->calls == 0 )
+      continue;
+    if( ( cp = find_caller( dst, c ) ) == NULL )
+    {
+      dst->failed = TRUE;
+      return;
+    }
+    if( cp->calls == 0 )
+    {
+      *cp = *c;
+      continue;
+    }
+    cp->calls   += c->calls;
+    cp->blocked += c->blocked;
+    cp->known   += c->known;
+    if( c->first < cp->first )
+    {
+      cp->first = c->first;
+      cp->number = c->number;
+    }
+    if( c->last > cp->last )
+      cp->last = c->last;
+  }
+
+  for( i = 0; src->periods != NULL && i <= (long)src->periodMask; i++ )
+  {
+    if( ( pc = &src->periods[i] )->calls == 0 )
+      continue;
+    if( ( pp = find_period_caller( dst, pc ) ) == NULL )
+    {
+      dst->failed = TRUE;
+      return;
+    }
+    if( pp->calls == 0 )
+    {
+      *pp = *pc;
+      continue;
+    }
+    pp->calls += pc->calls;
+    if( pc->first < pp->first )
+    {
+      pp->first = pc->first;
+      pp->number = pc->number;
+    }
+  }
+
+  dst->calls       += src->calls;
+  dst->blocked     += src->blocked;
+  dst->whitelisted += src->whitelisted;
+  dst->accepted    += src->accepted;
+  dst->unknown     += src->unknown;
+  dst->bad         += src->bad;
+  dst->failed      |= src->failed;
+  if( src->first < dst->first )
+    dst->first = src->first;
+  if( src->last > dst->last )
+    dst->last = src->last;
+}  /* end merge_aggregate */
+
+//
+// Numbers are the same if they normalize to the same number (8005551212 and
+// 1-800-555-1212); fields that are not numbers ("P", "O") if they are equal.
+//
+static bool same_number( const struct field *n1, uint64_t k1, const struct field *n2, uint64_t k2 )
+{  /* Begin same_number */
+  if( k1 != 0 || k2 != 0 )
+    return( k1 == k2 );
+  return( compare_fields( n1, n2 ) == 0 );
+}  /* end same_number */
+
+static unsigned number_hash( const struct field *number, uint64_t key )
+{  /* Begin number_hash */
+  if( key != 0 )
+    return( ( key * 0x9E3779B97F4A7C15ULL ) >> 32 );
+  return( field_hash( number ) );
+}  /* end number_hash */
+
+// FNV-1a
+static unsigned field_hash( const struct field *f )
+{  /* Begin field_hash */
+  unsigned h = 2166136261U;
+  int i;
+
+  for( i = 0; i < f->len; i++ )
+    h = ( h ^ (unsigned char)f->s[i] ) * 16777619U;
+  return( h );
+}  /* end field_hash */
+
+//
+// "YYYY-MM-DDThh:mm" (or the date only) to the time as stored in the history.
+// gmtime_r() and timegm() take a lock in the C library, so the threads do
+// the calendar arithmetic themselves.
+//
+static int text_time( const char *s, int len, int64_t *t )
+{  /* Begin text_time */
+  static const int pos[5] = { 0, 5, 8, 11, 14 }, width[5] = { 4, 2, 2, 2, 2 };
+  int v[5] = { 0, 0, 0, 0, 0 };
+  int f, i;
+
+  if( ( len != 10 && len != 16 ) || s[4] != '-' || s[7] != '-' ||
+      ( len == 16 && ( s[10] != 'T' || s[13] != ':' ) ) )
+    return( -1 );
+  for( f = 0; f < ( len == 16 ? 5 : 3 ); f++ )
+  {
+    for( i = pos[f]; i < pos[f] + width[f]; i++ )
+    {
+      if( s[i] < '0' || s[i] > '9' )
+        return( -1 );
+      v[f] = v[f] * 10 + ( s[i] - '0' );
+    }
+  }
+  if( v[1] < 1 || v[1] > 12 || v[2] < 1 || v[2] > 31 || v[3] > 23 || v[4] > 59 )
+    return( -1 );
+  *t = (int64_t)days_from_civil( v[0], v[1], v[2] ) * 86400 + v[3] * 3600 + v[4] * 60;
+  return( 0 );
+}  /* end text_time */
+
+//
+// Days since 1970-01-01 of a date of the Gregorian calendar, and back.
+//
+static long days_from_civil( int y, int m, int d )
+{  /* Begin days_from_civil */
+  long era, yoe, doy, doe;
+
+  y -= ( m <= 2 );
+  era = ( y >= 0 ? y : y - 399 ) / 400;
+  yoe = y - era * 400;
+  doy = ( 153 * ( m > 2 ? m - 3 : m + 9 ) + 2 ) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return( era * 146097 + doe - 719468 );
+}  /* end days_from_civil */
+
+static void civil_from_days( long days, int *y, int *m, int *d )
+{  /* Begin civil_from_days */
+  long era, doe, yoe, doy, mp;
+
+  days += 719468;
+  era = ( days >= 0 ? days : days - 146096 ) / 146097;
+  doe = days - era * 146097;
+  yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365;
+  doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 );
+  mp  = ( 5 * doy + 2 ) / 153;
+  *d  = doy - ( 153 * mp + 2 ) / 5 + 1;
+  *m  = mp < 10 ? mp + 3 : mp - 9;
+  *y  = yoe + era * 400 + ( *m <= 2 );
+}  /* end civil_from_days */
+
+static long days_of( int64_t t )
+{  /* Begin days_of */
+  return( t >= 0 ? t / 86400 : ( t - 86399 ) / 86400 );
+}  /* end days_of */
+
+//
+// The number of the day, week (1970-01-01 was a Thursday, so Mondays are at
+// days - 4 divisible by 7), month or year of a time.
+//
+static int period_of( int64_t t )
+{  /* Begin period_of */
+  long days = days_of( t );
+  int y, m, d;
+
+  if( reportPeriod == PERIOD_DAY )
+    return( days );
+  if( reportPeriod == PERIOD_WEEK )
+    return( ( days + 3 ) / 7 );
+  civil_from_days( days, &y, &m, &d );
+  return( reportPeriod == PERIOD_MONTH ? y * 12 + m - 1 : y );
+}  /* end period_of */
+
+static void period_label( int period, char *buf, int size )
+{  /* Begin period_label */
+  int y, m, d;
+
+  if( reportPeriod == PERIOD_DAY || reportPeriod == PERIOD_WEEK )
+  {
+    civil_from_days( reportPeriod == PERIOD_DAY ? period : period * 7L - 3, &y, &m, &d );
+    snprintf( buf, size, "%04d-%02d-%02d", y, m, d );
+  }
+  else if( reportPeriod == PERIOD_MONTH )
+    snprintf( buf, size, "%04d-%02d", period / 12, period % 12 + 1 );
+  else
+    snprintf( buf, size, "%04d", period );
+}  /* end period_label */
+
+static void format_time( int64_t t, char *buf, int size, bool withTime )
+{  /* Begin format_time */
+  long days = days_of( t ), secs = t - days * 86400;
+  int y, m, d, len;
+
+  civil_from_days( days, &y, &m, &d );
+  if( withTime )
+    len = snprintf( buf, size, "%04d-%02d-%02dT%02ld:%02ld", y, m, d, secs / 3600, secs / 60 % 60 );
+  else
+    len = snprintf( buf, size, "%04d-%02d-%02d", y, m, d );
+
+  // A time that does not fit (a corrupt record) is not shown cut short
+  if( len >= size )
+    snprintf( buf, size, "-" );
+}  /* end format_time */
+
+//
+// The report of CreateCallerIDReport.sh: calls per number and, beside it,
+// calls per caller ID name, most frequent first.
+//
+static void print_frequency( struct caller *callers, long n )
+{  /* Begin print_frequency */
+  struct number_count *numbers, *names;
+  long nnumbers, nnames, i;
+
+  nnumbers = count_by( callers, n, FALSE, &numbers );
+  nnames   = count_by( callers, n, TRUE, &names );
+  if( nnumbers < 0 || nnames < 0 )
+  {
+    free( numbers );
+    free( names );
+    return;
+  }
+
+  printf( "\n  Count   Number                              Count   CallerID\n" );
+  for( i = 0; i < nnumbers || i < nnames; i++ )
+  {
+    if( i < nnumbers )
+      printf( "%7ld %-36.*s", numbers[i].calls, numbers[i].text.len, numbers[i].text.s );
+    else
+      printf( "%44s", "" );
+    if( i < nnames )
+      printf( "%7ld %.*s", names[i].calls, names[i].text.len, names[i].text.s );
+    printf( "\n" );
+  }
+  free( numbers );
+  free( names );
+}  /* end print_frequency */
+
+//
+// Sum the calls of the callers by number (or by name) and sort the sums,
+// most calls first. Returns the number of sums, or -1.
+//
+static long count_by( struct caller *callers, long n, bool byName, struct number_count **out )
+{  /* Begin count_by */
+  struct number_count *counts;
+  long i, j, m = 0;
+
+  if( ( *out = counts = malloc( ( n + 1 ) * sizeof( *counts ) ) ) == NULL )
+    return( -1 );
+  qsort( callers, n, sizeof( *callers ), byName ? compare_caller_names : compare_caller_numbers );
+  for( i = 0; i < n; i = j )
+  {
+    counts[m].text = byName ? callers[i].name : callers[i].number;
+    counts[m].calls = 0;
+    for( j = i; j < n && ( byName ? compare_fields( &callers[j].name, &callers[i].name ) == 0 :
+                                    same_number( &callers[j].number, callers[j].key,
+                                                 &callers[i].number, callers[i].key ) ); j++ )
+      counts[m].calls += callers[j].calls;
+    m++;
+  }
+  qsort( counts, m, sizeof( *counts ), compare_counts );
+  return( m );
+}  /* end count_by */
+
+//
+// Check every caller against the current lists and show how many calls each
+// entry matched and how many of them were blocked (only calls recorded by
+// jcblock itself carry a decision; imported ones count as not recorded).
+//
+static void print_list_entries( const struct caller *callers, long n )
+{  /* Begin print_list_entries */
+  struct match_list *lists[2];
+  struct entry_count *entries[2], *e;
+  char callstr[128], date[32], token[LIST_LINE_MAX];
+  long i;
+  int l, rule, decision;
+
+  lists[0] = access( WHITELIST_FILE, F_OK ) == 0 ? open_list( WHITELIST_FILE, "whitelist" ) : NULL;
+  if( ( lists[1] = open_list( BLACKLIST_FILE, "blacklist" ) ) == NULL )
+  {
+    printf( "\n(no blacklist: calls per list entry not shown)\n" );
+    if( lists[0] != NULL )
+      free_list( lists[0] );
+    return;
+  }
+  for( l = 0; l < 2; l++ )
+    entries[l] = calloc( lists[l] ? lists[l]->nrules + 1 : 1, sizeof( struct entry_count ) );
+  if( entries[0] == NULL || entries[1] == NULL )
+    goto done;
+
+  for( i = 0; i < n; i++ )
+  {
+    format_time( callers[i].last, date, sizeof( date ), TRUE );
+    snprintf( callstr, sizeof( callstr ), "%s|%.*s|%.*s|\n", date, callers[i].number.len,
+              callers[i].number.s, callers[i].name.len, callers[i].name.s );
+    decision = decide_call( lists[0], lists[1], callstr, &rule, NULL );
+    if( rule == NO_MATCH )
+      continue;
+    e = &entries[decision == CALL_WHITELISTED ? 0 : 1][rule];
+    e->calls   += callers[i].calls;
+    e->blocked += callers[i].blocked;
+    e->known   += callers[i].known;
+  }
+
+  printf( "\n  Calls  Blocked   Rate  List       Entry\n" );
+  for( l = 0; l < 2; l++ )
+  {
+    for( rule = 0; lists[l] != NULL && rule < lists[l]->nrules; rule++ )
+    {
+      if( ( e = &entries[l][rule] )->calls == 0 )
+        continue;
+      if( e->known > 0 )
+        printf( "%7ld %8ld %5ld%%  %-10s %s\n", e->calls, e->blocked, e->blocked * 100 / e->known,
+                lists[l]->name, list_rule_token( lists[l], rule, token, sizeof( token ) ) );
+      else
+        printf( "%7ld %8s %6s  %-10s %s\n", e->calls, "-", "-", lists[l]->name,
+                list_rule_token( lists[l], rule, token, sizeof( token ) ) );
+    }
+  }
+
+done:
+  for( l = 0; l < 2; l++ )
+  {
+    free( entries[l] );
+    if( lists[l] != NULL )
+      free_list( lists[l] );
+  }
+}  /* end print_list_entries */
+
+//
+// The numbers that called most in each period.
+//
+static void print_top_callers( struct aggregate *a, int top )
+{  /* Begin print_top_callers */
+  struct period_caller *pcs;
+  char label[32];
+  long i, j, n = 0;
+
+  if( ( pcs = malloc( ( a->nperiods + 1 ) * sizeof( *pcs ) ) ) == NULL )
+    return;
+  for( i = 0; a->periods != NULL && i <= (long)a->periodMask; i++ )
+  {
+    if( a->periods[i].calls > 0 )
+      pcs[n++] = a->periods[i];
+  }
+  qsort( pcs, n, sizeof( *pcs ), compare_period_callers );
+
+  for( i = 0; i < n; i = j )
+  {
+    period_label( pcs[i].period, label, sizeof( label ) );
+    for( j = i; j < n && pcs[j].period == pcs[i].period; j++ )
+    {
+      if( j - i < top )
+        printf( "%-12s %7ld %.*s\n", j == i ? label : "", pcs[j].calls,
+                pcs[j].number.len, pcs[j].number.s );
+    }
+  }
+  free( pcs );
+}  /* end print_top_callers */
+
+static int compare_caller_numbers( const void *a, const void *b )
+{  /* Begin compare_caller_numbers */
+  const struct caller *ca = a, *cb = b;
+
+  // Numbers first, by key; then the fields that are not numbers
+  if( ca->key != cb->key )
+  {
+    if( ca->key == 0 || cb->key == 0 )
+      return( ca->key == 0 ? 1 : -1 );
+    return( ca->key < cb->key ? -1 : 1 );
+  }
+  if( ca->key == 0 )
+    return( compare_fields( &ca->number, &cb->number ) );
+  return( ( ca->first > cb->first ) - ( ca->first < cb->first ) );
+}  /* end compare_caller_numbers */
+
+static int compare_caller_names( const void *a, const void *b )
+{  /* Begin compare_caller_names */
+  return( compare_fields( &( (const struct caller *)a )->name, &( (const struct caller *)b )->name ) );
+}  /* end compare_caller_names */
+
+// Most calls first, then in text order
+static int compare_counts( const void *a, const void *b )
+{  /* Begin compare_counts */
+  const struct number_count *ca = a, *cb = b;
+
+  if( ca->calls != cb->calls )
+    return( ca->calls > cb->calls ? -1 : 1 );
+  return( compare_fields( &ca->text, &cb->text ) );
+}  /* end compare_counts */
+
+static int compare_period_callers( const void *a, const void *b )
+{  /* Begin compare_period_callers */
+  const struct period_caller *pa = a, *pb = b;
+
+  if( pa->period != pb->period )
+    return( pa->period < pb->period ? -1 : 1 );
+  if( pa->calls != pb->calls )
+    return( pa->calls > pb->calls ? -1 : 1 );
+  return( compare_fields( &pa->number, &pb->number ) );
+}  /* end compare_period_callers */
+
+static int compare_fields( const struct field *f1, const struct field *f2 )
+{  /* Begin compare_fields */
+  int r = memcmp( f1->s, f2->s, f1->len < f2->len ? f1->len : f2->len );
+
+  if( r != 0 )
+    return( r );
+  return( ( f1->len > f2->len ) - ( f1->len < f2->len ) );
+}  /* end compare_fields */
@@ -0,0 +1,217 @@
+/*
+Program name: jcblock
+
+File name: stats.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Latency histograms for the stages of handling a call and counters of calls
+and failures. Recording is a few atomic increments, so it can be done from any
+thread without locks. A thread writes everything to jcblock.prom in the
+Prometheus text format every few seconds (and once more at termination). The
+file is written under a temporary name and renamed into place, so a reader
+(the node_exporter textfile collector, or cat) never sees a partial file.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+
+// Bucket upper bounds in usec (the last bucket is +Inf)
+static const long bucketUsec[] =
+{
+  50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+#define NUM_BUCKETS ( sizeof( bucketUsec ) / sizeof( bucketUsec[0] ) + 1 )
+
+static const char *stageNames[NUM_STAGES] =
+{
+  "serial_read", "parse", "history_append", "whitelist_check",
+  "blacklist_check", "decision", "hangup", "modem_init", "early_decision_gain",
+  "startup"
+};
+
+struct histogram
+{
+  unsigned long bucket[NUM_BUCKETS];   // not cumulative
+  unsigned long count;
+  unsigned long sumUsec;
+};
+
+static struct histogram stages[NUM_STAGES];
+static unsigned long counters[NUM_COUNTERS];
+static int writeSeconds;
+static bool writerRunning, writerStop;
+static pthread_t writerThread;
+static pthread_mutex_t writeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *write_periodically( void *arg );
+
+//
+// Start the thread that writes STATS_FILE every intervalSec seconds
+// (0: the file is not written). Returns 0 or -1.
+//
+int stats_start( int intervalSec )
+{  /* Begin stats_start */
+  writeSeconds = intervalSec;
+  if( writeSeconds <= 0 )
+    return( 0 );
+  if( pthread_create( &writerThread, NULL, write_periodically, NULL ) != 0 )
+    return( -1 );
+  writerRunning = TRUE;
+  return( 0 );
+}  /* end stats_start */
+
+//
+// Stop the thread and write the file a last time.
+//
+void stats_stop( void )
+{  /* Begin stats_stop */
+  if( !writerRunning )
+    return;
+  __atomic_store_n( &writerStop, TRUE, __ATOMIC_RELEASE );
+  pthread_join( writerThread, NULL );
+  writerRunning = FALSE;
+  stats_write();
+}  /* end stats_stop */
+
+//
+// Add one sample (in usec) to the histogram of a stage.
+//
+void stats_record( int stage, long usec )
+{  /* Begin stats_record */
+  struct histogram *h = &stages[stage];
+  int i;
+
+  if( usec < 0 )
+    usec = 0;
+  for( i = 0; i < NUM_BUCKETS - 1 && usec > bucketUsec[i]; i++ )
+    ;
+  __atomic_add_fetch( &h->bucket[i], 1, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &h->sumUsec, usec, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &h->count, 1, __ATOMIC_RELAXED );
+}  /* end stats_record */
+
+void stats_count( int counter )
+{  /* Begin stats_count */
+  __atomic_add_fetch( &counters[counter], 1, __ATOMIC_RELAXED );
+}  /* end stats_count */
+
+void stats_add( int counter, long n )
+{  /* Begin stats_add */
+  if( n > 0 )
+    __atomic_add_fetch( &counters[counter], n, __ATOMIC_RELAXED );
+}  /* end stats_add */
+
+//
+// Write all histograms and counters to STATS_FILE. Returns 0 or -1.
+//
+int stats_write( void )
+{  /* Begin stats_write */
+  static const char *counterNames[NUM_COUNTERS][2] =
+  {
+    { "jcblock_calls_total",                 "Caller ID strings received." },
+    { "jcblock_calls_blocked_total",         "Calls terminated (blacklist match or short caller ID)." },
+    { "jcblock_calls_accepted_total",        "Calls on neither list." },
+    { "jcblock_calls_whitelisted_total",     "Calls accepted by a whitelist match." },
+    { "jcblock_parse_failures_total",        "Caller ID frames without a number." },
+    { "jcblock_modem_command_failures_total", "Modem commands answered with ERROR or not at all." },
+    { "jcblock_decision_cache_hits_total",   "Calls decided from the decision cache." },
+    { "jcblock_decision_cache_misses_total", "Calls checked against the lists (and then cached)." },
+    { "jcblock_decision_cache_saved_seconds_total", "List check time saved by decision cache hits." },
+    { "jcblock_fast_callers_total",          "Callers on neither list found calling too often." },
+    { "jcblock_early_hangups_total",         "Calls terminated on their number before the caller ID was complete." },
+    { "jcblock_star_key_blacklisted_total",  "Callers added to the blacklist with the star key." }
+  };
+  char tmpPath[FILE_PATH_MAX + 8];
+  unsigned long cumulative, count;
+  struct histogram h;
+  FILE *fp;
+  int s, i, rc;
+
+  // One writer at a time (the thread and stats_stop())
+  pthread_mutex_lock( &writeLock );
+  snprintf( tmpPath, sizeof( tmpPath ), "%s.tmp", STATS_FILE );
+  if( ( fp = fopen( tmpPath, "w" ) ) == NULL )
+  {
+    pthread_mutex_unlock( &writeLock );
+    return( -1 );
+  }
+
+  fprintf( fp, "# HELP jcblock_stage_seconds Time spent in each stage of handling a call.\n" );
+  fprintf( fp, "# TYPE jcblock_stage_seconds histogram\n" );
+  for( s = 0; s < NUM_STAGES; s++ )
+  {
+    for( i = 0; i < NUM_BUCKETS; i++ )
+      h.bucket[i] = __atomic_load_n( &stages[s].bucket[i], __ATOMIC_RELAXED );
+    h.sumUsec = __atomic_load_n( &stages[s].sumUsec, __ATOMIC_RELAXED );
+
+    // The count is the sum of the buckets read, so the +Inf bucket and
+    // _count always agree
+    for( cumulative = 0, i = 0; i < NUM_BUCKETS - 1; i++ )
+    {
+      cumulative += h.bucket[i];
+      fprintf( fp, "jcblock_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+               stageNames[s], bucketUsec[i] / 1e6, cumulative );
+    }
+    count = cumulative + h.bucket[NUM_BUCKETS - 1];
+    fprintf( fp, "jcblock_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n",
+             stageNames[s], count );
+    fprintf( fp, "jcblock_stage_seconds_sum{stage=\"%s\"} %.6f\n", stageNames[s],
+             h.sumUsec / 1e6 );
+    fprintf( fp, "jcblock_stage_seconds_count{stage=\"%s\"} %lu\n", stageNames[s], count );
+  }
+
+  for( i = 0; i < NUM_COUNTERS; i++ )
+  {
+    fprintf( fp, "# HELP %s %s\n# TYPE %s counter\n%s ", counterNames[i][0],
+             counterNames[i][1], counterNames[i][0], counterNames[i][0] );
+    if( i == COUNT_CACHE_SAVED )
+      fprintf( fp, "%.6f\n", __atomic_load_n( &counters[i], __ATOMIC_RELAXED ) / 1e6 );
+    else
+      fprintf( fp, "%lu\n", __atomic_load_n( &counters[i], __ATOMIC_RELAXED ) );
+  }
+
+  rc = fclose( fp );
+  if( rc == 0 )
+    rc = rename( tmpPath, STATS_FILE );
+  pthread_mutex_unlock( &writeLock );
+  return( rc == 0 ? 0 : -1 );
+}  /* end stats_write */
+
+//
+// Writer thread.
+//
+static void *write_periodically( void *arg )
+{  /* Begin write_periodically */
+  int waited = 0;
+
+  while( !__atomic_load_n( &writerStop, __ATOMIC_ACQUIRE ) )
+  {
+    // Sleep in short steps so stats_stop() does not wait long
+    usleep( 100000 );
+    if( ++waited < writeSeconds * 10 )
+      continue;
+    waited = 0;
+    if( stats_write() != 0 )
+      log_debug_info("write of jcblock.prom failed");
+  }
+  return( NULL );
+}  /* end write_periodically */
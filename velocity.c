@@ -0,0 +1,292 @@
+/*
+Program name: jcblock
+
+File name: velocity.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Finds callers on neither list that call too often: a number that calls a set
+number of times within some minutes, or a caller ID name that calls from a
+set number of different numbers next to each other (the same number but for
+its last two digits) within some minutes. Calls are counted in count-min sketches:
+each sketch is a few rows of counters, a call adds one to a counter of every
+row (chosen by a hash of the caller), and the smallest of those counters is
+an estimate that can only be too high, by little when the rows are wide
+enough. Every sketch is kept for VELOCITY_SLOTS time slots that together
+cover the window; the oldest slot is cleared when a new one starts, so the
+counts decay and the memory used stays the same however long jcblock runs.
+A caller found is reported to jcblock.c, which logs it and, with -a, adds an
+entry to blacklist.dat. The sketches are saved when jcblock terminates and
+taken back when it starts (warm.c), so a restart does not forget the calls
+of the window.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define VELOCITY_DEPTH  4      // rows of a sketch
+#define VELOCITY_BITS   10
+#define VELOCITY_WIDTH  ( 1 << VELOCITY_BITS )  // counters per row
+#define VELOCITY_SLOTS  6      // time slots per window
+#define RECENT_MAX      16     // entries remembered so they are not added twice
+
+struct sketch
+{
+  int      calls;              // limit: this many calls within the window
+  int      minutes;            //   (0 calls: not checked)
+  time_t   slotStart[VELOCITY_SLOTS];
+  uint16_t count[VELOCITY_SLOTS][VELOCITY_DEPTH][VELOCITY_WIDTH];
+};
+
+static struct sketch numbers;  // key: the number
+static struct sketch pairs;    // key: the name and the number
+static struct sketch sprays;   // key: the name and the number less two digits
+static char recent[RECENT_MAX][LIST_TERM_MAX + 1];
+static int recentNext;
+
+struct saved_velocity          // the sketches in WARM_FILE
+{
+  struct sketch numbers, pairs, sprays;
+  char recent[RECENT_MAX][LIST_TERM_MAX + 1];
+  int  recentNext;
+};
+
+static int parse_limit( const char *spec, int *calls, int *minutes );
+static int sketch_add( struct sketch *sk, uint64_t key, time_t now );
+static uint64_t string_key( const char *s, uint64_t h );
+static bool recently_added( const char *token );
+
+//
+// Set the limits: "calls/minutes" for one number and for the numbers of
+// one name ("0" turns a check off). Returns 0 or -1 if a limit is not valid.
+//
+int velocity_limits( const char *numberLimit, const char *sprayLimit )
+{  /* Begin velocity_limits */
+  if( parse_limit( numberLimit, &numbers.calls, &numbers.minutes ) != 0 ||
+      parse_limit( sprayLimit, &sprays.calls, &sprays.minutes ) != 0 )
+    return( -1 );
+  pairs.calls = sprays.calls;
+  pairs.minutes = sprays.minutes;
+  return( 0 );
+}  /* end velocity_limits */
+
+//
+// Count a call that neither list matched. Returns VELOCITY_OK, or
+// VELOCITY_NUMBER or VELOCITY_SPRAY with the blacklist token that would
+// stop the caller in token (the number, or its first digits followed by
+// '*') and the reason in why. A token added to the blacklist lately (see
+// velocity_added()) is not returned again. Only numbers are counted: "P"
+// (private) or "O" (out of area) are many different callers. A number of
+// fewer than NUMBER_EXACT_MIN digits is not returned: as a test field it
+// would match any caller ID containing it.
+//
+int velocity_check( const char *number, const char *name, time_t now,
+                    char *token, int tokenLen, char *why, int whyLen )
+{  /* Begin velocity_check */
+  uint64_t key = number_key( number, strlen( number ) );
+  uint64_t value = key & ( ( 1ULL << 50 ) - 1 );
+  uint64_t block;
+  int digits = key >> 50;
+  int numberCalls = 0, sprayCalls = 0;
+
+  if( key == 0 )
+    return( VELOCITY_OK );
+  if( numbers.calls > 0 )
+    numberCalls = sketch_add( &numbers, key, now );
+  // A number is only counted for its name the first time in the window
+  if( sprays.calls > 0 && *name != 0 && digits > 4 &&
+      sketch_add( &pairs, string_key( name, key ), now ) == 1 )
+  {
+    block = (uint64_t)( digits - 2 ) << 50 | value / 100;
+    sprayCalls = sketch_add( &sprays, string_key( name, block ), now );
+  }
+
+  if( numbers.calls > 0 && numberCalls >= numbers.calls && digits >= NUMBER_EXACT_MIN &&
+      strlen( number ) <= LIST_TERM_MAX - 1 && !recently_added( number ) )
+  {
+    snprintf( token, tokenLen, "%s", number );
+    snprintf( why, whyLen, "%d calls in %d min", numberCalls, numbers.minutes );
+    return( VELOCITY_NUMBER );
+  }
+  if( sprays.calls > 0 && sprayCalls >= sprays.calls && digits - 1 <= LIST_TERM_MAX - 1 &&
+      snprintf( token, tokenLen, "%0*llu*", digits - 2, (unsigned long long)( value / 100 ) ) <
+      tokenLen &&
+      !recently_added( token ) )
+  {
+    snprintf( why, whyLen, "%.15s: %d numbers %.*sxx in %d min", name, sprayCalls, digits - 2,
+              token, sprays.minutes );
+    return( VELOCITY_SPRAY );
+  }
+  return( VELOCITY_OK );
+}  /* end velocity_check */
+
+//
+// Write the sketches to fp. Returns 0 or -1.
+//
+int velocity_save( FILE *fp )
+{  /* Begin velocity_save */
+  uint32_t size = sizeof( struct saved_velocity );
+  struct saved_velocity *sv;
+  int rc = -1;
+
+  if( ( sv = malloc( sizeof( *sv ) ) ) == NULL )
+    return( -1 );
+  sv->numbers = numbers;
+  sv->pairs = pairs;
+  sv->sprays = sprays;
+  memcpy( sv->recent, recent, sizeof( recent ) );
+  sv->recentNext = recentNext;
+  if( fwrite( &size, sizeof( size ), 1, fp ) == 1 && fwrite( sv, sizeof( *sv ), 1, fp ) == 1 )
+    rc = 0;
+  free( sv );
+  return( rc );
+}  /* end velocity_save */
+
+//
+// Take back the sketches written by velocity_save() if they were counted
+// with the limits set now (the slots older than the window are cleared as
+// calls come in). Returns 1 if they were taken, 0 if not, or -1 if fp does
+// not hold them.
+//
+int velocity_load( FILE *fp )
+{  /* Begin velocity_load */
+  struct saved_velocity *sv;
+  uint32_t size;
+  int i, rc = -1;
+
+  if( fread( &size, sizeof( size ), 1, fp ) != 1 || size != sizeof( *sv ) ||
+      ( sv = malloc( sizeof( *sv ) ) ) == NULL )
+    return( -1 );
+  if( fread( sv, sizeof( *sv ), 1, fp ) == 1 )
+  {
+    rc = 0;
+    if( sv->numbers.calls == numbers.calls && sv->numbers.minutes == numbers.minutes &&
+        sv->sprays.calls == sprays.calls && sv->sprays.minutes == sprays.minutes )
+    {
+      numbers = sv->numbers;
+      pairs = sv->pairs;
+      sprays = sv->sprays;
+      for( i = 0; i < RECENT_MAX; i++ )
+      {
+        memcpy( recent[i], sv->recent[i], LIST_TERM_MAX );
+        recent[i][LIST_TERM_MAX] = 0;
+      }
+      recentNext = sv->recentNext >= 0 && sv->recentNext < RECENT_MAX ? sv->recentNext : 0;
+      rc = 1;
+    }
+  }
+  free( sv );
+  return( rc );
+}  /* end velocity_load */
+
+static int parse_limit( const char *spec, int *calls, int *minutes )
+{  /* Begin parse_limit */
+  if( strcmp( spec, "0" ) == 0 )
+  {
+    *calls = *minutes = 0;
+    return( 0 );
+  }
+  if( sscanf( spec, "%d/%d", calls, minutes ) != 2 || *calls < 2 || *calls > 65535 ||
+      *minutes < 1 )
+    return( -1 );
+  return( 0 );
+}  /* end parse_limit */
+
+//
+// Count a call of key in the current slot and return the estimate of its
+// calls within the window.
+//
+static int sketch_add( struct sketch *sk, uint64_t key, time_t now )
+{  /* Begin sketch_add */
+  static const uint64_t rowSeed[VELOCITY_DEPTH] =
+  {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL
+  };
+  long slotSec = sk->minutes * 60L / VELOCITY_SLOTS;
+  time_t slot;
+  unsigned h[VELOCITY_DEPTH];
+  int i, r, s, sum, estimate = 0;
+
+  if( slotSec < 1 )
+    slotSec = 1;
+  slot = now - now % slotSec;
+  s = ( now / slotSec ) % VELOCITY_SLOTS;
+  if( sk->slotStart[s] != slot )
+  {
+    memset( sk->count[s], 0, sizeof( sk->count[s] ) );
+    sk->slotStart[s] = slot;
+  }
+
+  // Each row has its own hash of the key
+  for( r = 0; r < VELOCITY_DEPTH; r++ )
+  {
+    h[r] = ( ( key ^ rowSeed[r] ) * 0x9E3779B97F4A7C15ULL ) >> ( 64 - VELOCITY_BITS );
+    if( sk->count[s][r][h[r]] < 65535 )
+      sk->count[s][r][h[r]]++;
+  }
+
+  // The smallest row sum over the slots of the window
+  for( r = 0; r < VELOCITY_DEPTH; r++ )
+  {
+    for( i = 0, sum = 0; i < VELOCITY_SLOTS; i++ )
+    {
+      if( sk->slotStart[i] > now - sk->minutes * 60L )
+        sum += sk->count[i][r][h[r]];
+    }
+    if( r == 0 || sum < estimate )
+      estimate = sum;
+  }
+  return( estimate );
+}  /* end sketch_add */
+
+// FNV-1a of a string, seeded with h
+static uint64_t string_key( const char *s, uint64_t h )
+{  /* Begin string_key */
+  h ^= 14695981039346656037ULL;
+  for( ; *s; s++ )
+    h = ( h ^ (unsigned char)*s ) * 1099511628211ULL;
+  return( h );
+}  /* end string_key */
+
+//
+// A token returned by velocity_check() was added to the blacklist (with
+// -a): remember it, as the blacklist is not reloaded at once and the caller
+// may call again before it is.
+//
+void velocity_added( const char *token )
+{  /* Begin velocity_added */
+  if( recently_added( token ) )
+    return;
+  snprintf( recent[recentNext], sizeof( recent[recentNext] ), "%s", token );
+  recentNext = ( recentNext + 1 ) % RECENT_MAX;
+}  /* end velocity_added */
+
+//
+// Whether token was added to the blacklist lately.
+//
+static bool recently_added( const char *token )
+{  /* Begin recently_added */
+  int i;
+
+  for( i = 0; i < RECENT_MAX; i++ )
+  {
+    if( strcmp( recent[i], token ) == 0 )
+      return( TRUE );
+  }
+  return( FALSE );
+}  /* end recently_added */
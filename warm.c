@@ -0,0 +1,145 @@
+/*
+Program name: jcblock
+
+File name: warm.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+What jcblock learns while it runs and would otherwise lose on a restart:
+the decision cache (cache.c) and the call counts of velocity.c. They are
+written to jcblock.warm when jcblock terminates and read back when it
+starts, once the first lists are loaded. The decisions are only taken back
+if the lists have the same entries as when they were saved (the fingerprint
+of their tokens), the counts only if the limits are the same. The file is
+written under a temporary name and renamed into place, so a crash while it
+is written leaves the previous one. It holds only what the same build of
+jcblock wrote: each part starts with the size of its records.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "common.h"
+
+#define WARM_MAGIC  "jcbwarm1"
+
+struct warm_header
+{
+  char     magic[8];
+  int64_t  saved;              // time of the snapshot
+  uint64_t fingerprint;        // of the lists the decisions were made with
+};
+
+//
+// Write the warm state (called at termination, on the thread that handles
+// the calls). Returns 0 or -1.
+//
+int warm_save( void )
+{  /* Begin warm_save */
+  struct warm_header h;
+  struct list_snapshot *lists;
+  unsigned long generation;
+  char tmpPath[FILE_PATH_MAX + 8];
+  char message[80];
+  FILE *fp;
+  int n = 0, rc;
+
+  // Before the first lists are loaded there is nothing new to save
+  if( ( lists = lists_acquire() ) == NULL )
+  {
+    lists_release();
+    return( 0 );
+  }
+  generation = control_generation( lists );
+  memset( &h, 0, sizeof( h ) );
+  memcpy( h.magic, WARM_MAGIC, sizeof( h.magic ) );
+  h.saved = time( NULL );
+  h.fingerprint = lists->fingerprint;
+  lists_release();
+
+  sprintf( tmpPath, "%s.tmp", WARM_FILE );
+  if( ( fp = fopen( tmpPath, "w" ) ) == NULL )
+  {
+    log_debug_info("open() of the warm state file failed");
+    return( -1 );
+  }
+  rc = fwrite( &h, sizeof( h ), 1, fp ) == 1 && velocity_save( fp ) == 0 &&
+       ( n = cache_save( fp, generation ) ) >= 0 ? 0 : -1;
+  if( fflush( fp ) != 0 || fsync( fileno( fp ) ) != 0 )
+    rc = -1;
+  if( fclose( fp ) != 0 || rc != 0 || rename( tmpPath, WARM_FILE ) != 0 )
+  {
+    log_debug_info("write of the warm state file failed");
+    unlink( tmpPath );
+    return( -1 );
+  }
+  sprintf( message, "warm state saved: %d decisions, call counts", n );
+  log_debug_info( message );
+  return( 0 );
+}  /* end warm_save */
+
+//
+// Take back the warm state written by the last jcblock (called once the
+// first lists are loaded, before any call is decided). What was taken is
+// described in summary. Returns 0, or -1 if there was none or it was not
+// usable.
+//
+int warm_load( char *summary, int size )
+{  /* Begin warm_load */
+  struct warm_header h;
+  struct list_snapshot *lists;
+  unsigned long generation;
+  const char *decisions = NULL;
+  char age[32];
+  FILE *fp;
+  int counts, n = 0;
+
+  if( ( fp = fopen( WARM_FILE, "r" ) ) == NULL )
+  {
+    snprintf( summary, size, "no warm state (%s)", strerror( errno ) );
+    return( -1 );
+  }
+  if( fread( &h, sizeof( h ), 1, fp ) != 1 || memcmp( h.magic, WARM_MAGIC, sizeof( h.magic ) ) != 0 ||
+      ( counts = velocity_load( fp ) ) < 0 )
+  {
+    fclose( fp );
+    snprintf( summary, size, "warm state not usable" );
+    return( -1 );
+  }
+
+  // The decisions are only valid for the same list entries
+  lists = lists_acquire();
+  generation = control_generation( lists );
+  if( generation == 0 )
+    decisions = "not cacheable";
+  else if( h.fingerprint != lists->fingerprint )
+    decisions = "lists changed";
+  else if( ( n = cache_load( fp, generation, lists ) ) < 0 )
+    decisions = "not usable";
+  lists_release();
+  fclose( fp );
+
+  snprintf( age, sizeof( age ), "%lld sec", (long long)( time( NULL ) - h.saved ) );
+  if( decisions == NULL )
+    snprintf( summary, size, "warm state of %s ago: %d decisions, %s", age, n,
+              counts ? "call counts" : "no call counts (other limits)" );
+  else
+    snprintf( summary, size, "warm state of %s ago: no decisions (%s), %s", age, decisions,
+              counts ? "call counts" : "no call counts (other limits)" );
+  return( 0 );
+}  /* end warm_load */
@@ -0,0 +1,368 @@
+/*
+Program name: jcblock
+
+File name: watch.c
+
+Copyright: 	Copyright 2008 Walter S. Heath
+
+Copy permission:
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See theGNU General Public License for more details.
+
+You may view the GNU General Public License at: <http://www.gnu.org/licenses/>.
+
+Description:
+Keeps the whitelist.dat/blacklist.dat automatons up to date while jcblock runs.
+A thread watches the list directory with inotify. When a list file is written
+and closed (or renamed into place by an editor) it waits for the writes to
+settle, rebuilds both automatons and publishes them as a new snapshot with an
+atomic pointer swap. The call path only loads the pointer; it never touches
+the filesystem to find out whether the lists changed. The old snapshot is
+freed once no caller is still using it (a simple form of RCU). A list with a
+usable compiled image (listimage.c) is mapped instead of read, and a newly
+compiled image is picked up like an edit.
+
+A rebuilt list is only published if the file did not change while it was read
+and its last record is complete, so a half-written file is never used. Until a
+rebuild validates, the previous snapshot stays live. A snapshot records the
+last list write of the writer thread (persist.c) done before its files were
+read, so that the edits of the control socket it includes are dropped
+(control.c).
+
+The first snapshot is built on the watcher thread too, while jcblock
+initializes the modems; lists_wait() waits for it and an eventfd tells the
+event loop when it is there.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+
+#define SETTLE_MSEC      250   // quiet time after the last event before a rebuild
+#define RETRY_MSEC      1000   // wait before trying again after a failed validation
+#define RETRY_LIMIT       10   // then wait for the next edit
+#define POLL_MSEC       2000   // stat() interval if inotify is not available
+
+static struct list_snapshot *liveLists;
+static int listReaders;
+static unsigned long listGeneration;
+static uint64_t listFingerprint;    // tokens of the lists of listGeneration
+static pthread_t watchThread;
+static int firstLoad;               // 0: being built, 1: built, -1: failed
+static int firstLoadFd = -1;        // eventfd, readable when the first load ends
+static pthread_mutex_t firstLoadLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t firstLoadCond = PTHREAD_COND_INITIALIZER;
+
+static void *watch_lists( void *arg );
+static bool load_first( void );
+static int build_snapshot( struct list_snapshot **snapOut, bool strict );
+static bool list_valid( const struct match_list *ml );
+static bool list_file_event( const char *name );
+static void publish_snapshot( struct list_snapshot *snap );
+static void free_snapshot( struct list_snapshot *snap );
+
+//
+// Start the watcher thread, which builds the first snapshot (the blacklist
+// must exist) before it watches the files. Returns 0 or -1.
+//
+int start_list_watcher( void )
+{  /* Begin start_list_watcher */
+  if( ( firstLoadFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 )
+    return( -1 );
+
+  if( pthread_create( &watchThread, NULL, watch_lists, NULL ) != 0 )
+  {
+    log_debug_info("pthread_create() of list watcher failed; lists will not be re-loaded");
+    load_first();
+    return( 0 );
+  }
+  pthread_detach( watchThread );
+  return( 0 );
+}  /* end start_list_watcher */
+
+//
+// Wait until the first snapshot is built. Returns 0, or -1 if it could not
+// be (lists_acquire() must not be called then).
+//
+int lists_wait( void )
+{  /* Begin lists_wait */
+  int rc;
+
+  pthread_mutex_lock( &firstLoadLock );
+  while( firstLoad == 0 )
+    pthread_cond_wait( &firstLoadCond, &firstLoadLock );
+  rc = firstLoad;
+  pthread_mutex_unlock( &firstLoadLock );
+  return( rc > 0 ? 0 : -1 );
+}  /* end lists_wait */
+
+//
+// The eventfd that becomes readable when the first snapshot is built (or
+// could not be).
+//
+int lists_wait_fd( void )
+{  /* Begin lists_wait_fd */
+  return( firstLoadFd );
+}  /* end lists_wait_fd */
+
+//
+// Build and publish the first snapshot and wake up those waiting for it.
+// Returns TRUE if it was built.
+//
+static bool load_first( void )
+{  /* Begin load_first */
+  struct list_snapshot *snap;
+  struct timespec t0, t1;
+  char message[128];
+  uint64_t one = 1;
+  int rc;
+
+  // At startup there is nothing to fall back to, so a last line
+  // without a '\n' is accepted as it always was
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  if( ( rc = build_snapshot( &snap, FALSE ) ) == 0 )
+  {
+    __atomic_store_n( &liveLists, snap, __ATOMIC_SEQ_CST );
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    sprintf( message, "lists loaded in %ld msec: %d whitelist, %d blacklist entries",
+             ( t1.tv_sec - t0.tv_sec ) * 1000L + ( t1.tv_nsec - t0.tv_nsec ) / 1000000L,
+             snap->white ? snap->white->nrules : 0, snap->black->nrules );
+    log_debug_info( message );
+  }
+
+  pthread_mutex_lock( &firstLoadLock );
+  firstLoad = rc == 0 ? 1 : -1;
+  pthread_cond_broadcast( &firstLoadCond );
+  pthread_mutex_unlock( &firstLoadLock );
+  if( write( firstLoadFd, &one, sizeof( one ) ) != sizeof( one ) )
+    log_debug_info("write() to the list load eventfd failed");
+  return( rc == 0 );
+}  /* end load_first */
+
+//
+// Enter a read-side section and get the current lists. Every call must be
+// paired with lists_release(); the snapshot must not be used after that.
+//
+struct list_snapshot *lists_acquire( void )
+{  /* Begin lists_acquire */
+  __atomic_add_fetch( &listReaders, 1, __ATOMIC_SEQ_CST );
+  return( __atomic_load_n( &liveLists, __ATOMIC_SEQ_CST ) );
+}  /* end lists_acquire */
+
+void lists_release( void )
+{  /* Begin lists_release */
+  __atomic_sub_fetch( &listReaders, 1, __ATOMIC_RELEASE );
+}  /* end lists_release */
+
+//
+// Watcher thread.
+//
+static void *watch_lists( void *arg )
+{  /* Begin watch_lists */
+  char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  struct pollfd pfd;
+  struct list_snapshot *snap;
+  struct list_snapshot *cur;
+  bool pending = FALSE;
+  int retries = 0;
+  int timeout;
+  int ifd;
+  int n, rc;
+  char *p;
+
+  if( !load_first() )
+    return( NULL );
+
+  if( ( ifd = inotify_init1( IN_CLOEXEC ) ) < 0 ||
+      inotify_add_watch( ifd, LIST_DIR, IN_CLOSE_WRITE | IN_MOVED_TO |
+                         IN_CREATE | IN_DELETE | IN_MODIFY ) < 0 )
+  {
+    // Fall back to checking the files now and then
+    log_debug_info("inotify on list directory failed; polling list files instead");
+    if( ifd >= 0 )
+      close( ifd );
+    for( ;; )
+    {
+      usleep( POLL_MSEC * 1000 );
+      cur = lists_acquire();
+      pending = list_changed( cur->black ) ||
+                ( cur->white != NULL && list_changed( cur->white ) ) ||
+                ( cur->white == NULL && access( WHITELIST_FILE, R_OK ) == 0 );
+      lists_release();
+      if( pending && build_snapshot( &snap, TRUE ) == 0 )
+        publish_snapshot( snap );
+    }
+  }
+
+  pfd.fd = ifd;
+  pfd.events = POLLIN;
+  for( ;; )
+  {
+    timeout = pending ? SETTLE_MSEC : -1;
+    if( ( rc = poll( &pfd, 1, timeout ) ) < 0 )
+    {
+      if( errno == EINTR )
+        continue;
+      log_debug_info("poll() on inotify failed; lists will not be re-loaded");
+      break;
+    }
+
+    if( rc > 0 )
+    {
+      // Events restart the settle time; only list files matter
+      if( ( n = read( ifd, events, sizeof( events ) ) ) <= 0 )
+        continue;
+      for( p = events; p < events + n; p += sizeof( *ev ) + ev->len )
+      {
+        ev = (struct inotify_event *)p;
+        if( ev->len && list_file_event( ev->name ) )
+        {
+          pending = TRUE;
+          retries = 0;
+        }
+      }
+      continue;
+    }
+
+    // The directory has been quiet for SETTLE_MSEC: rebuild
+    if( build_snapshot( &snap, TRUE ) == 0 )
+    {
+      publish_snapshot( snap );
+      pending = FALSE;
+    }
+    else if( ++retries < RETRY_LIMIT )
+    {
+      // Not valid yet (or out of memory): try again later unless
+      // another event comes first
+      usleep( RETRY_MSEC * 1000 );
+    }
+    else
+    {
+      log_info("\nERROR: list file is still incomplete (does its last line end with a newline?)\n");
+      log_info("previous lists are kept until the file is edited again.\n");
+      pending = FALSE;
+    }
+  }
+  close( ifd );
+  return( NULL );
+}  /* end watch_lists */
+
+//
+// Return TRUE if an inotify event names one of the list files or their
+// compiled images.
+//
+static bool list_file_event( const char *name )
+{  /* Begin list_file_event */
+  char whiteImage[FILE_PATH_MAX], blackImage[FILE_PATH_MAX];
+
+  list_image_path( WHITELIST_FILE, whiteImage, sizeof( whiteImage ) );
+  list_image_path( BLACKLIST_FILE, blackImage, sizeof( blackImage ) );
+  return( strcmp( name, strrchr( WHITELIST_FILE, '/' ) + 1 ) == 0 ||
+          strcmp( name, strrchr( BLACKLIST_FILE, '/' ) + 1 ) == 0 ||
+          strcmp( name, strrchr( whiteImage, '/' ) + 1 ) == 0 ||
+          strcmp( name, strrchr( blackImage, '/' ) + 1 ) == 0 );
+}  /* end list_file_event */
+
+//
+// Read both list files. Returns 0 with a new snapshot, or -1 if the blacklist
+// is missing or (if strict) a file is not yet valid.
+//
+static int build_snapshot( struct list_snapshot **snapOut, bool strict )
+{  /* Begin build_snapshot */
+  struct list_snapshot *snap;
+  uint64_t fingerprint;
+
+  if( ( snap = calloc( 1, sizeof( *snap ) ) ) == NULL )
+    return( -1 );
+
+  // Every list write up to this one is in the files read below
+  snap->listSeq = persist_lists_written();
+
+  // A whitelist is not required
+  snap->white = open_list( WHITELIST_FILE, "whitelist" );
+  if( strict && snap->white != NULL && !list_valid( snap->white ) )
+  {
+    log_debug_info("whitelist.dat is being written; keeping previous lists");
+    free_snapshot( snap );
+    return( -1 );
+  }
+
+  if( ( snap->black = open_list( BLACKLIST_FILE, "blacklist" ) ) == NULL )
+  {
+    log_debug_info("load of blacklist.dat failed; keeping previous lists");
+    free_snapshot( snap );
+    return( -1 );
+  }
+  if( strict && !list_valid( snap->black ) )
+  {
+    log_debug_info("blacklist.dat is being written; keeping previous lists");
+    free_snapshot( snap );
+    return( -1 );
+  }
+
+  // Edits of dates or comments reload the lists too; they keep their
+  // generation so that the decisions cached for it stay valid
+  fingerprint = list_fingerprint( snap->black ) * 31 +
+                ( snap->white != NULL ? list_fingerprint( snap->white ) : 0 );
+  if( fingerprint != listFingerprint || listGeneration == 0 )
+    ++listGeneration;
+  listFingerprint = fingerprint;
+  snap->generation = listGeneration;
+  snap->fingerprint = fingerprint;
+  snap->cacheable = !list_matches_dates( snap->black ) &&
+                    ( snap->white == NULL || !list_matches_dates( snap->white ) );
+  *snapOut = snap;
+  return( 0 );
+}  /* end build_snapshot */
+
+//
+// A list is valid if its last record was complete and the file was not
+// changed while it was being read.
+//
+static bool list_valid( const struct match_list *ml )
+{  /* Begin list_valid */
+  return( !ml->partial && !list_changed( ml ) );
+}  /* end list_valid */
+
+//
+// Swap in a new snapshot, then wait for readers of the old one to leave
+// before freeing it.
+//
+static void publish_snapshot( struct list_snapshot *snap )
+{  /* Begin publish_snapshot */
+  struct list_snapshot *old;
+  char message[128];
+
+  old = __atomic_exchange_n( &liveLists, snap, __ATOMIC_SEQ_CST );
+  while( __atomic_load_n( &listReaders, __ATOMIC_ACQUIRE ) != 0 )
+    usleep( 1000 );
+  free_snapshot( old );
+
+  sprintf( message, "lists re-loaded: %d whitelist, %d blacklist entries",
+           snap->white ? snap->white->nrules : 0, snap->black->nrules );
+  log_debug_info( message );
+}  /* end publish_snapshot */
+
+static void free_snapshot( struct list_snapshot *snap )
+{  /* Begin free_snapshot */
+  if( snap == NULL )
+    return;
+  free_list( snap->white );
+  free_list( snap->black );
+  free( snap );
+}  /* end free_snapshot */